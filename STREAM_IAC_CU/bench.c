@@ -0,0 +1,230 @@
+/// @file bench.c
+/// <summary>
+/// Benchmark kernels of the parser and table compiler, used by BNCH command
+/// on target and by the host benchmark harness (host/benchmark.c).
+/// </summary>
+///
+/// <description>
+/// Each kernel is run the given number of times and the fastest run is reported
+/// (interrupts and cache misses only ever add time), in clock units: core cycles
+/// (DWT cycle counter) on target, nanoseconds with BENCH_HOST_CLOCK defined (host build).
+/// Kernels are fed through the same Parse entry point as commands from a link, with their
+/// own parser context whose responses are discarded. Its link (LINK_BENCH) has no sequencer
+/// request queue, so STOP of a kernel doesn't reach the sequencer or another link's queue, and its own staging
+/// settings, so CHLS and STTG kernels don't touch settings of other links.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "bench.h"
+#include "main.h"
+#include "parse.h"
+#include <stdio.h>
+#include <string.h>
+
+#define BENCH_TEXT_SIZE 1024
+#define BENCH_MAX_INTS 64
+
+const char* const BENCH_KernelName[BENCH_NUM_OF_KERNELS] = {
+    [BENCH_PARSE]     = "PARSE",
+    [BENCH_STRTOINTS] = "STRTOINTS",
+    [BENCH_CHLS]      = "CHLS",
+    [BENCH_STTG]      = "STTG",
+};
+
+// Runs reported by BNCH command
+const bench_run BENCH_StandardRuns[] = {
+    {BENCH_PARSE, 16},
+    {BENCH_STRTOINTS, 20},
+    {BENCH_CHLS, 8},
+    {BENCH_CHLS, 32},
+    {BENCH_CHLS, MAX_STATES - 2},
+    {BENCH_STTG, 8},
+    {BENCH_STTG, 32},
+    {BENCH_STTG, MAX_STATES},
+};
+const int BENCH_NumOfStandardRuns = sizeof(BENCH_StandardRuns) / sizeof(*BENCH_StandardRuns);
+
+static char text[BENCH_TEXT_SIZE]; // kernel input
+static char work[BENCH_TEXT_SIZE]; // copy of input (parser tokenizes in place)
+
+static int BenchWrite(const uint8_t* data, int size)
+{
+    UNUSED(data);
+    return size;
+}
+
+static parse_context bench_ctx = {.Write = BenchWrite, .WriteFrame = BenchWrite, .link = LINK_BENCH, .last_seq = -1};
+
+#if defined(BENCH_HOST_CLOCK)
+
+#include <time.h>
+
+void BENCH_Init()
+{
+}
+
+uint32_t BENCH_ClockHz()
+{
+    return 1000000000;
+}
+
+static uint32_t Clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000000U + (uint32_t)ts.tv_nsec; // wraps, differences are still correct
+}
+
+#else
+
+//---------------------------------------------------------------------
+/// <summary> Enable DWT cycle counter. </summary>
+//---------------------------------------------------------------------
+void BENCH_Init()
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->LAR    = 0xC5ACCE55; // unlock (Cortex-M7)
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t BENCH_ClockHz()
+{
+    return SystemCoreClock;
+}
+
+static uint32_t Clock()
+{
+    return DWT->CYCCNT;
+}
+
+#endif
+
+//---------------------------------------------------------------------
+/// <summary> Parse one command with the benchmark context. </summary>
+//---------------------------------------------------------------------
+static void Command(const char* cmd)
+{
+    strncpy(work, cmd, sizeof(work) - 1);
+    Parse(&bench_ctx, work);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Fill settings tables with given number of entries (unique times, spread over all channels). </summary>
+///
+/// <param name="entries"> Number of entries. </param>
+//---------------------------------------------------------------------
+static void FillTable(int entries)
+{
+    Command("STOP"); // next CHLS starts new settings (stop request of LINK_BENCH is dropped)
+    Command("PRDS,65000");
+
+    for (int ch = 0; ch < NUM_OF_CHANNELS; ++ch) {
+        int len = snprintf(text, sizeof(text), "CHLS,%d", ch);
+        for (int e = ch; e < entries; e += NUM_OF_CHANNELS)
+            len += snprintf(&text[len], sizeof(text) - len, ",%d", 10 * (e + 1));
+        if (ch == 0 || ch < entries)
+            Command(text); // first CHLS clears old settings, even if it has no times
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Prepare kernel input. </summary>
+///
+/// <returns> Size the kernel will actually run with (size is limited by buffers and table size). </returns>
+//---------------------------------------------------------------------
+static int Prepare(bench_kernel kernel, int size)
+{
+    static const char* const lines[] = {"PING\n", "PRDG\n", "CHLG,3\n", "VERG\n"};
+    int                      len     = 0;
+
+    switch (kernel) {
+    case BENCH_PARSE:
+        size = MIN(size, BENCH_TEXT_SIZE / 8);
+        for (int i = 0; i < size; ++i)
+            len += snprintf(&text[len], sizeof(text) - len, "%s", lines[i % 4]);
+        break;
+    case BENCH_STRTOINTS:
+        size = MIN(size, BENCH_MAX_INTS);
+        for (int i = 0; i < size; ++i)
+            len += snprintf(&text[len], sizeof(text) - len, i == 0 ? "%d" : ",%d", 12345 + 997 * i);
+        break;
+    case BENCH_CHLS:
+        size = MIN(size, MAX_STATES - 2);
+        break;
+    case BENCH_STTG:
+        size = MIN(size, MAX_STATES);
+        FillTable(size);
+        break;
+    default:
+        break;
+    }
+
+    return size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Run benchmark kernel. </summary>
+///
+/// <param name="kernel"> Kernel to run. </param>
+/// <param name="size"> Size of kernel input (lines, numbers, table entries). </param>
+/// <param name="iterations"> Number of runs. </param>
+///
+/// <returns> Time of the fastest run in clock units (see BENCH_ClockHz). </returns>
+//---------------------------------------------------------------------
+uint32_t BENCH_Run(bench_kernel kernel, int size, int iterations)
+{
+    uint32_t best = UINT32_MAX;
+    int      ints[BENCH_MAX_INTS];
+    char     chls[40];
+
+    size = Prepare(kernel, size);
+    snprintf(chls, sizeof(chls), "CHLS,15,%d,%d", 10 * (size / 2) + 3, 10 * (size / 2) + 7);
+
+    for (int i = 0; i < iterations; ++i) {
+        uint32_t start = 0, end = 0;
+
+        switch (kernel) {
+        case BENCH_PARSE:
+            strcpy(work, text);
+            start = Clock();
+            Parse(&bench_ctx, work);
+            end = Clock();
+            break;
+        case BENCH_STRTOINTS:
+            start = Clock();
+            StrToInts(text, ints, size);
+            end = Clock();
+            break;
+        case BENCH_CHLS:
+            FillTable(size);
+            strcpy(work, chls);
+            start = Clock();
+            Parse(&bench_ctx, work);
+            end = Clock();
+            break;
+        case BENCH_STTG:
+            strcpy(work, "STTG");
+            start = Clock();
+            Parse(&bench_ctx, work);
+            end = Clock();
+            break;
+        default:
+            return 0;
+        }
+
+        if (end - start < best)
+            best = end - start;
+    }
+
+    return best;
+}
@@ -0,0 +1,41 @@
+/// @file bench.h
+/// <summary>
+/// Benchmark kernels of the parser and table compiler.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <stdint.h>
+
+#define BENCH_DEFAULT_ITERATIONS 100
+
+typedef enum {
+    BENCH_PARSE,     // Parse of <size> read-only command lines
+    BENCH_STRTOINTS, // StrToInts of <size> numbers
+    BENCH_CHLS,      // one CHLS (two edges) inserted into the middle of a table with <size> entries
+    BENCH_STTG,      // STTG (all channel settings formatted) of a table with <size> entries
+    BENCH_NUM_OF_KERNELS
+} bench_kernel;
+
+typedef struct {
+    bench_kernel kernel;
+    int          size;
+} bench_run;
+
+extern const char* const BENCH_KernelName[BENCH_NUM_OF_KERNELS];
+extern const bench_run   BENCH_StandardRuns[];
+extern const int         BENCH_NumOfStandardRuns;
+
+void     BENCH_Init();
+uint32_t BENCH_ClockHz();
+uint32_t BENCH_Run(bench_kernel kernel, int size, int iterations);
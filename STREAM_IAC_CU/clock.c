@@ -0,0 +1,285 @@
+/// @file clock.c
+/// <summary>
+/// Device clock: time in us on the cycle counter, synchronised to the host or bus master (SYNC,<t>).
+/// </summary>
+///
+/// <description>
+/// Device time is a free running 32 bit us counter (wraps every 71 minutes, times are compared
+/// modulo 2^32), computed from the DWT cycle counter, so any cycle counter timestamp (e.g. the
+/// terminator of a UART message) converts to device time. Cycle counter is extended to 64 bits
+/// on every SysTick, device time can go on for years without a sync.
+/// SYNC,<t> tells the unit that its terminator was at time t: unit takes it as the new time base,
+/// and from two syncs at least CLK_RATE_SPAN_MS apart it measures the rate of the master's clock
+/// against its own crystal (drift), so time stays aligned between syncs too.
+/// Bus master (gateway.c) broadcasts its time periodically on RS-485, all units timestamp the same
+/// terminator, so their clocks agree to a few us, independent of parser and main loop latency.
+/// Cycle counter stops while the core sleeps (main loop waiting for events), a free running timer
+/// keeps counting and the cycle counter is carried over the sleep by it (CLK_Sleep), before any
+/// interrupt takes a timestamp.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "clock.h"
+#include "main.h"
+
+// Sleep timer: its tick is CLK_TIMER_CYCLES cycles and it wraps after 2^16 ticks (1.56 ms at 168 MHz),
+// SysTick wakes the core every 1 ms, so it never wraps during a sleep
+#define CLK_TIMER TIM7
+#define CLK_TIMER_CYCLES 4
+#define CLK_TIMER_SPAN ((uint32_t)CLK_TIMER_CYCLES << 16) // cycles in one wrap of the timer
+
+volatile clk_stats CLK_Stats;
+
+// Cycle counter extended to 64 bits, at the last tick
+typedef struct {
+    uint64_t extended;
+    uint32_t cycles;
+} clk_epoch;
+
+// Time base of the last sync: device time = time + (cycle counter - cycles) * rate
+typedef struct {
+    uint64_t cycles; // extended cycle counter at the sync
+    uint32_t time;   // device time at the sync [us]
+    uint64_t rate;   // device time per cycle [us, Q32]
+} clk_base;
+
+// Double buffered: writer fills the copy that is not in use and then switches to it,
+// so readers in any context (preempting the writer or preempted by it) see a complete copy
+static clk_epoch         epoch[2];
+static volatile uint32_t epoch_in_use;
+static clk_base          base[2];
+static volatile uint32_t base_in_use;
+
+// Sync the drift is measured from
+static struct {
+    uint64_t cycles;
+    uint32_t time;
+    char     valid;
+} reference;
+
+static uint64_t nominal_rate; // device time per cycle at SystemCoreClock [us, Q32]
+static uint32_t timer_phase;  // cycle counter minus sleep timer count in cycles (modulo CLK_TIMER_SPAN)
+
+//---------------------------------------------------------------------
+/// <summary> Start the sleep timer, it counts with the cycle counter at a fixed phase
+/// (both run from the same clock), which is kept to set the counter after a sleep. </summary>
+//---------------------------------------------------------------------
+static void TimerInit()
+{
+    __TIM7_CLK_ENABLE();
+
+    // TIM7 is on APB1, same clock as sequencer timer
+    uint32_t timer_freq = HAL_RCC_GetPCLK1Freq();
+    if (RCC->CFGR & RCC_CFGR_PPRE1_2)
+        timer_freq *= 2;
+
+    CLK_TIMER->PSC = timer_freq / (SystemCoreClock / CLK_TIMER_CYCLES) - 1;
+    CLK_TIMER->ARR = 0xFFFF;
+    CLK_TIMER->EGR = TIM_EGR_UG; // load prescaler
+    CLK_TIMER->CR1 = TIM_CR1_CEN;
+
+    uint32_t ticks  = CLK_TIMER->CNT;
+    uint32_t cycles = DWT->CYCCNT;
+    timer_phase     = (cycles - ticks * CLK_TIMER_CYCLES) & (CLK_TIMER_SPAN - 1);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Extend a recent cycle counter value (within +-2^31 cycles of the last tick) to 64 bits. </summary>
+///
+/// <param name="cycles"> Cycle counter value. </param>
+///
+/// <returns> Extended cycle counter value. </returns>
+//---------------------------------------------------------------------
+static uint64_t Extend(uint32_t cycles)
+{
+    const clk_epoch* e = &epoch[__atomic_load_n(&epoch_in_use, __ATOMIC_ACQUIRE)];
+    return e->extended + (int32_t)(cycles - e->cycles);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Convert cycles to us at the given rate (rounded). Cycles are multiplied in two
+/// parts, so the product doesn't overflow 64 bits for years of cycles. </summary>
+///
+/// <param name="cycles"> Number of cycles (negative for a time before the time base). </param>
+/// <param name="rate"> Time per cycle [us, Q32]. </param>
+///
+/// <returns> Time [us]. </returns>
+//---------------------------------------------------------------------
+static int64_t Scale(int64_t cycles, uint64_t rate)
+{
+    uint64_t n  = cycles < 0 ? -cycles : cycles;
+    uint64_t us = ((n >> 16) * rate + ((n & 0xFFFF) * rate >> 16) + 0x8000) >> 16;
+    return cycles < 0 ? -(int64_t)us : (int64_t)us;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start device time at 0 with nominal rate. Called after clock
+/// configuration (SystemCoreClock) and cycle counter enable. </summary>
+//---------------------------------------------------------------------
+void CLK_Init()
+{
+    TimerInit();
+
+    uint32_t now = DWT->CYCCNT;
+
+    nominal_rate    = (((uint64_t)1000000 << 32) + SystemCoreClock / 2) / SystemCoreClock;
+    epoch[0]        = (clk_epoch){.extended = now, .cycles = now};
+    base[0]         = (clk_base){.cycles = now, .time = 0, .rate = nominal_rate};
+    epoch_in_use    = 0;
+    base_in_use     = 0;
+    reference.valid = 0;
+
+    CLK_Stats.syncs  = 0;
+    CLK_Stats.offset = 0;
+    CLK_Stats.drift  = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Extend the cycle counter (it wraps every 25 s at 168 MHz).
+/// Called from SysTick interrupt. </summary>
+//---------------------------------------------------------------------
+void CLK_Tick()
+{
+    uint32_t         now  = DWT->CYCCNT;
+    uint32_t         in   = epoch_in_use;
+    const clk_epoch* last = &epoch[in];
+    clk_epoch*       next = &epoch[in ^ 1];
+
+    next->extended = last->extended + (uint32_t)(now - last->cycles);
+    next->cycles   = now;
+    __atomic_store_n(&epoch_in_use, in ^ 1, __ATOMIC_RELEASE);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Sleep until an interrupt is pending (WFI). Called by main loop with interrupts
+/// disabled, the interrupt that wakes the core is taken once they are enabled, after the cycle
+/// counter is carried over the time asleep: it is set to the value that is at the timer's phase,
+/// nearest to its value before the sleep plus the timer ticks asleep. Sleep shorter than a tick
+/// leaves it alone, so it never goes back. </summary>
+//---------------------------------------------------------------------
+void CLK_Sleep()
+{
+    uint32_t before = DWT->CYCCNT;
+    uint16_t start  = CLK_TIMER->CNT;
+
+    __DSB();
+    __WFI();
+
+    uint16_t ticks  = CLK_TIMER->CNT;
+    uint32_t approx = before + (uint16_t)(ticks - start) * CLK_TIMER_CYCLES;
+    int32_t  error  = (int32_t)((ticks * CLK_TIMER_CYCLES + timer_phase - approx) & (CLK_TIMER_SPAN - 1));
+    if (error >= (int32_t)CLK_TIMER_SPAN / 2)
+        error -= CLK_TIMER_SPAN;
+
+    uint32_t target = approx + error;
+    if ((int32_t)(target - DWT->CYCCNT) > 0)
+        DWT->CYCCNT = target;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Device time at a cycle counter value. </summary>
+///
+/// <param name="cycles"> Cycle counter value (within +-12 s of now). </param>
+///
+/// <returns> Device time [us]. </returns>
+//---------------------------------------------------------------------
+uint32_t CLK_Time(uint32_t cycles)
+{
+    const clk_base* b = &base[__atomic_load_n(&base_in_use, __ATOMIC_ACQUIRE)];
+    return b->time + (uint32_t)Scale((int64_t)(Extend(cycles) - b->cycles), b->rate);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Device time now. </summary>
+///
+/// <returns> Device time [us]. </returns>
+//---------------------------------------------------------------------
+uint32_t CLK_Now()
+{
+    return CLK_Time(DWT->CYCCNT);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Time left until a device time. </summary>
+///
+/// <param name="time"> Device time [us]. </param>
+///
+/// <returns> Time until then [us], negative if it has passed. </returns>
+//---------------------------------------------------------------------
+int32_t CLK_Until(uint32_t time)
+{
+    return (int32_t)(time - CLK_Now());
+}
+
+//---------------------------------------------------------------------
+/// <summary> Convert a duration in device time to local time, i.e. ticks of a 1 MHz
+/// timer clocked from the crystal. They differ by the drift, which adds up over
+/// long durations (100 ppm is 100 us in a second). </summary>
+///
+/// <param name="us"> Duration in device time [us]. </param>
+///
+/// <returns> Duration in local time [us]. </returns>
+//---------------------------------------------------------------------
+int32_t CLK_Local(int32_t us)
+{
+    const clk_base* b = &base[__atomic_load_n(&base_in_use, __ATOMIC_ACQUIRE)];
+    int64_t         n = (int64_t)us * (int64_t)nominal_rate;
+    int64_t         r = (int64_t)b->rate;
+
+    return (int32_t)((n + (n < 0 ? -r : r) / 2) / r);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Synchronise device time: time was t at cycle counter value cycles.
+/// Called by parser of SYNC,<t> (UART interrupt or main loop). </summary>
+///
+/// <param name="cycles"> Cycle counter at the terminator of the sync message. </param>
+/// <param name="time"> Master's time at the terminator [us]. </param>
+//---------------------------------------------------------------------
+void CLK_Sync(uint32_t cycles, uint32_t time)
+{
+    __disable_irq(); // syncs may come from UART interrupt and USB (main loop) at once
+
+    uint64_t        now    = Extend(cycles);
+    uint32_t        before = CLK_Time(cycles);
+    uint32_t        in     = base_in_use;
+    clk_base*       next   = &base[in ^ 1];
+    const clk_base* last   = &base[in];
+    uint64_t        rate   = last->rate;
+
+    if (!reference.valid) {
+        reference.cycles = now;
+        reference.time   = time;
+        reference.valid  = 1;
+    } else if (now - reference.cycles >= (uint64_t)SystemCoreClock / 1000 * CLK_RATE_SPAN_MS) {
+        uint64_t measured = ((uint64_t)(time - reference.time) << 32) / (now - reference.cycles);
+        int64_t  diff     = (int64_t)(measured - nominal_rate);
+        int64_t  limit    = nominal_rate / (1000000 / CLK_MAX_DRIFT_PPM);
+
+        if (diff >= -limit && diff <= limit) {
+            rate            = measured;
+            CLK_Stats.drift = diff * 1000000000 / (int64_t)nominal_rate;
+        }
+        reference.cycles = now;
+        reference.time   = time;
+    }
+
+    next->cycles = now;
+    next->time   = time;
+    next->rate   = rate;
+    __atomic_store_n(&base_in_use, in ^ 1, __ATOMIC_RELEASE);
+
+    CLK_Stats.offset = (int32_t)(time - before);
+    CLK_Stats.syncs++;
+
+    __enable_irq();
+}
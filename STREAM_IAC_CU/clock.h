@@ -0,0 +1,39 @@
+/// @file clock.h
+/// <summary>
+/// Device clock: time in us on the cycle counter, synchronised to the host or bus master (SYNC,<t>).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <stdint.h>
+
+#define CLK_RATE_SPAN_MS 1000  // drift is measured between syncs at least this far apart
+#define CLK_MAX_DRIFT_PPM 500  // measured drift beyond this is a jump of the master's time, not drift
+
+// Clock statistics
+typedef struct {
+    uint32_t syncs;  // SYNC,<t> messages received
+    int32_t  offset; // correction made by the last sync (its time minus device time before it) [us]
+    int32_t  drift;  // rate of the master's clock relative to the cycle counter, minus 1 [ppb]
+} clk_stats;
+
+extern volatile clk_stats CLK_Stats;
+
+void     CLK_Init();
+void     CLK_Tick();
+void     CLK_Sleep();
+void     CLK_Sync(uint32_t cycles, uint32_t time);
+uint32_t CLK_Time(uint32_t cycles);
+uint32_t CLK_Now();
+int32_t  CLK_Until(uint32_t time);
+int32_t  CLK_Local(int32_t us);
@@ -14,42 +14,126 @@
 // Company: Sensum d.o.o.
 
 #include "communication.h"
+#include "frame.h"
+#include "latency.h"
 #include "main.h"
 #include "parse.h"
+#include "prof.h"
+#include "spsc.h"
+#include "trace.h"
 #include "uart.h"
+#include "usbd_bulk_if.h"
+#include "usbd_cdc_if.h"
 #include <string.h>
 
 extern uint8_t       UART_Address;
 extern const uint8_t CharacterMatch;
 
-int VCP_read(void* pBuffer, int size);
-int VCP_write(const void* pBuffer, int size);
+#define UART_RX_QUEUE_SIZE 4 // UART messages waiting to be parsed (power of 2)
 
-static uint8_t rx_buffer[UART_BUFFER_SIZE];
-static int     rx_buffer_size = 0;
+// Received UART message (producer: UART interrupt, consumer: EXTI0 interrupt)
+typedef struct {
+    uart_rx_time time;
+    int          size;
+    char         executed; // already executed by fast path (COM_UART_RX_Fast_Callback), only response is left
+    uint8_t      data[UART_BUFFER_SIZE];
+} uart_message;
+
+SPSC_QUEUE(uart_rx_queue, uart_message, UART_RX_QUEUE_SIZE);
+
+//---------------------------------------------------------------------
+/// <summary> Record write that didn't go through (completely) in trace. </summary>
+///
+/// <param name="link"> Link that was written to. </param>
+/// <param name="written"> Number of written bytes. </param>
+/// <param name="size"> Number of bytes that should be written. </param>
+///
+/// <returns> Number of written bytes. </returns>
+//---------------------------------------------------------------------
+static int TraceStall(link_id link, int written, int size)
+{
+    if (written < size)
+        TRACE_Write(TRACE_USB_TX_STALL, link, size);
+    return written;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Check if received message is for this unit (or for all units).
+/// Other messages only arrive while UART_Monitor is set. </summary>
+///
+/// <param name="rx"> Arrival of the message. </param>
+///
+/// <returns> 1 if message is for this unit. </returns>
+//---------------------------------------------------------------------
+static int ForThisUnit(const uart_rx_time* rx)
+{
+    return rx->broadcast || (rx->address & 0x7F) == UART_Address;
+}
 
 //---------------------------------------------------------------------
 /// <summary> See uart.c for documentation. </summary>
 //---------------------------------------------------------------------
 void UART_RX_Complete_Callback(const uint8_t* data, int size)
 {
-    rx_buffer_size = size;
-    memcpy(rx_buffer, data, size);
-    rx_buffer[size] = 0;
-    EXTI->SWIER     = EXTI_SWIER_SWIER0; // This triggers EXTI interrupt
+    uart_message* msg = SPSC_Claim(&uart_rx_queue);
+
+    if (msg == NULL) { // parser is behind by a whole queue, message is lost
+        uart_rx_queue.overflow++;
+        TRACE_Write(TRACE_UART_OVERRUN, 1, size);
+        return;
+    }
+
+    msg->time     = UART_RxTime;
+    msg->size     = size;
+    msg->executed = 0;
+    memcpy(msg->data, data, size);
+    msg->data[size] = 0;
+
+    // Time critical command can be executed right here, unless it would overtake messages still waiting to be parsed
+    if (SPSC_Count(&uart_rx_queue) == 0 && ForThisUnit(&UART_RxTime)) {
+        LAT_Received(LINK_UART, UART_RxTime.first, UART_RxTime.last);
+        msg->executed = COM_UART_RX_Fast_Callback(msg->data, size);
+    }
+
+    SPSC_Publish(&uart_rx_queue);
+
+    EXTI->SWIER = EXTI_SWIER_SWIER0; // This triggers EXTI interrupt
 }
 
 //---------------------------------------------------------------------
 /// <summary> External interrupt on line 0 interrupt handler.
 /// This handler is called via software IRQ when data from UART
-/// is recevied in its entirety. </summary>
+/// is recevied in its entirety, or when there is something to write
+/// to UART. Parses all queued messages, UART interrupt can queue more
+/// meanwhile, messages of other units go to the monitor callback.
+/// Everything written to UART by messages is written from here, at the
+/// end queued outgoing data can be written too (COM_UART_TX_Callback). </summary>
 //---------------------------------------------------------------------
 void EXTI0_IRQHandler()
 {
+    uint32_t      prof_start = PROF_Start();
+    uart_message* msg;
+
     EXTI->PR = EXTI_PR_PR0; // Clear pending bit
 
-    // Call actual implementation callback function (in main.c) which is project specific.
-    COM_UART_RX_Complete_Callback(rx_buffer, rx_buffer_size);
+    while ((msg = SPSC_Peek(&uart_rx_queue)) != NULL) {
+        // Call actual implementation callback function (in main.c) which is project specific.
+        if (!ForThisUnit(&msg->time)) {
+            COM_UART_RX_Monitor_Callback(msg->data, msg->size, &msg->time);
+        } else if (msg->executed) {
+            LAT_Received(LINK_UART, msg->time.first, msg->time.last);
+            COM_UART_RX_Executed_Callback(msg->data, msg->size, &msg->time);
+        } else {
+            LAT_Received(LINK_UART, msg->time.first, msg->time.last);
+            COM_UART_RX_Complete_Callback(msg->data, msg->size, &msg->time);
+        }
+
+        SPSC_Pop(&uart_rx_queue);
+    }
+
+    COM_UART_TX_Callback();
+
+    PROF_End(PROF_EXTI, prof_start);
 }
 
 //---------------------------------------------------------------------
@@ -60,11 +144,75 @@ void EXTI0_IRQHandler()
 ///
 /// <param name="buf"> Pointer to a buffer that is holding received data. </param>
 /// <param name="max_size"> Number of bytes in buffer. </param>
+/// <param name="rx"> Arrival of the message, broadcast or addressed to this unit. </param>
+//---------------------------------------------------------------------
+__weak void COM_UART_RX_Complete_Callback(uint8_t* buf, int size, const uart_rx_time* rx)
+{
+    UNUSED(buf);
+    UNUSED(size);
+    UNUSED(rx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Weak callback function that communication driver calls in UART interrupt
+/// as soon as a message is received, when no earlier message is waiting to be parsed.
+/// Time critical command can be executed here (fast path), without waiting for EXTI
+/// interrupt. Response must not be written here, message is still passed on to
+/// COM_UART_RX_Executed_Callback for it. To be implemented by the user! </summary>
+///
+/// <param name="buf"> Pointer to a buffer that is holding received data (zero terminated). </param>
+/// <param name="size"> Number of bytes in buffer. </param>
+///
+/// <returns> 1 if message was executed, 0 if it has to be parsed as usual. </returns>
+//---------------------------------------------------------------------
+__weak int COM_UART_RX_Fast_Callback(const uint8_t* buf, int size)
+{
+    UNUSED(buf);
+    UNUSED(size);
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Weak callback function that communication driver calls from EXTI
+/// interrupt, instead of COM_UART_RX_Complete_Callback, for a message that was
+/// executed by COM_UART_RX_Fast_Callback (response to it is written here).
+/// To be implemented by the user! </summary>
+///
+/// <param name="buf"> Pointer to a buffer that is holding received data. </param>
+/// <param name="size"> Number of bytes in buffer. </param>
+/// <param name="rx"> Arrival of the message, broadcast or addressed to this unit. </param>
+//---------------------------------------------------------------------
+__weak void COM_UART_RX_Executed_Callback(uint8_t* buf, int size, const uart_rx_time* rx)
+{
+    UNUSED(buf);
+    UNUSED(size);
+    UNUSED(rx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Weak callback function that communication driver calls from EXTI
+/// interrupt for a message of another unit (or to another unit), received
+/// while UART_Monitor is set. To be implemented by the user! </summary>
+///
+/// <param name="buf"> Pointer to a buffer that is holding received data. </param>
+/// <param name="size"> Number of bytes in buffer. </param>
+/// <param name="rx"> Arrival of the message and its address byte. </param>
 //---------------------------------------------------------------------
-__weak void COM_UART_RX_Complete_Callback(uint8_t* buf, int size)
+__weak void COM_UART_RX_Monitor_Callback(uint8_t* buf, int size, const uart_rx_time* rx)
 {
     UNUSED(buf);
     UNUSED(size);
+    UNUSED(rx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Weak callback function that communication driver calls at the end
+/// of EXTI interrupt, when all received messages are handled. Data queued
+/// for UART by other contexts can be written here, so UART transmit buffer
+/// is only written from one interrupt priority. To be implemented by the user! </summary>
+//---------------------------------------------------------------------
+__weak void COM_UART_TX_Callback()
+{
 }
 
 //---------------------------------------------------------------------
@@ -77,53 +225,119 @@ __weak void COM_UART_RX_Complete_Callback(uint8_t* buf, int size)
 //---------------------------------------------------------------------
 int UARTWrite(const uint8_t* buffer, int size)
 {
-    uint8_t buf[UART_BUFFER_SIZE];
-    int     len = 0;
+    int lines = 1;
 
     if (size <= 0)
         return 0;
+    for (int i = 0; i < size - 1; ++i)
+        lines += buffer[i] == CharacterMatch;
+
+    // Written directly into transmit buffer, data that doesn't fit is dropped (doesn't overwrite what is being sent)
+    int      len = size + lines + 1; // address byte of every line, terminating character
+    uint8_t* buf = UART_WriteClaim(len);
+    if (buf == NULL)
+        return TraceStall(LINK_UART, 0, len);
+
+    // Every line starts with origin address byte, so receivers (and gateway) see where it came from,
+    // line following a newline without it would be dropped by receivers
+    int n    = 0;
+    buf[n++] = 0x80 | UART_Address;
+    for (int i = 0; i < size; ++i) {
+        buf[n++] = buffer[i];
+        if (buffer[i] == CharacterMatch && i < size - 1)
+            buf[n++] = 0x80 | UART_Address;
+    }
+    buf[n++] = CharacterMatch; // add terminating character
+
+    UART_WritePublish(n);
+    return n;
+}
 
-    int packet_size = 1 + size + 1; // 1 - address byte, + size - payload, + 1 - terminating character
+//---------------------------------------------------------------------
+/// <summary> Write binary frame to UART. </summary>
+///
+/// <param name="packet"> Packet to send (framing and CRC are added). </param>
+/// <param name="size"> Size of packet. </param>
+///
+/// <returns> Number of written bytes </returns>
+//---------------------------------------------------------------------
+int UARTWriteFrame(const uint8_t* packet, int size)
+{
+    uint8_t buf[UART_BUFFER_SIZE];
 
-    if (packet_size > UART_BUFFER_SIZE)
+    buf[0]  = 0x80 | UART_Address; // add origin address byte
+    int len = FRAME_Encode(packet, size, &buf[1], sizeof(buf) - 1);
+    if (len == 0)
         return 0;
 
-    buf[0] = 0x80 | UART_Address; // add origin address byte
-    memcpy(&buf[1], buffer, size);
-    buf[packet_size - 1] = CharacterMatch; // add terminating character
-    len                  = UART_Write(buf, packet_size);
+    return UART_Write(buf, len + 1);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Parse data received on a link. Data can contain legacy ASCII
+/// commands and binary frames (which start and end with FRAME_DELIMITER),
+/// each is recognized and handled on its own. </summary>
+///
+/// <param name="ctx"> Parser context of the link. </param>
+/// <param name="buf"> Received data, must be zero terminated (buf[size] == 0). </param>
+/// <param name="size"> Number of received bytes. </param>
+//---------------------------------------------------------------------
+void COM_Parse(parse_context* ctx, uint8_t* buf, int size)
+{
+    int i = 0;
+
+    while (i < size) {
+        int start = i;
+        if (buf[i] == FRAME_DELIMITER) {
+            start = ++i;
+            while (i < size && buf[i] != FRAME_DELIMITER)
+                i++;
+            if (i == start) // empty frame, this delimiter opens the next one
+                continue;
 
-    return len;
+            int len = FRAME_Decode(&buf[start], i - start);
+            if (len > 0)
+                ParseFrame(ctx, &buf[start], len);
+            else
+                ctx->rx_errors++;
+
+            i++; // skip closing delimiter
+        } else {
+            while (i < size && buf[i] != FRAME_DELIMITER)
+                i++;
+            Parse(ctx, (char*)&buf[start]); // text is terminated by delimiter (zero) or by terminating zero after data
+        }
+    }
 }
 
 //---------------------------------------------------------------------
-/// <summary> Read data from USB. </summary>
+/// <summary> Read data from USB. Data is not copied, buffer points directly
+/// into the USB receive buffer, which has to be returned with USBReadRelease
+/// once it is no longer needed. Arrival time of the data is passed on to
+/// latency measurement. </summary>
 ///
-/// <param name="buffer"> Pointer to a buffer to read data into. </param>
-/// <param name="max_size"> Maximum number of bytes to read into buffer. </param>
+/// <param name="buffer"> Set to point to received (zero terminated) data. </param>
 ///
 /// <returns> Number of read bytes </returns>
 //---------------------------------------------------------------------
-int USBRead(uint8_t* buffer, int max_size)
-{
-    static uint32_t last_read_tick = 0;
-    static int      total_read     = 0;
-    int             read           = 0;
-    // Read while there is data in buffer
-    /* NOTE: Added delayed return since there was a problem with USB driver which reads data in 64 byte chunks.
-       This will erronously parse data not received in its entirety (over 64 bytes)).
-       I have measured, and it takes approx 200 us between receptions of 64 bytes packets. */
-    if ((read = VCP_read(&buffer[total_read], max_size - total_read)) > 0) {
-        last_read_tick = HAL_GetTick();
-        total_read += read;
-    } else if (total_read > 0 && ((HAL_GetTick() - last_read_tick) > 30)) { // at least 30 ms!!! JUST SPENT 2 hours!!! chasing a bug which turned out to be that terminal takes even longer than 3ms to send data, so increased it to 30 ms, hopes this never happenes again! Use a different terminal!!!
-        buffer[total_read] = 0;
-        int tmp            = total_read;
-        total_read         = 0;
-        return tmp;
+int USBRead(uint8_t** buffer)
+{
+    uint32_t first, last;
+
+    int size = VCP_AcquireReadBuffer(buffer);
+    if (size > 0) {
+        VCP_ReadBufferTime(&first, &last);
+        LAT_Received(LINK_USB, first, last);
     }
+    return size;
+}
 
-    return 0;
+//---------------------------------------------------------------------
+/// <summary> Release buffer obtained with USBRead, so USB can receive into it again. </summary>
+//---------------------------------------------------------------------
+void USBReadRelease()
+{
+    VCP_ReleaseReadBuffer();
 }
 
 //---------------------------------------------------------------------
@@ -144,7 +358,96 @@ int USBWrite(const uint8_t* buffer, int size)
 
     memcpy(buf, buffer, size);
     buf[size++] = CharacterMatch; // add terminating character
-    len         = VCP_write(buf, size);
+    len         = TraceStall(LINK_USB, VCP_write(buf, size), size);
 
     return len; // len will be size + 1 (because of terminating character)
-}
\ No newline at end of file
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write binary frame to USB. </summary>
+///
+/// <param name="packet"> Packet to send (framing and CRC are added). </param>
+/// <param name="size"> Size of packet. </param>
+///
+/// <returns> Number of written bytes </returns>
+//---------------------------------------------------------------------
+int USBWriteFrame(const uint8_t* packet, int size)
+{
+    uint8_t buf[UART_BUFFER_SIZE];
+
+    int len = FRAME_Encode(packet, size, buf, sizeof(buf));
+    if (len == 0)
+        return 0;
+
+    return TraceStall(LINK_USB, VCP_write(buf, len), len);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read data from USB vendor bulk interface (one transfer). Data is
+/// not copied, buffer has to be returned with BulkReadRelease. Arrival time
+/// of the data is passed on to latency measurement. </summary>
+///
+/// <param name="buffer"> Set to point to received (zero terminated) data. </param>
+///
+/// <returns> Number of read bytes </returns>
+//---------------------------------------------------------------------
+int BulkRead(uint8_t** buffer)
+{
+    uint32_t first, last;
+
+    int size = BULK_AcquireReadBuffer(buffer);
+    if (size > 0) {
+        BULK_ReadBufferTime(&first, &last);
+        LAT_Received(LINK_BULK, first, last);
+    }
+    return size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Release buffer obtained with BulkRead, so USB can receive into it again. </summary>
+//---------------------------------------------------------------------
+void BulkReadRelease()
+{
+    BULK_ReleaseReadBuffer();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write text response to USB vendor bulk interface (responses
+/// to ASCII commands, if host sends them on the bulk interface). </summary>
+///
+/// <param name="buffer"> Pointer to a buffer from which to write data. </param>
+/// <param name="size"> Number of bytes to write. </param>
+///
+/// <returns> Number of written bytes </returns>
+//---------------------------------------------------------------------
+int BulkWrite(const uint8_t* buffer, int size)
+{
+    uint8_t buf[UART_BUFFER_SIZE];
+
+    if (size <= 0 || size > (UART_BUFFER_SIZE - 1)) // -1 for newline at the end
+        return 0;
+
+    memcpy(buf, buffer, size);
+    buf[size++] = CharacterMatch; // add terminating character
+
+    return TraceStall(LINK_BULK, BULK_write(buf, size), size);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write binary frame to USB vendor bulk interface (one transfer per frame). </summary>
+///
+/// <param name="packet"> Packet to send (framing and CRC are added). </param>
+/// <param name="size"> Size of packet. </param>
+///
+/// <returns> Number of written bytes </returns>
+//---------------------------------------------------------------------
+int BulkWriteFrame(const uint8_t* packet, int size)
+{
+    uint8_t buf[BULK_RX_BUFFER_SIZE];
+
+    int len = FRAME_Encode(packet, size, buf, sizeof(buf));
+    if (len == 0)
+        return 0;
+
+    return TraceStall(LINK_BULK, BULK_write(buf, len), len);
+}
@@ -1,9 +1,24 @@
 #pragma once
 
+#include "parse.h"
+#include "uart.h"
 #include <stdint.h>
 
-void COM_UART_RX_Complete_Callback(uint8_t* buf, int size);
-int  UARTWrite(const uint8_t* buffer, int size);
+void COM_UART_RX_Complete_Callback(uint8_t* buf, int size, const uart_rx_time* rx);
+int  COM_UART_RX_Fast_Callback(const uint8_t* buf, int size);
+void COM_UART_RX_Executed_Callback(uint8_t* buf, int size, const uart_rx_time* rx);
+void COM_UART_RX_Monitor_Callback(uint8_t* buf, int size, const uart_rx_time* rx);
+void COM_UART_TX_Callback();
+void COM_Parse(parse_context* ctx, uint8_t* buf, int size);
 
-int USBRead(uint8_t* buffer, int max_size);
-int USBWrite(const uint8_t* buffer, int size);
\ No newline at end of file
+int UARTWrite(const uint8_t* buffer, int size);
+int UARTWriteFrame(const uint8_t* packet, int size);
+
+int  USBRead(uint8_t** buffer);
+void USBReadRelease();
+int  USBWrite(const uint8_t* buffer, int size);
+int  USBWriteFrame(const uint8_t* packet, int size);
+int  BulkRead(uint8_t** buffer);
+void BulkReadRelease();
+int  BulkWrite(const uint8_t* buffer, int size);
+int  BulkWriteFrame(const uint8_t* packet, int size);
\ No newline at end of file
@@ -0,0 +1,76 @@
+/// @file event.c
+/// <summary>
+/// Events for the main loop (executive).
+/// </summary>
+///
+/// <description>
+/// Pending events are bits of one word. Interrupts of any priority set them with an atomic
+/// OR (LDREX/STREX, no interrupt masking), main loop takes them with an atomic AND. Main loop
+/// sleeps with WFI while nothing is pending, with interrupts disabled: an interrupt that posts
+/// after the check stays pending and wakes WFI at once, so no event is missed. It is taken when
+/// interrupts are enabled after the sleep, once the cycle counter is carried over it (CLK_Sleep).
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "event.h"
+#include "clock.h"
+#include "main.h"
+#include "prof.h"
+
+static volatile uint32_t pending;
+
+//---------------------------------------------------------------------
+/// <summary> Post events. Can be called from any interrupt or main loop
+/// (runs from ITCM RAM, timer interrupt posts during FLASH erase too). </summary>
+///
+/// <param name="events"> Events (evt_id bits). </param>
+//---------------------------------------------------------------------
+RAMFUNC void EVT_Post(uint32_t events)
+{
+    __atomic_fetch_or(&pending, events, __ATOMIC_RELEASE);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Take (clear) pending events. Main loop only. </summary>
+///
+/// <param name="events"> Events to take (evt_id bits). </param>
+///
+/// <returns> Those of the events that were pending. </returns>
+//---------------------------------------------------------------------
+uint32_t EVT_Take(uint32_t events)
+{
+    return __atomic_fetch_and(&pending, ~events, __ATOMIC_ACQUIRE) & events;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Sleep until any event is pending and take all pending events. Main loop only.
+/// Time asleep is profiled as PROF_SLEEP (count is the number of sleeps). </summary>
+///
+/// <returns> Pending events (evt_id bits). </returns>
+//---------------------------------------------------------------------
+uint32_t EVT_Wait()
+{
+    if (pending == 0) {
+        uint32_t sleep_start = PROF_Start();
+        __disable_irq(); // interrupt that wakes the core runs after cycle counter is carried over the sleep
+        while (pending == 0) {
+            CLK_Sleep(); // also wakes on interrupts that post nothing, checks again
+            __enable_irq();
+            __ISB(); // pending interrupt is taken here
+            __disable_irq();
+        }
+        __enable_irq();
+        PROF_End(PROF_SLEEP, sleep_start);
+    }
+
+    return EVT_Take(~0u);
+}
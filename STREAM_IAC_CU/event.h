@@ -0,0 +1,34 @@
+/// @file event.h
+/// <summary>
+/// Events for the main loop (executive). Interrupts post events, main loop sleeps until one is pending.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <stdint.h>
+
+// Events, one bit each. Posting an event that is already pending does nothing (handler sees it once).
+// Main loop handles them in the order below, EVT_START first.
+typedef enum {
+    EVT_START   = 1 << 0, // start or stop requested, or stop done (SEQ_Poll), handled before anything else
+    EVT_USB_RX  = 1 << 1, // CDC receive buffer complete
+    EVT_BULK_RX = 1 << 2, // bulk transfer received
+    EVT_KV      = 1 << 3, // key-value store written or its FLASH operation finished
+    EVT_TICK    = 1 << 4, // system tick (1 ms), time based work (telemetry, receive timeouts)
+    EVT_GATE    = 1 << 5, // gateway: reply of a unit received or room freed in forwarding queue (gateway.c)
+    EVT_RESET   = 1 << 6, // reset requested (RSET), done once key-value store is written into FLASH
+} evt_id;
+
+void     EVT_Post(uint32_t events);
+uint32_t EVT_Take(uint32_t events);
+uint32_t EVT_Wait();
@@ -3,6 +3,13 @@
 /// FLASH driver.
 /// </summary>
 ///
+/// <description>
+/// Erase and program run in the background: an operation is started and the FLASH end of
+/// operation/error interrupt continues it (next word) or finishes it and calls its callback.
+/// One operation at a time. STM32F745 has a single FLASH bank, so any fetch from FLASH
+/// (code outside RAMFUNC, constants, FLASH_Read) waits while FLASH is busy.
+/// </description>
+///
 /// Supervision: /
 ///
 /// Company: Sensum d.o.o.
@@ -14,9 +21,17 @@
 // Company: Sensum d.o.o.
 
 #include "flash.h"
+#include "trace.h"
 
-#define FLASH_USER_START_ADDR ADDR_FLASH_SECTOR_5     /* Start @ of user Flash area */
-#define FLASH_USER_END_ADDR (ADDR_FLASH_SECTOR_6 - 1) /* End @ of user Flash area */
+// Background operation, driven by FLASH interrupt
+static volatile struct {
+    flash_op        op;
+    uint32_t        address;
+    const uint32_t* data;
+    int             done, size;
+    flash_callback  callback;
+    uint32_t        errors, error_flags;
+} flash;
 
 //---------------------------------------------------------------------
 /// <summary> Get FLASH sector number. </summary>
@@ -54,122 +69,189 @@ static uint32_t GetSector(uint32_t address)
 /// <summary> Read data from FLASH. </summary>
 ///
 /// <param name="buffer"> Pointer to buffer to read data into. </param>
-/// <param name="address"> Address to read from. </param>
-/// <param name="size"> Number of bytes to read. </param>
+/// <param name="address"> Address to read from (word aligned). </param>
+/// <param name="size"> Number of words to read. </param>
 ///
-/// <returns> Number of bytes read.  </returns>
+/// <returns> Number of words read.  </returns>
 //---------------------------------------------------------------------
 int FLASH_Read(uint32_t* buffer, uint32_t address, int size)
 {
-
     for (int i = 0; i < size; ++i) {
         *buffer = *(uint32_t*)address;
         buffer++;
-        address++;
+        address += 4;
     }
 
     return size;
 }
 
 //---------------------------------------------------------------------
-/// <summary> Write data to FLASH. </summary>
+/// <summary> Start programming the next word of the program operation. </summary>
+//---------------------------------------------------------------------
+static void ProgramWord()
+{
+    *(volatile uint32_t*)(flash.address + 4 * flash.done) = flash.data[flash.done];
+    __DSB(); // write reaches FLASH interface before anything else (end of operation interrupt follows)
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start erasing a sector in the background. Erase takes up to seconds,
+/// fetching from FLASH stalls meanwhile (only code in RAM keeps running, see RAMFUNC). </summary>
 ///
-/// <param name="data"> Pointer to buffer to write data from. </param>
-/// <param name="address"> Address to write data to. </param>
-/// <param name="size"> Number of bytes to write. </param>
+/// <param name="address"> Any address in the sector. </param>
+/// <param name="callback"> Called from FLASH interrupt when erase finishes (can be NULL). </param>
 ///
-/// <returns> Number of bytes written. </returns>
+/// <returns> 0 if erase was started, -1 if another operation is in progress. </returns>
 //---------------------------------------------------------------------
-int FLASH_Write(uint32_t* data, uint32_t address, int size)
+int FLASH_StartErase(uint32_t address, flash_callback callback)
 {
-    uint32_t FirstSector = 0, NbOfSectors = 0;
-    uint32_t Address = 0, SECTORError = 0;
-    __IO uint32_t data32 = 0, MemoryProgramStatus = 0;
+    if (flash.op != FLASH_OP_NONE)
+        return -1;
 
-    /*Variable used for Erase procedure*/
-    static FLASH_EraseInitTypeDef EraseInitStruct;
-
-    HAL_FLASH_Unlock();
-
-    /* Erase the user Flash area
-	(area defined by FLASH_USER_START_ADDR and FLASH_USER_END_ADDR) ***********/
-
-    /* Get the 1st sector to erase */
-    FirstSector = GetSector(FLASH_USER_START_ADDR);
-    /* Get the number of sector to erase from 1st sector*/
-    NbOfSectors = GetSector(FLASH_USER_END_ADDR) - FirstSector + 1;
-    /* Fill EraseInit structure*/
-    EraseInitStruct.TypeErase    = FLASH_TYPEERASE_SECTORS;
-    EraseInitStruct.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-    EraseInitStruct.Sector       = FirstSector;
-    EraseInitStruct.NbSectors    = NbOfSectors;
+    flash.op       = FLASH_OP_ERASE;
+    flash.address  = address;
+    flash.done     = 0;
+    flash.size     = 0;
+    flash.callback = callback;
 
     /* Note: If an erase operation in Flash memory also concerns data in the data or instruction cache,
 	you have to make sure that these data are rewritten before they are accessed during code
 	execution. If this cannot be done safely, it is recommended to flush the caches by setting the
 	DCRST and ICRST bits in the FLASH_CR register. */
-    if (HAL_FLASHEx_Erase(&EraseInitStruct, &SECTORError) != HAL_OK) {
-        /*
-		Error occurred while sector erase.
-		User can add here some code to deal with this error.
-		SECTORError will contain the faulty sector and then to know the code error on this sector,
-		user can call function 'HAL_FLASH_GetError()'
-		*/
-    }
+    TRACE_Write(TRACE_FLASH, TRACE_FLASH_ERASE, GetSector(address));
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_ALL_ERRORS);
+    FLASH->CR = FLASH_PSIZE_WORD | FLASH_CR_SER | (GetSector(address) << FLASH_CR_SNB_Pos) | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    FLASH->CR |= FLASH_CR_STRT;
 
-    /* Program the user Flash area word by word
-	(area defined by FLASH_USER_START_ADDR and FLASH_USER_END_ADDR) ***********/
+    return 0;
+}
 
-    Address = FLASH_USER_START_ADDR;
+//---------------------------------------------------------------------
+/// <summary> Start programming words into erased FLASH in the background (bits can
+/// only be cleared, erase sets them). One word is programmed per FLASH interrupt. </summary>
+///
+/// <param name="address"> Address to program (word aligned). </param>
+/// <param name="data"> Words to program, must stay unchanged until the operation finishes. </param>
+/// <param name="size"> Number of words to program. </param>
+/// <param name="callback"> Called from FLASH interrupt when programming finishes (can be NULL). </param>
+///
+/// <returns> 0 if programming was started, -1 if another operation is in progress. </returns>
+//---------------------------------------------------------------------
+int FLASH_StartProgram(uint32_t address, const uint32_t* data, int size, flash_callback callback)
+{
+    if (flash.op != FLASH_OP_NONE || size <= 0)
+        return -1;
 
-    while (size > 0) {
-        if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, Address, *data) == HAL_OK) {
-            data++;
-            Address = Address + 4;
-            size--;
-        } else {
-            /* Error occurred while writing data in Flash memory.
-			User can add here some code to deal with this error */
-        }
-    }
+    flash.op       = FLASH_OP_PROGRAM;
+    flash.address  = address;
+    flash.data     = data;
+    flash.done     = 0;
+    flash.size     = size;
+    flash.callback = callback;
 
-    /* Lock the Flash to disable the flash control register access (recommended
-	to protect the FLASH memory against possible unwanted operation) *********/
-    HAL_FLASH_Lock();
+    TRACE_Write(TRACE_FLASH, TRACE_FLASH_PROGRAM, GetSector(address));
+    HAL_FLASH_Unlock();
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_ALL_ERRORS);
+    FLASH->CR = FLASH_PSIZE_WORD | FLASH_CR_PG | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    ProgramWord();
 
     return 0;
 }
 
 //---------------------------------------------------------------------
-/// <summary> Read uC ID that was programmed by user. </summary>
+/// <summary> Finish operation in progress (lock FLASH, report result). </summary>
 ///
-/// <returns> ID of uC. </returns>
+/// <param name="result"> 0 on success, -1 on error. </param>
 //---------------------------------------------------------------------
-uint8_t FLASH_ReadID()
+static void Finish(int result)
 {
-    return *(uint8_t*)FLASH_USER_START_ADDR;
+    flash_callback callback = flash.callback;
+
+    FLASH->CR = 0; // clear operation bits and interrupt enables
+    HAL_FLASH_Lock();
+
+    // FLASH is read through D-cache when it is enabled (CLOCK_216MHZ), drop lines holding
+    // content from before the operation (a sector is too big to invalidate line by line)
+    if (flash.op == FLASH_OP_ERASE)
+        SCB_CleanInvalidateDCache();
+    else
+        SCB_InvalidateDCache_by_Addr((uint32_t*)(flash.address & ~31u), 4 * flash.size + (flash.address & 31u)); // whole 32 byte lines
+    flash.op = FLASH_OP_NONE;
+
+    if (callback != NULL)
+        callback(result);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Write uC ID to FLASH. </summary>
-///
-/// <param name="id"> User requested ID of uC. </param>
+/// <summary> FLASH interrupt handler (end of operation, operation error).
+/// Programs the next word or finishes the operation. </summary>
 //---------------------------------------------------------------------
-void FLASH_WriteID(uint8_t id)
+void FLASH_IRQHandler()
 {
-    uint32_t               SECTORError = 0;
-    FLASH_EraseInitTypeDef EraseInitStruct;
-    HAL_FLASH_Unlock();
+    uint32_t sr = FLASH->SR;
 
-    EraseInitStruct.TypeErase    = FLASH_TYPEERASE_SECTORS;
-    EraseInitStruct.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-    EraseInitStruct.Sector       = GetSector(FLASH_USER_START_ADDR);
-    EraseInitStruct.NbSectors    = 1;
-    HAL_FLASHEx_Erase(&EraseInitStruct, &SECTORError);
+    if (sr & FLASH_FLAG_ALL_ERRORS) {
+        FLASH->SR         = sr & (FLASH_FLAG_EOP | FLASH_FLAG_ALL_ERRORS); // flags are cleared by writing 1
+        flash.error_flags = sr & FLASH_FLAG_ALL_ERRORS;
+        flash.errors++;
+        TRACE_Write(TRACE_FLASH, TRACE_FLASH_ERROR, flash.error_flags);
+        Finish(-1);
+        return;
+    }
 
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, FLASH_USER_START_ADDR, id);
+    if (!(sr & FLASH_FLAG_EOP))
+        return;
+    FLASH->SR = FLASH_FLAG_EOP;
 
-    HAL_FLASH_Lock();
+    if (flash.op == FLASH_OP_PROGRAM && ++flash.done < flash.size)
+        ProgramWord();
+    else
+        Finish(0);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Enable FLASH interrupt (priority below command parsing, its work is short). </summary>
+//---------------------------------------------------------------------
+void FLASH_Init()
+{
+    HAL_NVIC_SetPriority(FLASH_IRQn, 4, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is a background operation in progress. </summary>
+///
+/// <returns> 1 if busy, 0 if idle. </returns>
+//---------------------------------------------------------------------
+int FLASH_Busy()
+{
+    return flash.op != FLASH_OP_NONE;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Wait for the background operation to finish. Only from main
+/// loop (or interrupts with lower priority than FLASH interrupt). </summary>
+//---------------------------------------------------------------------
+void FLASH_Wait()
+{
+    while (flash.op != FLASH_OP_NONE)
+        ;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Get status and progress of background operations. </summary>
+///
+/// <param name="status"> Status. </param>
+//---------------------------------------------------------------------
+void FLASH_Status(flash_status* status)
+{
+    status->op          = flash.op;
+    status->address     = flash.address;
+    status->done        = flash.done;
+    status->size        = flash.size;
+    status->errors      = flash.errors;
+    status->error_flags = flash.error_flags;
 }
 
 //---------------------------------------------------------------------
@@ -210,10 +292,13 @@ static uint32_t OTP_GetEmptyByteAddress()
 //---------------------------------------------------------------------
 static void OTP_WriteByte(uint8_t byte, uint32_t address)
 {
+    FLASH_Wait(); // HAL locks FLASH when done, wait for background operation first
     HAL_FLASH_Unlock();
     __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_WRPERR);
+    TRACE_Write(TRACE_FLASH, TRACE_FLASH_OTP, address - ADDR_OTP_SECTOR);
     HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, address, byte);
     HAL_FLASH_Lock();
+    SCB_InvalidateDCache_by_Addr((uint32_t*)(address & ~31u), 32); // next ID search reads the new byte
 }
 
 //---------------------------------------------------------------------
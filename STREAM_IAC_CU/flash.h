@@ -14,11 +14,32 @@
 #define ADDR_FLASH_SECTOR_6 ((uint32_t)0x08080000) /* Base address of Sector 6, 256 Kbytes */
 #define ADDR_FLASH_SECTOR_7 ((uint32_t)0x080C0000) /* Base address of Sector 7, 256 Kbytes */
 
-int FLASH_Read(uint32_t* buffer, uint32_t address, int size);
-int FLASH_Write(uint32_t* data, uint32_t address, int size);
+// Background FLASH operation
+typedef enum {
+    FLASH_OP_NONE,    // idle
+    FLASH_OP_ERASE,   // sector erase
+    FLASH_OP_PROGRAM, // programming words
+} flash_op;
 
-uint8_t FLASH_ReadID();
-void    FLASH_WriteID(uint8_t id);
+// Called from FLASH interrupt when an operation finishes, result is 0 on success, -1 on error
+typedef void (*flash_callback)(int result);
+
+typedef struct {
+    flash_op op;          // operation in progress
+    uint32_t address;     // its address (sector address for erase)
+    int      done;        // words programmed so far
+    int      size;        // words to program
+    uint32_t errors;      // failed operations since startup
+    uint32_t error_flags; // FLASH_SR error flags of the last failed operation
+} flash_status;
+
+void FLASH_Init();
+int  FLASH_Read(uint32_t* buffer, uint32_t address, int size);
+int  FLASH_StartErase(uint32_t address, flash_callback callback);
+int  FLASH_StartProgram(uint32_t address, const uint32_t* data, int size, flash_callback callback);
+int  FLASH_Busy();
+void FLASH_Wait();
+void FLASH_Status(flash_status* status);
 
 uint8_t OTP_ReadID();
 void    OTP_WriteID(uint8_t id);
\ No newline at end of file
@@ -0,0 +1,183 @@
+/// @file frame.c
+/// <summary>
+/// Binary link layer shared by USB and UART (COBS framing with CRC32).
+/// </summary>
+///
+/// <description>
+/// Frames are delimited with a zero byte on both ends. Content between delimiters
+/// is COBS encoded (Consistent Overhead Byte Stuffing), so it never contains a zero byte,
+/// which makes resynchronization after a corrupted or lost byte trivial - next delimiter
+/// starts a new frame. Legacy ASCII commands never start with a zero byte, so the
+/// receiver can tell the two apart for each frame.
+/// CRC32 is calculated by the CRC peripheral, configured to give the standard
+/// (zlib, Ethernet) CRC32, so the host can check it with any library.
+/// With FRAME_SOFTWARE_CRC defined (host build) the same CRC32 is calculated in software.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "frame.h"
+#include "stm32f7xx_hal.h"
+
+#if defined(FRAME_SOFTWARE_CRC)
+
+//---------------------------------------------------------------------
+/// <summary> Nothing to initialize, CRC32 is calculated in software. </summary>
+//---------------------------------------------------------------------
+void FRAME_Init()
+{
+}
+
+//---------------------------------------------------------------------
+/// <summary> Calculate CRC32 in software (reflected, polynomial 0xEDB88320,
+/// 4 bits at a time). Gives the same result as the CRC peripheral. </summary>
+///
+/// <param name="data"> Data. </param>
+/// <param name="size"> Number of bytes. </param>
+///
+/// <returns> CRC32 of data. </returns>
+//---------------------------------------------------------------------
+uint32_t FRAME_CRC32(const uint8_t* data, int size)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (int i = 0; i < size; ++i) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+
+    return ~crc;
+}
+
+#else
+
+//---------------------------------------------------------------------
+/// <summary> Initialize CRC peripheral for standard CRC32
+/// (polynomial 0x04C11DB7, reflected input and output). </summary>
+//---------------------------------------------------------------------
+void FRAME_Init()
+{
+    __HAL_RCC_CRC_CLK_ENABLE();
+
+    CRC->POL  = 0x04C11DB7;
+    CRC->INIT = 0xFFFFFFFF;
+    CRC->CR   = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT; // bit reversal done by byte, 32 bit polynomial
+}
+
+//---------------------------------------------------------------------
+/// <summary> Calculate CRC32 with the CRC peripheral. </summary>
+///
+/// <param name="data"> Data. </param>
+/// <param name="size"> Number of bytes. </param>
+///
+/// <returns> CRC32 of data. </returns>
+//---------------------------------------------------------------------
+uint32_t FRAME_CRC32(const uint8_t* data, int size)
+{
+    // Peripheral is shared by UART (interrupt) and USB (main loop), so block interrupts that could use it.
+    // Sequencer timer has priority 0 and is not blocked.
+    uint32_t basepri = __get_BASEPRI();
+    __set_BASEPRI(1 << (8 - __NVIC_PRIO_BITS));
+
+    CRC->CR |= CRC_CR_RESET;
+    for (int i = 0; i < size; ++i)
+        *(__IO uint8_t*)&CRC->DR = data[i];
+    uint32_t crc = ~CRC->DR;
+
+    __set_BASEPRI(basepri);
+
+    return crc;
+}
+
+#endif
+
+//---------------------------------------------------------------------
+/// <summary> Encode packet into a frame (adds CRC32, COBS encodes and adds delimiters). </summary>
+///
+/// <param name="packet"> Packet to encode. </param>
+/// <param name="size"> Size of packet. </param>
+/// <param name="frame"> Buffer to write frame to. </param>
+/// <param name="max_size"> Size of frame buffer. </param>
+///
+/// <returns> Size of frame, 0 if it doesn't fit into frame buffer. </returns>
+//---------------------------------------------------------------------
+int FRAME_Encode(const uint8_t* packet, int size, uint8_t* frame, int max_size)
+{
+    if (size <= 0 || FRAME_ENCODED_SIZE(size) > max_size)
+        return 0;
+
+    uint32_t crc         = FRAME_CRC32(packet, size);
+    uint8_t  crc_bytes[] = {crc, crc >> 8, crc >> 16, crc >> 24};
+    int      total       = size + FRAME_CRC_SIZE;
+    int      out         = 0;
+    uint8_t  code        = 1;
+
+    frame[out++] = FRAME_DELIMITER;
+    int code_idx = out++; // position of current COBS code byte
+
+    for (int i = 0; i < total; ++i) {
+        uint8_t byte = i < size ? packet[i] : crc_bytes[i - size];
+        if (byte != 0) {
+            frame[out++] = byte;
+            code++;
+        }
+        if (byte == 0 || code == 0xFF) {
+            frame[code_idx] = code;
+            code            = 1;
+            code_idx        = out++;
+        }
+    }
+    frame[code_idx] = code;
+
+    frame[out++] = FRAME_DELIMITER;
+
+    return out;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Decode frame in place (COBS decode and CRC32 check). </summary>
+///
+/// <param name="frame"> Frame content between delimiters, decoded packet is written over it. </param>
+/// <param name="size"> Size of frame content. </param>
+///
+/// <returns> Size of decoded packet (without CRC), -1 if frame is corrupted. </returns>
+//---------------------------------------------------------------------
+int FRAME_Decode(uint8_t* frame, int size)
+{
+    int in  = 0;
+    int out = 0;
+
+    while (in < size) {
+        uint8_t code = frame[in++];
+        if (code == 0 || in + code - 1 > size)
+            return -1;
+
+        for (int i = 1; i < code; ++i)
+            frame[out++] = frame[in++];
+
+        if (code != 0xFF && in < size)
+            frame[out++] = 0;
+    }
+
+    if (out < FRAME_HEADER_SIZE + FRAME_CRC_SIZE)
+        return -1;
+
+    out -= FRAME_CRC_SIZE;
+    uint32_t crc = frame[out] | frame[out + 1] << 8 | frame[out + 2] << 16 | (uint32_t)frame[out + 3] << 24;
+    if (crc != FRAME_CRC32(frame, out))
+        return -1;
+
+    return out;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary frame on the wire: FRAME_DELIMITER, COBS(packet, CRC32), FRAME_DELIMITER
+// Packet: sequence number, opcode, payload. CRC32 (same as zlib crc32) is little endian.
+#define FRAME_DELIMITER 0x00
+#define FRAME_CRC_SIZE 4
+#define FRAME_HEADER_SIZE 2          // sequence number, opcode
+#define FRAME_RESPONSE_HEADER_SIZE 3 // sequence number, opcode, status
+#define FRAME_MAX_PACKET_SIZE 503    // so that encoded frame plus UART address byte fits into UART_BUFFER_SIZE
+
+// Worst case size of encoded frame (COBS adds one byte per 254 bytes, plus both delimiters)
+#define FRAME_ENCODED_SIZE(packet_size) ((packet_size) + FRAME_CRC_SIZE + ((packet_size) + FRAME_CRC_SIZE) / 254 + 1 + 2)
+
+typedef enum {
+    FRAME_STATUS_OK        = 0x00,
+    FRAME_STATUS_UNKNOWN   = 0x01, // unknown opcode or not allowed on this link
+    FRAME_STATUS_DUPLICATE = 0x02, // same sequence number as previous frame, command was not executed again
+    FRAME_STATUS_BAD_ARGS  = 0x03, // payload does not match command's argument schema
+} frame_status;
+
+void     FRAME_Init();
+uint32_t FRAME_CRC32(const uint8_t* data, int size);
+int      FRAME_Encode(const uint8_t* packet, int size, uint8_t* frame, int max_size);
+int      FRAME_Decode(uint8_t* frame, int size);
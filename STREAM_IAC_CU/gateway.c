@@ -0,0 +1,320 @@
+/// @file gateway.c
+/// <summary>
+/// USB to RS-485 gateway: messages for other units on the bus are forwarded, their replies routed back.
+/// </summary>
+///
+/// <description>
+/// Host sends address prefixed lines on USB ("@5,PRDS,1000", "@*,STRT" for all units),
+/// parser queues them here (main loop) and EXTI0 interrupt writes them to the bus, the
+/// same interrupt that writes responses of this unit, so UART transmit buffer has one writer.
+/// Replies of units (their lines start with origin address byte) are received while
+/// UART_Monitor is set and written back to the USB link the forwarding came from,
+/// prefixed the same way ("@5,PRDS,1000").
+///
+/// Bus is half duplex, so after a message that is answered (addressed, untagged) the next
+/// one waits for the reply, or for a timeout. Tagged messages ("@5,#1,CHLS,...") are not
+/// answered until an untagged one arrives (units hold acknowledgements, see parse.c), so
+/// they are written back to back, batched into the transmit buffer: a configuration of the
+/// whole fleet goes out at bus line rate and costs one turnaround per unit (its ACKS).
+/// Broadcast query answered in slots (ENUM, STTQ) waits until its last slot is over.
+///
+/// Gateway is the bus master of device time too (clock.h): every GATE_SyncInterval it broadcasts
+/// SYNC,<t>, where t is the time at which receivers timestamp its terminator, so every unit takes
+/// the same instant as time t. It is sent only when the transmitter is idle, so that instant is known.
+///
+/// USB receive buffer is parsed only when the forwarding queue has room for all of it
+/// (GATE_Ready), otherwise it waits and USB flow control holds the host back.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "gateway.h"
+#include "clock.h"
+#include "event.h"
+#include "frame.h"
+#include "main.h"
+#include "slot.h"
+#include "spsc.h"
+#include <stdio.h>
+#include <string.h>
+
+// Time a unit has to start replying and finish the first line of the reply [us]
+#define GATE_REPLY_TIMEOUT_US (SLOT_CHARS_US(UART_BUFFER_SIZE) + 10000)
+
+// Time from the start of transmission of n characters to the middle of the last stop bit,
+// where receivers see the terminator and timestamp it [us]
+#define GATE_TERMINATOR_US(n) ((uint32_t)(((uint64_t)(n)*20 - 1) * 1000000 / (2 * UART_BAUD_RATE)))
+
+volatile gate_stats GATE_Stats;
+volatile uint32_t   GATE_SyncInterval = 0;
+
+static uint32_t last_sync; // HAL tick of the last time broadcast
+
+// Forwarded messages (producer: main loop, consumer: EXTI0 interrupt), head and tail are free running byte counters
+static struct {
+    uint8_t           data[GATE_QUEUE_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} queue;
+
+// Reply of a unit (producer: EXTI0 interrupt, consumer: main loop)
+typedef struct {
+    uint8_t address;
+    int     size;
+    uint8_t data[UART_BUFFER_SIZE];
+} gate_reply;
+
+SPSC_QUEUE(replies, gate_reply, GATE_REPLY_QUEUE_SIZE);
+
+static write_func reply_write; // write function of the link replies go to (main loop)
+
+// Bus state (EXTI0 interrupt), times are cycle counter values
+static struct {
+    int      expect;  // address of the unit whose reply is awaited, -1 if none
+    uint32_t until;   // reply timeout if a reply is awaited, else the bus is not free before (slots, rest of reply)
+    uint32_t tx_end;  // end of the last forwarded message, anything received before is its echo
+} bus = {.expect = -1};
+
+//---------------------------------------------------------------------
+/// <summary> Convert time to cycle counter ticks. </summary>
+///
+/// <param name="us"> Time [us]. </param>
+///
+/// <returns> Number of cycles. </returns>
+//---------------------------------------------------------------------
+static uint32_t Cycles(uint32_t us)
+{
+    return us * (SystemCoreClock / 1000000);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Copy data into forwarding queue (wraps around its end). </summary>
+///
+/// <param name="pos"> Byte counter of the first byte. </param>
+/// <param name="data"> Data. </param>
+/// <param name="size"> Size of data. </param>
+//---------------------------------------------------------------------
+static void QueuePut(uint32_t pos, const uint8_t* data, int size)
+{
+    for (int i = 0; i < size; ++i)
+        queue.data[(pos + i) & (GATE_QUEUE_SIZE - 1)] = data[i];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Copy data out of forwarding queue (wraps around its end). </summary>
+///
+/// <param name="pos"> Byte counter of the first byte. </param>
+/// <param name="data"> Buffer for data. </param>
+/// <param name="size"> Size of data. </param>
+//---------------------------------------------------------------------
+static void QueueGet(uint32_t pos, uint8_t* data, int size)
+{
+    for (int i = 0; i < size; ++i)
+        data[i] = queue.data[(pos + i) & (GATE_QUEUE_SIZE - 1)];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Check if received data can be parsed, i.e. if everything it could
+/// forward fits into the queue. Queued message never takes more than its line
+/// ("@5," prefix is as long as the queue header at least). </summary>
+///
+/// <param name="size"> Size of received data (receive buffer). </param>
+///
+/// <returns> 1 if data can be parsed. </returns>
+//---------------------------------------------------------------------
+int GATE_Ready(int size)
+{
+    return GATE_QUEUE_SIZE - (queue.head - __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE)) >= size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Queue a message for a unit on the bus and start monitoring the bus
+/// for replies, they are written with Write. </summary>
+///
+/// <param name="Write"> Write function of the link the message came from. </param>
+/// <param name="address"> Address of the unit (0 - 126) or GATE_BROADCAST. </param>
+/// <param name="data"> Message (without address and terminator). </param>
+/// <param name="size"> Size of message. </param>
+///
+/// <returns> 0 if message was queued, -1 if it was dropped. </returns>
+//---------------------------------------------------------------------
+int GATE_Forward(write_func Write, int address, const char* data, int size)
+{
+    uint32_t head = queue.head;
+
+    if (size <= 0 || size > GATE_MAX_MESSAGE || !GATE_Ready(GATE_HEADER_SIZE + size)) {
+        GATE_Stats.dropped++;
+        return -1;
+    }
+
+    uint8_t header[GATE_HEADER_SIZE] = {address, size & 0xFF, size >> 8};
+    QueuePut(head, header, GATE_HEADER_SIZE);
+    QueuePut(head + GATE_HEADER_SIZE, (const uint8_t*)data, size);
+
+    reply_write  = Write;
+    UART_Monitor = 1;
+    __atomic_store_n(&queue.head, head + GATE_HEADER_SIZE + size, __ATOMIC_RELEASE);
+
+    EXTI->SWIER = EXTI_SWIER_SWIER0; // written by EXTI interrupt
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is it time to broadcast device time. </summary>
+///
+/// <returns> 1 if it is. </returns>
+//---------------------------------------------------------------------
+static int SyncDue()
+{
+    return GATE_SyncInterval > 0 && HAL_GetTick() - last_sync >= GATE_SyncInterval;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Broadcast device time: SYNC,<t> with t as the time its terminator is received.
+/// Time is written with fixed width digits right before the message is written, so the
+/// delay between reading the clock and the start of transmission is short and constant. </summary>
+//---------------------------------------------------------------------
+static void SendSync()
+{
+    uint8_t  message[] = "\xFF" "SYNC,0000000000\n"; // broadcast address byte (0x80 | GATE_BROADCAST)
+    int      len       = sizeof(message) - 1;
+    uint32_t now       = DWT->CYCCNT;
+    uint32_t time      = CLK_Time(now) + GATE_TERMINATOR_US(len);
+
+    for (int i = len - 2; message[i] != ','; --i, time /= 10)
+        message[i] = '0' + time % 10;
+    UART_Write(message, len);
+
+    last_sync  = HAL_GetTick();
+    bus.tx_end = now + Cycles(SLOT_CHARS_US(len));
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write replies of units to the link, and let EXTI interrupt
+/// continue forwarding (reply timeouts). Called from main loop on EVT_GATE
+/// and on every tick. </summary>
+//---------------------------------------------------------------------
+void GATE_Poll()
+{
+    gate_reply* reply;
+    char        buf[UART_BUFFER_SIZE];
+
+    while ((reply = SPSC_Peek(&replies)) != NULL) {
+        int len  = snprintf(buf, sizeof(buf), "@%u,", reply->address);
+        int size = MIN(reply->size, (int)sizeof(buf) - 1 - len); // -1 for newline added by link
+        memcpy(&buf[len], reply->data, size);
+        reply_write((const uint8_t*)buf, len + size);
+        SPSC_Pop(&replies);
+    }
+
+    if (queue.head != queue.tail || bus.expect >= 0 || SyncDue())
+        EXTI->SWIER = EXTI_SWIER_SWIER0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write queued messages to the bus, as long as the bus is free and they
+/// fit into transmit buffer. Stops after a message that is answered (or a slotted
+/// broadcast query), the next one waits until the reply is over or times out.
+/// Device time broadcast, when it is due, goes first.
+/// Called at the end of EXTI interrupt (COM_UART_TX_Callback). </summary>
+//---------------------------------------------------------------------
+void GATE_Send()
+{
+    uint32_t now  = DWT->CYCCNT;
+    uint32_t tail = queue.tail;
+    uint32_t sent = tail;
+
+    if (bus.expect >= 0) {
+        if ((int32_t)(now - bus.until) < 0)
+            return;
+        bus.expect = -1; // unit is not there, or didn't understand the message
+        bus.until  = now;
+        GATE_Stats.timeouts++;
+    }
+    if ((int32_t)(now - bus.until) < 0 || UART_Receiving())
+        return;
+
+    if (SyncDue() && UART_TxIdle())
+        SendSync();
+
+    while (tail != __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE)) {
+        uint8_t header[GATE_HEADER_SIZE];
+        uint8_t packet[UART_BUFFER_SIZE + 1]; // address byte, message, terminator, zero
+        int     len = 0;
+
+        QueueGet(tail, header, GATE_HEADER_SIZE);
+        int address = header[0];
+        int size    = header[1] | header[2] << 8;
+        if (UART_TxFree() < size + 2)
+            break;
+
+        packet[len++] = 0x80 | address;
+        QueueGet(tail + GATE_HEADER_SIZE, &packet[len], size);
+        len += size;
+        packet[len++] = '\n';
+        packet[len]   = '\0';
+
+        int pending = UART_Write(packet, len);
+        tail += GATE_HEADER_SIZE + size;
+        __atomic_store_n(&queue.tail, tail, __ATOMIC_RELEASE);
+        GATE_Stats.forwarded++;
+        bus.tx_end = now + Cycles(SLOT_CHARS_US(pending));
+
+        if (address == GATE_BROADCAST) {
+            int slots = ParseSlotCount((const char*)&packet[1]);
+            if (slots > 0) {
+                bus.until = bus.tx_end + Cycles(SLOT_CHARS_US(SLOT_GUARD_CHARS) + slots * SLOT_Time);
+                break;
+            }
+        } else if (packet[1] != '#') { // tagged message is answered later, together with an untagged one
+            bus.expect = address;
+            bus.until  = bus.tx_end + Cycles(GATE_REPLY_TIMEOUT_US);
+            break;
+        }
+    }
+
+    if (tail != sent)
+        EVT_Post(EVT_GATE); // room in the queue for USB data waiting to be parsed
+}
+
+//---------------------------------------------------------------------
+/// <summary> Message of another unit received (UART_Monitor): route it to the host.
+/// Called from EXTI interrupt (COM_UART_RX_Monitor_Callback). </summary>
+///
+/// <param name="data"> Received message (without address byte and terminator). </param>
+/// <param name="size"> Size of message. </param>
+/// <param name="rx"> Arrival of the message and its address byte. </param>
+//---------------------------------------------------------------------
+void GATE_Received(const uint8_t* data, int size, const uart_rx_time* rx)
+{
+    // Only text replies of units, not own transmission echoed by transceiver, nor binary telemetry frames
+    if (rx->broadcast || (int32_t)(rx->first - bus.tx_end) < 0 || (size > 0 && data[0] == FRAME_DELIMITER))
+        return;
+
+    int         address = rx->address & 0x7F;
+    gate_reply* reply   = SPSC_Claim(&replies);
+    if (reply == NULL) {
+        GATE_Stats.dropped++;
+    } else {
+        reply->address = address;
+        reply->size    = size;
+        memcpy(reply->data, data, size);
+        SPSC_Publish(&replies);
+        GATE_Stats.replies++;
+        EVT_Post(EVT_GATE);
+    }
+
+    // Reply is there, rest of its lines follow right away
+    if (address == bus.expect) {
+        bus.expect = -1;
+        bus.until  = rx->last + Cycles(SLOT_CHARS_US(SLOT_GUARD_CHARS));
+    }
+}
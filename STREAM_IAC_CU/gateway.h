@@ -0,0 +1,46 @@
+/// @file gateway.h
+/// <summary>
+/// USB to RS-485 gateway: messages for other units on the bus are forwarded, their replies routed back.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include "parse.h"
+#include "uart.h"
+#include <stdint.h>
+
+#define GATE_QUEUE_SIZE 2048      // forwarded messages waiting for the bus [bytes] (power of 2)
+#define GATE_REPLY_QUEUE_SIZE 8   // replies waiting for main loop (power of 2)
+#define GATE_HEADER_SIZE 3        // queued message: address, size (2 bytes), message
+#define GATE_BROADCAST UART_BROADCAST // address of a message to all units
+#define GATE_MAX_MESSAGE (UART_BUFFER_SIZE - 2) // without address byte and terminator, receiver must fit it
+
+// Gateway statistics
+typedef struct {
+    uint32_t forwarded; // messages written to the bus
+    uint32_t replies;   // replies routed back
+    uint32_t timeouts;  // unit didn't reply to an untagged message
+    uint32_t dropped;   // messages that didn't fit into forwarding queue, replies that didn't fit into reply queue
+} gate_stats;
+
+extern volatile gate_stats GATE_Stats;
+extern volatile uint32_t   GATE_SyncInterval; // broadcast device time (SYNC,<t>) this often [ms], 0 - off
+
+// Main loop
+int  GATE_Ready(int size);
+int  GATE_Forward(write_func Write, int address, const char* data, int size);
+void GATE_Poll();
+
+// EXTI0 interrupt (UART parser priority)
+void GATE_Send();
+void GATE_Received(const uint8_t* data, int size, const uart_rx_time* rx);
@@ -0,0 +1,532 @@
+/// @file kvstore.c
+/// <summary>
+/// Wear-levelled key-value store in two FLASH sectors (append-only log of records),
+/// values are kept in RAM and written into FLASH in the background.
+/// </summary>
+///
+/// <description>
+/// One sector is active at a time. It starts with a header (magic, generation) followed by records
+/// [key | length << 16, value padded to words, CRC32 of key/length word and value]. Writing a value
+/// appends a record, the latest valid record of a key is its value. Only when the active sector is full
+/// are the latest records copied into the other (erased) sector, which then becomes active - its header
+/// is written last, so an interrupted compaction leaves the old sector active. A record is written
+/// before its CRC, so an interrupted write is ignored (previous value of the key stays in effect).
+///
+/// Values of all keys are read into RAM when the store is mounted. KV_Read and KV_Write only use
+/// RAM, so they never wait for FLASH and can be called from command handlers in any context.
+/// KV_Poll (main loop) writes changed values with background FLASH operations, one step per
+/// finished operation. A key is written by one context at a time (a write interrupted by
+/// another write or read of the same key can mix old and new bytes).
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "kvstore.h"
+#include "event.h"
+#include "frame.h"
+#include <string.h>
+
+#define KV_MAGIC 0x3153564B // "KVS1"
+#define KV_HEADER_SIZE 8    // magic, generation
+#define KV_ERASED 0xFFFFFFFF
+
+#define WORDS(size) (((size) + 3) / 4)
+#define RECORD_SIZE(len) (4 + 4 * WORDS(len) + 4) // key/length word, value, CRC
+
+// Background FLASH operation in progress
+typedef enum {
+    KV_IDLE,       // none
+    KV_ERASE,      // erasing the other sector
+    KV_COPY,       // copying the latest record of a key into the other sector
+    KV_GENERATION, // programming generation of the other sector
+    KV_ACTIVATE,   // programming magic of the other sector (makes it active)
+    KV_RECORD,     // programming record (key/length word and value)
+    KV_CRC,        // programming CRC of the record
+} kv_state;
+
+static struct {
+    char     mounted;
+    uint32_t sector;                // address of the active sector, 0 if store is not formatted yet
+    uint32_t generation;            // generation of the active sector
+    uint32_t free;                  // offset of the first free byte in the active sector
+    uint32_t bad;                   // records with wrong CRC
+    uint32_t index[KV_NUM_OF_KEYS]; // offset of the latest record of each key, 0 if key has no record
+
+    kv_state      state;
+    volatile char done;                     // FLASH operation finished (set from FLASH interrupt)
+    volatile int  result;                   // its result
+    char          failed;                   // operation failed, nothing is written until next KV_Write
+    uint32_t      errors;                   // failed operations
+    int           key;                      // key being copied or written
+    uint32_t      offset;                   // offset of the record being written
+    uint32_t      version;                  // version of the value being written
+    uint32_t      to;                       // sector being prepared (format, compaction)
+    uint32_t      to_free;                  // offset of the first free byte in it
+    uint32_t      to_index[KV_NUM_OF_KEYS]; // records copied into it
+    uint32_t      header[2];                // its header (magic, generation)
+} kv;
+
+// Latest value of each key
+static struct {
+    volatile uint32_t version; // incremented by KV_Write after the value is copied
+    uint32_t          stored;  // version that is in FLASH
+    int               size;    // -1 if key has no value
+    uint32_t          data[WORDS(KV_MAX_VALUE_SIZE)];
+} value[KV_NUM_OF_KEYS];
+
+static uint32_t record[WORDS(RECORD_SIZE(KV_MAX_VALUE_SIZE))]; // record being read or written
+
+//---------------------------------------------------------------------
+/// <summary> Read one word from FLASH. </summary>
+///
+/// <param name="address"> Address (word aligned). </param>
+///
+/// <returns> Word. </returns>
+//---------------------------------------------------------------------
+static uint32_t ReadWord(uint32_t address)
+{
+    uint32_t word;
+    FLASH_Read(&word, address, 1);
+    return word;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read record into record buffer and check its CRC. </summary>
+///
+/// <param name="sector"> Sector address. </param>
+/// <param name="offset"> Offset of the record in the sector. </param>
+/// <param name="valid"> Set to 1 if CRC is correct, 0 otherwise. </param>
+///
+/// <returns> Size of the record [bytes], 0 if there is no record (erased FLASH,
+/// end of log), -1 if length is out of range (rest of sector can't be used). </returns>
+//---------------------------------------------------------------------
+static int ReadRecord(uint32_t sector, uint32_t offset, int* valid)
+{
+    uint32_t head = ReadWord(sector + offset);
+    uint32_t len  = head >> 16;
+
+    if (head == KV_ERASED)
+        return 0;
+    if (len > KV_MAX_VALUE_SIZE || offset + RECORD_SIZE(len) > KV_SECTOR_SIZE)
+        return -1;
+
+    FLASH_Read(record, sector + offset, RECORD_SIZE(len) / 4);
+    *valid = FRAME_CRC32((const uint8_t*)record, 4 + len) == record[WORDS(RECORD_SIZE(len)) - 1];
+    return RECORD_SIZE(len);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Check if sector is erased (FLASH is erased when shipped,
+/// so first use doesn't have to wait for an erase). </summary>
+///
+/// <param name="sector"> Sector address. </param>
+///
+/// <returns> 1 if erased, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+static int Blank(uint32_t sector)
+{
+    for (uint32_t offset = 0; offset < KV_SECTOR_SIZE; offset += sizeof(record)) {
+        int words = MIN(sizeof(record), KV_SECTOR_SIZE - offset) / 4;
+        FLASH_Read(record, sector + offset, words);
+        for (int i = 0; i < words; ++i) {
+            if (record[i] != KV_ERASED)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+//---------------------------------------------------------------------
+/// <summary> FLASH operation finished. Called from FLASH interrupt. </summary>
+///
+/// <param name="result"> 0 on success, -1 on error. </param>
+//---------------------------------------------------------------------
+static void Done(int result)
+{
+    kv.result = result;
+    kv.done   = 1;
+    EVT_Post(EVT_KV);
+}
+
+//---------------------------------------------------------------------
+/// <summary> FLASH operation failed or couldn't be started. Writing stops
+/// until next KV_Write (an interrupted compaction leaves the active sector
+/// as it was, a record that failed is compacted away by the next write). </summary>
+//---------------------------------------------------------------------
+static void Fail()
+{
+    if (kv.state == KV_RECORD || kv.state == KV_CRC)
+        kv.free = KV_SECTOR_SIZE; // record can be partly programmed, mounting would stop at it
+
+    kv.state  = KV_IDLE;
+    kv.failed = 1;
+    kv.errors++;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start programming words. </summary>
+///
+/// <param name="address"> Address (word aligned). </param>
+/// <param name="data"> Words (kept unchanged until done). </param>
+/// <param name="size"> Number of words. </param>
+/// <param name="state"> Operation. </param>
+//---------------------------------------------------------------------
+static void Program(uint32_t address, const uint32_t* data, int size, kv_state state)
+{
+    kv.state = state;
+    kv.done  = 0;
+    if (FLASH_StartProgram(address, data, size, Done) != 0)
+        Fail();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Copy the latest record of the next key into the sector being
+/// prepared, after the last one start writing its header (generation first). </summary>
+//---------------------------------------------------------------------
+static void CopyNext()
+{
+    int valid;
+
+    while (kv.key < KV_NUM_OF_KEYS && (kv.sector == 0 || kv.index[kv.key] == 0))
+        kv.key++;
+
+    if (kv.key == KV_NUM_OF_KEYS) {
+        Program(kv.to + 4, &kv.header[1], 1, KV_GENERATION);
+        return;
+    }
+
+    int size = ReadRecord(kv.sector, kv.index[kv.key], &valid);
+    if (size <= 0 || !valid) {
+        Fail();
+        return;
+    }
+
+    kv.to_index[kv.key] = kv.to_free;
+    Program(kv.to + kv.to_free, record, size / 4, KV_COPY);
+    kv.to_free += size;
+    kv.key++;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start preparing a sector (erase if needed, copy the latest records
+/// of the active sector) that becomes active once its header is written. </summary>
+///
+/// <param name="sector"> Sector address. </param>
+/// <param name="generation"> Generation of the sector. </param>
+//---------------------------------------------------------------------
+static void Switch(uint32_t sector, uint32_t generation)
+{
+    kv.to        = sector;
+    kv.to_free   = KV_HEADER_SIZE;
+    kv.header[0] = KV_MAGIC;
+    kv.header[1] = generation;
+    kv.key       = 0;
+    memset(kv.to_index, 0, sizeof(kv.to_index));
+
+    if (Blank(sector)) {
+        CopyNext();
+        return;
+    }
+
+    kv.state = KV_ERASE;
+    kv.done  = 0;
+    if (FLASH_StartErase(sector, Done) != 0)
+        Fail();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start appending the latest value of a key to the active sector,
+/// or compacting the sector first if the record doesn't fit. </summary>
+///
+/// <param name="key"> Key. </param>
+//---------------------------------------------------------------------
+static void Append(int key)
+{
+    uint32_t version;
+    int      size, words;
+
+    do { // again if KV_Write interrupted the copy
+        version           = value[key].version;
+        size              = value[key].size;
+        words             = WORDS(RECORD_SIZE(size));
+        record[words - 2] = KV_ERASED; // padding of the last value word (key/length word if value is empty)
+        memcpy(&record[1], value[key].data, size);
+    } while (version != value[key].version);
+
+    if (kv.free + RECORD_SIZE(size) > KV_SECTOR_SIZE) {
+        Switch(kv.sector == KV_SECTOR_A ? KV_SECTOR_B : KV_SECTOR_A, kv.generation + 1);
+        return;
+    }
+
+    record[0]         = key | (uint32_t)size << 16;
+    record[words - 1] = FRAME_CRC32((const uint8_t*)record, 4 + size);
+
+    kv.key     = key;
+    kv.version = version;
+    kv.offset  = kv.free;
+
+    kv.free += RECORD_SIZE(size); // space is used even if programming fails
+    Program(kv.sector + kv.offset, record, words - 1, KV_RECORD);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Continue after a finished FLASH operation. </summary>
+//---------------------------------------------------------------------
+static void Next()
+{
+    uint32_t len = record[0] >> 16; // of the record being written
+
+    switch (kv.state) {
+    case KV_ERASE:
+    case KV_COPY:
+        CopyNext();
+        break;
+    case KV_GENERATION:
+        Program(kv.to, &kv.header[0], 1, KV_ACTIVATE);
+        break;
+    case KV_ACTIVATE:
+        kv.sector     = kv.to;
+        kv.generation = kv.header[1];
+        kv.free       = kv.to_free;
+        memcpy(kv.index, kv.to_index, sizeof(kv.index));
+        kv.state = KV_IDLE;
+        break;
+    case KV_RECORD:
+        Program(kv.sector + kv.offset + RECORD_SIZE(len) - 4, &record[WORDS(RECORD_SIZE(len)) - 1], 1, KV_CRC);
+        break;
+    case KV_CRC:
+        kv.index[kv.key]     = kv.offset;
+        value[kv.key].stored = kv.version;
+        kv.state             = KV_IDLE;
+        break;
+    default:
+        kv.state = KV_IDLE;
+        break;
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start the next write, if there is anything to write. Unformatted
+/// store is formatted first, keys are written in turns. </summary>
+//---------------------------------------------------------------------
+static void Start()
+{
+    if (kv.failed)
+        return;
+
+    if (kv.sector == 0) {
+        Switch(KV_SECTOR_A, 1);
+        return;
+    }
+
+    for (int i = 1; i <= KV_NUM_OF_KEYS; ++i) {
+        int key = (kv.key + i) % KV_NUM_OF_KEYS;
+        if (value[key].version != value[key].stored) {
+            Append(key);
+            return;
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Find the active sector (valid header, newer generation), index its
+/// records and read the latest values. Empty store is formatted by KV_Poll, the
+/// ID of the old layout (single byte at the start of sector 5, rest erased) is
+/// moved into it (old layout is erased with the first compaction into sector 5). </summary>
+//---------------------------------------------------------------------
+static void Mount()
+{
+    int a_valid = ReadWord(KV_SECTOR_A) == KV_MAGIC;
+    int b_valid = ReadWord(KV_SECTOR_B) == KV_MAGIC;
+
+    memset(&kv, 0, sizeof(kv));
+    memset(value, 0, sizeof(value));
+    for (int key = 0; key < KV_NUM_OF_KEYS; ++key)
+        value[key].size = -1;
+    kv.mounted = 1;
+
+    if (!a_valid && !b_valid) {
+        uint32_t legacy = ReadWord(ADDR_FLASH_SECTOR_5);
+        if (legacy != KV_ERASED && (legacy | 0xFF) == KV_ERASED) {
+            value[KV_ID].size    = 1;
+            value[KV_ID].data[0] = legacy & 0xFF;
+            value[KV_ID].version = 1;
+        }
+        return;
+    }
+
+    kv.sector = a_valid ? KV_SECTOR_A : KV_SECTOR_B;
+    if (a_valid && b_valid && (int32_t)(ReadWord(KV_SECTOR_B + 4) - ReadWord(KV_SECTOR_A + 4)) > 0)
+        kv.sector = KV_SECTOR_B;
+    kv.generation = ReadWord(kv.sector + 4);
+
+    uint32_t offset = KV_HEADER_SIZE;
+    while (offset < KV_SECTOR_SIZE) {
+        int valid;
+        int size = ReadRecord(kv.sector, offset, &valid);
+        if (size == 0)
+            break;
+        if (size < 0) {
+            kv.bad++;
+            offset = KV_SECTOR_SIZE; // length of a damaged record is not known, next write compacts
+            break;
+        }
+
+        uint32_t key = record[0] & 0xFFFF;
+        if (!valid) {
+            kv.bad++;
+        } else if (key < KV_NUM_OF_KEYS) {
+            kv.index[key]   = offset;
+            value[key].size = record[0] >> 16;
+            memcpy(value[key].data, &record[1], value[key].size);
+        }
+        offset += size;
+    }
+    kv.free = offset;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Mount the store (find active sector, read values). Called at
+/// startup, store is also mounted on first use if it wasn't. Anything not
+/// written into FLASH yet is dropped. </summary>
+//---------------------------------------------------------------------
+void KV_Init()
+{
+    Mount();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write changed values into FLASH, one background operation at a
+/// time (returns right away, next step is taken once it finishes). Called from main loop. </summary>
+//---------------------------------------------------------------------
+void KV_Poll()
+{
+    if (!kv.mounted)
+        Mount();
+
+    if (kv.state != KV_IDLE) {
+        if (!kv.done)
+            return;
+        if (kv.result != 0) {
+            Fail();
+            return;
+        }
+        Next();
+    }
+
+    if (kv.state == KV_IDLE)
+        Start();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is anything waiting to be written into FLASH. </summary>
+///
+/// <returns> 1 if writing is in progress or pending, 0 otherwise
+/// (also if writing stopped after an error). </returns>
+//---------------------------------------------------------------------
+int KV_Busy()
+{
+    if (kv.state != KV_IDLE)
+        return 1;
+    if (kv.failed)
+        return 0;
+    if (kv.sector == 0)
+        return 1;
+
+    for (int key = 0; key < KV_NUM_OF_KEYS; ++key) {
+        if (value[key].version != value[key].stored)
+            return 1;
+    }
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write everything into FLASH and wait for it (before reset).
+/// Called from main loop only. </summary>
+//---------------------------------------------------------------------
+void KV_Flush()
+{
+    KV_Poll();
+    while (KV_Busy()) {
+        FLASH_Wait();
+        KV_Poll();
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read value of a key. </summary>
+///
+/// <param name="key"> Key. </param>
+/// <param name="data"> Buffer to read value into. </param>
+/// <param name="size"> Size of buffer, longer value is truncated. </param>
+///
+/// <returns> Size of value [bytes], -1 if key has no value. </returns>
+//---------------------------------------------------------------------
+int KV_Read(kv_key key, void* data, int size)
+{
+    if (!kv.mounted)
+        Mount();
+    if (key >= KV_NUM_OF_KEYS || value[key].size < 0)
+        return -1;
+
+    int len = value[key].size;
+    memcpy(data, value[key].data, len < size ? len : size);
+    return len;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write value of a key. Value is copied and written into FLASH by
+/// KV_Poll, same value as the current one is not written again. </summary>
+///
+/// <param name="key"> Key. </param>
+/// <param name="data"> Value. </param>
+/// <param name="size"> Size of value [bytes], at most KV_MAX_VALUE_SIZE. </param>
+///
+/// <returns> 0 on success, -1 on error. </returns>
+//---------------------------------------------------------------------
+int KV_Write(kv_key key, const void* data, int size)
+{
+    if (!kv.mounted)
+        Mount();
+    if (key >= KV_NUM_OF_KEYS || size < 0 || size > KV_MAX_VALUE_SIZE)
+        return -1;
+
+    if (value[key].size == size && memcmp(value[key].data, data, size) == 0)
+        return 0;
+
+    value[key].size = size;
+    memcpy(value[key].data, data, size);
+    value[key].version++;
+    kv.failed = 0;
+    EVT_Post(EVT_KV);
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Get store statistics. </summary>
+///
+/// <param name="stats"> Statistics. </param>
+//---------------------------------------------------------------------
+void KV_Stats(kv_stats* stats)
+{
+    if (!kv.mounted)
+        Mount();
+
+    stats->sector     = kv.sector;
+    stats->generation = kv.generation;
+    stats->used       = kv.free;
+    stats->bad        = kv.bad;
+    stats->pending    = 0;
+    stats->errors     = kv.errors;
+    for (int key = 0; key < KV_NUM_OF_KEYS; ++key)
+        stats->pending += value[key].version != value[key].stored;
+}
@@ -0,0 +1,54 @@
+/// @file kvstore.h
+/// <summary>
+/// Wear-levelled key-value store in two FLASH sectors (append-only log of records),
+/// values are kept in RAM and written into FLASH in the background.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include "flash.h"
+#include <stdint.h>
+
+// STM32F745VE has 512 KB of FLASH (sectors 0 to 5), program has to fit into sectors 0 to 3.
+// Store uses sector 4 (128 KB) and the first 128 KB of sector 5 (256 KB).
+#define KV_SECTOR_A ADDR_FLASH_SECTOR_4
+#define KV_SECTOR_B ADDR_FLASH_SECTOR_5
+#define KV_SECTOR_SIZE (ADDR_FLASH_SECTOR_5 - ADDR_FLASH_SECTOR_4)
+#define KV_MAX_VALUE_SIZE 1024
+
+// Keys of stored values. Values are stored by key number, so never renumber existing keys, only add new ones.
+typedef enum {
+    KV_ID          = 0, // UART address (uint8_t)
+    KV_BAUD        = 1, // UART baud rate (uint32_t)
+    KV_RECIPE      = 2, // sequencer settings
+    KV_CALIBRATION = 3, // calibration data
+    KV_NUM_OF_KEYS
+} kv_key;
+
+// Store statistics
+typedef struct {
+    uint32_t sector;     // address of the active sector
+    uint32_t generation; // incremented on every compaction
+    uint32_t used;       // bytes used in the active sector (header, all records, including overwritten ones)
+    uint32_t bad;        // records with wrong CRC found while mounting (interrupted writes)
+    uint32_t pending;    // keys whose latest value is not in FLASH yet
+    uint32_t errors;     // failed FLASH operations (writing is retried with the next KV_Write)
+} kv_stats;
+
+void KV_Init();
+void KV_Poll();
+int  KV_Busy();
+void KV_Flush();
+int  KV_Read(kv_key key, void* data, int size);
+int  KV_Write(kv_key key, const void* data, int size);
+void KV_Stats(kv_stats* stats);
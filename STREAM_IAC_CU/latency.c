@@ -0,0 +1,196 @@
+/// @file latency.c
+/// <summary>
+/// Command-to-output latency of start command, measured per link (DWT cycle counter).
+/// </summary>
+///
+/// <description>
+/// Links timestamp every received command (first byte and terminator). When a start command
+/// is parsed, timestamps of its link are taken over and the measurement is completed when the
+/// sequencer timer is enabled (main loop) and when the first edge is set (timer interrupt).
+/// Only a start of stopped sequencer is measured.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "latency.h"
+#include "main.h"
+#include <string.h>
+
+const char* const LAT_LinkName[LAT_NUM_OF_LINKS]   = {"UART", "USB", "BULK", "UART_FAST"};
+const char* const LAT_PointName[LAT_NUM_OF_POINTS] = {"RX", "ENABLE", "EDGE"};
+
+volatile char LAT_EdgePending = 0;
+
+static volatile lat_stats stats[LAT_NUM_OF_LINKS][LAT_NUM_OF_POINTS];
+
+// Timestamps of the last command received on each link
+static volatile struct {
+    uint32_t first, last;
+} received[LAT_NUM_OF_LINKS];
+
+// Start command waiting for timer enable (link index -1 if none) and the one waiting for its first edge
+static volatile struct {
+    int      link;
+    uint32_t first, last;
+} requested = {.link = -1}, enabled;
+
+//---------------------------------------------------------------------
+/// <summary> Index of a link into statistics tables. </summary>
+///
+/// <param name="link"> Link. </param>
+///
+/// <returns> Index, -1 if not a single link. </returns>
+//---------------------------------------------------------------------
+static int LinkIndex(link_id link)
+{
+    for (int i = 0; i < LAT_FAST; ++i) {
+        if (link == (1 << i))
+            return i;
+    }
+    return -1;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Add one measurement to statistics (also from timer interrupt, runs from ITCM RAM). </summary>
+///
+/// <param name="link"> Link index. </param>
+/// <param name="point"> Measured interval. </param>
+/// <param name="cycles"> Length of interval [cycles]. </param>
+//---------------------------------------------------------------------
+RAMFUNC static void Add(int link, lat_point point, uint32_t cycles)
+{
+    volatile lat_stats* s  = &stats[link][point];
+    uint32_t            us = cycles / (SystemCoreClock / 1000000);
+    int                 b  = us == 0 ? 0 : 32 - __builtin_clz(us);
+
+    if (b >= LAT_NUM_OF_BUCKETS)
+        b = LAT_NUM_OF_BUCKETS - 1;
+
+    if (s->count == 0 || cycles < s->min)
+        s->min = cycles;
+    if (cycles > s->max)
+        s->max = cycles;
+    s->total += cycles;
+    s->bucket[b]++;
+    s->count++; // last, reader checks it to detect an update in the middle of reading
+}
+
+//---------------------------------------------------------------------
+/// <summary> Timestamp a command received on a link. Called by the link
+/// before the received data is parsed. </summary>
+///
+/// <param name="link"> Link the command was received on. </param>
+/// <param name="first"> Cycle counter at the first byte. </param>
+/// <param name="last"> Cycle counter at the terminator (last byte). </param>
+//---------------------------------------------------------------------
+void LAT_Received(link_id link, uint32_t first, uint32_t last)
+{
+    int i = LinkIndex(link);
+    if (i < 0)
+        return;
+
+    received[i].first = first;
+    received[i].last  = last;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start command was parsed, measure it with timestamps of the
+/// last command received on its link. </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+//---------------------------------------------------------------------
+void LAT_StartCommand(link_id link)
+{
+    int i = LinkIndex(link);
+    if (i < 0)
+        return;
+
+    requested.first = received[i].first;
+    requested.last  = received[i].last;
+    requested.link  = i;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start command is about to be executed by the fast path in receive
+/// interrupt of the link, measure it separately (LAT_FAST). </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+//---------------------------------------------------------------------
+void LAT_FastStartCommand(link_id link)
+{
+    LAT_StartCommand(link);
+    if (requested.link >= 0)
+        requested.link = LAT_FAST;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Sequencer timer is about to be enabled. Called right before
+/// enabling it, so the first edge can't come before it is expected. </summary>
+//---------------------------------------------------------------------
+void LAT_TimerEnable()
+{
+    uint32_t now  = DWT->CYCCNT;
+    int      link = requested.link;
+
+    if (link < 0)
+        return;
+    requested.link = -1;
+
+    Add(link, LAT_RX, requested.last - requested.first);
+    Add(link, LAT_ENABLE, now - requested.last);
+
+    enabled.link    = link;
+    enabled.last    = requested.last;
+    LAT_EdgePending = 1;
+}
+
+//---------------------------------------------------------------------
+/// <summary> First edge was set. Called from timer interrupt when
+/// LAT_EdgePending is set. </summary>
+//---------------------------------------------------------------------
+RAMFUNC void LAT_Edge()
+{
+    LAT_EdgePending = 0;
+    Add(enabled.link, LAT_EDGE, DWT->CYCCNT - enabled.last);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Sequencer was stopped, first edge won't come anymore. </summary>
+//---------------------------------------------------------------------
+RAMFUNC void LAT_Cancel()
+{
+    LAT_EdgePending = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read statistics of a link. Statistics can be updated by an
+/// interrupt while being read, in that case they are read again. </summary>
+///
+/// <param name="link_index"> Link index (bit number of link_id). </param>
+/// <param name="point"> Measured interval. </param>
+/// <param name="out"> Statistics. </param>
+//---------------------------------------------------------------------
+void LAT_Read(int link_index, lat_point point, lat_stats* out)
+{
+    volatile lat_stats* s = &stats[link_index][point];
+
+    do {
+        memcpy(out, (const void*)s, sizeof(*out));
+    } while (out->count != s->count);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Clear statistics of all links. </summary>
+//---------------------------------------------------------------------
+void LAT_Clear()
+{
+    memset((void*)stats, 0, sizeof(stats));
+}
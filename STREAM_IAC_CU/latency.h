@@ -0,0 +1,52 @@
+/// @file latency.h
+/// <summary>
+/// Command-to-output latency of start command, measured per link (DWT cycle counter).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include "parse.h"
+#include <stdint.h>
+
+#define LAT_NUM_OF_LINKS 4    // UART, USB, bulk (in link_id bit order), then LAT_FAST
+#define LAT_FAST 3            // statistics index of start commands executed by UART receive interrupt (fast path, ParseFast)
+#define LAT_NUM_OF_BUCKETS 16 // histogram bucket n counts latencies in [2^(n-1), 2^n) us, bucket 0 below 1 us, last one also everything above
+
+// Measured intervals of a start command, all but LAT_RX start at the terminator (last byte) of the command.
+// USB receives whole packets, so on USB links first and last byte are the arrival of first and last packet.
+typedef enum {
+    LAT_RX,     // first byte -> terminator (transfer time of the command)
+    LAT_ENABLE, // terminator -> sequencer timer enabled
+    LAT_EDGE,   // terminator -> first edge (includes time of the first edge in the table)
+    LAT_NUM_OF_POINTS
+} lat_point;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min, max; // [cycles]
+    uint64_t total;    // [cycles]
+    uint32_t bucket[LAT_NUM_OF_BUCKETS];
+} lat_stats;
+
+extern const char* const LAT_LinkName[LAT_NUM_OF_LINKS];
+extern const char* const LAT_PointName[LAT_NUM_OF_POINTS];
+extern volatile char     LAT_EdgePending;
+
+void LAT_Received(link_id link, uint32_t first, uint32_t last);
+void LAT_StartCommand(link_id link);
+void LAT_FastStartCommand(link_id link);
+void LAT_TimerEnable();
+void LAT_Edge();
+void LAT_Cancel();
+void LAT_Read(int link_index, lat_point point, lat_stats* out);
+void LAT_Clear();
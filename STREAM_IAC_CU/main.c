@@ -3,16 +3,6 @@
 /// Main file.
 /// </summary>
 ///
-/// <description>
-/// DMA2 is chosen because only only DMA2 streams are able to perform memory-to-memory transfers
-/// TIM1 is the trigger for DMA2
-/// TIM1 is in slave mode and is triggerd by TIM2. Reason for using TIM2 is that TIM1 is 16bit and TIM2 is 32bit
-/// TIM2 is where we change all the timing settings (ARR, PSC, CCR1), TIM1 stays at initial values.
-/// PSC		- timing resolution
-/// CCR1	- next DMA trigger g_time
-/// ARR		- sequence period
-/// </description>
-///
 /// Supervision: /
 ///
 /// Company: Sensum d.o.o.
@@ -23,88 +13,53 @@
 /////-----------------------------------------------------------
 // Company: Sensum d.o.o.
 
+#include "usbd_bulk_if.h"
 #include "usbd_cdc_if.h"
+#include "usbd_composite.h"
 #include <usbd_cdc.h>
 #include <usbd_core.h>
 #include <usbd_desc.h>
 
+#include "bench.h"
+#include "clock.h"
 #include "communication.h"
+#include "event.h"
+#include "flash.h"
+#include "frame.h"
+#include "gateway.h"
+#include "kvstore.h"
 #include "main.h"
 #include "parse.h"
+#include "prof.h"
+#include "sequencer.h"
+#include "slot.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "uart.h"
-
-#define TIMx TIM2
-#define TIMx_IRQHandler TIM2_IRQHandler
-#define __TIMx_CLK_ENABLE __TIM2_CLK_ENABLE
-#define TIMx_IRQn TIM2_IRQn
-
-#define DMAx DMA1
-#define DMAx_CLK_ENABLE __DMA1_CLK_ENABLE
-#define DMA_Stream1 DMA1_Stream1
-#define DMA_Stream2 DMA1_Stream3
+#include <string.h>
 
 USBD_HandleTypeDef       USBD_Device;
 void                     SysTick_Handler(void);
 void                     OTG_FS_IRQHandler(void);
 extern PCD_HandleTypeDef hpcd;
 
-int         VCP_read(void* pBuffer, int size);
-int         VCP_write(const void* pBuffer, int size);
 extern char g_VCPInitialized;
 
-const uint32_t GPIOPinArray[] = {
-    GPIO_PIN_0,
-    GPIO_PIN_1,
-    GPIO_PIN_2,
-    GPIO_PIN_3,
-    GPIO_PIN_4,
-    GPIO_PIN_5,
-    GPIO_PIN_6,
-    GPIO_PIN_7,
-    GPIO_PIN_8,
-    GPIO_PIN_9,
-    GPIO_PIN_10,
-    GPIO_PIN_11,
-    GPIO_PIN_12,
-    GPIO_PIN_13,
-    GPIO_PIN_14,
-    GPIO_PIN_15};
-
-// 0 - active high, 1 - active low
-const int IsGPIOReversePin[] = {
-    0, // GPIO_PIN_0
-    0, // GPIO_PIN_1
-    0, // GPIO_PIN_2
-    0, // GPIO_PIN_3
-    0, // GPIO_PIN_4
-    0, // GPIO_PIN_5
-    0, // GPIO_PIN_6
-    0, // GPIO_PIN_7
-    0, // GPIO_PIN_8
-    0, // GPIO_PIN_9
-    0, // GPIO_PIN_10
-    0, // GPIO_PIN_11
-    0, // GPIO_PIN_12
-    0, // GPIO_PIN_13
-    0, // GPIO_PIN_14
-    0  // GPIO_PIN_15
-};
-
-int g_timer_period_us = 0;
-
-char g_new_settings_received = 0;
-
-uint32_t g_pins[MAX_STATES] = {0}, g_pins_shadow[MAX_STATES] = {0};
-uint32_t g_time[MAX_STATES] = {0}, g_time_shadow[MAX_STATES] = {0};
-uint32_t g_num_of_entries = 0;
-
-static int array_idx = 0;
-
-static void Stop();
-static void Start();
-
-static char stop_request = 0, stopping_sequence_in_progress = 0;
-static char start_request = 0;
+#define NUM_OF_VECTORS 114 // 16 core exceptions + 98 STM32F745 interrupts (startup_stm32f745xx.c)
+
+extern void*    g_pfnVectors[NUM_OF_VECTORS];
+extern uint32_t _itcm_text_start, _itcm_text_end, _sitcm_text; // STM32F745VE_flash.lds
+
+#define DTCM_BASE 0x20000000U
+#define DTCM_SIZE 0x10000U
+
+// Vector table in DTCM RAM, so an interrupt can be taken while FLASH is erased or programmed
+// (table alignment has to be a power of two above its size)
+static void* ram_vectors[NUM_OF_VECTORS] __attribute__((aligned(512)));
+
+static parse_context uart_parse_ctx = {.Write = UARTWrite, .WriteFrame = UARTWriteFrame, .link = LINK_UART, .last_seq = -1};
+static parse_context usb_parse_ctx  = {.Write = USBWrite, .WriteFrame = USBWriteFrame, .link = LINK_USB, .last_seq = -1};
+static parse_context bulk_parse_ctx = {.Write = BulkWrite, .WriteFrame = BulkWriteFrame, .link = LINK_BULK, .last_seq = -1};
 
 //---------------------------------------------------------------------
 /// <summary> System tick interrupt handler. </summary>
@@ -113,6 +68,8 @@ void SysTick_Handler(void)
 {
     HAL_IncTick();
     HAL_SYSTICK_IRQHandler();
+    CLK_Tick();
+    EVT_Post(EVT_TICK);
 }
 
 //---------------------------------------------------------------------
@@ -120,45 +77,78 @@ void SysTick_Handler(void)
 //---------------------------------------------------------------------
 void OTG_FS_IRQHandler(void)
 {
+    uint32_t prof_start = PROF_Start();
+
     HAL_PCD_IRQHandler(&hpcd);
+
+    PROF_End(PROF_USB, prof_start);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Timer interrupt handler. </summary>
+/// <summary> Copy ITCM code (RAMFUNC) from FLASH and move vector table to RAM.
+/// Must run before any interrupt is enabled. </summary>
 //---------------------------------------------------------------------
-__attribute__((optimize("O2"))) void TIMx_IRQHandler()
+static void RAM_Init()
 {
-    if (TIMx->SR & TIM_SR_CC1IF) {
-        PORT->BSRR = g_pins[array_idx]; // first quickly set GPIO pins
-        TIMx->CCR1 = g_time[array_idx]; // then CCR register
-        TIMx->SR   = ~TIM_SR_CC1IF;     // then clear IRQ flag
-        array_idx++;
-    }
+    memcpy(&_itcm_text_start, &_sitcm_text, (uint8_t*)&_itcm_text_end - (uint8_t*)&_itcm_text_start);
+    memcpy(ram_vectors, g_pfnVectors, sizeof(ram_vectors));
 
-    // If update interrupt
-    if (TIMx->SR & TIM_SR_UIF) {
-        // Clear Update interrupt pending flag (note: no need for SR &= ~TIM...)
-        TIMx->SR  = ~TIM_SR_UIF;
-        array_idx = 0;
-        if (stopping_sequence_in_progress) {
-            // Stopping sequence ended. It is now safe to stop everything.
-            Stop();
-            // Leave one pulse mode
-            TIMx->CR1 &= ~TIM_CR1_OPM;
-            // Clear all stopping flags
-            stopping_sequence_in_progress = 0;
-            stop_request                  = 0;
-        } else if (stop_request) {
-            // On stop request enter one pulse mode
-            TIMx->CR1 |= TIM_CR1_OPM;
-            // Flag to signal that the final stopping sequence is active (ongoing)
-            stopping_sequence_in_progress = 1;
-        }
+    __DSB(); // copies are complete before code is fetched from ITCM and vectors from the new table
+    SCB->VTOR = (uint32_t)ram_vectors;
+    __DSB();
+    __ISB();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is the buffer in memory DMA and CPU see coherently (DTCM, never cached). </summary>
+///
+/// <param name="buffer"> Buffer. </param>
+/// <param name="size"> Size of buffer in bytes. </param>
+///
+/// <returns> 1 if coherent, 0 if not. </returns>
+//---------------------------------------------------------------------
+static int IsDMACoherent(const void* buffer, uint32_t size)
+{
+    uint32_t start = (uint32_t)buffer;
+
+    return start >= DTCM_BASE && start + size <= DTCM_BASE + DTCM_SIZE;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Startup self-check of the memory layout: sequencer tables, the only memory DMA reads,
+/// are in DTCM, where DMA and CPU see the same content. Halts if not, the sequencer would output
+/// stale pins and times once D-cache is enabled. </summary>
+//---------------------------------------------------------------------
+static void MEM_Check()
+{
+    int ok = 1;
+
+    ok &= IsDMACoherent(g_pins, sizeof(g_pins));
+    ok &= IsDMACoherent(g_time, sizeof(g_time));
+
+    if (!ok) {
+        asm("bkpt 255");
     }
 }
 
 //---------------------------------------------------------------------
-/// <summary> System clock configuration. </summary>
+/// <summary> Enable instruction and data cache (216 MHz profile). Code runs from FLASH over
+/// AXIM, where ART does not help, so the L1 caches keep FLASH wait states off the fetch path.
+/// All data is in DTCM, which is never cached, so DMA buffers need no cache maintenance. </summary>
+//---------------------------------------------------------------------
+static void CACHE_Enable()
+{
+#if CLOCK_216MHZ
+    SCB_EnableICache();
+    SCB_EnableDCache();
+#endif
+}
+
+//---------------------------------------------------------------------
+/// <summary> System clock configuration. HSE 8 MHz, APB1 = HCLK / 4, APB2 = HCLK / 2
+/// (timers on APB1 run at HCLK / 2, see TIM_Configure).
+/// CLOCK_216MHZ 0: 168 MHz, USB 48 MHz from main PLL Q output.
+/// CLOCK_216MHZ 1: 216 MHz with over-drive, USB 48 MHz from PLLSAI P output. </summary>
 //---------------------------------------------------------------------
 static void SystemClock_Config(void)
 {
@@ -167,6 +157,12 @@ static void SystemClock_Config(void)
     RCC_OscInitTypeDef       RCC_OscInitStruct;
     RCC_PeriphCLKInitTypeDef PeriphClkInitStruct;
 
+#if CLOCK_216MHZ
+    /* Over-drive needs voltage scale 1 */
+    __HAL_RCC_PWR_CLK_ENABLE();
+    __HAL_PWR_VOLTAGESCALING_CONFIG(PWR_REGULATOR_VOLTAGE_SCALE1);
+#endif
+
     /* Enable HSE Oscillator and activate PLL with HSE as source */
     RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
     RCC_OscInitStruct.HSEState       = RCC_HSE_ON;
@@ -174,16 +170,35 @@ static void SystemClock_Config(void)
     RCC_OscInitStruct.PLL.PLLState   = RCC_PLL_ON;
     RCC_OscInitStruct.PLL.PLLSource  = RCC_PLLSOURCE_HSE;
     RCC_OscInitStruct.PLL.PLLM       = 8;
+#if CLOCK_216MHZ
+    RCC_OscInitStruct.PLL.PLLN       = 432;
+    RCC_OscInitStruct.PLL.PLLP       = RCC_PLLP_DIV2;
+    RCC_OscInitStruct.PLL.PLLQ       = 9;
+#else
     RCC_OscInitStruct.PLL.PLLN       = 336;
     RCC_OscInitStruct.PLL.PLLP       = RCC_PLLP_DIV2;
     RCC_OscInitStruct.PLL.PLLQ       = 7;
+#endif
     if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) {
         asm("bkpt 255");
     }
 
+#if CLOCK_216MHZ
+    /* 216 MHz needs over-drive, enable it before switching to PLL */
+    if (HAL_PWREx_EnableOverDrive() != HAL_OK) {
+        asm("bkpt 255");
+    }
+
+    /* Select PLLSAI P output as USB clock source (1 MHz * 192 / 4 = 48 MHz), independent of system clock */
+    PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_CLK48;
+    PeriphClkInitStruct.Clk48ClockSelection  = RCC_CLK48SOURCE_PLLSAIP;
+    PeriphClkInitStruct.PLLSAI.PLLSAIN       = 192;
+    PeriphClkInitStruct.PLLSAI.PLLSAIP       = RCC_PLLSAIP_DIV4;
+#else
     /* Select PLLQ output as USB clock source */
     PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_CLK48;
     PeriphClkInitStruct.Clk48ClockSelection  = RCC_CLK48SOURCE_PLL;
+#endif
     if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInitStruct) != HAL_OK) {
         asm("bkpt 255");
     }
@@ -195,40 +210,11 @@ static void SystemClock_Config(void)
     RCC_ClkInitStruct.AHBCLKDivider  = RCC_SYSCLK_DIV1;
     RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV4;
     RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV2;
-    if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_5) != HAL_OK) {
+    if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, CLOCK_FLASH_LATENCY) != HAL_OK) {
         asm("bkpt 255");
     }
 }
 
-//---------------------------------------------------------------------
-/// <summary> Set GPIO pins to their default state as defined by IsGPIOReversePin array. </summary>
-//---------------------------------------------------------------------
-static void SetInitialGPIOState()
-{
-    // Set intial state
-    for (int i = 0; i < NUM_OF_CHANNELS; ++i) {
-        HAL_GPIO_WritePin(PORT, GPIOPinArray[i], (GPIO_PinState)IsGPIOReversePin[i]);
-    }
-}
-
-//---------------------------------------------------------------------
-/// <summary> GPIO configuration. </summary>
-//---------------------------------------------------------------------
-static void GPIO_Configure()
-{
-    PORT_CLK_ENABLE();
-    GPIO_InitTypeDef GPIO_InitStructure;
-
-    GPIO_InitStructure.Mode  = GPIO_MODE_OUTPUT_PP;
-    GPIO_InitStructure.Pull  = GPIO_NOPULL;
-    GPIO_InitStructure.Speed = GPIO_SPEED_FREQ_LOW;
-    GPIO_InitStructure.Pin   = ALL_PINS;
-
-    HAL_GPIO_Init(PORT, &GPIO_InitStructure);
-
-    SetInitialGPIOState();
-}
-
 //---------------------------------------------------------------------
 /// <summary> External interrupt configuration. </summary>
 //---------------------------------------------------------------------
@@ -240,254 +226,183 @@ static void EXTI_Configure()
 }
 
 //---------------------------------------------------------------------
-/// <summary> DMA (Direct Memory Access) configuration. </summary>
-//---------------------------------------------------------------------
-static void DMA_Configure()
-{
-    DMAx_CLK_ENABLE();
-    DMA_Stream1->NDTR = g_num_of_entries;
-    DMA_Stream1->M0AR = (uint32_t)g_pins;
-    DMA_Stream1->PAR  = (uint32_t)&PORT->BSRR;
-    DMA_Stream1->CR   = DMA_CHANNEL_6 | DMA_MBURST_SINGLE | DMA_PBURST_SINGLE | DMA_PRIORITY_VERY_HIGH | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 |
-                      DMA_MINC_ENABLE | DMA_CIRCULAR | DMA_MEMORY_TO_PERIPH | DMA_SxCR_HTIE | DMA_SxCR_TCIE;
-
-    DMA_Stream2->NDTR = g_num_of_entries;
-    DMA_Stream2->M0AR = (uint32_t)g_time;
-    DMA_Stream2->PAR  = (uint32_t)&TIMx->CCR1;
-    DMA_Stream2->CR   = DMA_CHANNEL_6 | DMA_MBURST_SINGLE | DMA_PBURST_SINGLE | DMA_PRIORITY_HIGH | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 |
-                      DMA_MINC_ENABLE | DMA_CIRCULAR | DMA_MEMORY_TO_PERIPH;
-}
-
-//---------------------------------------------------------------------
-/// <summary> Start DMA. </summary>
-//---------------------------------------------------------------------
-static void DMA_Start()
-{
-    // First CLEAR LISR and HISR event flags
-    DMAx->HIFCR = ~0x0; // clear all
-    DMAx->LIFCR = ~0x0; // clear all
-
-    DMA_Stream1->CR |= DMA_SxCR_EN;
-    DMA_Stream2->CR |= DMA_SxCR_EN;
-
-    while (!(DMA_Stream1->CR & DMA_SxCR_EN) || !(DMA_Stream2->CR & DMA_SxCR_EN))
-        ; // wait for CE to be read as 1
-}
-
-//---------------------------------------------------------------------
-/// <summary> Stop DMA. </summary>
+/// <summary> Initialize USB. </summary>
 //---------------------------------------------------------------------
-static void DMA_Stop()
+static void USB_Init()
 {
-    DMA_Stream1->CR &= ~DMA_SxCR_EN;
-    DMA_Stream2->CR &= ~DMA_SxCR_EN;
+    USBD_Init(&USBD_Device, &VCP_Desc, 0);
 
-    while (DMA_Stream1->CR & DMA_SxCR_EN || DMA_Stream2->CR & DMA_SxCR_EN)
-        ; // wait for CE to be read as 0
+    USBD_RegisterClass(&USBD_Device, &USBD_COMPOSITE); // CDC + vendor bulk interface
+    USBD_CDC_RegisterInterface(&USBD_Device, &USBD_CDC_STREAM_IAC_CU_fops);
+    USBD_Start(&USBD_Device);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Update DMA Streams </summary>
-///
-/// <param name="n_entries"> Number of entries in the array.
-/// In other words number of GPIO state changes. </param>
+/// <summary> Deinitialize USB. </summary>
 //---------------------------------------------------------------------
-static void DMA_Update(uint32_t n_entries)
+static void USB_Deinit()
 {
-    // Only update when DMA is disabled
-    if (!(DMA_Stream1->CR & DMA_SxCR_EN) && !(DMA_Stream2->CR & DMA_SxCR_EN)) {
-        DMA_Stream1->NDTR = n_entries;
-        DMA_Stream2->NDTR = n_entries;
-    }
+    USBD_Stop(&USBD_Device);
+    USBD_DeInit(&USBD_Device);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Timer configuration. </summary>
+/// <summary> Main init. </summary>
 //---------------------------------------------------------------------
-static void TIM_Configure()
+static void Init()
 {
-    __TIMx_CLK_ENABLE();
-
-#define TIMx_CLK_SOURCE_APB1             // TIMx(2) is on APB1
-    const uint32_t TIM_COUNT_FREQ = 1e6; // Freq = 1 MHz, T = 1 us.
-
-    // NOTE: Timer clocks can be tricky since they can be different from the bus frequency, so when in doubt check the datasheet.
-#if defined(TIMx_CLK_SOURCE_APB1)
-    uint32_t timer_freq = HAL_RCC_GetPCLK1Freq();
-    if (RCC->CFGR & RCC_CFGR_PPRE1_2) // if MSB is not zero (clk divison by more than 1)
-        timer_freq *= 2;
-#elif defined(TIMx_CLK_SOURCE_APB2)
-    uint32_t timer_freq = HAL_RCC_GetPCLK2Freq();
-    if (RCC->CFGR & RCC_CFGR_PPRE2_2) // if MSB is not zero (clk divison by more than 1)
-        timer_freq *= 2;
-#endif
+    RAM_Init();
+    MEM_Check();
+    CACHE_Enable();
+    HAL_Init(); // also enables ART and prefetch (stm32f7xx_hal_conf.h)
+    TRACE_Init(RCC->CSR >> 24); // reset cause flags
+    __HAL_RCC_CLEAR_RESET_FLAGS();
+    SystemClock_Config();
+    SEQ_Init();
+    EXTI_Configure();
+    FRAME_Init();
+    BENCH_Init();
+    CLK_Init(); // device time runs on the cycle counter (enabled by BENCH_Init), TIM7 carries it over sleep
 
-    TIM2->PSC  = (uint32_t)(timer_freq / TIM_COUNT_FREQ) - 1; // Set prescaler to count with 1/TIM_COUNT_FREQ period
-    TIMx->EGR  = TIM_EGR_UG;                                  // Generate update event (this also loads the prescaler)
-    TIMx->SR   = 0;                                           // Clear update event in the status register that we triggered in the line above
-    TIMx->DIER = TIM_DIER_UIE | TIM_DIER_CC1IE;
-    // Thougt I needed this, turns out I don't, I needed it because I updated ARR somewhere async while timer was running, and this prevented ARR from updating on the spot.
-    // But now with improvements to the code, parser no longer directly configures peripherals.
-    //TIMx->CR1 |= TIM_CR1_ARPE; // Auto reload register is preloaded (ref. page 711)
-
-    // Enable TIM interrupts
-    HAL_NVIC_SetPriority(TIMx_IRQn, 0, 0);
-    HAL_NVIC_EnableIRQ(TIMx_IRQn);
-}
+    TLM_RegisterLink(&uart_parse_ctx);
+    TLM_RegisterLink(&usb_parse_ctx);
+    TLM_RegisterLink(&bulk_parse_ctx);
 
-//---------------------------------------------------------------------
-/// <summary> Start timer. </summary>
-//---------------------------------------------------------------------
-static void TIM_Start()
-{
-    TIMx->CR1 |= TIM_CR1_CEN;
-}
+    FLASH_Init();
+    KV_Init();
+    UART_Init();
+    SLOT_Init();
 
-//---------------------------------------------------------------------
-/// <summary> Stop timer. </summary>
-//---------------------------------------------------------------------
-static void TIM_Stop()
-{
-    TIMx->CR1 &= ~TIM_CR1_CEN;
+    USB_Init();
 }
 
 //---------------------------------------------------------------------
-/// <summary> Update Timer ARR (Auto Reload Register). </summary>
+/// <summary> See communication.c for documentation. </summary>
 //---------------------------------------------------------------------
-static void TIM_Update_ARR(uint32_t arr)
+void COM_UART_RX_Complete_Callback(uint8_t* buf, int size, const uart_rx_time* rx)
 {
-    TIMx->ARR = arr;
+    uart_parse_ctx.broadcast = rx->broadcast;
+    uart_parse_ctx.rx_end    = rx->last;
+    COM_Parse(&uart_parse_ctx, buf, size);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Request to start generating GPIO pulse train. </summary>
+/// <summary> See communication.c for documentation. </summary>
 //---------------------------------------------------------------------
-void StartRequest()
+int COM_UART_RX_Fast_Callback(const uint8_t* buf, int size)
 {
-    start_request = 1;
+    return ParseFast(&uart_parse_ctx, buf, size);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Start generating GPIO pulse train. </summary>
+/// <summary> See communication.c for documentation. </summary>
 //---------------------------------------------------------------------
-static void Start()
+void COM_UART_RX_Executed_Callback(uint8_t* buf, int size, const uart_rx_time* rx)
 {
-    //DMA_Start();
-    TIM_Start();
+    uart_parse_ctx.broadcast = rx->broadcast;
+    uart_parse_ctx.rx_end    = rx->last;
+    ParseExecuted(&uart_parse_ctx, buf, size);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Request to stop generating GPIO pulse train. </summary>
+/// <summary> See communication.c for documentation. </summary>
 //---------------------------------------------------------------------
-void StopRequest()
+void COM_UART_RX_Monitor_Callback(uint8_t* buf, int size, const uart_rx_time* rx)
 {
-    // If timer is not running just return since it is already stopped
-    if (!(TIMx->CR1 & TIM_CR1_CEN))
-        return;
-
-    stop_request = 1;
+    GATE_Received(buf, size, rx);
 }
 
 //---------------------------------------------------------------------
-/// <summary> Stop generating GPIO pulse train. </summary>
+/// <summary> See communication.c for documentation. </summary>
 //---------------------------------------------------------------------
-static void Stop()
+void COM_UART_TX_Callback()
 {
-    TIM_Stop();
-    DMA_Stop();
-
-    SetInitialGPIOState();
+    GATE_Send();
+    TLM_Send();
 }
 
 //---------------------------------------------------------------------
-/// <summary> Initialize USB. </summary>
+/// <summary> Handle start request, if one is pending. Called between other
+/// work of the main loop, so start waits for one handler at most. </summary>
 //---------------------------------------------------------------------
-static void USB_Init()
+static void HandleStart()
 {
-    USBD_Init(&USBD_Device, &VCP_Desc, 0);
-
-    USBD_RegisterClass(&USBD_Device, &USBD_CDC);
-    USBD_CDC_RegisterInterface(&USBD_Device, &USBD_CDC_STREAM_IAC_CU_fops);
-    USBD_Start(&USBD_Device);
+    if (EVT_Take(EVT_START))
+        SEQ_Poll();
 }
 
 //---------------------------------------------------------------------
-/// <summary> Deinitialize USB. </summary>
+/// <summary> Parse one receive buffer of a USB link, if one is waiting. </summary>
+///
+/// <param name="ctx"> Parser context of the link. </param>
+/// <param name="Read"> Read function of the link (USBRead, BulkRead). </param>
+/// <param name="Release"> Release function of the link. </param>
+/// <param name="event"> Receive event of the link, posted again if a buffer was parsed (more may be waiting). </param>
 //---------------------------------------------------------------------
-static void USB_Deinit()
+static void ParseUSB(parse_context* ctx, int (*Read)(uint8_t**), void (*Release)(), evt_id event)
 {
-    USBD_Stop(&USBD_Device);
-    USBD_DeInit(&USBD_Device);
+    uint8_t* rxBuf;
+    int      size = Read(&rxBuf);
+
+    if (size > 0) {
+        uint32_t parse_start = PROF_Start();
+        COM_Parse(ctx, rxBuf, size);
+        PROF_End(PROF_PARSE, parse_start);
+        Release();
+        EVT_Post(event);
+        HandleStart();
+    }
 }
 
 //---------------------------------------------------------------------
-/// <summary> Main init. </summary>
+/// <summary> Reset requested by RSET. Values not written into FLASH yet are stored
+/// first (FLASH interrupt finishes the operations, main loop can wait for them). </summary>
 //---------------------------------------------------------------------
-static void Init()
+static void Reset()
 {
-    HAL_Init();
-    SystemClock_Config();
-    GPIO_Configure();
-    DMA_Configure();
-    TIM_Configure();
-    EXTI_Configure();
-
-    UART_Init();
+    KV_Flush();
 
-    USB_Init();
-}
+    // Give it time to send echo back
+    HAL_Delay(100);
 
-//---------------------------------------------------------------------
-/// <summary> See communication.c for documentation. </summary>
-//---------------------------------------------------------------------
-void COM_UART_RX_Complete_Callback(uint8_t* buf, int size)
-{
-    Parse((char*)buf, UARTWrite);
+    NVIC_SystemReset();
 }
 
 //---------------------------------------------------------------------
-/// <summary> Main function. </summary>
+/// <summary> Main function. Event driven: sleeps until an interrupt posts an event
+/// (system tick at the latest), then handles pending events, start first. </summary>
 //---------------------------------------------------------------------
 int main()
 {
-    uint8_t rxBuf[UART_BUFFER_SIZE] = {0};
-    int     usb_read                = 0;
-
     Init();
 
     while (1) {
+        uint32_t events     = EVT_Wait();
+        uint32_t loop_start = PROF_Start();
+
+        if (events & EVT_START)
+            SEQ_Poll();
 
         if (g_VCPInitialized) { // Make sure USB is initialized (calling, VCP_write can halt the system if the data structure hasn't been malloc-ed yet)
-            usb_read = USBRead(rxBuf, sizeof(rxBuf));
-            if (usb_read > 0) {
-                Parse((char*)rxBuf, USBWrite);
-                memset(rxBuf, 0, usb_read);
-            }
+            // Data is parsed when whatever it forwards to RS-485 fits into gateway queue, room is made on EVT_GATE
+            if ((events & (EVT_USB_RX | EVT_TICK | EVT_GATE)) && GATE_Ready(VCP_RX_BUFFER_SIZE)) // on tick for data without line end (receive timeout)
+                ParseUSB(&usb_parse_ctx, USBRead, USBReadRelease, EVT_USB_RX);
+            if ((events & (EVT_BULK_RX | EVT_GATE)) && GATE_Ready(BULK_RX_BUFFER_SIZE))
+                ParseUSB(&bulk_parse_ctx, BulkRead, BulkReadRelease, EVT_BULK_RX);
         }
 
-        if (start_request && !stop_request) {
+        if (events & (EVT_GATE | EVT_TICK))
+            GATE_Poll();
 
-            start_request = 0;
+        if (events & EVT_TICK)
+            TLM_Poll();
 
-            if (g_new_settings_received) {
-                g_new_settings_received = 0;
+        if (events & (EVT_KV | EVT_TICK))
+            KV_Poll();
 
-                // Copy values from shadow registers
-                for (int i = 0; i < g_num_of_entries; ++i) {
-                    g_pins[i] = g_pins_shadow[i];
-                    g_time[i] = g_time_shadow[i];
-                }
+        if (events & EVT_RESET)
+            Reset();
 
-                DMA_Update(g_num_of_entries);
-
-                TIM_Update_ARR(g_timer_period_us);
-
-                // Update CCR1 register with the last entry in the time array which is the time at which the first GPIO change should happen
-                // NOTE: First entry in the settings can't be 0 (TODO: look into it if there is a way to allow starting with 0)
-                TIM2->CCR1 = g_time[g_num_of_entries - 1];
-            }
-
-            Start();
-        }
+        PROF_End(PROF_LOOP, loop_start);
     }
 }
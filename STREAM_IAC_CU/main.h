@@ -6,6 +6,24 @@
 #define PROJECT_TITLE "STREAM_IAC_CU_FW"
 #define VERSION "v1.0.0.0"
 
+// Clock profile: 0 = 168 MHz, 1 = 216 MHz with over-drive and L1 caches (SystemClock_Config, main.c).
+// Timer prescalers follow the APB clocks, BNCH, PROF and LATG report the core clock with their measurements.
+#ifndef CLOCK_216MHZ
+#define CLOCK_216MHZ 0
+#endif
+
+#if CLOCK_216MHZ
+#define CLOCK_FLASH_LATENCY FLASH_LATENCY_7 // 7 wait states from 210 MHz at 2.7 V - 3.6 V
+#else
+#define CLOCK_FLASH_LATENCY FLASH_LATENCY_5
+#endif
+
+// Code that has to keep running while FLASH is erased or programmed (FLASH stalls instruction fetches
+// for the whole operation). Placed into ITCM RAM by the linker script and copied there by RAM_Init.
+#ifndef RAMFUNC
+#define RAMFUNC __attribute__((section(".itcm_text")))
+#endif
+
 #define WritePins(port, on, off) port->BSRR = ((uint32_t)on) | (((uint32_t)off) << 16U)
 #define SetPins(port, x) port->BSRR = (uint32_t)x
 #define ResetPins(port, x) port->BSRR = ((uint32_t)x) << 16U
@@ -20,56 +20,184 @@
 #include <string.h>
 
 // User Library
+#include "bench.h"
+#include "clock.h"
 #include "communication.h"
+#include "event.h"
+#include "flash.h"
+#include "frame.h"
+#include "gateway.h"
+#include "kvstore.h"
+#include "latency.h"
 #include "main.h"
 #include "parse.h"
+#include "prof.h"
+#include "sequencer.h"
+#include "slot.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "uart.h"
 
-extern void StopRequest();
-extern void StartRequest();
+extern uint8_t UART_Address;
 
-extern uint32_t g_pins_shadow[MAX_STATES];
-extern uint32_t g_time_shadow[MAX_STATES];
-extern uint32_t g_num_of_entries;
+static const char Delims[] = "\n\r\t, ";
 
-extern char g_new_settings_received;
+#define TAG_PREFIX '#'  // ASCII command tag, e.g. "#17,CHLS,0,140,240"
+#define GATE_PREFIX '@' // message for another unit on RS-485 (USB links), e.g. "@5,PRDS,1000", "@*,STRT" for all units
 
-extern const int      IsGPIOReversePin[];
-extern const uint32_t GPIOPinArray[];
+typedef enum {
+    CMD_OK       = 0,
+    CMD_ERR_ARGS = 1, // missing or invalid arguments
+} command_status;
 
-extern uint8_t UART_Address;
+//---------------------------------------------------------------------
+/// <summary> Get next token from the text being parsed. Same as strtok,
+/// except that the position is kept in the link's parser context instead
+/// of a hidden global, so a message of one link can be tokenized while
+/// another link's message is (USB in main loop, UART in interrupt). Each
+/// call works on one complete message, nothing carries over between
+/// messages. </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+/// <param name="delims"> Delimiter characters. </param>
+///
+/// <returns> Pointer to zero terminated token, NULL if there are no more tokens. </returns>
+//---------------------------------------------------------------------
+static char* NextToken(parse_context* ctx, const char* delims)
+{
+    char* token = ctx->next;
+    if (token == NULL)
+        return NULL;
+
+    token += strspn(token, delims); // skip leading delimiters
+    if (*token == '\0') {
+        ctx->next = NULL;
+        return NULL;
+    }
 
-static const char Delims[] = "\n\r\t, ";
+    char* end = token + strcspn(token, delims);
+    if (*end != '\0') {
+        *end      = '\0';
+        ctx->next = end + 1;
+    } else {
+        ctx->next = NULL;
+    }
 
-static int newSettings     = 1; // when first configuring flag should be active
-static int needsCorrecting = 1; // when first configuring flag should be active
+    return token;
+}
 
-extern int g_timer_period_us;
+//---------------------------------------------------------------------
+/// <summary> Check if the link's output can take more data. On UART the output also has
+/// to fit into free space of the transmit buffer, as UARTWrite puts it there: with the
+/// address byte in front of every line and terminator at the end. </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+/// <param name="size"> Number of bytes to add. </param>
+/// <param name="lines"> Number of lines they start. </param>
+///
+/// <returns> 1 if they fit, 0 if output has to be written out first. </returns>
+//---------------------------------------------------------------------
+static int Fits(const parse_context* ctx, int size, int lines)
+{
+    int len = ctx->out_len + size;
+
+    if (len > sizeof(ctx->out))
+        return 0;
+    if (ctx->link != LINK_UART || ctx->in_frame)
+        return 1;
+    return len + ctx->out_lines + lines + 1 <= UART_TxFree();
+}
 
 //---------------------------------------------------------------------
-/// <summary> Clear all settings (clear arrays). </summary>
+/// <summary> Add a response message to the link's output. Responses are
+/// collected and written to the link in one go when parsing is done
+/// (or earlier if the output is full, see Fits). Messages are separated with newline,
+/// the same as if each of them was written on its own. Nothing is
+/// collected for a broadcast message, units on the bus would all answer
+/// at once (queries answer in slots instead, see RespondInSlot). </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+/// <param name="data"> Response message. </param>
+/// <param name="size"> Length of the message. </param>
 //---------------------------------------------------------------------
-static void ClearSettings()
+static void Respond(parse_context* ctx, const char* data, int size)
 {
-    for (int i = 0; i < MAX_STATES; i++) {
-        g_pins_shadow[i] = g_time_shadow[i] = 0;
+    if (ctx->broadcast)
+        return;
+
+    int lines = 1;
+    for (const char* nl = data; (nl = memchr(nl, '\n', data + size - nl)) != NULL; ++nl)
+        lines++;
+
+    if (ctx->out_len > 0 && !Fits(ctx, 1 + size, lines))
+        ParseFlush(ctx);
+
+    // Message that doesn't fit even into empty output is written directly (binary response is truncated)
+    if (size > sizeof(ctx->out)) {
+        if (!ctx->in_frame) {
+            ctx->Write((const uint8_t*)data, size);
+            return;
+        }
+        size = sizeof(ctx->out);
     }
-    g_num_of_entries = 0;
+
+    if (ctx->out_len > 0)
+        ctx->out[ctx->out_len++] = '\n';
+    memcpy(&ctx->out[ctx->out_len], data, size);
+    ctx->out_len += size;
+    ctx->out_lines += lines;
 }
 
 //---------------------------------------------------------------------
-/// <summary> Upon receiving all settings, shift the time array
-/// to correct for the inherent offset in the functionality. </summary>
+/// <summary> Respond to a query that can be broadcast to the whole RS-485 bus.
+/// Broadcast query is answered by units with addresses first .. first + count - 1,
+/// each in its own slot (slot.h), the rest stay silent. Addressed query (or query
+/// from another link) gets a normal response. </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+/// <param name="data"> Response message. </param>
+/// <param name="size"> Length of the message. </param>
+/// <param name="first"> Address of the unit answering in the first slot. </param>
+/// <param name="count"> Number of slots. </param>
+//---------------------------------------------------------------------
+static void RespondInSlot(parse_context* ctx, const char* data, int size, unsigned int first, unsigned int count)
+{
+    if (!ctx->broadcast) {
+        Respond(ctx, data, size);
+        return;
+    }
+
+    unsigned int index = (unsigned int)UART_Address - first; // wraps to a large number below first
+    if (ctx->link == LINK_UART && index < count)
+        SLOT_Respond(ctx->Write, data, size, ctx->rx_end, index);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read optional range of units answering a broadcast query ([first,count]). </summary>
+///
+/// <param name="ctx"> Parser context, positioned at command's arguments. </param>
+/// <param name="first"> First address, 0 if not given. </param>
+/// <param name="count"> Number of addresses, all (UART_UNITS) if not given. </param>
+//---------------------------------------------------------------------
+static void NextRange(parse_context* ctx, unsigned int* first, unsigned int* count)
+{
+    char* str = NextToken(ctx, Delims);
+    *first    = str != NULL ? atoi(str) : 0;
+    str       = NextToken(ctx, Delims);
+    *count    = str != NULL ? atoi(str) : UART_UNITS;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Clear all settings (clear arrays). </summary>
+///
+/// <param name="set"> Settings to clear. </param>
 //---------------------------------------------------------------------
-void ShiftTimeSettings()
+static void ClearSettings(seq_settings* set)
 {
-    // Shift values in the g_time array to correct for the inherent offset in the functionality
-    int tmpTime = g_time_shadow[0];
-    for (int i = 0; i < g_num_of_entries - 1; i++) {
-        g_time_shadow[i] = g_time_shadow[i + 1];
+    for (int i = 0; i < MAX_STATES; i++) {
+        set->pins[i] = set->time[i] = 0;
     }
-    g_time_shadow[g_num_of_entries - 1] = tmpTime;
-    needsCorrecting                     = 0;
+    set->num_of_entries = 0;
 }
 
 //---------------------------------------------------------------------
@@ -81,7 +209,7 @@ void ShiftTimeSettings()
 ///
 /// <returns> Number of converted ints. </returns>
 //---------------------------------------------------------------------
-static int StrToInts(char* str, int* ints, int maxArrSize)
+int StrToInts(char* str, int* ints, int maxArrSize)
 {
     int  element    = 0;
     int  num_i      = 0;
@@ -116,177 +244,410 @@ static int StrToInts(char* str, int* ints, int maxArrSize)
 //---------------------------------------------------------------------
 /// <summary> Update pins array from raw inputs. </summary>
 ///
+/// <param name="set"> Settings to update. </param>
 /// <param name="ch_num"> Channel number (0-15). </param>
 /// <param name="seq_idx"> Sequence index, used to determine on/off state of pin. </param>
 /// <param name="array_idx"> Index in the array where to update value. </param>
 //---------------------------------------------------------------------
-static void UpdatePinsArray(uint32_t ch_num, int seq_idx, int array_idx)
+static void UpdatePinsArray(seq_settings* set, uint32_t ch_num, int seq_idx, int array_idx)
 {
     uint32_t gpio_pin = GPIOPinArray[ch_num];
 
     if (!IsGPIOReversePin[ch_num]) {
         // Pin is NOT reversed
-        g_pins_shadow[array_idx] |= seq_idx % 2 == 0 ? gpio_pin : gpio_pin << 16;
+        set->pins[array_idx] |= seq_idx % 2 == 0 ? gpio_pin : gpio_pin << 16;
     } else {
         // Pin is reversed
-        g_pins_shadow[array_idx] |= seq_idx % 2 == 1 ? gpio_pin : gpio_pin << 16;
+        set->pins[array_idx] |= seq_idx % 2 == 1 ? gpio_pin : gpio_pin << 16;
     }
 }
 
 //---------------------------------------------------------------------
 /// <summary> Insert new entry into time and pins array. </summary>
 ///
+/// <param name="set"> Settings to insert into. </param>
 /// <param name="ch_num"> Channel number (0-15). </param>
 /// <param name="seq_idx"> Sequence index, used to determine on/off state of pin. </param>
 /// <param name="time_val"> Timer value to write to time array. </param>
 /// <param name="array_idx"> Index in the arrays where to update values. </param>
 //---------------------------------------------------------------------
-static void Insert(uint32_t ch_num, int seq_idx, int time_val, int array_idx)
+static void Insert(seq_settings* set, uint32_t ch_num, int seq_idx, int time_val, int array_idx)
 {
-    if (g_num_of_entries >= MAX_STATES)
+    if (set->num_of_entries >= MAX_STATES)
         return;
-    for (int i = g_num_of_entries; i > array_idx; i--) {
-        g_time_shadow[i] = g_time_shadow[i - 1];
-        g_pins_shadow[i] = g_pins_shadow[i - 1];
+    for (int i = set->num_of_entries; i > array_idx; i--) {
+        set->time[i] = set->time[i - 1];
+        set->pins[i] = set->pins[i - 1];
     }
-    g_time_shadow[array_idx] = time_val;
-    g_pins_shadow[array_idx] = 0;
-    UpdatePinsArray(ch_num, seq_idx, array_idx);
-    g_num_of_entries++;
+    set->time[array_idx] = time_val;
+    set->pins[array_idx] = 0;
+    UpdatePinsArray(set, ch_num, seq_idx, array_idx);
+    set->num_of_entries++;
 }
 
 //---------------------------------------------------------------------
-/// <summary> Reset uC. </summary>
+/// <summary> Reset uC. Only requested here (EVT_RESET), main loop writes values not
+/// written into FLASH yet and resets, so the command can run in the UART interrupt,
+/// which FLASH interrupt can't preempt. </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_RSET(char* str, write_func Write)
+static command_status Function_RSET(parse_context* ctx)
 {
-    // Echo
-    Write((uint8_t*)"RSET", 4);
+    EVT_Post(EVT_RESET);
 
-    // Give it time to send string back
-    HAL_Delay(100);
+    // Echo
+    Respond(ctx, "RSET", 4);
 
-    NVIC_SystemReset();
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Version (hardcoded) GET. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_VERG(char* str, write_func Write)
+static command_status Function_VERG(parse_context* ctx)
 {
     char buf[100] = {0};
     snprintf(buf, sizeof(buf), "VERG,%s,%s", PROJECT_TITLE, VERSION);
-    Write((uint8_t*)buf, strlen(buf));
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> uC UART ID SET. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_ID_S(char* str, write_func Write)
+static command_status Function_ID_S(parse_context* ctx)
 {
-    str = strtok(NULL, Delims);
+    command_status status = CMD_ERR_ARGS;
+
+    char* str = NextToken(ctx, Delims);
     if (str != NULL) {
         int num = atoi(str);
-        if (num <= 127) {
+        if (num >= 0 && num < UART_UNITS) {
             UART_Set_Address(num);
+            status = CMD_OK;
         }
     }
 
     // Echo
     char buf[10] = {0};
     snprintf(buf, sizeof(buf), "ID_S,%u", UART_Address);
-    Write((uint8_t*)buf, strlen(buf));
+    Respond(ctx, buf, strlen(buf));
+
+    return status;
 }
 
 //---------------------------------------------------------------------
 /// <summary> uC UART ID GET. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_ID_G(char* str, write_func Write)
+static command_status Function_ID_G(parse_context* ctx)
 {
     char buf[10] = {0};
     snprintf(buf, sizeof(buf), "ID_G,%u", UART_Address);
-    Write((uint8_t*)buf, strlen(buf));
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Simple PING, to check if uC is alive. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_PING(char* str, write_func Write)
+static command_status Function_PING(parse_context* ctx)
 {
-    Write((uint8_t*)"PING", 4);
+    Respond(ctx, "PING", 4);
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Start train pulse. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_STRT(char* str, write_func Write)
+static command_status Function_STRT(parse_context* ctx)
 {
-    if (needsCorrecting) {
-        ShiftTimeSettings();
-        g_new_settings_received = 1;
+    // Start time (optional): STRT@<t> in text, argument in a binary frame
+    const char* at   = ctx->in_frame ? NextToken(ctx, Delims) : ctx->at;
+    char*       end  = NULL;
+    uint32_t    time = at != NULL ? strtoul(at, &end, 10) : 0;
+    if (at != NULL && (end == at || *end != '\0'))
+        return CMD_ERR_ARGS;
+
+    if (ctx->settings_changed) {
+        SEQ_Publish(ctx->link);
+        ctx->settings_changed = 0;
+    }
+    ctx->adding_channels = 0;
+    if (at != NULL) {
+        StartAtRequest(ctx->link, time);
+    } else {
+        if (!IsRunning())
+            LAT_StartCommand(ctx->link);
+        StartRequest(ctx->link);
     }
-    newSettings = 1;
-    StartRequest();
 
     // Echo
-    Write((uint8_t*)"STRT", 4);
+    char buf[20];
+    int  len = at != NULL ? snprintf(buf, sizeof(buf), "STRT@%lu", (unsigned long)time) : snprintf(buf, sizeof(buf), "STRT");
+    Respond(ctx, buf, len);
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Stop train pulse. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_STOP(parse_context* ctx)
+{
+    ctx->adding_channels = 0;
+    StopRequest(ctx->link);
+
+    // Echo
+    Respond(ctx, "STOP", 4);
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Restart the running period now, so units receiving the command together have their periods aligned.
+/// SYNC,<t> sets the device clock instead (clock.h): terminator of the message was at time t [us]
+/// (received on UART it is timestamped by UART interrupt, on USB when parsed). </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_STOP(char* str, write_func Write)
+static command_status Function_SYNC(parse_context* ctx)
 {
-    newSettings = 1;
-    StopRequest();
+    char* str = NextToken(ctx, Delims); // param - time [us] (optional)
+
+    if (str == NULL) {
+        SEQ_Sync();
+
+        // Echo
+        Respond(ctx, "SYNC", 4);
+        return CMD_OK;
+    }
+
+    uint32_t time = strtoul(str, NULL, 10);
+    CLK_Sync(ctx->link == LINK_UART ? ctx->rx_end : DWT->CYCCNT, time);
 
     // Echo
-    Write((uint8_t*)"STOP", 4);
+    char buf[20];
+    int  len = snprintf(buf, sizeof(buf), "SYNC,%lu", (unsigned long)time);
+    Respond(ctx, buf, len);
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Device clock query, can be broadcast (answered in slots, same range as ENUM).
+/// Response: SYNQ,address,syncs,offset of the last sync [us],drift [ppb] </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_SYNQ(parse_context* ctx)
+{
+    unsigned int first, count;
+    NextRange(ctx, &first, &count);
+
+    char buf[50];
+    int  len = snprintf(buf, sizeof(buf), "SYNQ,%u,%lu,%ld,%ld", UART_Address, (unsigned long)CLK_Stats.syncs, (long)CLK_Stats.offset,
+                        (long)CLK_Stats.drift);
+    RespondInSlot(ctx, buf, len, first, count);
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Sync master SET: broadcast device time (SYNC,<t>) on RS-485 every interval,
+/// so all units on the bus follow the clock of this unit (gateway.c).
+/// Example SYNM,1000 // every second, SYNM,0 // off </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_SYNM(parse_context* ctx)
+{
+    command_status status = CMD_ERR_ARGS;
+
+    char* str = NextToken(ctx, Delims); // param - interval [ms]
+    if (str != NULL) {
+        GATE_SyncInterval = strtoul(str, NULL, 10);
+        status            = CMD_OK;
+    }
+
+    // Echo
+    char buf[20];
+    int  len = snprintf(buf, sizeof(buf), "SYNM,%lu", (unsigned long)GATE_SyncInterval);
+    Respond(ctx, buf, len);
+
+    return status;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Enumerate units on the RS-485 bus. Broadcast ENUM is answered by every
+/// unit in its slot, so the host finds all units in one round instead of polling
+/// 127 addresses. Range narrows it down, e.g. ENUM,0,32 // units 0 - 31 in 32 slots </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_ENUM(parse_context* ctx)
+{
+    unsigned int first, count;
+    NextRange(ctx, &first, &count);
+
+    char buf[20];
+    int  len = snprintf(buf, sizeof(buf), "ENUM,%u", UART_Address);
+    RespondInSlot(ctx, buf, len, first, count);
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Short status query, can be broadcast (answered in slots, same range as ENUM).
+/// Response: STTQ,address,state (0 - stopped, 1 - running, 2 - stopping, 3 - waiting for scheduled start),periods,late edges </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_STTQ(parse_context* ctx)
+{
+    unsigned int first, count;
+    NextRange(ctx, &first, &count);
+
+    int  state = IsArmed() ? 3 : IsStopping() ? 2 : IsRunning() ? 1 : 0;
+    char buf[50];
+    int  len = snprintf(buf, sizeof(buf), "STTQ,%u,%d,%lu,%lu", UART_Address, state, (unsigned long)g_seq_stats.periods,
+                        (unsigned long)g_seq_stats.late_edges);
+    RespondInSlot(ctx, buf, len, first, count);
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Response slot time SET [us]. All units on the bus must use the same,
+/// usually set with a broadcast. Example SLTS,1000 </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_SLTS(parse_context* ctx)
+{
+    command_status status = CMD_ERR_ARGS;
+
+    char* str = NextToken(ctx, Delims);
+    if (str != NULL) {
+        int slot = atoi(str);
+        if (slot > 0) {
+            SLOT_Time = slot;
+            status    = CMD_OK;
+        }
+    }
+
+    // Echo
+    char buf[20];
+    int  len = snprintf(buf, sizeof(buf), "SLTS,%lu", (unsigned long)SLOT_Time);
+    Respond(ctx, buf, len);
+
+    return status;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Response slot time GET, with slot statistics.
+/// Response: SLTG,slot time [us],sent,missed </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_SLTG(parse_context* ctx)
+{
+    char buf[50];
+    int  len = snprintf(buf, sizeof(buf), "SLTG,%lu,%lu,%lu", (unsigned long)SLOT_Time, (unsigned long)SLOT_Stats.sent,
+                        (unsigned long)SLOT_Stats.missed);
+    Respond(ctx, buf, len);
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Gateway statistics GET (messages forwarded from USB to RS-485).
+/// Response: GATG,forwarded,replies,timeouts,dropped </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_GATG(parse_context* ctx)
+{
+    char buf[60];
+    int  len = snprintf(buf, sizeof(buf), "GATG,%lu,%lu,%lu,%lu", (unsigned long)GATE_Stats.forwarded, (unsigned long)GATE_Stats.replies,
+                        (unsigned long)GATE_Stats.timeouts, (unsigned long)GATE_Stats.dropped);
+    Respond(ctx, buf, len);
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Train pulse period SET. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_PRDS(char* str, write_func Write)
+static command_status Function_PRDS(parse_context* ctx)
 {
-    str = strtok(NULL, Delims); // param - PERIOD [us]
+    command_status status = CMD_ERR_ARGS;
+
+    char* str = NextToken(ctx, Delims); // param - PERIOD [us]
     if (str != NULL) {
         int period = atoi(str);
         if (period > 0) {
-            // This also triggers new settings received
-            g_new_settings_received = 1;
-            g_timer_period_us       = period;
+            SEQ_Staging(ctx->link)->timer_period_us = period;
+            ctx->settings_changed                   = 1; // published on start
+            status                                  = CMD_OK;
         }
     }
 
     // Echo
     char buf[30];
-    snprintf(buf, sizeof(buf), "PRDS,%u", g_timer_period_us);
-    Write((uint8_t*)buf, strlen(buf));
+    snprintf(buf, sizeof(buf), "PRDS,%u", SEQ_Staging(ctx->link)->timer_period_us);
+    Respond(ctx, buf, strlen(buf));
+
+    return status;
 }
 
 //---------------------------------------------------------------------
@@ -295,37 +656,42 @@ static void Function_PRDS(char* str, write_func Write)
 /// - coresponds to PIN numbers (0 - PIN0, 1 - PIN1, ...)
 /// second param: on g_time, third param: off g_time ... toggle so on </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_CHLS(char* str, write_func Write)
+static command_status Function_CHLS(parse_context* ctx)
 {
-    if (newSettings) {
-        needsCorrecting = 1;
-        ClearSettings();
-        newSettings = 0;
+    seq_settings* set = SEQ_Staging(ctx->link);
+
+    if (!ctx->adding_channels) { // first CHLS after start or stop begins new settings
+        ClearSettings(set);
+        ctx->adding_channels  = 1;
+        ctx->settings_changed = 1;
     }
 
-    str = strtok(NULL, Delims);
+    char* str = NextToken(ctx, Delims);
     if (str == NULL)
-        return;
+        return CMD_ERR_ARGS;
     unsigned int chNum = atoi(str);
     if (chNum >= NUM_OF_CHANNELS)
-        return;
+        return CMD_ERR_ARGS;
 
-    str = strtok(NULL, "\n\r");
+    str = NextToken(ctx, "\n\r"); // rest of the line - times
+    if (str == NULL)
+        return CMD_ERR_ARGS;
 
     int timeArray[20] = {0};
     int elementsFound = StrToInts(str, timeArray, sizeof(timeArray) / sizeof(*timeArray));
 
     for (int i_el = 0; i_el < elementsFound; ++i_el) {
-        if (timeArray[i_el] < g_time_shadow[0]) {
+        if (set->num_of_entries == 0 || timeArray[i_el] < set->time[0]) {
             // Lowest value doesn't exist in g_time array
-            Insert(chNum, i_el, timeArray[i_el], 0);
+            Insert(set, chNum, i_el, timeArray[i_el], 0);
             continue;
-        } else if (timeArray[i_el] > g_time_shadow[g_num_of_entries - 1]) {
+        } else if (timeArray[i_el] > set->time[set->num_of_entries - 1]) {
             // Highest value doesn't exist in g_time array
-            Insert(chNum, i_el, timeArray[i_el], g_num_of_entries);
+            Insert(set, chNum, i_el, timeArray[i_el], set->num_of_entries);
             continue;
         }
 
@@ -334,20 +700,20 @@ static void Function_CHLS(char* str, write_func Write)
         ///////////////////////////////
 
         int found = 0;
-        for (int i = 0; i < g_num_of_entries; ++i) {
-            if (g_time_shadow[i] == timeArray[i_el]) {
+        for (int i = 0; i < set->num_of_entries; ++i) {
+            if (set->time[i] == timeArray[i_el]) {
                 // Time already exists
-                UpdatePinsArray(chNum, i_el, i);
+                UpdatePinsArray(set, chNum, i_el, i);
                 found = 1;
                 break;
             }
         }
 
         if (!found) {
-            for (int i = 0; i < g_num_of_entries; ++i) {
-                if (g_time_shadow[i] > timeArray[i_el]) {
+            for (int i = 0; i < set->num_of_entries; ++i) {
+                if (set->time[i] > timeArray[i_el]) {
                     // Time does not exist, insert it into array
-                    Insert(chNum, i_el, timeArray[i_el], i);
+                    Insert(set, chNum, i_el, timeArray[i_el], i);
                     break;
                 }
             }
@@ -360,45 +726,46 @@ static void Function_CHLS(char* str, write_func Write)
     for (int i = 0; i < elementsFound; ++i) {
         snprintf(&buf[strlen(buf)], sizeof(buf) - strlen(buf), ",%u", timeArray[i]);
     }
-    Write((uint8_t*)buf, strlen(buf));
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Period GET. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_PRDG(char* str, write_func Write)
+static command_status Function_PRDG(parse_context* ctx)
 {
     char buf[30];
-    snprintf(buf, sizeof(buf), "PRDG,%u", g_timer_period_us);
+    snprintf(buf, sizeof(buf), "PRDG,%u", SEQ_Staging(ctx->link)->timer_period_us);
 
-    Write((uint8_t*)buf, strlen(buf));
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> Export channel settings as text. </summary>
 ///
+/// <param name="set"> Settings to export. </param>
 /// <param name="buf"> Pointer to buffer to put text into. </param>
 /// <param name="max_size"> Maximum size of buffer. </param>
 /// <param name="ch"> Channel to export. </param>
 ///
 /// <returns> Number of written bytes. </returns>
 //---------------------------------------------------------------------
-static int WriteChannelSettings(char* buf, int max_size, int ch)
+static int WriteChannelSettings(const seq_settings* set, char* buf, int max_size, int ch)
 {
     int written = 0;
     buf[0]      = 0;
     // Write times for said channel
-    for (int i = 0; i < g_num_of_entries; ++i) {
-        if (g_pins_shadow[i] & GPIOPinArray[ch] || (g_pins_shadow[i] & GPIOPinArray[ch] << 16)) // take into account setting and reseting
-        {
-            if (i == 0) // fetch last time entry
-                written += snprintf(&buf[strlen(buf)], max_size - strlen(buf), "%lu,", g_time_shadow[g_num_of_entries - 1]);
-            else
-                written += snprintf(&buf[strlen(buf)], max_size - strlen(buf), "%lu,", g_time_shadow[i - 1]);
-        }
+    for (int i = 0; i < set->num_of_entries; ++i) {
+        if (set->pins[i] & GPIOPinArray[ch] || (set->pins[i] & GPIOPinArray[ch] << 16)) // take into account setting and reseting
+            written += snprintf(&buf[strlen(buf)], max_size - strlen(buf), "%lu,", (unsigned long)set->time[i]);
     }
     if (strlen(buf) > 0)
         buf[strlen(buf) - 1] = 0;
@@ -409,78 +776,539 @@ static int WriteChannelSettings(char* buf, int max_size, int ch)
 //---------------------------------------------------------------------
 /// <summary> GET channel settings. </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_CHLG(char* str, write_func Write)
+static command_status Function_CHLG(parse_context* ctx)
 {
     char buf[100];
     int  ch = -1; // default is an invalid ch num
 
     // Get channel number
     /////////////////////
-    str = strtok(NULL, Delims); // param - PERIOD [us]
+    char* str = NextToken(ctx, Delims); // param - PERIOD [us]
     if (str != NULL)
         ch = atoi(str);
 
     if (ch < 0 || ch >= NUM_OF_CHANNELS) // Invalid channel number
-        return;
+        return CMD_ERR_ARGS;
     /////////////////////
 
     // Write channel number
     snprintf(buf, sizeof(buf), "CHLG,%u,", ch);
 
     // Write channel settings
-    WriteChannelSettings(&buf[strlen(buf)], sizeof(buf) - strlen(buf), ch);
+    WriteChannelSettings(SEQ_Staging(ctx->link), &buf[strlen(buf)], sizeof(buf) - strlen(buf), ch);
+
+    Respond(ctx, buf, strlen(buf));
 
-    Write((uint8_t*)buf, strlen(buf));
+    return CMD_OK;
 }
 
 //---------------------------------------------------------------------
 /// <summary> GET all settings (period and all channels). </summary>
 ///
-/// <param name="str"> Raw text with optional function arguments. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
 //---------------------------------------------------------------------
-static void Function_STTG(char* str, write_func Write)
+static command_status Function_STTG(parse_context* ctx)
 {
+    const seq_settings* set = SEQ_Staging(ctx->link);
+
     char buf[500];
-    snprintf(buf, sizeof(buf), "PERIOD,%u\n", g_timer_period_us);
+    snprintf(buf, sizeof(buf), "PERIOD,%u\n", set->timer_period_us);
 
     char tmp_buf[100];
     for (int ch = 0; ch < NUM_OF_CHANNELS; ++ch) {
-        if (WriteChannelSettings(tmp_buf, sizeof(tmp_buf), ch) > 0)
+        if (WriteChannelSettings(set, tmp_buf, sizeof(tmp_buf), ch) > 0)
             snprintf(&buf[strlen(buf)], sizeof(buf) - strlen(buf), "CH,%u,%s\n", ch, tmp_buf);
     }
 
-    Write((uint8_t*)buf, strlen(buf));
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Telemetry stream SET. Stream is sent on the link the command came from.
+/// Example TLMS,100 // record every 100 periods
+/// TLMS,0,500 // record every 500 ms, TLMS,0 // disable </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_TLMS(parse_context* ctx)
+{
+    char* periods = NextToken(ctx, Delims); // param - every N periods
+    char* ms      = NextToken(ctx, Delims); // param - every N ms (optional)
+
+    if (periods == NULL)
+        return CMD_ERR_ARGS;
+
+    uint32_t every_periods = strtoul(periods, NULL, 10);
+    uint32_t every_ms      = ms != NULL ? strtoul(ms, NULL, 10) : 0;
+    TLM_Configure(ctx, every_periods, every_ms);
+
+    // Echo
+    char buf[40];
+    snprintf(buf, sizeof(buf), "TLMS,%lu,%lu", (unsigned long)every_periods, (unsigned long)every_ms);
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Send acknowledgements of tagged commands that are being held back. </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_ACKS(parse_context* ctx)
+{
+    UNUSED(ctx);
+
+    // Nothing to do, untagged command releases held acknowledgements on its own
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Run benchmark kernels (parser and table compiler) and report the
+/// fastest run of each in core cycles, one line per kernel and size.
+/// Example BNCH,100 // 100 runs of each kernel
+/// Response BNCH,CLOCK,<Hz>, then BNCH,<kernel>,<size>,<cycles> ...
+/// Sequencer must be stopped. Kernels use settings of their own link (LINK_BENCH). </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_BNCH(parse_context* ctx)
+{
+    char* str        = NextToken(ctx, Delims); // param - number of runs (optional)
+    int   iterations = str != NULL ? atoi(str) : BENCH_DEFAULT_ITERATIONS;
+    if (iterations <= 0 || IsRunning())
+        return CMD_ERR_ARGS;
+
+    char buf[40];
+    snprintf(buf, sizeof(buf), "BNCH,CLOCK,%lu", (unsigned long)BENCH_ClockHz());
+    Respond(ctx, buf, strlen(buf));
+
+    for (int i = 0; i < BENCH_NumOfStandardRuns; ++i) {
+        const bench_run* run    = &BENCH_StandardRuns[i];
+        uint32_t         cycles = BENCH_Run(run->kernel, run->size, iterations);
+        snprintf(buf, sizeof(buf), "BNCH,%s,%d,%lu", BENCH_KernelName[run->kernel], run->size, (unsigned long)cycles);
+        Respond(ctx, buf, strlen(buf));
+    }
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Profiler SET/GET. PROF,1 clears statistics and enables profiler,
+/// PROF,0 disables it, PROF reports (statistics are kept while disabled).
+/// Response PROF,TIME,<ms enabled>,<core clock Hz>, then
+/// PROF,<region>,<count>,<total us>,<max cycles> for each region. </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_PROF(parse_context* ctx)
+{
+    char  buf[60];
+    char* str = NextToken(ctx, Delims); // param - enable (optional)
+
+    if (str != NULL) {
+        PROF_Enable(atoi(str) != 0);
+        snprintf(buf, sizeof(buf), "PROF,%u", PROF_Enabled);
+        Respond(ctx, buf, strlen(buf));
+        return CMD_OK;
+    }
+
+    snprintf(buf, sizeof(buf), "PROF,TIME,%lu,%lu", (unsigned long)PROF_EnabledMs(), (unsigned long)SystemCoreClock);
+    Respond(ctx, buf, strlen(buf));
+
+    for (int i = 0; i < PROF_NUM_OF_REGIONS; ++i) {
+        uint32_t count, total_us, max;
+        PROF_Read(i, &count, &total_us, &max);
+        snprintf(buf, sizeof(buf), "PROF,%s,%lu,%lu,%lu", PROF_RegionName[i], (unsigned long)count, (unsigned long)total_us, (unsigned long)max);
+        Respond(ctx, buf, strlen(buf));
+    }
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Dump event trace. TRCD,<seq> returns entries from sequence number seq
+/// on (TRCD or TRCD,0 from the oldest one), as many as fit into one response.
+/// Binary frame response: next seq (u32), then 16 byte entries (see trace_entry).
+/// ASCII response: TRCD,<next seq>,<same entries in hex>. Host repeats with next seq
+/// until no entries are returned. </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_TRCD(parse_context* ctx)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    uint8_t     buf[PARSE_OUTPUT_SIZE];
+    trace_entry entries[(PARSE_OUTPUT_SIZE - 4) / sizeof(trace_entry)];
+    char*       str = NextToken(ctx, Delims); // param - first sequence number (optional)
+    uint32_t    seq = str != NULL ? strtoul(str, NULL, 10) : 0;
+
+    if (ctx->in_frame) {
+        int n  = TRACE_Read(&seq, entries, sizeof(entries) / sizeof(*entries));
+        buf[0] = seq;
+        buf[1] = seq >> 8;
+        buf[2] = seq >> 16;
+        buf[3] = seq >> 24;
+        memcpy(&buf[4], entries, n * sizeof(trace_entry));
+        Respond(ctx, (const char*)buf, 4 + n * sizeof(trace_entry));
+    } else {
+        int max_entries = (PARSE_OUTPUT_SIZE - 20) / (2 * sizeof(trace_entry));
+        int n           = TRACE_Read(&seq, entries, max_entries);
+        int len         = snprintf((char*)buf, sizeof(buf), "TRCD,%lu,", (unsigned long)seq);
+        for (int i = 0; i < n * (int)sizeof(trace_entry); ++i) {
+            uint8_t byte = ((const uint8_t*)entries)[i];
+            buf[len++]   = hex[byte >> 4];
+            buf[len++]   = hex[byte & 0x0F];
+        }
+        Respond(ctx, (const char*)buf, len);
+    }
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Event trace mask SET/GET. Bit n enables recording of trace_event n.
+/// Example TRCE,65535 // all events, including timer update event of every period </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_TRCE(parse_context* ctx)
+{
+    char* str = NextToken(ctx, Delims); // param - mask (optional)
+    if (str != NULL)
+        TRACE_Mask = strtoul(str, NULL, 10);
+
+    char buf[20];
+    snprintf(buf, sizeof(buf), "TRCE,%lu", (unsigned long)TRACE_Mask);
+    Respond(ctx, buf, strlen(buf));
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start command latency GET, LATG,1 also clears statistics after reporting.
+/// Response LATG,CLOCK,<core clock Hz>, then for each link and measured interval that
+/// has measurements LATG,<link>,<interval>,<count>,<min>,<avg>,<max cycles>,<histogram>
+/// (LAT_NUM_OF_BUCKETS counts, bucket n holds latencies in [2^(n-1), 2^n) us). </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_LATG(parse_context* ctx)
+{
+    char  buf[256]; // fits all fields at their longest
+    char* str = NextToken(ctx, Delims); // param - clear (optional)
+
+    snprintf(buf, sizeof(buf), "LATG,CLOCK,%lu", (unsigned long)SystemCoreClock);
+    Respond(ctx, buf, strlen(buf));
+
+    for (int link = 0; link < LAT_NUM_OF_LINKS; ++link) {
+        for (int point = 0; point < LAT_NUM_OF_POINTS; ++point) {
+            lat_stats s;
+            LAT_Read(link, point, &s);
+            if (s.count == 0)
+                continue;
+
+            int len = snprintf(buf, sizeof(buf), "LATG,%s,%s,%lu,%lu,%lu,%lu", LAT_LinkName[link], LAT_PointName[point], (unsigned long)s.count,
+                               (unsigned long)s.min, (unsigned long)(s.total / s.count), (unsigned long)s.max);
+            for (int b = 0; b < LAT_NUM_OF_BUCKETS; ++b)
+                len += snprintf(&buf[len], sizeof(buf) - len, ",%lu", (unsigned long)s.bucket[b]);
+            Respond(ctx, buf, len);
+        }
+    }
+
+    if (str != NULL && atoi(str) != 0)
+        LAT_Clear();
+
+    return CMD_OK;
+}
+
+//---------------------------------------------------------------------
+/// <summary> FLASH status GET. Response FLSG,<operation in progress (NONE, ERASE, PROGRAM)>,
+/// <words programmed>,<words to program>,<failed operations>,<FLASH_SR error flags of the last one>,
+/// <keys waiting to be stored>,<store generation>,<store bytes used>. </summary>
+///
+/// <param name="ctx"> Parser context of the link the command came from (arguments, response builder). </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Function_FLSG(parse_context* ctx)
+{
+    static const char* const op_name[] = {"NONE", "ERASE", "PROGRAM"};
+
+    flash_status flash;
+    kv_stats     kv;
+    char         buf[100];
+
+    FLASH_Status(&flash);
+    KV_Stats(&kv);
+
+    int len = snprintf(buf, sizeof(buf), "FLSG,%s,%d,%d,%lu,%lu,%lu,%lu,%lu", op_name[flash.op], flash.done, flash.size, (unsigned long)flash.errors,
+                       (unsigned long)flash.error_flags, (unsigned long)kv.pending, (unsigned long)kv.generation, (unsigned long)kv.used);
+    Respond(ctx, buf, len);
+
+    return CMD_OK;
 }
 
-#define COMMAND(NAME)          \
-    {                          \
-#NAME, Function_##NAME \
+// Command table. One line per command:
+// NAME, its four opcode characters, binary opcode, links it is allowed on, flags (CMD_ISR_SAFE - can be
+// executed directly in interrupt context, only these are accepted on UART, CMD_SLOTTED - answered in slots)
+// and argument schema.
+#define COMMAND_TABLE(X)                                                                    \
+    X(VERG, 'V', 'E', 'R', 'G', 0x01, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(ID_S, 'I', 'D', '_', 'S', 0x02, LINK_ALL, CMD_ISR_SAFE, ARGS_UINT)                    \
+    X(ID_G, 'I', 'D', '_', 'G', 0x03, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(PING, 'P', 'I', 'N', 'G', 0x04, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(RSET, 'R', 'S', 'E', 'T', 0x05, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(ACKS, 'A', 'C', 'K', 'S', 0x06, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(BNCH, 'B', 'N', 'C', 'H', 0x07, LINK_HOST, 0, ARGS_OPT_UINT)                          \
+    X(PROF, 'P', 'R', 'O', 'F', 0x08, LINK_ALL, CMD_ISR_SAFE, ARGS_OPT_UINT)                \
+    X(TRCD, 'T', 'R', 'C', 'D', 0x09, LINK_ALL, CMD_ISR_SAFE, ARGS_OPT_UINT)                \
+    X(TRCE, 'T', 'R', 'C', 'E', 0x0A, LINK_ALL, CMD_ISR_SAFE, ARGS_OPT_UINT)                \
+    X(LATG, 'L', 'A', 'T', 'G', 0x0B, LINK_ALL, CMD_ISR_SAFE, ARGS_OPT_UINT)                \
+    X(FLSG, 'F', 'L', 'S', 'G', 0x0C, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(ENUM, 'E', 'N', 'U', 'M', 0x0D, LINK_ALL, CMD_ISR_SAFE | CMD_SLOTTED, ARGS_OPT_UINTS) \
+    X(STTQ, 'S', 'T', 'T', 'Q', 0x0E, LINK_ALL, CMD_ISR_SAFE | CMD_SLOTTED, ARGS_OPT_UINTS) \
+    X(GATG, 'G', 'A', 'T', 'G', 0x0F, LINK_HOST, CMD_ISR_SAFE, ARGS_NONE)                   \
+                                                                                            \
+    X(STRT, 'S', 'T', 'R', 'T', 0x10, LINK_ALL, CMD_ISR_SAFE, ARGS_OPT_UINT)                \
+    X(STOP, 'S', 'T', 'O', 'P', 0x11, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(SYNC, 'S', 'Y', 'N', 'C', 0x12, LINK_ALL, CMD_ISR_SAFE, ARGS_OPT_UINT)                \
+                                                                                            \
+    X(PRDS, 'P', 'R', 'D', 'S', 0x20, LINK_ALL, CMD_ISR_SAFE, ARGS_UINT)                    \
+    X(CHLS, 'C', 'H', 'L', 'S', 0x21, LINK_ALL, CMD_ISR_SAFE, ARGS_CHANNEL_TIMES)           \
+    X(SLTS, 'S', 'L', 'T', 'S', 0x22, LINK_ALL, CMD_ISR_SAFE, ARGS_UINT)                    \
+    X(SYNM, 'S', 'Y', 'N', 'M', 0x23, LINK_HOST, CMD_ISR_SAFE, ARGS_UINT)                   \
+                                                                                            \
+    X(PRDG, 'P', 'R', 'D', 'G', 0x30, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(CHLG, 'C', 'H', 'L', 'G', 0x31, LINK_ALL, CMD_ISR_SAFE, ARGS_UINT)                    \
+    X(STTG, 'S', 'T', 'T', 'G', 0x32, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(SLTG, 'S', 'L', 'T', 'G', 0x33, LINK_ALL, CMD_ISR_SAFE, ARGS_NONE)                    \
+    X(SYNQ, 'S', 'Y', 'N', 'Q', 0x34, LINK_ALL, CMD_ISR_SAFE | CMD_SLOTTED, ARGS_OPT_UINTS) \
+                                                                                            \
+    X(TLMS, 'T', 'L', 'M', 'S', 0x40, LINK_ALL, CMD_ISR_SAFE, ARGS_UINTS)
+
+// Four opcode characters packed the same way as they are read from received text (little endian)
+#define COMMAND_CODE(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+// Perfect hash of the command code into COMMAND_SLOTS slots (multiplicative hash, multiplier picked so that
+// no two commands collide - a collision is a compile error, see CheckCommandTable)
+#define COMMAND_SLOT_BITS 6
+#define COMMAND_SLOTS (1 << COMMAND_SLOT_BITS)
+#define COMMAND_HASH(code) ((uint32_t)((code)*0x9E377A23U) >> (32 - COMMAND_SLOT_BITS))
+
+typedef enum {
+    CMD_ISR_SAFE = 0x01, // does not block or wait for interrupts, can run in the UART (EXTI) interrupt
+    CMD_SLOTTED  = 0x02, // broadcast is answered in slots, by units in range [first,count] (RespondInSlot)
+} command_flags;
+
+typedef enum {
+    ARGS_NONE,          // no arguments
+    ARGS_UINT,          // one unsigned integer
+    ARGS_CHANNEL_TIMES, // channel number followed by a list of times
+    ARGS_UINTS,         // one or more unsigned integers
+    ARGS_OPT_UINT,      // optional unsigned integer
+    ARGS_OPT_UINTS,     // zero or more unsigned integers
+} command_args;
+
+typedef struct {
+    uint32_t     code;   // packed opcode characters
+    uint8_t      opcode; // binary opcode
+    uint8_t      links;  // mask of links the command is accepted on
+    uint8_t      flags;  // command_flags
+    command_args args;
+    command_status (*Func)(parse_context*);
+} command_entry;
+
+#define COMMAND_INDEX(NAME, a, b, c, d, opcode, links, flags, args) CMD_##NAME,
+#define COMMAND_ENTRY(NAME, a, b, c, d, opcode, links, flags, args) {COMMAND_CODE(a, b, c, d), opcode, links, flags, args, Function_##NAME},
+#define COMMAND_SLOT(NAME, a, b, c, d, opcode, links, flags, args) [COMMAND_HASH(COMMAND_CODE(a, b, c, d))] = CMD_##NAME + 1,
+#define COMMAND_OPCODE(NAME, a, b, c, d, opcode, links, flags, args) [opcode] = CMD_##NAME + 1,
+#define COMMAND_SLOT_CASE(NAME, a, b, c, d, opcode, links, flags, args) case COMMAND_HASH(COMMAND_CODE(a, b, c, d)):
+#define COMMAND_OPCODE_CASE(NAME, a, b, c, d, opcode, links, flags, args) case opcode:
+
+enum { COMMAND_TABLE(COMMAND_INDEX) NUM_OF_COMMANDS };
+
+static const command_entry command[NUM_OF_COMMANDS] = {COMMAND_TABLE(COMMAND_ENTRY)};
+
+// Hash slot / binary opcode -> index into command table + 1 (0 means no command)
+static const uint8_t command_by_slot[COMMAND_SLOTS] = {COMMAND_TABLE(COMMAND_SLOT)};
+static const uint8_t command_by_opcode[256]         = {COMMAND_TABLE(COMMAND_OPCODE)};
+
+//---------------------------------------------------------------------
+/// <summary> Never called. Only here so that the compiler reports a
+/// "duplicate case value" error if two commands end up in the same hash
+/// slot or share a binary opcode. </summary>
+//---------------------------------------------------------------------
+__attribute__((unused)) static void CheckCommandTable(uint32_t slot, uint8_t opcode)
+{
+    switch (slot) {
+        COMMAND_TABLE(COMMAND_SLOT_CASE)
+        break;
+    }
+    switch (opcode) {
+        COMMAND_TABLE(COMMAND_OPCODE_CASE)
+        break;
     }
+}
 
-static struct {
-    const char* name;
-    void (*Func)(char*, write_func);
-} command[] = {
-    COMMAND(VERG), // GET VERION
-    COMMAND(ID_S), // SET ID
-    COMMAND(ID_G), // GET ID
-    COMMAND(PING), // PING (echo)
-    COMMAND(RSET), // RESET
+//---------------------------------------------------------------------
+/// <summary> Find command by its text token (first four characters). </summary>
+///
+/// <param name="token"> Zero terminated token. </param>
+///
+/// <returns> Command entry or NULL if token is not a command. </returns>
+//---------------------------------------------------------------------
+static const command_entry* FindCommand(const char* token)
+{
+    uint32_t code = 0;
+    for (int i = 0; i < 4 && token[i] != '\0'; ++i)
+        code |= (uint32_t)(uint8_t)token[i] << (8 * i);
 
-    COMMAND(STRT), // START
-    COMMAND(STOP), // STOP
+    int idx = command_by_slot[COMMAND_HASH(code)];
+    if (idx == 0 || command[idx - 1].code != code)
+        return NULL;
 
-    COMMAND(PRDS), // SET PERIOD
-    COMMAND(CHLS), // SET CHANNEL
+    return &command[idx - 1];
+}
 
-    COMMAND(PRDG), // GET PERIOD
-    COMMAND(CHLG), // GET CHANNEL
-    COMMAND(STTG), // GET ALL SETTINGS
-};
+//---------------------------------------------------------------------
+/// <summary> Find command by its binary opcode. </summary>
+///
+/// <param name="opcode"> Binary opcode. </param>
+///
+/// <returns> Command entry or NULL if there is no such opcode. </returns>
+//---------------------------------------------------------------------
+static const command_entry* FindCommandByOpcode(uint8_t opcode)
+{
+    int idx = command_by_opcode[opcode];
+    return idx ? &command[idx - 1] : NULL;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Can command be executed on the link of a parser context. Command has to be
+/// allowed on the link, UART is parsed in EXTI interrupt, so there it has to be interrupt safe
+/// (others are rejected the same way as commands that are not allowed on the link). </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+/// <param name="cmd"> Command. </param>
+///
+/// <returns> 1 if command can be executed, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+static int Allowed(const parse_context* ctx, const command_entry* cmd)
+{
+    if (!(cmd->links & ctx->link))
+        return 0;
+    return ctx->link != LINK_UART || (cmd->flags & CMD_ISR_SAFE);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Execute command (record it in trace first). </summary>
+///
+/// <param name="ctx"> Parser context, positioned at command's arguments. </param>
+/// <param name="cmd"> Command. </param>
+/// <param name="token"> Command token, NULL for a binary frame. </param>
+///
+/// <returns> Command status. </returns>
+//---------------------------------------------------------------------
+static command_status Execute(parse_context* ctx, const command_entry* cmd, const char* token)
+{
+    ctx->at = token != NULL && token[4] == '@' ? &token[5] : NULL;
+
+    TRACE_Write(TRACE_COMMAND, ctx->link, cmd->opcode);
+    return cmd->Func(ctx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Execute tagged command (command following the tag token).
+/// Instead of a plain echo, tagged command responds with "#tag,OK,echo"
+/// or "#tag,ERR[,echo]", so host can send many commands without waiting
+/// for each response and match acknowledgements to commands afterwards.
+/// Acknowledgements are held back (collected in link's output) until an
+/// untagged command (e.g. ACKS) is received or the output is full, so on
+/// RS-485 the whole pipeline costs one bus turnaround. </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+/// <param name="tag"> Tag given by host. </param>
+//---------------------------------------------------------------------
+static void ExecuteTagged(parse_context* ctx, unsigned int tag)
+{
+    char*                str    = NextToken(ctx, Delims);
+    const command_entry* cmd    = str != NULL ? FindCommand(str) : NULL;
+    command_status       status = CMD_ERR_ARGS;
+
+    ctx->hold = 1;
+
+    // Make room for the acknowledgement in front of the echo
+    char ack[20];
+    if (!Fits(ctx, sizeof(ack) + 1, 1))
+        ParseFlush(ctx);
+
+    int mark    = ctx->out_len;
+    int flushes = ctx->flushes;
+    if (cmd != NULL && Allowed(ctx, cmd))
+        status = Execute(ctx, cmd, str);
+
+    int ack_len = snprintf(ack, sizeof(ack), "#%u,%s", tag, status == CMD_OK ? "OK" : "ERR");
+
+    if (ctx->flushes != flushes)
+        mark = 0; // output was written out during the command, what is left of the echo starts at its beginning
+
+    if (!Fits(ctx, ack_len + 1, 0) || (ctx->flushes != flushes && ctx->out_len == 0)) {
+        // No room to prefix the echo or it was already written out, acknowledge on its own
+        Respond(ctx, ack, ack_len);
+    } else if (ctx->out_len > mark) {
+        // Prefix the echo (first echo message starts after separator, if output wasn't empty)
+        int echo = mark > 0 ? mark + 1 : mark;
+        memmove(&ctx->out[echo + ack_len + 1], &ctx->out[echo], ctx->out_len - echo);
+        memcpy(&ctx->out[echo], ack, ack_len);
+        ctx->out[echo + ack_len] = ',';
+        ctx->out_len += ack_len + 1;
+    } else {
+        Respond(ctx, ack, ack_len);
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Forward the rest of the line to a unit on RS-485 (gateway.h).
+/// Its reply comes back later, on its own. </summary>
+///
+/// <param name="ctx"> Parser context, positioned after the address token. </param>
+/// <param name="address"> Address token ("@5", "@*" for all units). </param>
+//---------------------------------------------------------------------
+static void Forward(parse_context* ctx, const char* address)
+{
+    char* message = NextToken(ctx, "\n\r"); // rest of the line
+    if (message == NULL)
+        return;
+
+    if (address[1] == '*')
+        GATE_Forward(ctx->Write, GATE_BROADCAST, message, strlen(message));
+    else if (address[1] >= '0' && address[1] <= '9' && atoi(&address[1]) < UART_UNITS)
+        GATE_Forward(ctx->Write, atoi(&address[1]), message, strlen(message));
+}
 
 //---------------------------------------------------------------------
 /// <summary> Parse commands. </summary>
@@ -500,23 +1328,273 @@ static struct {
 /// STRT
 /// </example>
 ///
+/// <param name="ctx"> Parser context of the link the text was received on. </param>
 /// <param name="string"> Raw command text. </param>
-/// <param name="Write"> Function pointer to a write function (UART, USB). </param>
 //---------------------------------------------------------------------
-void Parse(char* string, write_func Write)
+void Parse(parse_context* ctx, char* string)
 {
     char* str;
 
-    str = strtok(string, Delims);
+    ctx->next = string;
+
+    str = NextToken(ctx, Delims);
     while (str != NULL) {
 
-        for (int i = 0; i < sizeof(command) / sizeof(command[0]); ++i) {
-            if (*(uint32_t*)str == *(uint32_t*)command[i].name) {
-                command[i].Func(str, Write);
-                break;
+        if (str[0] == TAG_PREFIX) {
+            ExecuteTagged(ctx, atoi(&str[1]));
+        } else if (str[0] == GATE_PREFIX && ctx->link != LINK_UART) {
+            Forward(ctx, str);
+        } else {
+            const command_entry* cmd = FindCommand(str);
+            if (cmd != NULL && Allowed(ctx, cmd)) {
+                ctx->hold = 0; // untagged command ends the pipeline, release held acknowledgements with its response
+                Execute(ctx, cmd, str);
             }
         }
 
-        str = strtok(NULL, Delims);
+        str = NextToken(ctx, Delims);
+    }
+
+    if (!ctx->hold)
+        ParseFlush(ctx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Size of a message without the carriage return of a CRLF line end. </summary>
+///
+/// <param name="data"> Message (without newline). </param>
+/// <param name="size"> Size of message. </param>
+///
+/// <returns> Size without trailing carriage return. </returns>
+//---------------------------------------------------------------------
+static int TrimCR(const uint8_t* data, int size)
+{
+    return size > 0 && data[size - 1] == '\r' ? size - 1 : size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Fast path of time critical commands (STRT, STOP, SYNC), called from receive
+/// interrupt of a link as soon as a message is complete, before it is queued for Parse.
+/// A message that is exactly one of these commands is executed right away, if sequencer
+/// can take it without overtaking earlier requests of the link (see SEQ_FastStart), everything
+/// else goes the normal way. Nothing is written to the link here: caller
+/// passes the message on and its echo is written by ParseExecuted. </summary>
+///
+/// <param name="ctx"> Parser context of the link. </param>
+/// <param name="data"> Received message (without newline). </param>
+/// <param name="size"> Size of message. </param>
+///
+/// <returns> 1 if command was executed, 0 if message has to be parsed (Parse). </returns>
+//---------------------------------------------------------------------
+int ParseFast(parse_context* ctx, const uint8_t* data, int size)
+{
+    if (TrimCR(data, size) != 4)
+        return 0;
+
+    uint32_t code = COMMAND_CODE(data[0], data[1], data[2], data[3]);
+    int      idx  = command_by_slot[COMMAND_HASH(code)];
+
+    if (idx == 0 || command[idx - 1].code != code || !(command[idx - 1].links & ctx->link))
+        return 0;
+
+    switch (idx - 1) {
+    case CMD_STRT:
+        if (ctx->settings_changed) // new channel settings, parser publishes them
+            return 0;
+        if (!IsRunning())
+            LAT_FastStartCommand(ctx->link);
+        if (SEQ_FastStart(ctx->link) != 0)
+            return 0;
+        ctx->adding_channels = 0;
+        break;
+    case CMD_STOP:
+        if (SEQ_FastStop(ctx->link) != 0)
+            return 0;
+        ctx->adding_channels = 0;
+        break;
+    case CMD_SYNC:
+        SEQ_Sync();
+        break;
+    default:
+        return 0;
+    }
+
+    TRACE_Write(TRACE_COMMAND, ctx->link, command[idx - 1].opcode);
+    return 1;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Respond to a message executed by ParseFast, the same way Parse
+/// would have (echo, held acknowledgements of tagged commands go with it). </summary>
+///
+/// <param name="ctx"> Parser context of the link. </param>
+/// <param name="data"> Message executed by ParseFast. </param>
+/// <param name="size"> Size of message. </param>
+//---------------------------------------------------------------------
+void ParseExecuted(parse_context* ctx, const uint8_t* data, int size)
+{
+    ctx->hold = 0;
+    Respond(ctx, (const char*)data, TrimCR(data, size));
+    ParseFlush(ctx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Number of slots a broadcast message is answered in (gateway
+/// waits for them before it uses the bus again). </summary>
+///
+/// <param name="message"> Message (zero terminated). </param>
+///
+/// <returns> Slot count of a slotted query (its count argument), 0 for other messages. </returns>
+//---------------------------------------------------------------------
+int ParseSlotCount(const char* message)
+{
+    char token[5] = {0};
+    strncpy(token, message, 4);
+
+    const command_entry* cmd = FindCommand(token);
+    if (cmd == NULL || !(cmd->flags & CMD_SLOTTED))
+        return 0;
+
+    // Same defaults as NextRange
+    char*         end   = (char*)&message[strlen(token)];
+    unsigned long count = UART_UNITS;
+    if (*end == ',') {
+        strtoul(end + 1, &end, 10); // first
+        if (*end == ',')
+            count = strtoul(end + 1, NULL, 10);
+    }
+    return MIN(count, UART_UNITS);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Convert binary command arguments to text, as they would be
+/// written in an ASCII command, according to command's argument schema.
+/// Numbers are 32 bit little endian, channel number is one byte. </summary>
+///
+/// <param name="args"> Argument schema. </param>
+/// <param name="data"> Binary arguments. </param>
+/// <param name="size"> Size of binary arguments. </param>
+/// <param name="text"> Buffer for text. </param>
+/// <param name="max_size"> Size of text buffer. </param>
+///
+/// <returns> 1 on success, 0 if arguments don't match the schema. </returns>
+//---------------------------------------------------------------------
+static int ArgsToText(command_args args, const uint8_t* data, int size, char* text, int max_size)
+{
+    int len = 0;
+    text[0] = '\0';
+
+    switch (args) {
+    case ARGS_NONE:
+        return size == 0;
+    case ARGS_OPT_UINT:
+        if (size == 0)
+            return 1;
+        // fall through
+    case ARGS_UINT:
+        if (size != 4)
+            return 0;
+        len = snprintf(text, max_size, "%lu", (unsigned long)(data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24));
+        break;
+    case ARGS_CHANNEL_TIMES:
+        if (size < 1 || (size - 1) % 4 != 0)
+            return 0;
+        len = snprintf(text, max_size, "%u", data[0]);
+        for (int i = 1; i < size && len < max_size; i += 4)
+            len += snprintf(&text[len], max_size - len, ",%lu", (unsigned long)(data[i] | data[i + 1] << 8 | data[i + 2] << 16 | (uint32_t)data[i + 3] << 24));
+        break;
+    case ARGS_OPT_UINTS:
+        if (size == 0)
+            return 1;
+        // fall through
+    case ARGS_UINTS:
+        if (size < 4 || size % 4 != 0)
+            return 0;
+        for (int i = 0; i < size && len < max_size; i += 4)
+            len += snprintf(&text[len], max_size - len, i == 0 ? "%lu" : ",%lu", (unsigned long)(data[i] | data[i + 1] << 8 | data[i + 2] << 16 | (uint32_t)data[i + 3] << 24));
+        break;
+    }
+
+    return len < max_size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Execute a command received in a binary frame.
+/// Response (command's echo) is sent back as a binary frame with the same
+/// sequence number and opcode, and a status. </summary>
+///
+/// <param name="ctx"> Parser context of the link the frame was received on. </param>
+/// <param name="packet"> Decoded packet (sequence number, opcode, binary arguments). </param>
+/// <param name="size"> Size of packet. </param>
+//---------------------------------------------------------------------
+void ParseFrame(parse_context* ctx, const uint8_t* packet, int size)
+{
+    if (size < FRAME_HEADER_SIZE)
+        return;
+
+    ParseFlush(ctx); // don't mix pending text responses into the frame
+
+    ctx->in_frame        = 1;
+    ctx->frame_responded = 0;
+    ctx->seq             = packet[0];
+    ctx->opcode          = packet[1];
+    ctx->status          = FRAME_STATUS_OK;
+    ctx->rx_frames++;
+
+    if (ctx->last_seq >= 0 && ctx->seq == ctx->last_seq) {
+        // Host repeated the frame (e.g. it didn't get the response), don't execute it twice
+        ctx->status = FRAME_STATUS_DUPLICATE;
+    } else {
+        if (ctx->last_seq >= 0 && ctx->seq != (uint8_t)(ctx->last_seq + 1))
+            ctx->seq_gaps++;
+        ctx->last_seq = ctx->seq;
+
+        const command_entry* cmd = FindCommandByOpcode(ctx->opcode);
+        char                 args[256];
+        if (cmd == NULL || !Allowed(ctx, cmd)) {
+            ctx->status = FRAME_STATUS_UNKNOWN;
+        } else if (!ArgsToText(cmd->args, &packet[FRAME_HEADER_SIZE], size - FRAME_HEADER_SIZE, args, sizeof(args))) {
+            ctx->status = FRAME_STATUS_BAD_ARGS;
+        } else {
+            ctx->next = args;
+            if (Execute(ctx, cmd, NULL) != CMD_OK)
+                ctx->status = FRAME_STATUS_BAD_ARGS;
+        }
+    }
+
+    // Every frame gets a response, even if the command has nothing to say
+    if (ctx->out_len > 0 || !ctx->frame_responded)
+        ParseFlush(ctx);
+
+    ctx->in_frame = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write collected responses to the link (nothing is written while
+/// parsing a broadcast message). </summary>
+///
+/// <param name="ctx"> Parser context. </param>
+//---------------------------------------------------------------------
+void ParseFlush(parse_context* ctx)
+{
+    if (ctx->broadcast)
+        return; // held acknowledgements of earlier addressed messages wait for the next one
+
+    if (ctx->in_frame) {
+        uint8_t packet[FRAME_RESPONSE_HEADER_SIZE + PARSE_OUTPUT_SIZE];
+        packet[0] = ctx->seq;
+        packet[1] = ctx->opcode;
+        packet[2] = ctx->status;
+        memcpy(&packet[FRAME_RESPONSE_HEADER_SIZE], ctx->out, ctx->out_len);
+        ctx->WriteFrame(packet, FRAME_RESPONSE_HEADER_SIZE + ctx->out_len);
+        ctx->flushes++;
+        ctx->frame_responded = 1;
+        ctx->out_len         = 0;
+        ctx->out_lines       = 0;
+    } else if (ctx->out_len > 0) {
+        ctx->Write(ctx->out, ctx->out_len);
+        ctx->flushes++;
+        ctx->out_len   = 0;
+        ctx->out_lines = 0;
     }
 }
\ No newline at end of file
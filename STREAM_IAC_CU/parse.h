@@ -2,6 +2,61 @@
 
 #include <stdint.h>
 
+// Size of response output of one link. Together with response header it must fit into one binary frame (FRAME_MAX_PACKET_SIZE).
+// On UART output is written out earlier if it wouldn't fit into transmit buffer with address bytes of its lines (see Fits).
+#define PARSE_OUTPUT_SIZE 500
+
 typedef int (*write_func)(const uint8_t*, int);
 
-void Parse(char*, write_func);
\ No newline at end of file
+// Communication links (mask values, so commands can list the links they are allowed on)
+typedef enum {
+    LINK_UART  = 0x01,
+    LINK_USB   = 0x02, // CDC virtual COM port
+    LINK_BULK  = 0x04, // vendor bulk interface of the composite USB device
+    LINK_BENCH = 0x08, // benchmark kernels (bench.c), its requests never reach the sequencer
+    LINK_HOST  = LINK_USB | LINK_BULK, // links to the host PC
+    LINK_ALL   = LINK_UART | LINK_USB | LINK_BULK | LINK_BENCH,
+} link_id;
+
+// Parser state of one communication link. Each link (UART, USB, bulk) has its own context and its own
+// staging copy of channel settings (SEQ_Staging), so a message arriving on one link can be parsed while
+// the other one is mid-command. Messages are tokenized whole, as assembled by the link (not streamed).
+typedef struct {
+    char*      next;       // tokenizer position in the text being parsed
+    write_func Write;      // write function of the link (UART, USB)
+    write_func WriteFrame; // binary frame write function of the link (packet is framed by the link)
+    link_id    link;       // link this context belongs to
+
+    // Binary frame being executed (responses are sent back as binary frames)
+    char    in_frame, frame_responded;
+    uint8_t seq, opcode, status;
+    int     last_seq; // sequence number of previous frame, -1 if none
+
+    const char* at; // time of the command being executed, part of its token after '@' (STRT@<t>), NULL if none
+
+    // Channel settings of the link (staging copy)
+    char adding_channels;  // CHLS after the first one adds channels, start or stop ends adding (next CHLS clears settings)
+    char settings_changed; // staging copy changed since it was published, STRT publishes it
+
+    // Link statistics
+    uint32_t rx_frames, rx_errors, seq_gaps;
+
+    uint8_t out[PARSE_OUTPUT_SIZE]; // responses collected while parsing, written to link in one go
+    int     out_len;
+    int     out_lines; // lines in output (UART prefixes each of them with the address byte)
+    int     flushes;   // times output was written out (ParseFlush), tells whether output was written during a command
+    char    hold; // tagged commands are pipelined, hold acknowledgements in output until untagged command
+
+    // Message being parsed (set by UART link)
+    char     broadcast; // sent to all units on the bus: no responses, except to queries answered in a slot (slot.h)
+    uint32_t rx_end;    // cycle counter at its terminator, slots are counted from it
+} parse_context;
+
+void Parse(parse_context* ctx, char* string);
+void ParseFrame(parse_context* ctx, const uint8_t* packet, int size);
+void ParseFlush(parse_context* ctx);
+int  ParseFast(parse_context* ctx, const uint8_t* data, int size);
+void ParseExecuted(parse_context* ctx, const uint8_t* data, int size);
+int  ParseSlotCount(const char* message);
+
+int StrToInts(char* str, int* ints, int maxArrSize);
\ No newline at end of file
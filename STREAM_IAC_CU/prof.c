@@ -0,0 +1,88 @@
+/// @file prof.c
+/// <summary>
+/// Lightweight profiler of interrupt handlers, parser and main loop.
+/// </summary>
+///
+/// <description>
+/// Regions are marked with PROF_Start/PROF_End (inline, see prof.h), which stamp the DWT
+/// cycle counter (enabled by BENCH_Init) and accumulate count, total and max cycles per region.
+/// Disabled profiler costs one counter read and one flag test per region.
+/// Statistics are read out with the PROF command, total is converted to microseconds
+/// so the host can relate it to the time profiler has been enabled.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "prof.h"
+#include <string.h>
+
+const char* const PROF_RegionName[PROF_NUM_OF_REGIONS] = {
+    [PROF_TIM]   = "TIM",
+    [PROF_UART]  = "UART",
+    [PROF_EXTI]  = "EXTI",
+    [PROF_USB]   = "USB",
+    [PROF_PARSE] = "PARSE",
+    [PROF_LOOP]  = "LOOP",
+    [PROF_SLEEP] = "SLEEP",
+};
+
+volatile char       PROF_Enabled = 0;
+volatile prof_stats PROF_Stats[PROF_NUM_OF_REGIONS];
+
+static uint32_t enabled_tick;
+
+//---------------------------------------------------------------------
+/// <summary> Enable (statistics are cleared) or disable profiler. </summary>
+///
+/// <param name="enable"> 1 to enable, 0 to disable. </param>
+//---------------------------------------------------------------------
+void PROF_Enable(int enable)
+{
+    PROF_Enabled = 0;
+    if (enable) {
+        memset((void*)PROF_Stats, 0, sizeof(PROF_Stats));
+        enabled_tick = HAL_GetTick();
+        PROF_Enabled = 1;
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Time since profiler was enabled. </summary>
+///
+/// <returns> Time [ms], 0 if profiler is disabled. </returns>
+//---------------------------------------------------------------------
+uint32_t PROF_EnabledMs()
+{
+    return PROF_Enabled ? HAL_GetTick() - enabled_tick : 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read statistics of a region. Region can be updated by an interrupt
+/// while it is being read, in that case it is read again. </summary>
+///
+/// <param name="region"> Region. </param>
+/// <param name="count"> Number of runs. </param>
+/// <param name="total_us"> Total time [us]. </param>
+/// <param name="max"> Longest run [cycles]. </param>
+//---------------------------------------------------------------------
+void PROF_Read(prof_region region, uint32_t* count, uint32_t* total_us, uint32_t* max)
+{
+    volatile prof_stats* stats = &PROF_Stats[region];
+    uint64_t             total;
+
+    do {
+        *count = stats->count;
+        total  = stats->total;
+        *max   = stats->max;
+    } while (*count != stats->count);
+
+    *total_us = (uint32_t)(total / (SystemCoreClock / 1000000));
+}
@@ -0,0 +1,76 @@
+/// @file prof.h
+/// <summary>
+/// Lightweight profiler of interrupt handlers, parser and main loop (DWT cycle counter).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include "stm32f7xx_hal.h"
+#include <stdint.h>
+
+// Profiled regions. Each region is entered from one execution context only (one interrupt or main loop),
+// so its statistics are updated without locking. Time of a region includes interrupts that preempted it.
+typedef enum {
+    PROF_TIM,   // sequencer timer interrupt (TIM2)
+    PROF_UART,  // RS-485 UART interrupt
+    PROF_EXTI,  // UART command parsing (EXTI0 software interrupt)
+    PROF_USB,   // USB interrupt (OTG_FS)
+    PROF_PARSE, // USB and bulk command parsing (main loop)
+    PROF_LOOP,  // one pass of main loop (handling of events)
+    PROF_SLEEP, // main loop asleep waiting for events (EVT_Wait)
+    PROF_NUM_OF_REGIONS
+} prof_region;
+
+typedef struct {
+    uint32_t count; // number of times region was run
+    uint32_t max;   // longest run [cycles]
+    uint64_t total; // sum of all runs [cycles]
+} prof_stats;
+
+extern const char* const   PROF_RegionName[PROF_NUM_OF_REGIONS];
+extern volatile char       PROF_Enabled;
+extern volatile prof_stats PROF_Stats[PROF_NUM_OF_REGIONS];
+
+void     PROF_Enable(int enable);
+uint32_t PROF_EnabledMs();
+void     PROF_Read(prof_region region, uint32_t* count, uint32_t* total_us, uint32_t* max);
+
+//---------------------------------------------------------------------
+/// <summary> Start of profiled region (cycle counter is read even if
+/// profiler is disabled, that is cheaper than checking). </summary>
+///
+/// <returns> Cycle counter value, pass it to PROF_End. </returns>
+//---------------------------------------------------------------------
+static inline uint32_t PROF_Start()
+{
+    return DWT->CYCCNT;
+}
+
+//---------------------------------------------------------------------
+/// <summary> End of profiled region, add its run to statistics. </summary>
+///
+/// <param name="region"> Region. </param>
+/// <param name="start"> Value returned by PROF_Start at the start of region. </param>
+//---------------------------------------------------------------------
+static inline void PROF_End(prof_region region, uint32_t start)
+{
+    if (!PROF_Enabled)
+        return;
+
+    uint32_t             cycles = DWT->CYCCNT - start;
+    volatile prof_stats* stats  = &PROF_Stats[region];
+    stats->count++;
+    stats->total += cycles;
+    if (cycles > stats->max)
+        stats->max = cycles;
+}
@@ -0,0 +1,757 @@
+/// @file sequencer.c
+/// <summary>
+/// GPIO pulse train sequencer (TIM2 interrupt state machine and its tables).
+/// </summary>
+///
+/// <description>
+/// DMA2 is chosen because only only DMA2 streams are able to perform memory-to-memory transfers
+/// TIM1 is the trigger for DMA2
+/// TIM1 is in slave mode and is triggerd by TIM2. Reason for using TIM2 is that TIM1 is 16bit and TIM2 is 32bit
+/// TIM2 is where we change all the timing settings (ARR, PSC, CCR1), TIM1 stays at initial values.
+/// PSC		- timing resolution
+/// CCR1	- next DMA trigger g_time
+/// ARR		- sequence period
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "clock.h"
+#include "event.h"
+#include "latency.h"
+#include "main.h"
+#include "prof.h"
+#include "sequencer.h"
+#include "spsc.h"
+#include "trace.h"
+
+#define TIMx TIM2
+#define TIMx_IRQHandler TIM2_IRQHandler
+#define __TIMx_CLK_ENABLE __TIM2_CLK_ENABLE
+#define TIMx_IRQn TIM2_IRQn
+
+#define DMAx DMA1
+#define DMAx_CLK_ENABLE __DMA1_CLK_ENABLE
+#define DMA_Stream1 DMA1_Stream1
+#define DMA_Stream2 DMA1_Stream3
+
+const uint32_t GPIOPinArray[] = {
+    GPIO_PIN_0,
+    GPIO_PIN_1,
+    GPIO_PIN_2,
+    GPIO_PIN_3,
+    GPIO_PIN_4,
+    GPIO_PIN_5,
+    GPIO_PIN_6,
+    GPIO_PIN_7,
+    GPIO_PIN_8,
+    GPIO_PIN_9,
+    GPIO_PIN_10,
+    GPIO_PIN_11,
+    GPIO_PIN_12,
+    GPIO_PIN_13,
+    GPIO_PIN_14,
+    GPIO_PIN_15};
+
+// 0 - active high, 1 - active low
+const int IsGPIOReversePin[] = {
+    0, // GPIO_PIN_0
+    0, // GPIO_PIN_1
+    0, // GPIO_PIN_2
+    0, // GPIO_PIN_3
+    0, // GPIO_PIN_4
+    0, // GPIO_PIN_5
+    0, // GPIO_PIN_6
+    0, // GPIO_PIN_7
+    0, // GPIO_PIN_8
+    0, // GPIO_PIN_9
+    0, // GPIO_PIN_10
+    0, // GPIO_PIN_11
+    0, // GPIO_PIN_12
+    0, // GPIO_PIN_13
+    0, // GPIO_PIN_14
+    0  // GPIO_PIN_15
+};
+
+volatile uint32_t g_settings_version = 0;
+
+// Active tables are read by timer interrupt, so they stay in DTCM (no wait states), where DMA
+// (PORT->BSRR and TIMx->CCR1 source, DMA_Start) can reach them too and they are never cached
+uint32_t g_pins[MAX_STATES];
+uint32_t g_time[MAX_STATES];
+uint32_t g_num_of_entries  = 0;
+int      g_timer_period_us = 0;
+
+// Settings of each link (UART, USB, bulk, benchmark). Parser of the link edits its staging copy,
+// SEQ_Publish publishes it and staging goes on in the other copy, so links never write the same
+// settings and nothing has to be locked: published copy is not written until the next publish
+static struct {
+    seq_settings copy[2];
+    int          staging; // index of the staging copy
+} link_settings[4];
+
+static const seq_settings  no_settings;
+static const seq_settings* published = &no_settings; // loaded into the active tables on start
+
+volatile sequencer_stats g_seq_stats;
+
+static int array_idx = 0;
+
+static uint32_t initial_bsrr = 0; // BSRR value that sets all pins to their default state (computed from tables above)
+
+static void Stop();
+static void Start();
+
+// Start/stop requests of each link (producer: parser of the link, consumer: main loop)
+SPSC_QUEUE(uart_requests, seq_request_entry, SEQ_REQUEST_QUEUE_SIZE);
+SPSC_QUEUE(usb_requests, seq_request_entry, SEQ_REQUEST_QUEUE_SIZE);
+SPSC_QUEUE(bulk_requests, seq_request_entry, SEQ_REQUEST_QUEUE_SIZE);
+
+static spsc_queue* const requests[] = {&uart_requests, &usb_requests, &bulk_requests};
+
+// Stop handshake between main loop and timer interrupt: main loop counts stop requests,
+// interrupt copies the count once the stop is done, stop is in progress while they differ
+static volatile uint32_t stop_requests = 0, stops_done = 0;
+static char              stopping_sequence_in_progress = 0; // timer interrupt only
+
+static uint32_t loaded_settings_version = 0; // settings in the active tables
+
+// Timer counts the lead time of a scheduled start, first period starts with the update event at its end
+// (written by main loop while timer interrupt can't run, cleared by timer interrupt)
+static volatile char armed = 0;
+
+static volatile char polling = 0; // main loop is in SEQ_Poll, fast path (SEQ_FastStart, SEQ_FastStop) must not interfere
+
+//---------------------------------------------------------------------
+/// <summary> Timer interrupt handler. Runs from ITCM RAM and only touches
+/// RAM and peripherals, so FLASH erase/program doesn't stall it. </summary>
+//---------------------------------------------------------------------
+RAMFUNC __attribute__((optimize("O2"))) void TIMx_IRQHandler()
+{
+    uint32_t prof_start = PROF_Start();
+    uint32_t sr         = TIMx->SR; // read status once (flag raised after this read keeps the interrupt pending)
+    char     started    = 0;
+
+    if ((sr & TIM_SR_UIF) && armed) {
+        // Lead time is over, preloaded period and first edge are active: CCR1 and ARR are written directly again
+        TIMx->CCMR1 &= ~TIM_CCMR1_OC1PE;
+        TIMx->CR1 &= ~TIM_CR1_ARPE;
+        armed   = 0;
+        started = 1;
+    }
+
+    if (sr & TIM_SR_CC1IF) {
+        PORT->BSRR       = g_pins[array_idx];      // first quickly set GPIO pins
+        uint32_t latency = TIMx->CNT - TIMx->CCR1; // how late the pins were set (wraps if edge is at the end of period)
+        TIMx->CCR1       = g_time[array_idx];      // then CCR register
+        TIMx->SR         = ~TIM_SR_CC1IF;          // then clear IRQ flag
+        array_idx++;
+
+        if (LAT_EdgePending) // first edge after start
+            LAT_Edge();
+
+        if (latency > g_seq_stats.max_latency && latency <= TIMx->ARR)
+            g_seq_stats.max_latency = latency;
+        if (array_idx < g_num_of_entries && TIMx->CNT >= TIMx->CCR1) { // last entry holds the first edge of next period
+            g_seq_stats.late_edges++;
+            TRACE_Write(TRACE_LATE_EDGE, 0, array_idx);
+        }
+    }
+
+    if (started) {
+        // End of lead time is not the end of a period
+        TIMx->SR  = ~TIM_SR_UIF;
+        array_idx = 0;
+        TRACE_Write(TRACE_START, 1, g_num_of_entries);
+    } else if (sr & TIM_SR_UIF) { // If update interrupt
+        // Clear Update interrupt pending flag (note: no need for SR &= ~TIM...)
+        TIMx->SR  = ~TIM_SR_UIF;
+        array_idx = 0;
+        g_seq_stats.periods++;
+        TRACE_Write(TRACE_UPDATE, 0, g_seq_stats.periods);
+        if (stopping_sequence_in_progress) {
+            // Stopping sequence ended. It is now safe to stop everything.
+            Stop();
+            // Leave one pulse mode
+            TIMx->CR1 &= ~TIM_CR1_OPM;
+            // Stop is done, start waiting for it can go on
+            stopping_sequence_in_progress = 0;
+            stops_done                    = stop_requests;
+            EVT_Post(EVT_START);
+        } else if (stop_requests != stops_done) {
+            // On stop request enter one pulse mode
+            TIMx->CR1 |= TIM_CR1_OPM;
+            // Flag to signal that the final stopping sequence is active (ongoing)
+            stopping_sequence_in_progress = 1;
+        }
+    }
+
+    PROF_End(PROF_TIM, prof_start);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Set GPIO pins to their default state as defined by IsGPIOReversePin array
+/// (with one BSRR write of the value computed by GPIO_Configure, tables are in FLASH). </summary>
+//---------------------------------------------------------------------
+RAMFUNC static void SetInitialGPIOState()
+{
+    PORT->BSRR = initial_bsrr;
+}
+
+//---------------------------------------------------------------------
+/// <summary> GPIO configuration. </summary>
+//---------------------------------------------------------------------
+static void GPIO_Configure()
+{
+    PORT_CLK_ENABLE();
+    GPIO_InitTypeDef GPIO_InitStructure;
+
+    GPIO_InitStructure.Mode  = GPIO_MODE_OUTPUT_PP;
+    GPIO_InitStructure.Pull  = GPIO_NOPULL;
+    GPIO_InitStructure.Speed = GPIO_SPEED_FREQ_LOW;
+    GPIO_InitStructure.Pin   = ALL_PINS;
+
+    HAL_GPIO_Init(PORT, &GPIO_InitStructure);
+
+    initial_bsrr = 0;
+    for (int i = 0; i < NUM_OF_CHANNELS; ++i)
+        initial_bsrr |= IsGPIOReversePin[i] ? GPIOPinArray[i] : GPIOPinArray[i] << 16U;
+
+    SetInitialGPIOState();
+}
+
+//---------------------------------------------------------------------
+/// <summary> DMA (Direct Memory Access) configuration. </summary>
+//---------------------------------------------------------------------
+static void DMA_Configure()
+{
+    DMAx_CLK_ENABLE();
+    DMA_Stream1->NDTR = g_num_of_entries;
+    DMA_Stream1->M0AR = (uint32_t)g_pins;
+    DMA_Stream1->PAR  = (uint32_t)&PORT->BSRR;
+    DMA_Stream1->CR   = DMA_CHANNEL_6 | DMA_MBURST_SINGLE | DMA_PBURST_SINGLE | DMA_PRIORITY_VERY_HIGH | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 |
+                      DMA_MINC_ENABLE | DMA_CIRCULAR | DMA_MEMORY_TO_PERIPH | DMA_SxCR_HTIE | DMA_SxCR_TCIE;
+
+    DMA_Stream2->NDTR = g_num_of_entries;
+    DMA_Stream2->M0AR = (uint32_t)g_time;
+    DMA_Stream2->PAR  = (uint32_t)&TIMx->CCR1;
+    DMA_Stream2->CR   = DMA_CHANNEL_6 | DMA_MBURST_SINGLE | DMA_PBURST_SINGLE | DMA_PRIORITY_HIGH | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 |
+                      DMA_MINC_ENABLE | DMA_CIRCULAR | DMA_MEMORY_TO_PERIPH;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start DMA. </summary>
+//---------------------------------------------------------------------
+static void DMA_Start()
+{
+    // First CLEAR LISR and HISR event flags
+    DMAx->HIFCR = ~0x0; // clear all
+    DMAx->LIFCR = ~0x0; // clear all
+
+    DMA_Stream1->CR |= DMA_SxCR_EN;
+    DMA_Stream2->CR |= DMA_SxCR_EN;
+
+    while (!(DMA_Stream1->CR & DMA_SxCR_EN) || !(DMA_Stream2->CR & DMA_SxCR_EN))
+        ; // wait for CE to be read as 1
+}
+
+//---------------------------------------------------------------------
+/// <summary> Stop DMA. </summary>
+//---------------------------------------------------------------------
+RAMFUNC static void DMA_Stop()
+{
+    DMA_Stream1->CR &= ~DMA_SxCR_EN;
+    DMA_Stream2->CR &= ~DMA_SxCR_EN;
+
+    while (DMA_Stream1->CR & DMA_SxCR_EN || DMA_Stream2->CR & DMA_SxCR_EN)
+        ; // wait for CE to be read as 0
+}
+
+//---------------------------------------------------------------------
+/// <summary> Update DMA Streams </summary>
+///
+/// <param name="n_entries"> Number of entries in the array.
+/// In other words number of GPIO state changes. </param>
+//---------------------------------------------------------------------
+static void DMA_Update(uint32_t n_entries)
+{
+    // Only update when DMA is disabled
+    if (!(DMA_Stream1->CR & DMA_SxCR_EN) && !(DMA_Stream2->CR & DMA_SxCR_EN)) {
+        DMA_Stream1->NDTR = n_entries;
+        DMA_Stream2->NDTR = n_entries;
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Timer configuration. </summary>
+//---------------------------------------------------------------------
+static void TIM_Configure()
+{
+    __TIMx_CLK_ENABLE();
+
+#define TIMx_CLK_SOURCE_APB1             // TIMx(2) is on APB1
+    const uint32_t TIM_COUNT_FREQ = 1e6; // Freq = 1 MHz, T = 1 us.
+
+    // NOTE: Timer clocks can be tricky since they can be different from the bus frequency, so when in doubt check the datasheet.
+#if defined(TIMx_CLK_SOURCE_APB1)
+    uint32_t timer_freq = HAL_RCC_GetPCLK1Freq();
+    if (RCC->CFGR & RCC_CFGR_PPRE1_2) // if MSB is not zero (clk divison by more than 1)
+        timer_freq *= 2;
+#elif defined(TIMx_CLK_SOURCE_APB2)
+    uint32_t timer_freq = HAL_RCC_GetPCLK2Freq();
+    if (RCC->CFGR & RCC_CFGR_PPRE2_2) // if MSB is not zero (clk divison by more than 1)
+        timer_freq *= 2;
+#endif
+
+    TIM2->PSC  = (uint32_t)(timer_freq / TIM_COUNT_FREQ) - 1; // Set prescaler to count with 1/TIM_COUNT_FREQ period
+    TIMx->EGR  = TIM_EGR_UG;                                  // Generate update event (this also loads the prescaler)
+    TIMx->SR   = 0;                                           // Clear update event in the status register that we triggered in the line above
+    TIMx->DIER = TIM_DIER_UIE | TIM_DIER_CC1IE;
+    // Thougt I needed this, turns out I don't, I needed it because I updated ARR somewhere async while timer was running, and this prevented ARR from updating on the spot.
+    // But now with improvements to the code, parser no longer directly configures peripherals.
+    //TIMx->CR1 |= TIM_CR1_ARPE; // Auto reload register is preloaded (ref. page 711)
+
+    // Enable TIM interrupts
+    HAL_NVIC_SetPriority(TIMx_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(TIMx_IRQn);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start timer. </summary>
+//---------------------------------------------------------------------
+static void TIM_Start()
+{
+    TIMx->CR1 |= TIM_CR1_CEN;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Stop timer. </summary>
+//---------------------------------------------------------------------
+RAMFUNC static void TIM_Stop()
+{
+    TIMx->CR1 &= ~TIM_CR1_CEN;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Update Timer ARR (Auto Reload Register). </summary>
+//---------------------------------------------------------------------
+static void TIM_Update_ARR(uint32_t arr)
+{
+    TIMx->ARR = arr;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Request queue of a link. </summary>
+///
+/// <param name="link"> Link. </param>
+///
+/// <returns> Queue, NULL if not a single link. </returns>
+//---------------------------------------------------------------------
+static spsc_queue* LinkQueue(link_id link)
+{
+    for (int i = 0; i < sizeof(requests) / sizeof(*requests); ++i) {
+        if (link == (1 << i))
+            return requests[i];
+    }
+    return NULL;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Queue request of a link for main loop. </summary>
+///
+/// <param name="link"> Link the request came from (its parser is the only producer of the queue). </param>
+/// <param name="request"> Request. </param>
+/// <param name="time"> Start time of SEQ_REQUEST_START_AT [us]. </param>
+///
+/// <returns> 0 on success, -1 if queue of the link is full (request is lost and counted in overflow of the queue). </returns>
+//---------------------------------------------------------------------
+static int Request(link_id link, seq_request request, uint32_t time)
+{
+    spsc_queue*       queue = LinkQueue(link);
+    seq_request_entry r     = {.request = request, .time = time};
+
+    if (queue == NULL || SPSC_Push(queue, &r) != 0)
+        return -1;
+
+    EVT_Post(EVT_START);
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Request to start generating GPIO pulse train (main loop starts it, see SEQ_Poll). </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+///
+/// <returns> 0 on success, -1 if request couldn't be queued. </returns>
+//---------------------------------------------------------------------
+int StartRequest(link_id link)
+{
+    return Request(link, SEQ_REQUEST_START, 0);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Request to start generating GPIO pulse train at a device time (clock.h).
+/// Main loop arms the timer, the first period starts exactly at that time (see Arm). </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+/// <param name="time"> Start time [us]. </param>
+///
+/// <returns> 0 on success, -1 if request couldn't be queued. </returns>
+//---------------------------------------------------------------------
+int StartAtRequest(link_id link, uint32_t time)
+{
+    return Request(link, SEQ_REQUEST_START_AT, time);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start generating GPIO pulse train. </summary>
+//---------------------------------------------------------------------
+static void Start()
+{
+    //DMA_Start();
+    LAT_TimerEnable();
+    TIM_Start();
+    TRACE_Write(TRACE_START, 0, g_num_of_entries);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is GPIO pulse train being generated. </summary>
+///
+/// <returns> 1 if sequencer timer is running, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+int IsRunning()
+{
+    return (TIMx->CR1 & TIM_CR1_CEN) != 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is stop in progress (stop requested, waiting for the end of period). </summary>
+///
+/// <returns> 1 if stopping, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+int IsStopping()
+{
+    return IsRunning() && stop_requests != stops_done;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is a scheduled start waiting for its time (timer runs, counting the lead time). </summary>
+///
+/// <returns> 1 if armed, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+int IsArmed()
+{
+    return armed;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Request to stop generating GPIO pulse train at the end of period
+/// (main loop passes it on to timer interrupt, see SEQ_Poll). </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+///
+/// <returns> 0 on success, -1 if request couldn't be queued. </returns>
+//---------------------------------------------------------------------
+int StopRequest(link_id link)
+{
+    return Request(link, SEQ_REQUEST_STOP, 0);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Can a request of a link be carried out right away, in the receive interrupt of the link,
+/// without overtaking anything: no earlier request of the link is queued and main loop is not in SEQ_Poll
+/// (receive interrupt preempts main loop, so main loop can't get into SEQ_Poll meanwhile). </summary>
+///
+/// <param name="link"> Link. </param>
+///
+/// <returns> 1 if it can, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+static int CanActNow(link_id link)
+{
+    spsc_queue* queue = LinkQueue(link);
+
+    return queue != NULL && !polling && SPSC_Count(queue) == 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start right away (fast path of time critical commands, called from receive
+/// interrupt of a link). Only a start of stopped sequencer with settings that are already
+/// in the active tables is done here, anything else needs main loop (StartRequest). </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+///
+/// <returns> 0 if started, -1 if start has to be requested instead. </returns>
+//---------------------------------------------------------------------
+int SEQ_FastStart(link_id link)
+{
+    if (!CanActNow(link) || IsRunning() || loaded_settings_version != g_settings_version)
+        return -1;
+
+    stop_requests = stops_done;
+    Start();
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Stop right away (fast path of time critical commands, called from receive
+/// interrupt of a link). Stop still takes effect at the end of period. </summary>
+///
+/// <param name="link"> Link the command came from. </param>
+///
+/// <returns> 0 if stop was passed on to timer interrupt (or there was nothing to stop),
+/// -1 if stop has to be requested instead. </returns>
+//---------------------------------------------------------------------
+int SEQ_FastStop(link_id link)
+{
+    if (!CanActNow(link) || armed) // scheduled start is cancelled by main loop
+        return -1;
+
+    if (IsRunning())
+        stop_requests++;
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Restart the running period now: counter goes back to 0, pins to their default
+/// state and the table starts over with the first edge. Units that receive the same command
+/// at the same time (broadcast) get their periods aligned. Can be called from any context. </summary>
+///
+/// <returns> 0 on success, -1 if sequencer is not running (or is stopping). </returns>
+//---------------------------------------------------------------------
+int SEQ_Sync()
+{
+    if (!IsRunning() || IsStopping() || armed || g_num_of_entries == 0)
+        return -1;
+
+    HAL_NVIC_DisableIRQ(TIMx_IRQn);
+    TIMx->CCR1 = g_time[g_num_of_entries - 1]; // first edge
+    TIMx->EGR  = TIM_EGR_UG;                   // counter to 0, update interrupt starts the table over
+    TIMx->SR   = ~TIM_SR_CC1IF;                // drop compare match of the old period, if one is pending
+    SetInitialGPIOState();
+    HAL_NVIC_EnableIRQ(TIMx_IRQn);
+
+    TRACE_Write(TRACE_SYNC, 0, g_seq_stats.periods);
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Stop generating GPIO pulse train (called from timer interrupt). </summary>
+//---------------------------------------------------------------------
+RAMFUNC static void Stop()
+{
+    TIM_Stop();
+    DMA_Stop();
+    LAT_Cancel();
+    TRACE_Write(TRACE_STOP, 0, g_seq_stats.periods);
+
+    SetInitialGPIOState();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Initialize sequencer peripherals (GPIO port, DMA, timer). </summary>
+//---------------------------------------------------------------------
+void SEQ_Init()
+{
+    GPIO_Configure();
+    DMA_Configure();
+    TIM_Configure();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Index of the settings of a link. </summary>
+///
+/// <param name="link"> Link. </param>
+///
+/// <returns> Index into link_settings. </returns>
+//---------------------------------------------------------------------
+static int SettingsIndex(link_id link)
+{
+    switch (link) {
+    case LINK_USB:
+        return 1;
+    case LINK_BULK:
+        return 2;
+    case LINK_BENCH:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Staging settings of a link, written only by the parser of the link
+/// (PRDS, CHLS) and published by it (SEQ_Publish). </summary>
+///
+/// <param name="link"> Link. </param>
+///
+/// <returns> Staging settings. </returns>
+//---------------------------------------------------------------------
+seq_settings* SEQ_Staging(link_id link)
+{
+    int i = SettingsIndex(link);
+    return &link_settings[i].copy[link_settings[i].staging];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Publish staging settings of a link, they are loaded on next start. Called by
+/// parser of the link (STRT), from its context. Settings stay where they are and the link
+/// continues in its other copy, so publish is one pointer write, whatever interrupts it. </summary>
+///
+/// <param name="link"> Link. </param>
+//---------------------------------------------------------------------
+void SEQ_Publish(link_id link)
+{
+    int           i     = SettingsIndex(link);
+    seq_settings* ready = &link_settings[i].copy[link_settings[i].staging];
+
+    __atomic_store_n(&published, ready, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&g_settings_version, 1, __ATOMIC_RELEASE);
+
+    link_settings[i].staging ^= 1;
+    link_settings[i].copy[link_settings[i].staging] = *ready; // editing goes on from the published settings
+}
+
+//---------------------------------------------------------------------
+/// <summary> Load published settings into the active tables (main loop). Times are shifted by
+/// one entry: timer interrupt sets the pins of an entry and loads the time of the next one, last
+/// entry holds the first edge. Link that published them may publish again and then edit them
+/// (its parser preempts main loop), so copy is repeated until settings stay the same for the whole copy. </summary>
+//---------------------------------------------------------------------
+static void LoadSettings()
+{
+    uint32_t version, entries;
+    int      period;
+
+    do {
+        version                 = __atomic_load_n(&g_settings_version, __ATOMIC_ACQUIRE);
+        const seq_settings* set = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+
+        entries = MIN(set->num_of_entries, MAX_STATES);
+        period  = set->timer_period_us;
+        for (int i = 0; i < entries; ++i) {
+            g_pins[i] = set->pins[i];
+            g_time[i] = set->time[(i + 1) % entries];
+        }
+    } while (version != __atomic_load_n(&g_settings_version, __ATOMIC_ACQUIRE));
+    loaded_settings_version = version;
+    g_num_of_entries        = entries;
+    g_timer_period_us       = period;
+
+    DMA_Update(g_num_of_entries);
+
+    TIM_Update_ARR(g_timer_period_us);
+
+    // Update CCR1 register with the last entry in the time array which is the time at which the first GPIO change should happen
+    // NOTE: First entry in the settings can't be 0 (TODO: look into it if there is a way to allow starting with 0)
+    if (g_num_of_entries > 0)
+        TIMx->CCR1 = g_time[g_num_of_entries - 1];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Arm the timer to start at a device time. Timer first counts the lead time
+/// (ARR), period and first edge wait in the preload registers (ARPE, OC1PE) and the
+/// update event at the end of the lead time loads them in hardware, so the first period
+/// starts on the timer tick, no matter when its interrupt runs. Lead time is measured
+/// with interrupts disabled, right before the timer starts counting it, and converted to
+/// timer ticks at the measured rate of the master's clock (CLK_Local). </summary>
+///
+/// <param name="time"> Start time [us]. </param>
+//---------------------------------------------------------------------
+static void Arm(uint32_t time)
+{
+    uint32_t first_edge = g_num_of_entries > 0 ? g_time[g_num_of_entries - 1] : TIMx->CCR1;
+
+    __disable_irq();
+    int32_t lead = CLK_Until(time);
+    if (lead < SEQ_MIN_LEAD_US) {
+        __enable_irq();
+        g_seq_stats.late_starts++;
+        Start();
+        return;
+    }
+
+    TIMx->CR1 |= TIM_CR1_ARPE;
+    TIMx->CCMR1 |= TIM_CCMR1_OC1PE;
+    TIMx->ARR   = CLK_Local(lead) - 1; // update event at the end of lead time
+    TIMx->CCR1  = 0xFFFFFFFF;          // no compare match during lead time
+    TIMx->EGR   = TIM_EGR_UG;          // load them (and counter to 0)
+    TIMx->SR    = 0;                   // not the end of a period (interrupt that is left pending finds no flag)
+    TIMx->ARR   = g_timer_period_us;
+    TIMx->CCR1  = first_edge;
+    armed       = 1;
+    TIM_Start();
+    __enable_irq();
+
+    TRACE_Write(TRACE_ARM, 0, MIN(lead / 1000, 0xFFFF));
+}
+
+//---------------------------------------------------------------------
+/// <summary> Cancel a scheduled start that is still waiting for its time (main loop). </summary>
+//---------------------------------------------------------------------
+static void Disarm()
+{
+    HAL_NVIC_DisableIRQ(TIMx_IRQn);
+    if (armed) {
+        TIM_Stop();
+        TIMx->CCMR1 &= ~TIM_CCMR1_OC1PE;
+        TIMx->CR1 &= ~TIM_CR1_ARPE;
+        TIMx->ARR = g_timer_period_us; // as left by LoadSettings, for the next start
+        if (g_num_of_entries > 0)
+            TIMx->CCR1 = g_time[g_num_of_entries - 1];
+        TIMx->EGR = TIM_EGR_UG; // counter to 0
+        TIMx->SR  = 0;          // lead time may have just ended, first period is not started
+        armed     = 0;
+        SetInitialGPIOState();
+        TRACE_Write(TRACE_STOP, 1, g_seq_stats.periods);
+    }
+    HAL_NVIC_EnableIRQ(TIMx_IRQn);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Carry out queued start and stop requests, each link's in the order they came.
+/// Start waits in the queue while a stop is in progress (end of stop posts EVT_START).
+/// Start while running (or armed) keeps the sequencer as it is, tables the timer interrupt
+/// reads included (new settings wait for the next start), stop of an armed sequencer
+/// cancels the scheduled start. Called from main loop. </summary>
+//---------------------------------------------------------------------
+void SEQ_Poll()
+{
+    polling = 1;
+
+    for (int i = 0; i < sizeof(requests) / sizeof(*requests); ++i) {
+        seq_request_entry* request;
+
+        while ((request = SPSC_Peek(requests[i])) != NULL) {
+            if (request->request != SEQ_REQUEST_STOP) {
+                if (IsStopping())
+                    break;
+
+                if (!IsRunning()) {
+                    stop_requests = stops_done; // drop a stop that came when the timer was stopping on its own
+                    if (loaded_settings_version != g_settings_version)
+                        LoadSettings();
+
+                    if (request->request == SEQ_REQUEST_START_AT)
+                        Arm(request->time);
+                    else
+                        Start();
+                }
+            } else if (armed) {
+                Disarm();
+            } else if (IsRunning()) { // If timer is not running there is nothing to stop
+                stop_requests++;
+            }
+
+            SPSC_Pop(requests[i]);
+        }
+    }
+
+    polling = 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "main.h"
+#include "parse.h"
+#include <stdint.h>
+
+#define SEQ_REQUEST_QUEUE_SIZE 8 // start/stop requests waiting for main loop, per link (power of 2)
+#define SEQ_MIN_LEAD_US 20       // scheduled start closer than this (or past) starts right away and is counted as late
+
+// Sequencer statistics, updated in timer interrupt
+typedef struct {
+    uint32_t periods;     // completed periods (update events)
+    uint32_t late_edges;  // next edge time had already passed when it was loaded into CCR1 (edge slips a whole period)
+    uint32_t max_latency; // max delay between compare match and GPIO write [timer ticks = us]
+    uint32_t late_starts; // scheduled start time had (nearly) passed when main loop got to it
+} sequencer_stats;
+
+// Requests of a link, queued by its parser and carried out by main loop in order (SEQ_Poll)
+typedef enum {
+    SEQ_REQUEST_START,
+    SEQ_REQUEST_STOP,
+    SEQ_REQUEST_START_AT, // start at device time (clock.h)
+} seq_request;
+
+typedef struct {
+    uint8_t  request; // seq_request
+    uint32_t time;    // start time of SEQ_REQUEST_START_AT [us]
+} seq_request_entry;
+
+// Channel settings: period and table of pin changes (BSRR values) with their times, sorted by time
+typedef struct {
+    uint32_t pins[MAX_STATES];
+    uint32_t time[MAX_STATES];
+    uint32_t num_of_entries;
+    int      timer_period_us;
+} seq_settings;
+
+extern const uint32_t GPIOPinArray[];
+extern const int      IsGPIOReversePin[];
+
+extern volatile uint32_t g_settings_version; // changes whenever settings are published (SEQ_Publish)
+
+// Active settings (used by timer interrupt), loaded from the published settings on start
+extern uint32_t g_pins[MAX_STATES];
+extern uint32_t g_time[MAX_STATES]; // shifted by one: entry waits for the next entry's time, last entry holds the first edge
+extern uint32_t g_num_of_entries;
+extern int      g_timer_period_us;
+
+extern volatile sequencer_stats g_seq_stats;
+
+void          SEQ_Init();
+void          SEQ_Poll();
+seq_settings* SEQ_Staging(link_id link);
+void          SEQ_Publish(link_id link);
+
+int StartRequest(link_id link);
+int StartAtRequest(link_id link, uint32_t time);
+int StopRequest(link_id link);
+int SEQ_FastStart(link_id link);
+int SEQ_FastStop(link_id link);
+int SEQ_Sync();
+int IsRunning();
+int IsStopping();
+int IsArmed();
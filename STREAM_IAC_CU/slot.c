@@ -0,0 +1,111 @@
+/// @file slot.c
+/// <summary>
+/// Time slotted responses to RS-485 broadcast queries (TDMA, slot number is UART address).
+/// </summary>
+///
+/// <description>
+/// Broadcast query (message without address byte, see uart.c) reaches all units on the bus
+/// at the same time, and each of them answers in its own slot, so the host collects answers
+/// of the whole bus in one round instead of polling units one by one. Response in slot i is
+/// written i slot times plus SLOT_GUARD_CHARS character times after the terminator of the
+/// query (cycle counter timestamp from UART interrupt), so parser latency doesn't move it.
+/// It is written by TIM5 one pulse interrupt.
+/// Default slot fits SLOT_MAX_RESPONSE characters at UART_BAUD_RATE, SLTS sets another one
+/// (e.g. shorter for enumeration, longer for a slower bus), all units on a bus must use the same.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "slot.h"
+#include "main.h"
+#include <string.h>
+
+uint32_t            SLOT_Time = SLOT_DEFAULT_US; // [us]
+volatile slot_stats SLOT_Stats;
+
+// Response waiting for its slot
+static struct {
+    uint8_t       data[SLOT_MAX_RESPONSE - 2]; // link adds address byte and terminator
+    int           size;
+    write_func    Write;
+    volatile char pending;
+} response;
+
+//---------------------------------------------------------------------
+/// <summary> Configure TIM5 as one pulse timer with 1 us tick (32 bit,
+/// so the last slot of the bus fits at any slot time). </summary>
+//---------------------------------------------------------------------
+void SLOT_Init()
+{
+    __TIM5_CLK_ENABLE();
+
+    // TIM5 is on APB1, same clock as sequencer timer
+    uint32_t timer_freq = HAL_RCC_GetPCLK1Freq();
+    if (RCC->CFGR & RCC_CFGR_PPRE1_2)
+        timer_freq *= 2;
+
+    TIM5->PSC  = timer_freq / 1000000 - 1;
+    TIM5->EGR  = TIM_EGR_UG; // load prescaler
+    TIM5->SR   = 0;
+    TIM5->CR1  = TIM_CR1_OPM;
+    TIM5->DIER = TIM_DIER_UIE;
+
+    // Same priority as UART parser (EXTI0), so responses of both are never written over each other
+    HAL_NVIC_SetPriority(TIM5_IRQn, 3, 0);
+    HAL_NVIC_EnableIRQ(TIM5_IRQn);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write response in a slot after the end of a broadcast query. Only one
+/// response can wait at a time (one query per round). </summary>
+///
+/// <param name="Write"> Write function of the link. </param>
+/// <param name="data"> Response (copied). </param>
+/// <param name="size"> Size of response. </param>
+/// <param name="query_end"> Cycle counter at the terminator of the query. </param>
+/// <param name="index"> Slot number. </param>
+///
+/// <returns> 0 if response was scheduled (or written), -1 if it was dropped. </returns>
+//---------------------------------------------------------------------
+int SLOT_Respond(write_func Write, const char* data, int size, uint32_t query_end, int index)
+{
+    uint32_t start   = SLOT_CHARS_US(SLOT_GUARD_CHARS) + (uint32_t)index * SLOT_Time;
+    uint32_t elapsed = (DWT->CYCCNT - query_end) / (SystemCoreClock / 1000000);
+
+    if (response.pending || elapsed >= start || size > sizeof(response.data)) {
+        SLOT_Stats.missed++;
+        return -1;
+    }
+
+    memcpy(response.data, data, size);
+    response.size    = size;
+    response.Write   = Write;
+    response.pending = 1;
+
+    TIM5->CNT = 0;
+    TIM5->ARR = start - elapsed;
+    TIM5->CR1 |= TIM_CR1_CEN;
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> TIM5 interrupt: start of the slot, write waiting response. </summary>
+//---------------------------------------------------------------------
+void TIM5_IRQHandler()
+{
+    TIM5->SR = ~TIM_SR_UIF;
+
+    if (response.pending) {
+        response.Write(response.data, response.size);
+        response.pending = 0;
+        SLOT_Stats.sent++;
+    }
+}
@@ -0,0 +1,40 @@
+/// @file slot.h
+/// <summary>
+/// Time slotted responses to RS-485 broadcast queries (TDMA, slot number is UART address).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include "parse.h"
+#include "uart.h"
+#include <stdint.h>
+
+#define SLOT_MAX_RESPONSE 40 // longest slotted response incl. address byte and terminator [bytes]
+#define SLOT_GUARD_CHARS 2   // silence before each response, bus turnaround [character times]
+
+// Time of n characters (start + 8 data + stop bit) at UART_BAUD_RATE [us]
+#define SLOT_CHARS_US(n) ((uint32_t)(((uint64_t)(n)*10 * 1000000 + UART_BAUD_RATE - 1) / UART_BAUD_RATE))
+
+#define SLOT_DEFAULT_US SLOT_CHARS_US(SLOT_MAX_RESPONSE + SLOT_GUARD_CHARS)
+
+// Slot statistics
+typedef struct {
+    uint32_t sent;   // responses sent in their slot
+    uint32_t missed; // responses dropped: query was handled after the start of unit's slot, or previous response still waiting
+} slot_stats;
+
+extern uint32_t            SLOT_Time;
+extern volatile slot_stats SLOT_Stats;
+
+void SLOT_Init();
+int  SLOT_Respond(write_func Write, const char* data, int size, uint32_t query_end, int index);
@@ -0,0 +1,135 @@
+/// @file spsc.c
+/// <summary>
+/// Lock-free single producer, single consumer ring queue of fixed size items.
+/// </summary>
+///
+/// <description>
+/// Producer and consumer are two execution contexts (an interrupt and main loop, or two
+/// interrupts), each side of a queue is used from one context only. Neither side masks
+/// interrupts: the producer writes an item into the slot at head and then publishes it by
+/// advancing head, the consumer reads the item at tail and then frees it by advancing tail.
+/// Counters are advanced with release stores and read with acquire loads (DMB on Cortex-M7),
+/// so the item is complete in memory before the other side can see the new counter value,
+/// and a slot is not reused before the consumer is done with it. Items are never overwritten:
+/// a full queue rejects the push and counts it in overflow.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "spsc.h"
+#include <string.h>
+
+//---------------------------------------------------------------------
+/// <summary> Get the free slot at head to write the next item into (producer).
+/// Same slot is returned until it is published, so an item can be filled in parts. </summary>
+///
+/// <param name="q"> Queue. </param>
+///
+/// <returns> Slot, NULL if queue is full. </returns>
+//---------------------------------------------------------------------
+void* SPSC_Claim(spsc_queue* q)
+{
+    uint32_t head = q->head;
+
+    if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) > q->mask)
+        return NULL;
+    return &q->items[(head & q->mask) * q->size];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Publish the item written into the slot from SPSC_Claim (producer). </summary>
+///
+/// <param name="q"> Queue. </param>
+//---------------------------------------------------------------------
+void SPSC_Publish(spsc_queue* q)
+{
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Copy an item into the queue (producer). </summary>
+///
+/// <param name="q"> Queue. </param>
+/// <param name="item"> Item (queue item size). </param>
+///
+/// <returns> 0 on success, -1 if queue is full (item is counted in overflow). </returns>
+//---------------------------------------------------------------------
+int SPSC_Push(spsc_queue* q, const void* item)
+{
+    void* slot = SPSC_Claim(q);
+
+    if (slot == NULL) {
+        q->overflow++;
+        return -1;
+    }
+    memcpy(slot, item, q->size);
+    SPSC_Publish(q);
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Get the oldest item, without removing it (consumer). </summary>
+///
+/// <param name="q"> Queue. </param>
+///
+/// <returns> Item, NULL if queue is empty. </returns>
+//---------------------------------------------------------------------
+void* SPSC_Peek(spsc_queue* q)
+{
+    uint32_t tail = q->tail;
+
+    if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &q->items[(tail & q->mask) * q->size];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Remove the oldest item, returned by SPSC_Peek (consumer).
+/// Its slot can be reused by the producer from here on. </summary>
+///
+/// <param name="q"> Queue. </param>
+//---------------------------------------------------------------------
+void SPSC_Pop(spsc_queue* q)
+{
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Copy the oldest item out of the queue and remove it (consumer). </summary>
+///
+/// <param name="q"> Queue. </param>
+/// <param name="item"> Buffer for the item (queue item size). </param>
+///
+/// <returns> 1 if an item was read, 0 if queue is empty. </returns>
+//---------------------------------------------------------------------
+int SPSC_Pull(spsc_queue* q, void* item)
+{
+    void* slot = SPSC_Peek(q);
+
+    if (slot == NULL)
+        return 0;
+    memcpy(item, slot, q->size);
+    SPSC_Pop(q);
+    return 1;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Number of items in the queue (exact on the consumer side,
+/// producer can only add more meanwhile). </summary>
+///
+/// <param name="q"> Queue. </param>
+///
+/// <returns> Number of items. </returns>
+//---------------------------------------------------------------------
+int SPSC_Count(spsc_queue* q)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - q->tail;
+}
@@ -0,0 +1,46 @@
+/// @file spsc.h
+/// <summary>
+/// Lock-free single producer, single consumer ring queue of fixed size items.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <stdint.h>
+
+// Queue of capacity items (power of two). head and tail are free running counters,
+// head is only written by the producer, tail only by the consumer.
+typedef struct {
+    uint8_t*          items;    // capacity * size bytes
+    uint32_t          size;     // item size [bytes]
+    uint32_t          mask;     // capacity - 1
+    volatile uint32_t head;     // items published
+    volatile uint32_t tail;     // items consumed
+    volatile uint32_t overflow; // items the producer couldn't push (queue was full)
+} spsc_queue;
+
+// Define a queue named name, of capacity items of type
+#define SPSC_QUEUE(name, type, capacity)                                                          \
+    _Static_assert(((capacity) & ((capacity)-1)) == 0, #name " capacity is not a power of two"); \
+    static type       name##_items[capacity];                                                     \
+    static spsc_queue name = {.items = (uint8_t*)name##_items, .size = sizeof(type), .mask = (capacity)-1}
+
+// Producer side
+void* SPSC_Claim(spsc_queue* q);
+void  SPSC_Publish(spsc_queue* q);
+int   SPSC_Push(spsc_queue* q, const void* item);
+
+// Consumer side
+void* SPSC_Peek(spsc_queue* q);
+void  SPSC_Pop(spsc_queue* q);
+int   SPSC_Pull(spsc_queue* q, void* item);
+int   SPSC_Count(spsc_queue* q);
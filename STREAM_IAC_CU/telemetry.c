@@ -0,0 +1,190 @@
+/// @file telemetry.c
+/// <summary>
+/// Periodic binary telemetry stream of sequencer state. Instead of polling
+/// each unit with PRDG/STTG/PING, supervisor enables the stream once (TLMS)
+/// and the unit pushes a compact record every N periods or every N ms on the
+/// link the stream was enabled on.
+///
+/// Record is captured by the main loop as soon as it sees the period counter
+/// (incremented on timer update event) or the tick pass the interval. On RS-485 it is delayed into the unit's own slot:
+/// device time (clock.h), which SYNC broadcasts keep the same on all units, is divided into rounds of
+/// TLM_UART_SLOTS slots, slot number is UART address, so units sharing the bus do not talk over each other.
+/// Main loop hands the record over to EXTI0 interrupt, the only writer of UART (see COM_UART_TX_Callback).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "telemetry.h"
+#include "clock.h"
+#include "frame.h"
+#include "main.h"
+#include "sequencer.h"
+#include "slot.h"
+#include "uart.h"
+#include <string.h>
+
+extern uint8_t UART_Address;
+
+static const parse_context* links[TLM_NUM_OF_LINKS];
+
+// Captured record, main loop owns it until it is handed over to EXTI0 interrupt
+typedef enum {
+    TLM_IDLE,   // nothing to send
+    TLM_DUE,    // captured, waiting for the slot (RS-485)
+    TLM_HANDED, // slot has begun, EXTI0 interrupt writes it (TLM_Send)
+} tlm_state;
+
+static struct {
+    parse_context* ctx; // link the stream is sent on, NULL if disabled
+    uint32_t       every_periods, every_ms;
+    uint32_t       last_periods, last_tick;
+
+    volatile tlm_state state;
+    uint8_t            seq;
+    uint8_t            packet[FRAME_RESPONSE_HEADER_SIZE + sizeof(tlm_record)];
+} tlm;
+
+// Time of the record frame on RS-485 (address byte and encoded packet) [us]
+#define TLM_UART_FRAME_US SLOT_CHARS_US(1 + FRAME_ENCODED_SIZE(sizeof(tlm.packet)))
+
+//---------------------------------------------------------------------
+/// <summary> Register parser context of a link, so its statistics are included in the record. </summary>
+///
+/// <param name="ctx"> Parser context of the link. </param>
+//---------------------------------------------------------------------
+void TLM_RegisterLink(const parse_context* ctx)
+{
+    for (int i = 0; i < TLM_NUM_OF_LINKS; ++i) {
+        if (ctx->link == (1 << i))
+            links[i] = ctx;
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Enable or disable telemetry stream. </summary>
+///
+/// <param name="ctx"> Link to send the stream on. </param>
+/// <param name="every_periods"> Send record every this many sequencer periods (0 - not by periods). </param>
+/// <param name="every_ms"> Send record every this many ms (0 - not by time). Both 0 disables the stream. </param>
+//---------------------------------------------------------------------
+void TLM_Configure(parse_context* ctx, uint32_t every_periods, uint32_t every_ms)
+{
+    tlm.ctx           = NULL; // main loop must not send while settings change (command can run in interrupt)
+    tlm.state         = TLM_IDLE;
+    tlm.every_periods = every_periods;
+    tlm.every_ms      = every_ms;
+    tlm.last_periods  = g_seq_stats.periods;
+    tlm.last_tick     = HAL_GetTick();
+
+    if (every_periods > 0 || every_ms > 0)
+        tlm.ctx = ctx;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Capture telemetry record. </summary>
+//---------------------------------------------------------------------
+static void Capture()
+{
+    tlm_record* rec = (tlm_record*)&tlm.packet[FRAME_RESPONSE_HEADER_SIZE];
+
+    tlm.packet[0] = tlm.seq++;
+    tlm.packet[1] = TLM_RECORD_OPCODE;
+    tlm.packet[2] = FRAME_STATUS_OK;
+
+    rec->version         = TLM_RECORD_VERSION;
+    rec->flags           = (IsRunning() ? TLM_FLAG_RUNNING : 0) | (IsStopping() ? TLM_FLAG_STOPPING : 0);
+    rec->periods         = g_seq_stats.periods;
+    rec->late_edges      = g_seq_stats.late_edges;
+    rec->isr_max_latency = g_seq_stats.max_latency;
+    rec->uart_overruns   = UART_Stats.overruns;
+    rec->uart_errors     = UART_Stats.errors;
+
+    g_seq_stats.max_latency = 0; // max since previous record (a sample taken right now may be lost, that's fine)
+
+    for (int i = 0; i < TLM_NUM_OF_LINKS; ++i) {
+        const parse_context* ctx = links[i];
+
+        rec->link[i].rx_frames = ctx != NULL ? ctx->rx_frames : 0;
+        rec->link[i].rx_errors = ctx != NULL ? ctx->rx_errors : 0;
+        rec->link[i].seq_gaps  = ctx != NULL ? ctx->seq_gaps : 0;
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Is it early enough in the unit's RS-485 slot that the record frame ends within it. </summary>
+///
+/// <param name="now"> Device time [us]. </param>
+///
+/// <returns> 1 if record can be written now, 0 otherwise. </returns>
+//---------------------------------------------------------------------
+static int InSlot(uint32_t now)
+{
+    uint32_t slot_us = TLM_UART_SLOT_MS * 1000;
+    uint32_t offset  = (now - (uint32_t)UART_Address * slot_us) % (TLM_UART_SLOTS * slot_us);
+
+    return offset <= slot_us - TLM_UART_FRAME_US;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Capture and send telemetry record when it is due. On RS-485 the record
+/// is handed over to EXTI0 interrupt once its slot begins. Called from main loop. </summary>
+//---------------------------------------------------------------------
+void TLM_Poll()
+{
+    parse_context* ctx = tlm.ctx;
+    if (ctx == NULL || tlm.state == TLM_HANDED)
+        return;
+
+    uint32_t now     = HAL_GetTick();
+    uint32_t periods = g_seq_stats.periods;
+
+    if (tlm.state == TLM_IDLE) {
+        if (tlm.every_periods > 0 && (periods - tlm.last_periods) >= tlm.every_periods) {
+            tlm.last_periods = periods;
+        } else if (tlm.every_ms > 0 && (now - tlm.last_tick) >= tlm.every_ms) {
+            tlm.last_tick = now;
+        } else {
+            return;
+        }
+
+        Capture();
+        tlm.state = TLM_DUE;
+    }
+
+    if (ctx->link != LINK_UART) {
+        tlm.state = TLM_IDLE;
+        ctx->WriteFrame(tlm.packet, sizeof(tlm.packet));
+    } else if (InSlot(CLK_Now())) {
+        tlm.state   = TLM_HANDED;
+        EXTI->SWIER = EXTI_SWIER_SWIER0; // written by EXTI interrupt
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write record handed over by TLM_Poll to RS-485, if its slot hasn't
+/// passed meanwhile (then it waits for the slot in the next round).
+/// Called at the end of EXTI interrupt (COM_UART_TX_Callback). </summary>
+//---------------------------------------------------------------------
+void TLM_Send()
+{
+    parse_context* ctx = tlm.ctx;
+    if (tlm.state != TLM_HANDED)
+        return;
+
+    if (ctx == NULL) {
+        tlm.state = TLM_IDLE;
+    } else if (InSlot(CLK_Now())) {
+        ctx->WriteFrame(tlm.packet, sizeof(tlm.packet));
+        tlm.state = TLM_IDLE;
+    } else {
+        tlm.state = TLM_DUE;
+    }
+}
@@ -0,0 +1,48 @@
+/// @file telemetry.h
+/// <summary>
+/// Periodic binary telemetry stream of sequencer state.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include "parse.h"
+#include <stdint.h>
+
+#define TLM_RECORD_OPCODE 0xC0 // opcode of telemetry record frames (unsolicited, so not a command opcode)
+#define TLM_RECORD_VERSION 1
+#define TLM_NUM_OF_LINKS 3     // UART, USB, bulk (in link_id bit order)
+#define TLM_UART_SLOT_MS 5     // RS-485 slot of one unit (record frame at 115200 baud takes 3.8 ms), slot number is UART address
+#define TLM_UART_SLOTS 128     // slots in a round of device time, one per address (at most one record per round on RS-485)
+
+#define TLM_FLAG_RUNNING 0x01  // sequencer is running
+#define TLM_FLAG_STOPPING 0x02 // stop was requested, last period is in progress
+
+// Telemetry record, sent in a binary frame [seq, TLM_RECORD_OPCODE, FRAME_STATUS_OK, record].
+// All fields are little endian, counters are free running (host takes differences).
+typedef struct __attribute__((packed)) {
+    uint8_t  version;         // TLM_RECORD_VERSION
+    uint8_t  flags;           // TLM_FLAG_...
+    uint32_t periods;         // completed sequencer periods
+    uint16_t late_edges;      // edges that were set up after their time had already passed
+    uint16_t isr_max_latency; // max timer interrupt latency since previous record [us]
+    uint16_t uart_overruns;
+    uint16_t uart_errors;     // framing, noise and parity errors
+    struct __attribute__((packed)) {
+        uint16_t rx_frames, rx_errors, seq_gaps;
+    } link[TLM_NUM_OF_LINKS];
+} tlm_record;
+
+void TLM_RegisterLink(const parse_context* ctx);
+void TLM_Configure(parse_context* ctx, uint32_t every_periods, uint32_t every_ms);
+void TLM_Poll();
+void TLM_Send();
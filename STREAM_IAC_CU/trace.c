@@ -0,0 +1,112 @@
+/// @file trace.c
+/// <summary>
+/// Event trace ring buffer. Timestamped events (commands, start/stop, late edges,
+/// UART overruns, USB write failures, FLASH operations) are recorded into a fixed
+/// buffer, so the history is there when a unit misbehaves and can be dumped with TRCD.
+/// </summary>
+///
+/// <description>
+/// Writers reserve an entry by atomically incrementing the head (LDREX/STREX, no interrupt
+/// locking), so any interrupt or main loop can write. Sequence number of the entry is written
+/// last; reader only takes entries whose sequence number matches, so an entry being written
+/// (or overwritten) while it is read is skipped instead of returned half written.
+/// Buffer is in .noinit section, so it isn't cleared by startup code and is kept over a warm
+/// reset (RSET, watchdog, reset pin). It is cleared only if its magic number doesn't match (power on).
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "trace.h"
+#include "main.h"
+#include <string.h>
+
+#define TRACE_MAGIC 0x54524331 // "TRC1", change when entry layout changes
+
+static struct {
+    uint32_t             magic;
+    volatile uint32_t    head; // sequence number of last reserved entry
+    volatile trace_entry entry[TRACE_SIZE];
+} trace __attribute__((section(".noinit")));
+
+volatile uint32_t TRACE_Mask = TRACE_DEFAULT_MASK;
+
+//---------------------------------------------------------------------
+/// <summary> Initialize trace buffer (keep it if it survived reset) and record reset. </summary>
+///
+/// <param name="reset_flags"> Reset cause flags. </param>
+//---------------------------------------------------------------------
+void TRACE_Init(uint8_t reset_flags)
+{
+    if (trace.magic != TRACE_MAGIC) {
+        memset((void*)&trace, 0, sizeof(trace));
+        trace.magic = TRACE_MAGIC;
+    }
+
+    TRACE_Write(TRACE_RESET, reset_flags, 0);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Record event (if enabled in TRACE_Mask). Can be called from any interrupt,
+/// runs from ITCM RAM (tick is read directly, HAL_GetTick is in FLASH). </summary>
+///
+/// <param name="event"> Event. </param>
+/// <param name="arg8"> Event argument (see trace_event). </param>
+/// <param name="arg16"> Event argument (see trace_event). </param>
+//---------------------------------------------------------------------
+RAMFUNC void TRACE_Write(trace_event event, uint8_t arg8, uint16_t arg16)
+{
+    if (!(TRACE_Mask & (1 << event)))
+        return;
+
+    uint32_t              seq = __atomic_add_fetch(&trace.head, 1, __ATOMIC_RELAXED);
+    volatile trace_entry* e   = &trace.entry[seq & (TRACE_SIZE - 1)];
+
+    e->seq    = 0; // invalid while being written
+    e->tick   = uwTick;
+    e->cycles = DWT->CYCCNT;
+    e->event  = event;
+    e->arg8   = arg8;
+    e->arg16  = arg16;
+    e->seq    = seq;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read entries, oldest first. </summary>
+///
+/// <param name="seq"> Sequence number of first entry to read (older entries that were already
+/// overwritten are skipped), set to sequence number of the next entry to read. </param>
+/// <param name="entries"> Buffer for entries. </param>
+/// <param name="max_entries"> Size of buffer. </param>
+///
+/// <returns> Number of entries read. </returns>
+//---------------------------------------------------------------------
+int TRACE_Read(uint32_t* seq, trace_entry* entries, int max_entries)
+{
+    uint32_t head = trace.head;
+    uint32_t next = *seq;
+    int      n    = 0;
+
+    int32_t behind = (int32_t)(head - next);
+    if (next == 0 || behind >= TRACE_SIZE || behind < -1) // overwritten, or not written yet (buffer was cleared)
+        next = head >= TRACE_SIZE ? head - TRACE_SIZE + 1 : 1; // oldest entry still in buffer
+
+    for (; next <= head && n < max_entries; ++next) {
+        volatile trace_entry* e = &trace.entry[next & (TRACE_SIZE - 1)];
+        if (e->seq != next)
+            continue; // being written or already overwritten
+        memcpy(&entries[n], (const void*)e, sizeof(trace_entry));
+        if (e->seq == next && entries[n].seq == next)
+            n++;
+    }
+
+    *seq = next;
+    return n;
+}
@@ -0,0 +1,61 @@
+/// @file trace.h
+/// <summary>
+/// Event trace ring buffer (kept over warm reset).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <stdint.h>
+
+#define TRACE_SIZE 256 // number of entries, power of two
+
+typedef enum {
+    TRACE_RESET         = 0,  // unit started, arg8: reset flags (RCC CSR bits 31..24)
+    TRACE_COMMAND       = 1,  // command received, arg8: link, arg16: binary opcode
+    TRACE_START         = 2,  // sequencer started, arg8: 1 scheduled start (end of lead time), arg16: number of entries
+    TRACE_STOP          = 3,  // sequencer stopped, arg8: 1 scheduled start cancelled, arg16: low bits of period counter
+    TRACE_UPDATE        = 4,  // timer update event (end of period), arg16: low bits of period counter
+    TRACE_LATE_EDGE     = 5,  // edge time had passed when it was loaded, arg16: index in time table
+    TRACE_UART_OVERRUN  = 6,  // UART overrun, arg8: 0 byte lost, 1 message lost (parser queue full, arg16: size)
+    TRACE_USB_TX_STALL  = 7,  // response not (completely) written, arg8: link, arg16: size
+    TRACE_FLASH         = 8,  // FLASH operation, arg8: trace_flash_op, arg16: sector (byte offset for OTP, error flags for error)
+    TRACE_SYNC          = 9,  // running period restarted by sync command, arg16: low bits of period counter
+    TRACE_ARM           = 10, // sequencer armed for a scheduled start, arg16: lead time [ms]
+    TRACE_NUM_OF_EVENTS = 16, // events in the mask
+} trace_event;
+
+typedef enum {
+    TRACE_FLASH_ERASE   = 0,
+    TRACE_FLASH_PROGRAM = 1,
+    TRACE_FLASH_OTP     = 2,
+    TRACE_FLASH_ERROR   = 3, // background operation failed
+} trace_flash_op;
+
+// Events recorded by default (update events would flood the buffer)
+#define TRACE_DEFAULT_MASK (0xFFFF & ~(1 << TRACE_UPDATE))
+
+// One trace entry (16 bytes, little endian)
+typedef struct __attribute__((packed)) {
+    uint32_t seq;    // sequence number of the entry (1, 2, ...), written last
+    uint32_t tick;   // HAL tick [ms]
+    uint32_t cycles; // DWT cycle counter (position within the ms)
+    uint8_t  event;  // trace_event
+    uint8_t  arg8;
+    uint16_t arg16;
+} trace_entry;
+
+extern volatile uint32_t TRACE_Mask;
+
+void TRACE_Init(uint8_t reset_flags);
+void TRACE_Write(trace_event event, uint8_t arg8, uint16_t arg16);
+int  TRACE_Read(uint32_t* seq, trace_entry* entries, int max_entries);
@@ -14,7 +14,10 @@
 // Company: Sensum d.o.o.
 
 #include "uart.h"
-#include "flash.h"
+#include "frame.h"
+#include "kvstore.h"
+#include "prof.h"
+#include "trace.h"
 #include <string.h>
 
 const uint8_t             CharacterMatch = 0x0A; // Newline
@@ -22,10 +25,22 @@ static UART_HandleTypeDef UartHandle;
 
 uint8_t UART_Address = 0;
 
+volatile uart_stats UART_Stats;
+
+uart_rx_time UART_RxTime;
+
+volatile char UART_Monitor = 0;
+
 static struct {
-    uint8_t data[UART_BUFFER_SIZE];
-    int     i;
-} uart_rx_buffer = {.i = 0};
+    uint8_t  data[UART_BUFFER_SIZE];
+    int      i;
+    char     binary;    // receiving binary frame (started with FRAME_DELIMITER) instead of ASCII text
+    char     started;   // first byte of message (address byte) has been received
+    char     broadcast; // message has broadcast address byte
+    char     listen;    // message is for this unit (own address or broadcast), others are received only to find their end
+    uint8_t  address;   // address byte, 0 if message started without it (it is not for any unit)
+    uint32_t first;     // cycle counter at the first byte
+} uart_rx_buffer = {.i = 0, .binary = 0, .started = 0};
 
 static struct {
     uint8_t data[UART_BUFFER_SIZE];
@@ -33,20 +48,66 @@ static struct {
 } uart_tx_buffer = {.i = 0, .size = 0};
 
 //---------------------------------------------------------------------
-/// <summary> UART interrupt handler. </summary>
+/// <summary> Hand received message over to UART_RX_Complete_Callback (if it is
+/// for this unit, or messages of all units are monitored) and start receiving the next one. </summary>
+///
+/// <param name="now"> Cycle counter at the terminator. </param>
+//---------------------------------------------------------------------
+static void RxComplete(uint32_t now)
+{
+    if (uart_rx_buffer.listen || UART_Monitor) {
+        UART_RxTime.first     = uart_rx_buffer.first;
+        UART_RxTime.last      = now;
+        UART_RxTime.broadcast = uart_rx_buffer.broadcast;
+        UART_RxTime.address   = uart_rx_buffer.address;
+        UART_RX_Complete_Callback(uart_rx_buffer.data, uart_rx_buffer.i);
+    }
+    uart_rx_buffer.i       = 0;
+    uart_rx_buffer.started = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> UART interrupt handler. Every message on the bus is received and only the ones
+/// for this unit (own address or broadcast address byte 0x80 | UART_BROADCAST) are passed on.
+/// Message without address byte is not for any unit. Receiver is not muted between messages
+/// and address match is done here instead of in USART: binary frames can contain any byte,
+/// and in mute mode each byte >= 0x80 would be taken for an address mark. </summary>
 //---------------------------------------------------------------------
 void USARTx_IRQHandler()
 {
-    uint32_t isrflags = USARTx->ISR;
-    uint32_t cr1its   = USARTx->CR1;
+    uint32_t prof_start = PROF_Start();
+    uint32_t isrflags   = USARTx->ISR;
+    uint32_t cr1its     = USARTx->CR1;
 
     if ((isrflags & USART_ISR_RXNE) && (cr1its & USART_CR1_RXNEIE)) {
         uint8_t rx_byte = USARTx->RDR;
-        if (rx_byte == CharacterMatch) {
-            HAL_MultiProcessor_EnterMuteMode(&UartHandle);
-            UART_RX_Complete_Callback(uart_rx_buffer.data, uart_rx_buffer.i);
-            uart_rx_buffer.i = 0;
-        } else if (uart_rx_buffer.i < UART_BUFFER_SIZE - 1 && rx_byte < 0x80) { // -1 to fit terminating zero, rx_byte < 0x80 don't copy the address byte
+        if (!uart_rx_buffer.started) {
+            uart_rx_buffer.first     = prof_start;
+            uart_rx_buffer.started   = 1;
+            uart_rx_buffer.broadcast = 0;
+            uart_rx_buffer.listen    = 0;
+            uart_rx_buffer.address   = 0;
+        }
+        if (uart_rx_buffer.i == 0 && rx_byte >= 0x80) {
+            // Address byte, don't copy it
+            uart_rx_buffer.broadcast = (rx_byte & 0x7F) == UART_BROADCAST;
+            uart_rx_buffer.listen    = uart_rx_buffer.broadcast || (rx_byte & 0x7F) == UART_Address;
+            uart_rx_buffer.address   = rx_byte;
+        } else if (uart_rx_buffer.binary) {
+            // Binary frame can contain any byte except delimiter, it ends with the second delimiter
+            if (rx_byte == FRAME_DELIMITER && uart_rx_buffer.i > 1) {
+                uart_rx_buffer.data[uart_rx_buffer.i++] = rx_byte;
+                RxComplete(prof_start);
+                uart_rx_buffer.binary = 0;
+            } else if (rx_byte != FRAME_DELIMITER && uart_rx_buffer.i < UART_BUFFER_SIZE - 2) { // -2 to fit closing delimiter and terminating zero
+                uart_rx_buffer.data[uart_rx_buffer.i++] = rx_byte;
+            }
+        } else if (rx_byte == CharacterMatch) {
+            RxComplete(prof_start);
+        } else if (rx_byte == FRAME_DELIMITER && uart_rx_buffer.i == 0) {
+            uart_rx_buffer.binary                   = 1;
+            uart_rx_buffer.data[uart_rx_buffer.i++] = rx_byte;
+        } else if (uart_rx_buffer.i < UART_BUFFER_SIZE - 1 && rx_byte < 0x80) { // -1 to fit terminating zero, rx_byte < 0x80 only ASCII text
             uart_rx_buffer.data[uart_rx_buffer.i++] = rx_byte;
         }
     }
@@ -63,7 +124,17 @@ void USARTx_IRQHandler()
     // if overrun occured
     if ((isrflags & USART_ISR_ORE) && (cr1its & USART_CR1_RXNEIE)) {
         USARTx->ICR = USART_ICR_ORECF; // clear ORE flag
+        UART_Stats.overruns++;
+        TRACE_Write(TRACE_UART_OVERRUN, 0, 0);
     }
+
+    // if received byte was damaged (flags are set together with RXNE, so received byte has already been handled)
+    if (isrflags & (USART_ISR_FE | USART_ISR_NE | USART_ISR_PE)) {
+        USARTx->ICR = USART_ICR_FECF | USART_ICR_NCF | USART_ICR_PECF;
+        UART_Stats.errors++;
+    }
+
+    PROF_End(PROF_UART, prof_start);
 }
 
 //---------------------------------------------------------------------
@@ -117,18 +188,18 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
 //---------------------------------------------------------------------
 /// <summary> Set uC UART address (using multiprocessor mode). </summary>
 ///
-/// <param name="addr"> UART address of uC. </param>
+/// <param name="addr"> UART address of uC (0 - 126, UART_BROADCAST is address of all units). </param>
 //---------------------------------------------------------------------
 void UART_Set_Address(uint8_t addr)
 {
-    if (addr <= 127) {
+    if (addr < UART_UNITS) {
         USARTx->CR1 &= ~USART_CR1_UE;
         MODIFY_REG(USARTx->CR2, USART_CR2_ADD, ((uint32_t)addr << UART_CR2_ADDRESS_LSB_POS));
         USARTx->CR1 |= USART_CR1_UE;
 
         if (addr == ((USARTx->CR2 & USART_CR2_ADD_Msk) >> UART_CR2_ADDRESS_LSB_POS)) {
             UART_Address = addr;
-            FLASH_WriteID(UART_Address);
+            KV_Write(KV_ID, &UART_Address, sizeof(UART_Address));
         }
     }
 }
@@ -140,7 +211,7 @@ void UART_Init()
 {
     UartHandle.Instance = USARTx;
 
-    UartHandle.Init.BaudRate     = 115200;
+    UartHandle.Init.BaudRate     = UART_BAUD_RATE;
     UartHandle.Init.WordLength   = UART_WORDLENGTH_8B;
     UartHandle.Init.StopBits     = UART_STOPBITS_1;
     UartHandle.Init.Parity       = UART_PARITY_NONE;
@@ -148,14 +219,12 @@ void UART_Init()
     UartHandle.Init.Mode         = UART_MODE_TX_RX;
     UartHandle.Init.OverSampling = UART_OVERSAMPLING_16;
 
-    uint8_t id = FLASH_ReadID();
-    if (id < 128)
+    uint8_t id;
+    if (KV_Read(KV_ID, &id, sizeof(id)) == sizeof(id) && id < UART_UNITS)
         UART_Address = id;
 
     HAL_RS485Ex_Init(&UartHandle, UART_DE_POLARITY_HIGH, 16, 16); // 16 - with oversampling 16, that comes out to 1 bit delay between DE(high) -> START, and STOP -> DE(low).
-    HAL_MultiProcessor_Init(&UartHandle, UART_Address, UART_WAKEUPMETHOD_ADDRESSMARK);
-    HAL_MultiProcessor_EnableMuteMode(&UartHandle);
-    HAL_MultiProcessor_EnterMuteMode(&UartHandle);
+    HAL_MultiProcessor_Init(&UartHandle, UART_Address, UART_WAKEUPMETHOD_ADDRESSMARK); // address is matched in software, mute mode stays disabled
 
     HAL_NVIC_SetPriority(USARTx_IRQn, 1, 0);
     HAL_NVIC_EnableIRQ(USARTx_IRQn);
@@ -195,6 +264,71 @@ int UART_Write(const uint8_t* data, int size)
     return uart_tx_buffer.size - uart_tx_buffer.i; // return remaining
 }
 
+//---------------------------------------------------------------------
+/// <summary> Claim space at the end of transmit buffer, so data can be put there
+/// directly. Transmission is paused until UART_WritePublish. </summary>
+///
+/// <param name="size"> Number of bytes. </param>
+///
+/// <returns> Pointer to claimed space, NULL if data doesn't fit (nothing is claimed). </returns>
+//---------------------------------------------------------------------
+uint8_t* UART_WriteClaim(int size)
+{
+    // Disable UART transmission to prevent uart_tx_buffer corruption
+    USARTx->CR1 &= ~USART_CR1_TXEIE;
+
+    if (size <= 0 || uart_tx_buffer.size + size > sizeof(uart_tx_buffer.data)) {
+        if (uart_tx_buffer.size > 0)
+            USARTx->CR1 |= USART_CR1_TXEIE; // continue transmission
+        return NULL;
+    }
+    return &uart_tx_buffer.data[uart_tx_buffer.size];
+}
+
+//---------------------------------------------------------------------
+/// <summary> Send data put into space claimed with UART_WriteClaim. </summary>
+///
+/// <param name="size"> Number of bytes (at most the claimed size). </param>
+//---------------------------------------------------------------------
+void UART_WritePublish(int size)
+{
+    uart_tx_buffer.size += size;
+
+    if (uart_tx_buffer.size > 0)
+        USARTx->CR1 |= USART_CR1_TXEIE; // Enable transmission
+}
+
+//---------------------------------------------------------------------
+/// <summary> Free space in transmit buffer. </summary>
+///
+/// <returns> Number of bytes that can be written without overflow. </returns>
+//---------------------------------------------------------------------
+int UART_TxFree()
+{
+    return sizeof(uart_tx_buffer.data) - uart_tx_buffer.size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Check if transmitter is idle: buffer is empty and the last
+/// character has left the shift register (transmission complete). </summary>
+///
+/// <returns> 1 if idle, i.e. data written now goes out right away. </returns>
+//---------------------------------------------------------------------
+int UART_TxIdle()
+{
+    return uart_tx_buffer.size == 0 && (USARTx->ISR & USART_ISR_TC);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Check if a message is being received (bus is busy). </summary>
+///
+/// <returns> 1 if first byte of a message was received and its end wasn't yet. </returns>
+//---------------------------------------------------------------------
+int UART_Receiving()
+{
+    return uart_rx_buffer.started;
+}
+
 //---------------------------------------------------------------------
 /// <summary> Weak callback function that UART driver calls after
 /// receving entire data. To be implemented by higher level communication library! </summary>
@@ -3,6 +3,9 @@
 #include "stm32f7xx_hal.h"
 
 #define UART_BUFFER_SIZE 512
+#define UART_BAUD_RATE 115200
+#define UART_BROADCAST 127        // address of all units on the bus (address byte 0xFF)
+#define UART_UNITS UART_BROADCAST // units have addresses 0 - 126
 
 //#define NUCLEO_USART2
 //#define NUCLEO_USART6
@@ -113,8 +116,31 @@
 
 #endif
 
-void UART_Init();
-int  UART_Write(const uint8_t* data, int size);
-void UART_Set_Address(uint8_t addr);
+// UART error counters, updated in UART interrupt
+typedef struct {
+    uint32_t overruns; // ORE, byte lost because previous one wasn't read in time
+    uint32_t errors;   // framing, noise and parity errors
+} uart_stats;
+
+// Arrival of the message passed to UART_RX_Complete_Callback (DWT cycle counter)
+typedef struct {
+    uint32_t first;     // first byte (address byte)
+    uint32_t last;      // terminator
+    char     broadcast; // message had broadcast address byte (UART_BROADCAST), it was sent to all units
+    uint8_t  address;   // address byte (0x80 | unit address), 0 if message had none
+} uart_rx_time;
+
+extern volatile uart_stats UART_Stats;
+extern uart_rx_time        UART_RxTime;
+extern volatile char       UART_Monitor; // pass on messages of other units too (gateway.c)
+
+void     UART_Init();
+int      UART_Write(const uint8_t* data, int size);
+uint8_t* UART_WriteClaim(int size);
+void     UART_WritePublish(int size);
+int      UART_TxFree();
+int      UART_TxIdle();
+int      UART_Receiving();
+void     UART_Set_Address(uint8_t addr);
 
 void UART_RX_Complete_Callback(const uint8_t* data, int size);
@@ -0,0 +1,223 @@
+/// @file usbd_bulk_if.c
+/// <summary>
+/// Data layer of the vendor specific bulk interface. Unlike the CDC port,
+/// bulk transfers keep their boundaries: host sends each encoded binary frame
+/// as one transfer (ended by a short or zero length packet), so a transfer is
+/// handed to the parser as soon as it completes, without scanning for line ends.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "usbd_bulk_if.h"
+#include "event.h"
+#include "spsc.h"
+#include "usbd_composite.h"
+#include <string.h>
+
+#define BULK_TX_TIMEOUT_MS 100 // host is not reading the bulk IN endpoint, drop data instead of blocking
+
+// One received transfer
+typedef struct
+{
+    uint8_t  Buffer[BULK_RX_BUFFER_SIZE + 1]; // +1 for terminating zero
+    int      Size;
+    uint32_t Time; // cycle counter at the end of transfer
+} bulk_rx_buffer;
+
+// Rotating receive buffers, same scheme as the CDC receive buffers (see usbd_cdc_if.c),
+// except that every completed transfer is a buffer of its own.
+SPSC_QUEUE(s_RxQueue, bulk_rx_buffer, BULK_RX_BUFFER_COUNT);
+
+static struct
+{
+    volatile char Stalled; // all buffers are waiting to be read, OUT endpoint is not armed (host gets NAK)
+} s_Rx;
+
+// Transmit buffer, so writer does not have to wait for the transfer to finish
+static struct
+{
+    uint8_t       Buffer[BULK_RX_BUFFER_SIZE];
+    int           Length;
+    volatile char Busy;
+} s_Tx;
+
+static USBD_HandleTypeDef* s_pdev;
+
+static void ArmReceive(void)
+{
+    bulk_rx_buffer* fill = SPSC_Claim(&s_RxQueue);
+    USBD_LL_PrepareReceive(s_pdev, BULK_OUT_EP, fill->Buffer, BULK_RX_BUFFER_SIZE);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Bulk interface was configured by the host. Called from USB interrupt. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+//---------------------------------------------------------------------
+void BULK_Init(USBD_HandleTypeDef* pdev)
+{
+    s_pdev         = pdev;
+    s_RxQueue.head = s_RxQueue.tail = 0;
+    s_Rx.Stalled   = 0;
+    s_Tx.Length    = 0;
+    s_Tx.Busy      = 0;
+
+    ArmReceive();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Bulk interface was deconfigured (cable removed, host reset). </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+//---------------------------------------------------------------------
+void BULK_DeInit(USBD_HandleTypeDef* pdev)
+{
+    UNUSED(pdev);
+    s_pdev = NULL;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Transfer on OUT endpoint done. Called from USB interrupt. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+//---------------------------------------------------------------------
+void BULK_DataOut(USBD_HandleTypeDef* pdev)
+{
+    bulk_rx_buffer* fill = SPSC_Claim(&s_RxQueue); // endpoint was armed into it
+    int             size = USBD_LL_GetRxDataSize(pdev, BULK_OUT_EP);
+
+    // Zero length packet terminating a transfer of exactly BULK_RX_BUFFER_SIZE bytes is not a transfer of its own
+    if (size > 0) {
+        fill->Size         = size;
+        fill->Time         = DWT->CYCCNT;
+        fill->Buffer[size] = 0; // parser expects zero terminated data
+        SPSC_Publish(&s_RxQueue);
+        EVT_Post(EVT_BULK_RX);
+
+        if (SPSC_Claim(&s_RxQueue) == NULL) {
+            s_Rx.Stalled = 1;
+            return;
+        }
+    }
+
+    ArmReceive();
+}
+
+//---------------------------------------------------------------------
+/// <summary> Transfer on IN endpoint done. Called from USB interrupt. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+//---------------------------------------------------------------------
+void BULK_DataIn(USBD_HandleTypeDef* pdev)
+{
+    // Transfer of a multiple of packet size is not terminated by a short packet, end it with a zero length one
+    if (s_Tx.Length > 0 && (s_Tx.Length % BULK_MAX_PACKET_SIZE) == 0) {
+        s_Tx.Length = 0;
+        USBD_LL_Transmit(pdev, BULK_IN_EP, NULL, 0);
+        return;
+    }
+
+    s_Tx.Busy = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Get the next received transfer, without copying it. Buffer stays
+/// owned by the caller until BULK_ReleaseReadBuffer is called. </summary>
+///
+/// <param name="pBuffer"> Set to point to the received (zero terminated) data. </param>
+///
+/// <returns> Number of bytes in buffer, 0 if nothing was received. </returns>
+//---------------------------------------------------------------------
+int BULK_AcquireReadBuffer(uint8_t** pBuffer)
+{
+    bulk_rx_buffer* read = SPSC_Peek(&s_RxQueue);
+
+    if (read == NULL)
+        return 0;
+
+    *pBuffer = read->Buffer;
+    return read->Size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Arrival of the transfer acquired with BULK_AcquireReadBuffer. Only the end
+/// of transfer is seen, so first and last are the same for multi packet transfers too. </summary>
+///
+/// <param name="first"> Cycle counter at the first packet. </param>
+/// <param name="last"> Cycle counter at the last packet. </param>
+//---------------------------------------------------------------------
+void BULK_ReadBufferTime(uint32_t* first, uint32_t* last)
+{
+    bulk_rx_buffer* read = SPSC_Peek(&s_RxQueue);
+
+    *first = *last = read->Time;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Return buffer acquired with BULK_AcquireReadBuffer back to the endpoint. </summary>
+//---------------------------------------------------------------------
+void BULK_ReleaseReadBuffer(void)
+{
+    if (SPSC_Peek(&s_RxQueue) == NULL)
+        return;
+
+    SPSC_Pop(&s_RxQueue);
+
+    // If all buffers were full the endpoint was left unarmed, now there is room again
+    if (s_Rx.Stalled) {
+        HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+        s_Rx.Stalled = 0;
+        if (s_pdev != NULL)
+            ArmReceive();
+        HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write data to bulk IN endpoint. Data is copied, so function
+/// only waits for the previous transfer and returns once this one is started. </summary>
+///
+/// <param name="pBuffer"> Data to write. </param>
+/// <param name="size"> Number of bytes to write. </param>
+///
+/// <returns> Number of written bytes, 0 if interface is not configured or host is not reading. </returns>
+//---------------------------------------------------------------------
+int BULK_write(const void* pBuffer, int size)
+{
+    if (size > (int)sizeof(s_Tx.Buffer)) {
+        int offset;
+        int done = 0;
+        for (offset = 0; offset < size; offset += done) {
+            int todo = MIN((int)sizeof(s_Tx.Buffer), size - offset);
+            done     = BULK_write(((const uint8_t*)pBuffer) + offset, todo);
+            if (done != todo)
+                return offset + done;
+        }
+
+        return size;
+    }
+
+    uint32_t start = HAL_GetTick();
+    while (s_Tx.Busy) { // Wait for previous transfer
+        if ((HAL_GetTick() - start) > BULK_TX_TIMEOUT_MS)
+            return 0;
+    }
+
+    if (s_pdev == NULL || s_pdev->dev_state != USBD_STATE_CONFIGURED)
+        return 0;
+
+    memcpy(s_Tx.Buffer, pBuffer, size);
+    s_Tx.Length = size;
+    s_Tx.Busy   = 1;
+    USBD_LL_Transmit(s_pdev, BULK_IN_EP, s_Tx.Buffer, size);
+
+    return size;
+}
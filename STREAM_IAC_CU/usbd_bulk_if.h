@@ -0,0 +1,31 @@
+/// @file usbd_bulk_if.h
+/// <summary>
+/// Data layer of the vendor specific bulk interface of the composite USB device.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <usbd_def.h>
+
+#define BULK_RX_BUFFER_COUNT 4   // number of rotating receive buffers (power of 2)
+#define BULK_RX_BUFFER_SIZE 512  // one bulk transfer (one encoded binary frame), multiple of max packet size
+
+void BULK_Init(USBD_HandleTypeDef* pdev);
+void BULK_DeInit(USBD_HandleTypeDef* pdev);
+void BULK_DataOut(USBD_HandleTypeDef* pdev);
+void BULK_DataIn(USBD_HandleTypeDef* pdev);
+
+int  BULK_AcquireReadBuffer(uint8_t** pBuffer);
+void BULK_ReadBufferTime(uint32_t* first, uint32_t* last);
+void BULK_ReleaseReadBuffer(void);
+int  BULK_write(const void* pBuffer, int size);
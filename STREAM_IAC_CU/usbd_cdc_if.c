@@ -27,6 +27,9 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "usbd_cdc_if.h"
+#include "event.h"
+#include "spsc.h"
+#include <string.h>
 
 /** @addtogroup STM32_USB_DEVICE_LIBRARY
   * @{
@@ -95,18 +98,108 @@ USBD_CDC_LineCodingTypeDef linecoding =
   */
 extern USBD_HandleTypeDef USBD_Device;
 
+#ifdef USE_USB_HS
+enum { kMaxOutPacketSize = CDC_DATA_HS_OUT_PACKET_SIZE };
+#else
+enum { kMaxOutPacketSize = CDC_DATA_FS_OUT_PACKET_SIZE };
+#endif
+
+// One receive buffer, holds one or more complete lines or binary frames
+typedef struct
+{
+    uint8_t  Buffer[VCP_RX_BUFFER_SIZE + kMaxOutPacketSize + 1]; // longest line and the packet that ends it, +1 for terminating zero
+    int      Size;
+    uint32_t First, Last; // cycle counter at first and last packet
+} vcp_rx_buffer;
+
+// Rotating receive buffers (producer: USB interrupt, consumer: reader in main loop). The OUT endpoint writes
+// directly into the claimed buffer (at the end of the data already received), and a filled buffer is published
+// and handed to the parser up to the end of its last complete line or frame, the rest is carried over into the
+// next buffer. While all buffers wait to be read nothing can be claimed, the endpoint is then left unarmed until
+// the reader releases one.
+SPSC_QUEUE(s_RxQueue, vcp_rx_buffer, VCP_RX_BUFFER_COUNT);
+
 static struct
 {
-    uint8_t Buffer[CDC_DATA_HS_OUT_PACKET_SIZE];
-    int     Position, Size;
-    char    ReadDone;
+    volatile char     Stalled; // all buffers are waiting to be read, OUT endpoint is not armed (host gets NAK)
+    volatile uint32_t LastRxTick;
+    char              FrameOpen; // inside a binary frame (opening zero delimiter received, closing not yet)
+    int               FrameLen;
+    volatile int      Complete;   // data in fill buffer up to the end of its last complete line or frame
+    char              Discarding; // line (or frame) longer than VCP_RX_BUFFER_SIZE is dropped up to its end
+    uint32_t          Overflows;  // lines dropped
+
+    // Unterminated end of the buffer handed over last, it starts the next one
+    uint8_t  Carry[VCP_RX_BUFFER_SIZE];
+    int      CarryLen;
+    uint32_t CarryTime;
 } s_RxBuffer;
 
 char g_VCPInitialized;
 
+static void ArmReceive(void)
+{
+    vcp_rx_buffer* fill = SPSC_Claim(&s_RxQueue);
+    USBD_CDC_SetRxBuffer(&USBD_Device, &fill->Buffer[fill->Size]);
+    USBD_CDC_ReceivePacket(&USBD_Device);
+}
+
+// Claim the next buffer to fill, empty (NULL and endpoint stalled if all buffers wait to be read)
+static vcp_rx_buffer* ClaimFillBuffer(void)
+{
+    vcp_rx_buffer* fill = SPSC_Claim(&s_RxQueue);
+
+    if (fill == NULL) {
+        s_RxBuffer.Stalled = 1;
+    } else {
+        memcpy(fill->Buffer, s_RxBuffer.Carry, s_RxBuffer.CarryLen);
+        fill->Size          = s_RxBuffer.CarryLen;
+        fill->First         = s_RxBuffer.CarryTime;
+        fill->Last          = s_RxBuffer.CarryTime;
+        s_RxBuffer.CarryLen = 0;
+    }
+    return fill;
+}
+
+// Hand the fill buffer over to the reader up to size (end of its last complete line or frame) and claim the next one.
+// Data after it is carried over into the next buffer, unless it is already too long for a line, then it is dropped
+// up to its end.
+static void CompleteFillBuffer(int size)
+{
+    vcp_rx_buffer* fill = SPSC_Claim(&s_RxQueue);
+
+    s_RxBuffer.Complete = 0;
+    s_RxBuffer.CarryLen = fill->Size - size;
+    if (s_RxBuffer.CarryLen > VCP_RX_BUFFER_SIZE) {
+        s_RxBuffer.CarryLen   = 0;
+        s_RxBuffer.Discarding = 1;
+        s_RxBuffer.Overflows++;
+    }
+    memcpy(s_RxBuffer.Carry, &fill->Buffer[size], s_RxBuffer.CarryLen);
+    s_RxBuffer.CarryTime = fill->Last;
+
+    if (size == 0) { // nothing to hand over, buffer is filled again
+        fill->Size = 0;
+        return;
+    }
+
+    fill->Size         = size;
+    fill->Buffer[size] = 0; // parser expects zero terminated string
+    SPSC_Publish(&s_RxQueue);
+    EVT_Post(EVT_USB_RX);
+
+    ClaimFillBuffer();
+}
+
 static int8_t STREAM_IAC_CU_Init(void)
 {
-    USBD_CDC_SetRxBuffer(&USBD_Device, s_RxBuffer.Buffer);
+    s_RxQueue.head = s_RxQueue.tail = 0;
+    s_RxBuffer.Stalled              = 0;
+    s_RxBuffer.Complete             = 0;
+    s_RxBuffer.Discarding           = 0;
+    s_RxBuffer.CarryLen             = 0;
+
+    USBD_CDC_SetRxBuffer(&USBD_Device, ClaimFillBuffer()->Buffer);
     g_VCPInitialized = 1;
     return (0);
 }
@@ -211,9 +304,56 @@ static int8_t STREAM_IAC_CU_Control(uint8_t cmd, uint8_t* pbuf, uint16_t length)
   */
 static int8_t STREAM_IAC_CU_Receive(uint8_t* Buf, uint32_t* Len)
 {
-    s_RxBuffer.Position = 0;
-    s_RxBuffer.Size     = *Len;
-    s_RxBuffer.ReadDone = 1;
+    vcp_rx_buffer* fill = SPSC_Claim(&s_RxQueue); // endpoint was armed into it
+    uint32_t       now  = DWT->CYCCNT;
+
+    if (fill == NULL)
+        return (0);
+
+    if (fill->Size == 0)
+        fill->First = now;
+    fill->Last = now;
+    int start  = fill->Size;
+    fill->Size += *Len;
+    s_RxBuffer.LastRxTick = HAL_GetTick();
+
+    // Follow lines and binary frames (between two zero delimiters), so buffer is not handed over in the middle of one
+    int drop = 0;
+    for (int i = 0; i < *Len; ++i) {
+        if (Buf[i] == 0) {
+            s_RxBuffer.FrameOpen = !(s_RxBuffer.FrameOpen && s_RxBuffer.FrameLen > 0); // empty frame - delimiter opens the next one
+            s_RxBuffer.FrameLen  = 0;
+        } else {
+            s_RxBuffer.FrameLen++;
+        }
+
+        if (!s_RxBuffer.FrameOpen && (Buf[i] == '\n' || Buf[i] == '\r' || Buf[i] == 0)) {
+            s_RxBuffer.Complete = start + i + 1;
+            if (s_RxBuffer.Discarding) { // end of the line that didn't fit
+                s_RxBuffer.Discarding = 0;
+                drop                  = s_RxBuffer.Complete;
+            }
+        }
+    }
+    if (drop > 0) {
+        memmove(fill->Buffer, &fill->Buffer[drop], fill->Size - drop);
+        fill->Size -= drop;
+        s_RxBuffer.Complete -= drop;
+    } else if (s_RxBuffer.Discarding) {
+        fill->Size = 0;
+    }
+
+    // Hand the buffer over to the reader on end of line or end of binary frame, or when another
+    // packet would not fit anymore (then only its complete lines, the rest goes on in the next buffer)
+    if (fill->Size > 0 && s_RxBuffer.Complete == fill->Size)
+        CompleteFillBuffer(fill->Size);
+    else if (fill->Size > VCP_RX_BUFFER_SIZE)
+        CompleteFillBuffer(s_RxBuffer.Complete);
+
+    // Re-arm right away so the host can keep sending while the previous data is being parsed
+    if (!s_RxBuffer.Stalled)
+        ArmReceive();
+
     return (0);
 }
 
@@ -240,31 +380,75 @@ static int8_t STREAM_IAC_CU_TransmitCplt(uint8_t* Buf, uint32_t* Len, uint8_t ep
 
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
 
-int VCP_read(void* pBuffer, int size)
+//---------------------------------------------------------------------
+/// <summary> Get the next received buffer, without copying it. Buffer stays
+/// owned by the caller until VCP_ReleaseReadBuffer is called. </summary>
+///
+/// <param name="pBuffer"> Set to point to the received (zero terminated) data. </param>
+///
+/// <returns> Number of bytes in buffer, 0 if nothing was received. </returns>
+//---------------------------------------------------------------------
+int VCP_AcquireReadBuffer(uint8_t** pBuffer)
 {
-    if (!s_RxBuffer.ReadDone)
-        return 0;
+    vcp_rx_buffer* read = SPSC_Peek(&s_RxQueue);
 
-    int remaining = s_RxBuffer.Size - s_RxBuffer.Position;
-    int todo      = MIN(remaining, size);
-    if (todo <= 0)
-        return 0;
+    if (read == NULL) {
+        if (s_RxBuffer.Complete == 0 || (HAL_GetTick() - s_RxBuffer.LastRxTick) <= VCP_RX_TIMEOUT_MS)
+            return 0;
+
+        // Complete lines followed by the beginning of the next one have been sitting in the buffer for a while,
+        // so hand them over, the rest waits for its end in the next buffer. Endpoint is currently armed into this
+        // buffer, so move it to the next one. USB interrupt is the producer of the queue, it is masked while reader
+        // takes its place.
+        HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+        if (SPSC_Peek(&s_RxQueue) == NULL && s_RxBuffer.Complete > 0) {
+            CompleteFillBuffer(s_RxBuffer.Complete);
+            if (!s_RxBuffer.Stalled)
+                ArmReceive();
+        }
+        HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
 
-    memcpy(pBuffer, s_RxBuffer.Buffer + s_RxBuffer.Position, todo);
-    s_RxBuffer.Position += todo;
-    if (s_RxBuffer.Position >= s_RxBuffer.Size) {
-        s_RxBuffer.ReadDone = 0;
-        USBD_CDC_ReceivePacket(&USBD_Device);
+        read = SPSC_Peek(&s_RxQueue);
+        if (read == NULL)
+            return 0;
     }
 
-    return todo;
+    *pBuffer = read->Buffer;
+    return read->Size;
 }
 
-#ifdef USE_USB_HS
-enum { kMaxOutPacketSize = CDC_DATA_HS_OUT_PACKET_SIZE };
-#else
-enum { kMaxOutPacketSize = CDC_DATA_FS_OUT_PACKET_SIZE };
-#endif
+//---------------------------------------------------------------------
+/// <summary> Arrival of the buffer acquired with VCP_AcquireReadBuffer. </summary>
+///
+/// <param name="first"> Cycle counter at the first packet. </param>
+/// <param name="last"> Cycle counter at the last packet. </param>
+//---------------------------------------------------------------------
+void VCP_ReadBufferTime(uint32_t* first, uint32_t* last)
+{
+    vcp_rx_buffer* read = SPSC_Peek(&s_RxQueue);
+    *first              = read->First;
+    *last               = read->Last;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Return buffer acquired with VCP_AcquireReadBuffer back to the endpoint. </summary>
+//---------------------------------------------------------------------
+void VCP_ReleaseReadBuffer(void)
+{
+    if (SPSC_Peek(&s_RxQueue) == NULL)
+        return;
+
+    SPSC_Pop(&s_RxQueue);
+
+    // If all buffers were full the endpoint was left unarmed, now there is room again
+    if (s_RxBuffer.Stalled) {
+        HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+        s_RxBuffer.Stalled = 0;
+        ClaimFillBuffer();
+        ArmReceive();
+        HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+    }
+}
 
 int VCP_write(const void* pBuffer, int size)
 {
@@ -38,11 +38,20 @@ extern "C" {
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
 
+#define VCP_RX_BUFFER_COUNT 4   // number of rotating receive buffers (power of 2)
+#define VCP_RX_BUFFER_SIZE 512  // longest line or binary frame, one receive buffer holds it and one more packet
+#define VCP_RX_TIMEOUT_MS 30    // complete lines followed by an unterminated one are handed over after this much silence
+
 extern USBD_CDC_ItfTypeDef USBD_CDC_STREAM_IAC_CU_fops;
 
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 
+int  VCP_AcquireReadBuffer(uint8_t** pBuffer);
+void VCP_ReadBufferTime(uint32_t* first, uint32_t* last);
+void VCP_ReleaseReadBuffer(void);
+int  VCP_write(const void* pBuffer, int size);
+
 #ifdef __cplusplus
 }
 #endif
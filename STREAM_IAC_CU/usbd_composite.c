@@ -0,0 +1,326 @@
+/// @file usbd_composite.c
+/// <summary>
+/// Composite USB device class. CDC part is handled by the ST CDC class
+/// (USBD_CDC), this class only provides the combined configuration descriptor
+/// and routes requests and endpoint events of the vendor specific bulk
+/// interface to usbd_bulk_if.c and everything else to the CDC class.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "usbd_composite.h"
+#include "usbd_bulk_if.h"
+#include <usbd_ctlreq.h>
+
+#ifdef USE_USB_HS
+#define CDC_DATA_MAX_PACKET_SIZE CDC_DATA_HS_MAX_PACKET_SIZE
+#else
+#define CDC_DATA_MAX_PACKET_SIZE CDC_DATA_FS_MAX_PACKET_SIZE
+#endif
+#define CDC_CMD_INTERVAL 0x10
+
+static uint8_t  COMPOSITE_Init(USBD_HandleTypeDef* pdev, uint8_t cfgidx);
+static uint8_t  COMPOSITE_DeInit(USBD_HandleTypeDef* pdev, uint8_t cfgidx);
+static uint8_t  COMPOSITE_Setup(USBD_HandleTypeDef* pdev, USBD_SetupReqTypedef* req);
+static uint8_t  COMPOSITE_EP0_RxReady(USBD_HandleTypeDef* pdev);
+static uint8_t  COMPOSITE_DataIn(USBD_HandleTypeDef* pdev, uint8_t epnum);
+static uint8_t  COMPOSITE_DataOut(USBD_HandleTypeDef* pdev, uint8_t epnum);
+static uint8_t* COMPOSITE_GetCfgDesc(uint16_t* length);
+static uint8_t* COMPOSITE_GetDeviceQualifierDesc(uint16_t* length);
+
+USBD_ClassTypeDef USBD_COMPOSITE = {
+    .Init                          = COMPOSITE_Init,
+    .DeInit                        = COMPOSITE_DeInit,
+    .Setup                         = COMPOSITE_Setup,
+    .EP0_RxReady                   = COMPOSITE_EP0_RxReady,
+    .DataIn                        = COMPOSITE_DataIn,
+    .DataOut                       = COMPOSITE_DataOut,
+    .GetHSConfigDescriptor         = COMPOSITE_GetCfgDesc,
+    .GetFSConfigDescriptor         = COMPOSITE_GetCfgDesc,
+    .GetOtherSpeedConfigDescriptor = COMPOSITE_GetCfgDesc,
+    .GetDeviceQualifierDescriptor  = COMPOSITE_GetDeviceQualifierDesc,
+};
+
+// Configuration descriptor: IAD + CDC ACM (as in usbd_cdc.c) + vendor interface with two bulk endpoints
+#if defined(__ICCARM__) /*!< IAR Compiler */
+#pragma data_alignment = 4
+#endif
+__ALIGN_BEGIN static uint8_t COMPOSITE_CfgDesc[COMPOSITE_CONFIG_DESC_SIZE] __ALIGN_END = {
+    0x09,                              /* bLength */
+    USB_DESC_TYPE_CONFIGURATION,       /* bDescriptorType */
+    COMPOSITE_CONFIG_DESC_SIZE,        /* wTotalLength */
+    0x00,
+    COMPOSITE_NUM_INTERFACES,          /* bNumInterfaces */
+    0x01,                              /* bConfigurationValue */
+    0x00,                              /* iConfiguration */
+    0xC0,                              /* bmAttributes: self powered */
+    0x32,                              /* MaxPower 100 mA */
+
+    /* Interface association (CDC) */
+    0x08,                              /* bLength */
+    0x0B,                              /* bDescriptorType: IAD */
+    COMPOSITE_CDC_CMD_INTERFACE,       /* bFirstInterface */
+    0x02,                              /* bInterfaceCount */
+    0x02,                              /* bFunctionClass: CDC */
+    0x02,                              /* bFunctionSubClass: ACM */
+    0x01,                              /* bFunctionProtocol: AT commands */
+    0x00,                              /* iFunction */
+
+    /* CDC communication interface */
+    0x09,                              /* bLength */
+    USB_DESC_TYPE_INTERFACE,           /* bDescriptorType */
+    COMPOSITE_CDC_CMD_INTERFACE,       /* bInterfaceNumber */
+    0x00,                              /* bAlternateSetting */
+    0x01,                              /* bNumEndpoints */
+    0x02,                              /* bInterfaceClass: CDC */
+    0x02,                              /* bInterfaceSubClass: ACM */
+    0x01,                              /* bInterfaceProtocol: AT commands */
+    0x00,                              /* iInterface */
+
+    /* Header functional descriptor */
+    0x05,                              /* bLength */
+    0x24,                              /* bDescriptorType: CS_INTERFACE */
+    0x00,                              /* bDescriptorSubtype: header */
+    0x10,                              /* bcdCDC 1.10 */
+    0x01,
+
+    /* Call management functional descriptor */
+    0x05,                              /* bFunctionLength */
+    0x24,                              /* bDescriptorType: CS_INTERFACE */
+    0x01,                              /* bDescriptorSubtype: call management */
+    0x00,                              /* bmCapabilities: D0+D1 */
+    COMPOSITE_CDC_DATA_INTERFACE,      /* bDataInterface */
+
+    /* ACM functional descriptor */
+    0x04,                              /* bFunctionLength */
+    0x24,                              /* bDescriptorType: CS_INTERFACE */
+    0x02,                              /* bDescriptorSubtype: abstract control management */
+    0x02,                              /* bmCapabilities */
+
+    /* Union functional descriptor */
+    0x05,                              /* bFunctionLength */
+    0x24,                              /* bDescriptorType: CS_INTERFACE */
+    0x06,                              /* bDescriptorSubtype: union */
+    COMPOSITE_CDC_CMD_INTERFACE,       /* bMasterInterface */
+    COMPOSITE_CDC_DATA_INTERFACE,      /* bSlaveInterface0 */
+
+    /* Command endpoint */
+    0x07,                              /* bLength */
+    USB_DESC_TYPE_ENDPOINT,            /* bDescriptorType */
+    CDC_CMD_EP,                        /* bEndpointAddress */
+    0x03,                              /* bmAttributes: interrupt */
+    LOBYTE(CDC_CMD_PACKET_SIZE),       /* wMaxPacketSize */
+    HIBYTE(CDC_CMD_PACKET_SIZE),
+    CDC_CMD_INTERVAL,                  /* bInterval */
+
+    /* CDC data interface */
+    0x09,                              /* bLength */
+    USB_DESC_TYPE_INTERFACE,           /* bDescriptorType */
+    COMPOSITE_CDC_DATA_INTERFACE,      /* bInterfaceNumber */
+    0x00,                              /* bAlternateSetting */
+    0x02,                              /* bNumEndpoints */
+    0x0A,                              /* bInterfaceClass: CDC data */
+    0x00,                              /* bInterfaceSubClass */
+    0x00,                              /* bInterfaceProtocol */
+    0x00,                              /* iInterface */
+
+    /* Data OUT endpoint */
+    0x07,                              /* bLength */
+    USB_DESC_TYPE_ENDPOINT,            /* bDescriptorType */
+    CDC_OUT_EP,                        /* bEndpointAddress */
+    0x02,                              /* bmAttributes: bulk */
+    LOBYTE(CDC_DATA_MAX_PACKET_SIZE),  /* wMaxPacketSize */
+    HIBYTE(CDC_DATA_MAX_PACKET_SIZE),
+    0x00,                              /* bInterval */
+
+    /* Data IN endpoint */
+    0x07,                              /* bLength */
+    USB_DESC_TYPE_ENDPOINT,            /* bDescriptorType */
+    CDC_IN_EP,                         /* bEndpointAddress */
+    0x02,                              /* bmAttributes: bulk */
+    LOBYTE(CDC_DATA_MAX_PACKET_SIZE),  /* wMaxPacketSize */
+    HIBYTE(CDC_DATA_MAX_PACKET_SIZE),
+    0x00,                              /* bInterval */
+
+    /* Vendor specific bulk interface */
+    0x09,                              /* bLength */
+    USB_DESC_TYPE_INTERFACE,           /* bDescriptorType */
+    COMPOSITE_BULK_INTERFACE,          /* bInterfaceNumber */
+    0x00,                              /* bAlternateSetting */
+    0x02,                              /* bNumEndpoints */
+    0xFF,                              /* bInterfaceClass: vendor specific */
+    0x00,                              /* bInterfaceSubClass */
+    0x00,                              /* bInterfaceProtocol */
+    0x00,                              /* iInterface */
+
+    /* Bulk OUT endpoint */
+    0x07,                              /* bLength */
+    USB_DESC_TYPE_ENDPOINT,            /* bDescriptorType */
+    BULK_OUT_EP,                       /* bEndpointAddress */
+    0x02,                              /* bmAttributes: bulk */
+    LOBYTE(BULK_MAX_PACKET_SIZE),      /* wMaxPacketSize */
+    HIBYTE(BULK_MAX_PACKET_SIZE),
+    0x00,                              /* bInterval */
+
+    /* Bulk IN endpoint */
+    0x07,                              /* bLength */
+    USB_DESC_TYPE_ENDPOINT,            /* bDescriptorType */
+    BULK_IN_EP,                        /* bEndpointAddress */
+    0x02,                              /* bmAttributes: bulk */
+    LOBYTE(BULK_MAX_PACKET_SIZE),      /* wMaxPacketSize */
+    HIBYTE(BULK_MAX_PACKET_SIZE),
+    0x00,                              /* bInterval */
+};
+
+//---------------------------------------------------------------------
+/// <summary> Initialize both functions when host selects the configuration. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+/// <param name="cfgidx"> Configuration index. </param>
+///
+/// <returns> USBD_OK or USBD_FAIL. </returns>
+//---------------------------------------------------------------------
+static uint8_t COMPOSITE_Init(USBD_HandleTypeDef* pdev, uint8_t cfgidx)
+{
+    uint8_t ret = USBD_CDC.Init(pdev, cfgidx);
+
+    USBD_LL_OpenEP(pdev, BULK_OUT_EP, USBD_EP_TYPE_BULK, BULK_MAX_PACKET_SIZE);
+    USBD_LL_OpenEP(pdev, BULK_IN_EP, USBD_EP_TYPE_BULK, BULK_MAX_PACKET_SIZE);
+    BULK_Init(pdev);
+
+    return ret;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Deinitialize both functions. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+/// <param name="cfgidx"> Configuration index. </param>
+///
+/// <returns> USBD_OK or USBD_FAIL. </returns>
+//---------------------------------------------------------------------
+static uint8_t COMPOSITE_DeInit(USBD_HandleTypeDef* pdev, uint8_t cfgidx)
+{
+    BULK_DeInit(pdev);
+    USBD_LL_CloseEP(pdev, BULK_OUT_EP);
+    USBD_LL_CloseEP(pdev, BULK_IN_EP);
+
+    return USBD_CDC.DeInit(pdev, cfgidx);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Handle setup requests. Bulk interface has no class requests,
+/// it only answers the standard interface requests, everything else belongs to CDC. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+/// <param name="req"> Setup request. </param>
+///
+/// <returns> USBD_OK or USBD_FAIL. </returns>
+//---------------------------------------------------------------------
+static uint8_t COMPOSITE_Setup(USBD_HandleTypeDef* pdev, USBD_SetupReqTypedef* req)
+{
+    static uint8_t alt_setting = 0;
+
+    switch (req->bmRequest & USB_REQ_RECIPIENT_MASK) {
+    case USB_REQ_RECIPIENT_INTERFACE:
+        if (LOBYTE(req->wIndex) != COMPOSITE_BULK_INTERFACE)
+            break;
+
+        if ((req->bmRequest & USB_REQ_TYPE_MASK) == USB_REQ_TYPE_STANDARD) {
+            if (req->bRequest == USB_REQ_GET_INTERFACE)
+                USBD_CtlSendData(pdev, &alt_setting, 1);
+            return USBD_OK;
+        }
+
+        USBD_CtlError(pdev, req);
+        return USBD_FAIL;
+
+    case USB_REQ_RECIPIENT_ENDPOINT:
+        if ((LOBYTE(req->wIndex) & 0x7F) == (BULK_OUT_EP & 0x7F)) // both bulk endpoints, halt is cleared by the core
+            return USBD_OK;
+        break;
+    }
+
+    return USBD_CDC.Setup(pdev, req);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Control OUT data stage done (only CDC has control requests with data). </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+///
+/// <returns> USBD_OK. </returns>
+//---------------------------------------------------------------------
+static uint8_t COMPOSITE_EP0_RxReady(USBD_HandleTypeDef* pdev)
+{
+    return USBD_CDC.EP0_RxReady(pdev);
+}
+
+//---------------------------------------------------------------------
+/// <summary> IN transfer done. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+/// <param name="epnum"> Endpoint number. </param>
+///
+/// <returns> USBD_OK. </returns>
+//---------------------------------------------------------------------
+static uint8_t COMPOSITE_DataIn(USBD_HandleTypeDef* pdev, uint8_t epnum)
+{
+    if (epnum == (BULK_IN_EP & 0x7F)) {
+        BULK_DataIn(pdev);
+        return USBD_OK;
+    }
+
+    return USBD_CDC.DataIn(pdev, epnum);
+}
+
+//---------------------------------------------------------------------
+/// <summary> OUT transfer done. </summary>
+///
+/// <param name="pdev"> USB device handle. </param>
+/// <param name="epnum"> Endpoint number. </param>
+///
+/// <returns> USBD_OK. </returns>
+//---------------------------------------------------------------------
+static uint8_t COMPOSITE_DataOut(USBD_HandleTypeDef* pdev, uint8_t epnum)
+{
+    if (epnum == BULK_OUT_EP) {
+        BULK_DataOut(pdev);
+        return USBD_OK;
+    }
+
+    return USBD_CDC.DataOut(pdev, epnum);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Get configuration descriptor (same for all speeds, packet sizes are set at compile time). </summary>
+///
+/// <param name="length"> Set to descriptor length. </param>
+///
+/// <returns> Pointer to descriptor. </returns>
+//---------------------------------------------------------------------
+static uint8_t* COMPOSITE_GetCfgDesc(uint16_t* length)
+{
+    *length = sizeof(COMPOSITE_CfgDesc);
+    return COMPOSITE_CfgDesc;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Get device qualifier descriptor. </summary>
+///
+/// <param name="length"> Set to descriptor length. </param>
+///
+/// <returns> Pointer to descriptor. </returns>
+//---------------------------------------------------------------------
+static uint8_t* COMPOSITE_GetDeviceQualifierDesc(uint16_t* length)
+{
+    return USBD_CDC.GetDeviceQualifierDescriptor(length);
+}
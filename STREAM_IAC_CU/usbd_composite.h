@@ -0,0 +1,40 @@
+/// @file usbd_composite.h
+/// <summary>
+/// Composite USB device class: CDC virtual COM port (legacy text protocol)
+/// and a vendor specific bulk interface (binary frames, table uploads, telemetry).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <usbd_cdc.h>
+#include <usbd_ioreq.h>
+
+// Interfaces (CDC uses interfaces 0 and 1, grouped by an interface association descriptor)
+#define COMPOSITE_CDC_CMD_INTERFACE 0
+#define COMPOSITE_CDC_DATA_INTERFACE 1
+#define COMPOSITE_BULK_INTERFACE 2
+#define COMPOSITE_NUM_INTERFACES 3
+
+// Vendor bulk interface endpoints (CDC uses 0x01, 0x81 and 0x82)
+#define BULK_OUT_EP 0x03
+#define BULK_IN_EP 0x83
+
+#ifdef USE_USB_HS
+#define BULK_MAX_PACKET_SIZE 512
+#else
+#define BULK_MAX_PACKET_SIZE 64
+#endif
+
+#define COMPOSITE_CONFIG_DESC_SIZE 98
+
+extern USBD_ClassTypeDef USBD_COMPOSITE;
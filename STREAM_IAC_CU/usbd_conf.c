@@ -359,9 +359,12 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef* pdev)
     /* Initialize LL Driver */
     HAL_PCD_Init(&hpcd);
 
+    /* FIFO sizes in words, 320 available: RX, EP0, CDC data IN, CDC command, vendor bulk IN */
     HAL_PCDEx_SetRxFiFo(&hpcd, 0x80);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x40);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 1, 0x80);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x20);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 1, 0x40);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 2, 0x10);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 3, 0x40);
 #endif
 
 #ifdef USE_USB_HS
@@ -396,9 +399,12 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef* pdev)
     /* Initialize LL Driver */
     HAL_PCD_Init(&hpcd);
 
-    HAL_PCDEx_SetRxFiFo(&hpcd, 0x200);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x80);
-    HAL_PCDEx_SetTxFiFo(&hpcd, 1, 0x174);
+    /* FIFO sizes in words, 1024 available: RX, EP0, CDC data IN, CDC command, vendor bulk IN */
+    HAL_PCDEx_SetRxFiFo(&hpcd, 0x180);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 0, 0x40);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 1, 0x100);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 2, 0x10);
+    HAL_PCDEx_SetTxFiFo(&hpcd, 3, 0x100);
 #endif
 
     return USBD_OK;
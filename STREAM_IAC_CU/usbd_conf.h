@@ -38,7 +38,7 @@
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
 /* Common Config */
-#define USBD_MAX_NUM_INTERFACES 1
+#define USBD_MAX_NUM_INTERFACES 3 // CDC command + CDC data + vendor bulk (usbd_composite.h)
 #define USBD_MAX_NUM_CONFIGURATION 1
 #define USBD_MAX_STR_DESC_SIZ 0x100
 #define USBD_SUPPORT_USER_STRING 0
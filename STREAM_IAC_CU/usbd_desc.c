@@ -76,15 +76,15 @@ __ALIGN_BEGIN uint8_t USBD_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END = {
     USB_DESC_TYPE_DEVICE, /* bDescriptorType */
     0x00,                 /* bcdUSB */
     0x02,
-    0x00,             /* bDeviceClass */
-    0x00,             /* bDeviceSubClass */
-    0x00,             /* bDeviceProtocol */
+    0xEF,             /* bDeviceClass: miscellaneous (composite with IAD) */
+    0x02,             /* bDeviceSubClass: common class */
+    0x01,             /* bDeviceProtocol: interface association descriptor */
     USB_MAX_EP0_SIZE, /* bMaxPacketSize */
     LOBYTE(USBD_VID), /* idVendor */
     HIBYTE(USBD_VID), /* idVendor */
     LOBYTE(USBD_PID), /* idVendor */
     HIBYTE(USBD_PID), /* idVendor */
-    0x00,             /* bcdDevice rel. 2.00 */
+    0x10,             /* bcdDevice rel. 2.10 (composite, so host does not reuse the cached VCP-only driver binding) */
     0x02,
     USBD_IDX_MFC_STR,          /* Index of manufacturer string */
     USBD_IDX_PRODUCT_STR,      /* Index of product string */
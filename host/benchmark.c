@@ -0,0 +1,77 @@
+/// @file benchmark.c
+/// <summary>
+/// Host benchmark harness of the parser and table compiler. Runs the same kernels
+/// as the BNCH command (bench.c) over a range of sizes and prints one JSON object
+/// per line (kernel, size, iterations, ns of fastest run, items per second).
+/// </summary>
+///
+/// <description>
+/// Usage: benchmark [-i iterations]
+/// Items are lines for PARSE, numbers for STRTOINTS and commands for CHLS and STTG.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "bench.h"
+#include "fake.h"
+#include "frame.h"
+#include "main.h"
+#include "sequencer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const int parse_sizes[]     = {1, 4, 16, 64};
+static const int strtoints_sizes[] = {1, 4, 20, 64};
+static const int table_sizes[]     = {0, 8, 16, 24, 32, 40, 48, 56, MAX_STATES - 2};
+
+//---------------------------------------------------------------------
+/// <summary> Run kernel for each size and print results. </summary>
+//---------------------------------------------------------------------
+static void Sweep(bench_kernel kernel, const int* sizes, int num_of_sizes, int iterations)
+{
+    for (int i = 0; i < num_of_sizes; ++i) {
+        uint32_t ns    = BENCH_Run(kernel, sizes[i], iterations);
+        int      items = kernel == BENCH_PARSE || kernel == BENCH_STRTOINTS ? sizes[i] : 1;
+        double   rate  = ns > 0 ? items * 1e9 / ns : 0;
+
+        printf("{\"kernel\": \"%s\", \"size\": %d, \"iterations\": %d, \"ns\": %u, \"per_second\": %.0f}\n",
+               BENCH_KernelName[kernel], sizes[i], iterations, ns, rate);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 10000;
+    int c;
+
+    while ((c = getopt(argc, argv, "i:")) != -1) {
+        if (c != 'i') {
+            fprintf(stderr, "usage: benchmark [-i iterations]\n");
+            return 2;
+        }
+        iterations = atoi(optarg);
+    }
+
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    FRAME_Init();
+    SEQ_Init();
+    BENCH_Init();
+
+    Sweep(BENCH_PARSE, parse_sizes, sizeof(parse_sizes) / sizeof(*parse_sizes), iterations);
+    Sweep(BENCH_STRTOINTS, strtoints_sizes, sizeof(strtoints_sizes) / sizeof(*strtoints_sizes), iterations);
+    Sweep(BENCH_CHLS, table_sizes, sizeof(table_sizes) / sizeof(*table_sizes), iterations);
+    Sweep(BENCH_STTG, table_sizes, sizeof(table_sizes) / sizeof(*table_sizes), iterations);
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Test control of fake drivers (host build), see fake_*.c
+
+#include <stdint.h>
+
+#define FAKE_UART_TX_SIZE 4096
+
+extern uint8_t fake_uart_tx[FAKE_UART_TX_SIZE]; // bytes written with UART_Write
+extern int     fake_uart_tx_len;
+extern int     fake_uart_receiving; // set while a message is being received (UART_Receiving)
+
+extern uint8_t fake_flash[];      // user FLASH area (sectors 4 and 5)
+extern int     fake_flash_erases; // number of sector erases
+extern int     fake_flash_fail;   // set to make the next FLASH operation fail
+
+extern void (*fake_flash_erase_hook)(); // called in the middle of every sector erase (if set)
+
+void FAKE_UART_Reset();
+void FAKE_FLASH_Reset();
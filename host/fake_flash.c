@@ -0,0 +1,164 @@
+/// @file fake_flash.c
+/// <summary>
+/// Fake FLASH driver for the host build. User area (sectors 4 and 5) and OTP are kept in RAM.
+/// Background operations are done when FLASH_Wait is called (tests decide when they finish).
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "fake.h"
+#include "flash.h"
+#include <string.h>
+
+#define FAKE_FLASH_START ADDR_FLASH_SECTOR_4
+#define FAKE_FLASH_SIZE (ADDR_FLASH_SECTOR_6 - ADDR_FLASH_SECTOR_4)
+
+uint8_t fake_flash[FAKE_FLASH_SIZE];
+int     fake_flash_erases;
+int     fake_flash_fail;
+void (*fake_flash_erase_hook)();
+uint8_t fake_otp[OTP_SECTOR_SIZE];
+
+// Background operation in progress
+static struct {
+    flash_op        op;
+    uint32_t        address;
+    const uint32_t* data;
+    int             done, size;
+    flash_callback  callback;
+    uint32_t        errors;
+} op;
+
+//---------------------------------------------------------------------
+/// <summary> Erase user area and OTP (all bytes 0xFF). </summary>
+//---------------------------------------------------------------------
+void FAKE_FLASH_Reset()
+{
+    memset(fake_flash, 0xFF, sizeof(fake_flash));
+    memset(fake_otp, 0xFF, sizeof(fake_otp));
+    fake_flash_erases = 0;
+    fake_flash_fail   = 0;
+    memset(&op, 0, sizeof(op));
+}
+
+//---------------------------------------------------------------------
+/// <summary> Read words from user area. </summary>
+//---------------------------------------------------------------------
+int FLASH_Read(uint32_t* buffer, uint32_t address, int size)
+{
+    memcpy(buffer, &fake_flash[address - FAKE_FLASH_START], size * sizeof(uint32_t));
+    return size;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start background erase (done by FLASH_Wait). </summary>
+//---------------------------------------------------------------------
+int FLASH_StartErase(uint32_t address, flash_callback callback)
+{
+    if (op.op != FLASH_OP_NONE)
+        return -1;
+
+    op.op       = FLASH_OP_ERASE;
+    op.address  = address;
+    op.done     = 0;
+    op.size     = 0;
+    op.callback = callback;
+    return 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Start background programming (done by FLASH_Wait). </summary>
+//---------------------------------------------------------------------
+int FLASH_StartProgram(uint32_t address, const uint32_t* data, int size, flash_callback callback)
+{
+    if (op.op != FLASH_OP_NONE || size <= 0)
+        return -1;
+
+    op.op       = FLASH_OP_PROGRAM;
+    op.address  = address;
+    op.data     = data;
+    op.done     = 0;
+    op.size     = size;
+    op.callback = callback;
+    return 0;
+}
+
+int FLASH_Busy()
+{
+    return op.op != FLASH_OP_NONE;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Do the operation in progress and call its callback (as the end of operation
+/// interrupt would). Programming can only clear bits (same as FLASH), erase sets whole sector. </summary>
+//---------------------------------------------------------------------
+void FLASH_Wait()
+{
+    flash_callback callback = op.callback;
+    int            result   = 0;
+
+    if (op.op == FLASH_OP_NONE)
+        return;
+
+    if (fake_flash_fail) {
+        fake_flash_fail = 0;
+        op.errors++;
+        result = -1;
+    } else if (op.op == FLASH_OP_ERASE) {
+        if (fake_flash_erase_hook)
+            fake_flash_erase_hook(); // interrupts taken while FLASH is busy
+        if (op.address < ADDR_FLASH_SECTOR_5)
+            memset(fake_flash, 0xFF, ADDR_FLASH_SECTOR_5 - ADDR_FLASH_SECTOR_4);
+        else
+            memset(&fake_flash[ADDR_FLASH_SECTOR_5 - FAKE_FLASH_START], 0xFF, ADDR_FLASH_SECTOR_6 - ADDR_FLASH_SECTOR_5);
+        fake_flash_erases++;
+    } else {
+        uint8_t* dst = &fake_flash[op.address - FAKE_FLASH_START];
+        for (int i = 0; i < op.size * (int)sizeof(uint32_t); ++i)
+            dst[i] &= ((const uint8_t*)op.data)[i];
+        op.done = op.size;
+    }
+
+    op.op = FLASH_OP_NONE;
+    if (callback)
+        callback(result);
+}
+
+void FLASH_Status(flash_status* status)
+{
+    status->op          = op.op;
+    status->address     = op.address;
+    status->done        = op.done;
+    status->size        = op.size;
+    status->errors      = op.errors;
+    status->error_flags = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Last programmed OTP byte is the ID (bytes are never erased). </summary>
+//---------------------------------------------------------------------
+uint8_t OTP_ReadID()
+{
+    int i = 0;
+    while (i < OTP_SECTOR_SIZE && fake_otp[i] != 0xFF)
+        i++;
+    return i > 0 ? fake_otp[i - 1] : 0;
+}
+
+void OTP_WriteID(uint8_t id)
+{
+    for (int i = 0; i < OTP_SECTOR_SIZE; ++i) {
+        if (fake_otp[i] == 0xFF) {
+            fake_otp[i] = id;
+            return;
+        }
+    }
+}
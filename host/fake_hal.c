@@ -0,0 +1,131 @@
+/// @file fake_hal.c
+/// <summary>
+/// Fake HAL for the host build: peripheral registers in RAM, tick and NVIC stubs.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "stm32f7xx_hal.h"
+#include <string.h>
+
+GPIO_TypeDef       fake_GPIOE;
+TIM_TypeDef        fake_TIM2, fake_TIM5, fake_TIM7;
+DMA_TypeDef        fake_DMA1;
+DMA_Stream_TypeDef fake_DMA1_Stream1, fake_DMA1_Stream3;
+RCC_TypeDef        fake_RCC;
+EXTI_TypeDef       fake_EXTI;
+DWT_Type           fake_DWT;
+CoreDebug_Type     fake_CoreDebug;
+
+uint32_t SystemCoreClock = 168000000;
+
+uint32_t fake_tick          = 0;
+uint32_t fake_pclk1         = 42000000; // 168 MHz / 4
+int      fake_reset_count   = 0;
+uint16_t fake_gpio_init_pin = 0;
+uint64_t fake_nvic_disabled = 0;
+
+void (*fake_nvic_disable_hook)(IRQn_Type IRQn);
+void (*fake_wfi_hook)();
+
+//---------------------------------------------------------------------
+/// <summary> Clear all fake registers and counters (call at the start of each test). </summary>
+//---------------------------------------------------------------------
+void FAKE_HAL_Reset(void)
+{
+    memset((void*)&fake_GPIOE, 0, sizeof(fake_GPIOE));
+    memset((void*)&fake_TIM2, 0, sizeof(fake_TIM2));
+    memset((void*)&fake_TIM5, 0, sizeof(fake_TIM5));
+    memset((void*)&fake_TIM7, 0, sizeof(fake_TIM7));
+    memset((void*)&fake_DMA1, 0, sizeof(fake_DMA1));
+    memset((void*)&fake_DMA1_Stream1, 0, sizeof(fake_DMA1_Stream1));
+    memset((void*)&fake_DMA1_Stream3, 0, sizeof(fake_DMA1_Stream3));
+    memset((void*)&fake_RCC, 0, sizeof(fake_RCC));
+    memset((void*)&fake_EXTI, 0, sizeof(fake_EXTI));
+    memset((void*)&fake_DWT, 0, sizeof(fake_DWT));
+
+    fake_RCC.CFGR      = RCC_CFGR_PPRE1_2; // APB1 divided, timer clock is 2x PCLK1
+    fake_tick          = 0;
+    fake_pclk1         = 42000000;
+    fake_reset_count   = 0;
+    fake_gpio_init_pin = 0;
+    fake_nvic_disabled = 0;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Apply BSRR to ODR (set bits in low half, reset bits in high half, set wins) and clear BSRR. </summary>
+///
+/// <param name="GPIOx"> GPIO port. </param>
+//---------------------------------------------------------------------
+void FAKE_GPIO_Latch(GPIO_TypeDef* GPIOx)
+{
+    uint32_t bsrr = GPIOx->BSRR;
+    GPIOx->ODR    = ((GPIOx->ODR & ~(bsrr >> 16)) | bsrr) & 0xFFFF;
+    GPIOx->BSRR   = 0;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef* GPIOx, GPIO_InitTypeDef* GPIO_Init)
+{
+    UNUSED(GPIOx);
+    fake_gpio_init_pin |= GPIO_Init->Pin;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    if (PinState != GPIO_PIN_RESET)
+        GPIOx->ODR |= GPIO_Pin;
+    else
+        GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+    return fake_pclk1;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+    return fake_pclk1 * 2;
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+    UNUSED(IRQn);
+    UNUSED(PreemptPriority);
+    UNUSED(SubPriority);
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+    fake_nvic_disabled &= ~((uint64_t)1 << IRQn);
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+    fake_nvic_disabled |= (uint64_t)1 << IRQn;
+    if (fake_nvic_disable_hook)
+        fake_nvic_disable_hook(IRQn); // interrupts taken while it is masked
+}
+
+void NVIC_SystemReset(void)
+{
+    fake_reset_count++;
+}
+
+uint32_t HAL_GetTick(void)
+{
+    return fake_tick;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    fake_tick += Delay;
+}
@@ -0,0 +1,88 @@
+/// @file fake_uart.c
+/// <summary>
+/// Fake RS-485 UART for the host build. Written bytes are captured, so tests can check them.
+/// </summary>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "fake.h"
+#include "kvstore.h"
+#include "uart.h"
+#include <string.h>
+
+uint8_t             UART_Address = 0;
+volatile uart_stats UART_Stats;
+volatile char       UART_Monitor;
+
+uint8_t fake_uart_tx[FAKE_UART_TX_SIZE];
+int     fake_uart_tx_len    = 0;
+int     fake_uart_receiving = 0;
+
+void UART_Init()
+{
+}
+
+//---------------------------------------------------------------------
+/// <summary> Capture data (data that doesn't fit is dropped). </summary>
+//---------------------------------------------------------------------
+int UART_Write(const uint8_t* data, int size)
+{
+    int n = MIN(size, FAKE_UART_TX_SIZE - fake_uart_tx_len);
+    memcpy(&fake_uart_tx[fake_uart_tx_len], data, n);
+    fake_uart_tx_len += n;
+    return n;
+}
+
+uint8_t* UART_WriteClaim(int size)
+{
+    if (size <= 0 || fake_uart_tx_len + size > FAKE_UART_TX_SIZE)
+        return NULL;
+    return &fake_uart_tx[fake_uart_tx_len];
+}
+
+void UART_WritePublish(int size)
+{
+    fake_uart_tx_len += size;
+}
+
+int UART_TxFree()
+{
+    return FAKE_UART_TX_SIZE - fake_uart_tx_len;
+}
+
+int UART_TxIdle()
+{
+    return fake_uart_tx_len == 0;
+}
+
+int UART_Receiving()
+{
+    return fake_uart_receiving;
+}
+
+void UART_Set_Address(uint8_t addr)
+{
+    if (addr < UART_UNITS) {
+        UART_Address = addr;
+        KV_Write(KV_ID, &UART_Address, sizeof(UART_Address));
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Forget captured data and reset error counters. </summary>
+//---------------------------------------------------------------------
+void FAKE_UART_Reset()
+{
+    fake_uart_tx_len    = 0;
+    fake_uart_receiving = 0;
+    UART_Monitor        = 0;
+    memset((void*)&UART_Stats, 0, sizeof(UART_Stats));
+}
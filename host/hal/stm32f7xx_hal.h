@@ -0,0 +1,244 @@
+/// @file stm32f7xx_hal.h
+/// <summary>
+/// Fake HAL for the host (Linux) build of the firmware core.
+/// </summary>
+///
+/// <description>
+/// Only what parse.c, frame.c, sequencer.c and telemetry.c use is provided.
+/// Peripherals are plain structs in RAM with the register names of the real ones,
+/// so the firmware code compiles unchanged and tests can set and inspect registers.
+/// Registers don't do anything on their own: status flags are not cleared by
+/// writing 0 (test sets TIM2->SR before calling the handler), counters (TIM2->CNT,
+/// DWT->CYCCNT) don't count.
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define __IO volatile
+#define __weak __attribute__((weak))
+#define UNUSED(x) ((void)(x))
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+typedef enum {
+    HAL_OK      = 0x00,
+    HAL_ERROR   = 0x01,
+    HAL_BUSY    = 0x02,
+    HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+//---------------------------------------------------------------------
+// Peripherals
+//---------------------------------------------------------------------
+
+typedef struct {
+    __IO uint32_t MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR, BSRR, LCKR, AFR[2];
+} GPIO_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RCR, CCR1, CCR2, CCR3, CCR4;
+} TIM_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR, NDTR, PAR, M0AR, M1AR, FCR;
+} DMA_Stream_TypeDef;
+
+typedef struct {
+    __IO uint32_t LISR, HISR, LIFCR, HIFCR;
+} DMA_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR, PLLCFGR, CFGR;
+} RCC_TypeDef;
+
+typedef struct {
+    __IO uint32_t IMR, EMR, RTSR, FTSR, SWIER, PR;
+} EXTI_TypeDef;
+
+typedef struct {
+    __IO uint32_t CTRL, CYCCNT, LAR;
+} DWT_Type;
+
+typedef struct {
+    __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern GPIO_TypeDef       fake_GPIOE;
+extern TIM_TypeDef        fake_TIM2, fake_TIM5, fake_TIM7;
+extern DMA_TypeDef        fake_DMA1;
+extern DMA_Stream_TypeDef fake_DMA1_Stream1, fake_DMA1_Stream3;
+extern RCC_TypeDef        fake_RCC;
+extern EXTI_TypeDef       fake_EXTI;
+extern DWT_Type           fake_DWT;
+extern CoreDebug_Type     fake_CoreDebug;
+
+#define GPIOE (&fake_GPIOE)
+#define TIM2 (&fake_TIM2)
+#define TIM5 (&fake_TIM5)
+#define TIM7 (&fake_TIM7)
+#define DMA1 (&fake_DMA1)
+#define DMA1_Stream1 (&fake_DMA1_Stream1)
+#define DMA1_Stream3 (&fake_DMA1_Stream3)
+#define RCC (&fake_RCC)
+#define EXTI (&fake_EXTI)
+#define DWT (&fake_DWT)
+#define CoreDebug (&fake_CoreDebug)
+
+#define __GPIOE_CLK_ENABLE() ((void)0)
+#define __GPIOE_CLK_DISABLE() ((void)0)
+#define __TIM2_CLK_ENABLE() ((void)0)
+#define __TIM5_CLK_ENABLE() ((void)0)
+#define __TIM7_CLK_ENABLE() ((void)0)
+#define __DMA1_CLK_ENABLE() ((void)0)
+
+//---------------------------------------------------------------------
+// GPIO
+//---------------------------------------------------------------------
+
+#define GPIO_PIN_0 ((uint16_t)0x0001)
+#define GPIO_PIN_1 ((uint16_t)0x0002)
+#define GPIO_PIN_2 ((uint16_t)0x0004)
+#define GPIO_PIN_3 ((uint16_t)0x0008)
+#define GPIO_PIN_4 ((uint16_t)0x0010)
+#define GPIO_PIN_5 ((uint16_t)0x0020)
+#define GPIO_PIN_6 ((uint16_t)0x0040)
+#define GPIO_PIN_7 ((uint16_t)0x0080)
+#define GPIO_PIN_8 ((uint16_t)0x0100)
+#define GPIO_PIN_9 ((uint16_t)0x0200)
+#define GPIO_PIN_10 ((uint16_t)0x0400)
+#define GPIO_PIN_11 ((uint16_t)0x0800)
+#define GPIO_PIN_12 ((uint16_t)0x1000)
+#define GPIO_PIN_13 ((uint16_t)0x2000)
+#define GPIO_PIN_14 ((uint16_t)0x4000)
+#define GPIO_PIN_15 ((uint16_t)0x8000)
+#define GPIO_PIN_All ((uint16_t)0xFFFF)
+
+#define GPIO_MODE_OUTPUT_PP 0x00000001U
+#define GPIO_NOPULL 0x00000000U
+#define GPIO_SPEED_FREQ_LOW 0x00000000U
+
+typedef enum {
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct {
+    uint32_t Pin, Mode, Pull, Speed, Alternate;
+} GPIO_InitTypeDef;
+
+void HAL_GPIO_Init(GPIO_TypeDef* GPIOx, GPIO_InitTypeDef* GPIO_Init);
+void HAL_GPIO_WritePin(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+//---------------------------------------------------------------------
+// Timer
+//---------------------------------------------------------------------
+
+#define TIM_CR1_CEN 0x0001U
+#define TIM_CR1_OPM 0x0008U
+#define TIM_CR1_ARPE 0x0080U
+#define TIM_CCMR1_OC1PE 0x0008U
+#define TIM_DIER_UIE 0x0001U
+#define TIM_DIER_CC1IE 0x0002U
+#define TIM_SR_UIF 0x0001U
+#define TIM_SR_CC1IF 0x0002U
+#define TIM_EGR_UG 0x0001U
+
+//---------------------------------------------------------------------
+// DMA
+//---------------------------------------------------------------------
+
+#define DMA_SxCR_EN 0x00000001U
+#define DMA_SxCR_HTIE 0x00000008U
+#define DMA_SxCR_TCIE 0x00000010U
+#define DMA_SxCR_PSIZE_1 0x00001000U
+#define DMA_SxCR_MSIZE_1 0x00004000U
+#define DMA_MEMORY_TO_PERIPH 0x00000040U
+#define DMA_CIRCULAR 0x00000100U
+#define DMA_MINC_ENABLE 0x00000400U
+#define DMA_PRIORITY_HIGH 0x00020000U
+#define DMA_PRIORITY_VERY_HIGH 0x00030000U
+#define DMA_PBURST_SINGLE 0x00000000U
+#define DMA_MBURST_SINGLE 0x00000000U
+#define DMA_CHANNEL_6 0x0C000000U
+
+//---------------------------------------------------------------------
+// RCC, EXTI
+//---------------------------------------------------------------------
+
+#define RCC_CFGR_PPRE1_2 0x00001000U
+#define RCC_CFGR_PPRE2_2 0x00008000U
+#define EXTI_IMR_IM0 0x00000001U
+#define EXTI_SWIER_SWIER0 0x00000001U
+
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+
+//---------------------------------------------------------------------
+// Core
+//---------------------------------------------------------------------
+
+typedef enum {
+    EXTI0_IRQn = 6,
+    TIM2_IRQn  = 28,
+    TIM5_IRQn  = 50,
+} IRQn_Type;
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn);
+void NVIC_SystemReset(void);
+
+#define CoreDebug_DEMCR_TRCENA_Msk 0x01000000U
+#define DWT_CTRL_CYCCNTENA_Msk 0x00000001U
+
+extern uint32_t SystemCoreClock;
+
+#define __disable_irq() ((void)0)
+#define __enable_irq() ((void)0)
+#define __DSB() ((void)0)
+#define __ISB() ((void)0)
+#define __WFE() ((void)0)
+#define __WFI() (fake_wfi_hook ? fake_wfi_hook() : (void)0)
+
+uint32_t HAL_GetTick(void);
+void     HAL_Delay(uint32_t Delay);
+
+#define uwTick fake_tick
+
+// ITCM code section (main.h), named as a C identifier, so the linker provides
+// __start_itcm_text and __stop_itcm_text and tests can check what runs from it
+#define RAMFUNC __attribute__((section("itcm_text")))
+
+//---------------------------------------------------------------------
+// Test control
+//---------------------------------------------------------------------
+
+extern uint32_t fake_tick;          // HAL_GetTick and uwTick value [ms], HAL_Delay advances it
+extern uint32_t fake_pclk1;         // APB1 clock [Hz]
+extern int      fake_reset_count;   // number of NVIC_SystemReset calls
+extern uint16_t fake_gpio_init_pin; // pins configured with HAL_GPIO_Init
+extern uint64_t fake_nvic_disabled; // interrupts masked with HAL_NVIC_DisableIRQ (bit per IRQn)
+
+extern void (*fake_nvic_disable_hook)(IRQn_Type IRQn); // called by HAL_NVIC_DisableIRQ (if set)
+extern void (*fake_wfi_hook)();                       // called by __WFI (if set), core sleeps meanwhile
+
+void FAKE_HAL_Reset(void);
+void FAKE_GPIO_Latch(GPIO_TypeDef* GPIOx); // apply BSRR written by firmware to ODR (as hardware does) and clear it
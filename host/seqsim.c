@@ -0,0 +1,326 @@
+/// @file seqsim.c
+/// <summary>
+/// Sequencer simulator. Runs a PRDS/CHLS command script through the firmware
+/// parser and table compiler, then drives the firmware's TIM2 interrupt handler
+/// with a simulated timer and writes the outputs as a VCD waveform.
+/// </summary>
+///
+/// <description>
+/// Timer counts at 1 MHz (1 us per tick, as configured by the firmware), from 0 to ARR.
+/// Compare match happens when the counter reaches CCR1, so an edge whose time has already
+/// passed when the handler loads it into CCR1 matches only in the next period (late edge,
+/// counted by the firmware and flagged here). The handler runs ISR latency after the
+/// event (or after the previous handler finished), pins change when it runs.
+///
+/// Usage: seqsim [-n periods] [-l latency_ns] [-d isr_duration_ns] [-o out.vcd] [-v] script
+/// Script is the text that would be sent to the unit (one command per line, '-' for stdin).
+/// VCD can be viewed in GTKWave (convert to FST with vcd2fst for long runs).
+/// </description>
+///
+/// Supervision: /
+///
+/// Company: Sensum d.o.o.
+///
+/// @authors Erik Juvan
+///
+/// @version /
+/////-----------------------------------------------------------
+// Company: Sensum d.o.o.
+
+#include "fake.h"
+#include "frame.h"
+#include "main.h"
+#include "parse.h"
+#include "sequencer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TICK_NS 1000ULL // timer tick [ns]
+#define NEVER UINT64_MAX
+
+void TIM2_IRQHandler();
+
+static struct {
+    uint32_t periods;     // periods to simulate
+    uint32_t latency_ns;  // interrupt entry latency (event to first instruction of handler)
+    uint32_t duration_ns; // handler execution time (next handler can't start before)
+    int      verbose;
+    FILE*    vcd;
+} opt = {.periods = 10, .latency_ns = 200, .duration_ns = 500};
+
+// Simulated timer
+static struct {
+    uint64_t period_start; // time of last update event [ns]
+    uint64_t compare;      // time of next compare match [ns], NEVER if CCR1 is beyond ARR
+    uint32_t flags;        // pending status flags (TIM_SR_*)
+    uint64_t pending_since;
+    uint64_t busy_until; // end of handler that is running
+    int      counting;
+} tim;
+
+static struct {
+    uint32_t late_edges, missed_edges, handlers;
+    uint64_t max_delay; // max delay from event to handler [ns]
+} result;
+
+//---------------------------------------------------------------------
+/// <summary> Parser responses are shown only in verbose mode. </summary>
+//---------------------------------------------------------------------
+static int ScriptWrite(const uint8_t* data, int size)
+{
+    if (opt.verbose)
+        fprintf(stderr, "> %.*s\n", size, (const char*)data);
+    return size;
+}
+
+static int ScriptWriteFrame(const uint8_t* packet, int size)
+{
+    UNUSED(packet);
+    return size;
+}
+
+static parse_context script_ctx = {.Write = ScriptWrite, .WriteFrame = ScriptWriteFrame, .link = LINK_USB, .last_seq = -1};
+
+//---------------------------------------------------------------------
+/// <summary> Feed command script to the parser, line by line. </summary>
+///
+/// <param name="file"> Script file. </param>
+//---------------------------------------------------------------------
+static void RunScript(FILE* file)
+{
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (opt.verbose)
+            fprintf(stderr, "< %s", line);
+        Parse(&script_ctx, line);
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Counter value at given time. </summary>
+//---------------------------------------------------------------------
+static uint32_t Counter(uint64_t t)
+{
+    return (uint32_t)((t - tim.period_start) / TICK_NS);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Time of next compare match after CCR1 was written at time t.
+/// If counter has already passed CCR1, the match happens in the next period. </summary>
+//---------------------------------------------------------------------
+static uint64_t NextCompare(uint64_t t)
+{
+    uint32_t ccr1 = TIM2->CCR1;
+    if (ccr1 > TIM2->ARR)
+        return NEVER;
+    if (ccr1 > Counter(t))
+        return tim.period_start + ccr1 * TICK_NS;
+    return tim.period_start + (TIM2->ARR + 1 + ccr1) * TICK_NS;
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write VCD header and initial state of outputs. </summary>
+//---------------------------------------------------------------------
+static void VcdHeader(uint32_t pins)
+{
+    if (opt.vcd == NULL)
+        return;
+
+    fprintf(opt.vcd, "$timescale 1ns $end\n$scope module sequencer $end\n");
+    for (int ch = 0; ch < NUM_OF_CHANNELS; ++ch)
+        fprintf(opt.vcd, "$var wire 1 %c ch%d $end\n", 'a' + ch, ch);
+    fprintf(opt.vcd, "$var wire 1 L late $end\n$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+    for (int ch = 0; ch < NUM_OF_CHANNELS; ++ch)
+        fprintf(opt.vcd, "%u%c\n", (pins >> ch) & 1, 'a' + ch);
+    fprintf(opt.vcd, "0L\n$end\n");
+}
+
+//---------------------------------------------------------------------
+/// <summary> Write changed outputs to VCD. </summary>
+//---------------------------------------------------------------------
+static void VcdChange(uint64_t t, uint32_t old_pins, uint32_t pins, int old_late, int late)
+{
+    if (opt.vcd == NULL || (old_pins == pins && old_late == late))
+        return;
+
+    fprintf(opt.vcd, "#%llu\n", (unsigned long long)t);
+    for (int ch = 0; ch < NUM_OF_CHANNELS; ++ch) {
+        if (((old_pins ^ pins) >> ch) & 1)
+            fprintf(opt.vcd, "%u%c\n", (pins >> ch) & 1, 'a' + ch);
+    }
+    if (old_late != late)
+        fprintf(opt.vcd, "%dL\n", late);
+}
+
+//---------------------------------------------------------------------
+/// <summary> Advance timer hardware up to time t (raise flags of events that happened). </summary>
+//---------------------------------------------------------------------
+static void HardwareEvents(uint64_t t)
+{
+    while (tim.counting) {
+        uint64_t update = tim.period_start + (TIM2->ARR + 1) * TICK_NS;
+        uint64_t next   = tim.compare < update ? tim.compare : update;
+        if (next > t)
+            break;
+
+        if (tim.flags == 0)
+            tim.pending_since = next;
+
+        if (next == tim.compare) {
+            tim.flags |= TIM_SR_CC1IF;
+            tim.compare += (TIM2->ARR + 1) * TICK_NS; // matches again next period unless CCR1 changes
+        }
+        if (next == update) {
+            tim.flags |= TIM_SR_UIF;
+            tim.period_start = update;
+            if (TIM2->CR1 & TIM_CR1_OPM)
+                tim.counting = 0; // one pulse mode, counter stops at update event
+        }
+    }
+}
+
+//---------------------------------------------------------------------
+/// <summary> Simulate timer and interrupt handler for the requested number of periods. </summary>
+//---------------------------------------------------------------------
+static void Simulate()
+{
+    uint32_t pins = GPIOE->ODR;
+    int      late = 0;
+    uint64_t t    = 0;
+
+    VcdHeader(pins);
+
+    tim.counting = 1;
+    tim.compare  = NextCompare(0);
+    if (tim.compare == NEVER && g_num_of_entries > 0)
+        result.missed_edges++;
+
+    while (IsRunning() && g_seq_stats.periods < opt.periods) {
+        // Next event and when its handler runs (events until then are handled by the same call)
+        uint64_t update = tim.period_start + (TIM2->ARR + 1) * TICK_NS;
+        HardwareEvents(tim.compare < update ? tim.compare : update);
+        t = tim.pending_since + opt.latency_ns;
+        if (t < tim.busy_until)
+            t = tim.busy_until;
+        HardwareEvents(t);
+
+        if (t - tim.pending_since > result.max_delay)
+            result.max_delay = t - tim.pending_since;
+
+        uint32_t late_edges = g_seq_stats.late_edges;
+        uint32_t ccr1       = TIM2->CCR1;
+
+        TIM2->CNT = tim.counting ? Counter(t) : 0;
+        TIM2->SR  = tim.flags;
+        TIM2_IRQHandler();
+        FAKE_GPIO_Latch(GPIOE);
+        tim.flags = 0;
+        result.handlers++;
+
+        int now_late = g_seq_stats.late_edges != late_edges;
+        if (now_late) {
+            result.late_edges++;
+            printf("late edge: period %u, edge at %u us loaded at %u us, pins change a period late\n", g_seq_stats.periods, TIM2->CCR1, TIM2->CNT);
+        }
+        if (TIM2->CCR1 != ccr1) {
+            tim.compare = NextCompare(t);
+            if (tim.compare == NEVER) {
+                result.missed_edges++;
+                printf("missed edge: period %u, edge at %u us is beyond period (%u us)\n", g_seq_stats.periods, TIM2->CCR1, TIM2->ARR);
+            }
+        }
+
+        VcdChange(t, pins, GPIOE->ODR, late, now_late);
+        pins           = GPIOE->ODR;
+        late           = now_late;
+        tim.busy_until = t + opt.duration_ns;
+
+        if (!tim.counting && IsRunning())
+            break; // counter stopped in one pulse mode, nothing more will happen
+    }
+
+    if (opt.vcd != NULL)
+        fprintf(opt.vcd, "#%llu\n", (unsigned long long)(tim.period_start > t ? tim.period_start : t));
+}
+
+//---------------------------------------------------------------------
+/// <summary> Print usage. </summary>
+//---------------------------------------------------------------------
+static void Usage()
+{
+    fprintf(stderr, "usage: seqsim [-n periods] [-l latency_ns] [-d isr_duration_ns] [-o out.vcd] [-v] script\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* vcd_name = NULL;
+    int         c;
+
+    while ((c = getopt(argc, argv, "n:l:d:o:v")) != -1) {
+        switch (c) {
+        case 'n':
+            opt.periods = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            opt.latency_ns = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            opt.duration_ns = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            vcd_name = optarg;
+            break;
+        case 'v':
+            opt.verbose = 1;
+            break;
+        default:
+            Usage();
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        Usage();
+        return 2;
+    }
+
+    FILE* script = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+    if (script == NULL) {
+        perror(argv[optind]);
+        return 2;
+    }
+    if (vcd_name != NULL && (opt.vcd = fopen(vcd_name, "w")) == NULL) {
+        perror(vcd_name);
+        return 2;
+    }
+
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    FRAME_Init();
+    SEQ_Init();
+
+    RunScript(script);
+    if (!IsRunning()) {
+        char strt[] = "STRT";
+        Parse(&script_ctx, strt);
+    }
+    SEQ_Poll();
+
+    if (g_timer_period_us <= 0 || g_num_of_entries == 0) {
+        fprintf(stderr, "script doesn't set period (PRDS) and channels (CHLS)\n");
+        return 2;
+    }
+
+    Simulate();
+
+    printf("periods %u, entries %u, handlers %u, late edges %u, missed edges %u, max handler delay %llu ns\n",
+           g_seq_stats.periods, g_num_of_entries, result.handlers, result.late_edges, result.missed_edges,
+           (unsigned long long)result.max_delay);
+
+    if (opt.vcd != NULL)
+        fclose(opt.vcd);
+
+    return result.late_edges || result.missed_edges ? 1 : 0;
+}
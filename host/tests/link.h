@@ -0,0 +1,49 @@
+#pragma once
+
+// Fake communication link for tests: captures what the parser writes
+
+#include "frame.h"
+#include "parse.h"
+#include <string.h>
+
+static char    link_text[2048]; // text responses (Write), zero terminated
+static int     link_text_len;
+static uint8_t link_packet[FRAME_RESPONSE_HEADER_SIZE + PARSE_OUTPUT_SIZE]; // last response packet (WriteFrame)
+static int     link_packet_len;
+static int     link_packets;
+
+static int LinkWrite(const uint8_t* data, int size)
+{
+    memcpy(&link_text[link_text_len], data, size);
+    link_text_len += size;
+    link_text[link_text_len] = '\0';
+    return size;
+}
+
+static int LinkWriteFrame(const uint8_t* packet, int size)
+{
+    memcpy(link_packet, packet, size);
+    link_packet_len = size;
+    link_packets++;
+    return size;
+}
+
+static void LinkReset()
+{
+    link_text_len   = 0;
+    link_text[0]    = '\0';
+    link_packet_len = 0;
+    link_packets    = 0;
+}
+
+static parse_context link_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_USB, .last_seq = -1};
+
+// Parse text command(s) (copied, parser tokenizes in place)
+static inline const char* Command(const char* text)
+{
+    char buf[1024];
+    strcpy(buf, text);
+    LinkReset();
+    Parse(&link_ctx, buf);
+    return link_text;
+}
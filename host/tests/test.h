@@ -0,0 +1,41 @@
+#pragma once
+
+// Minimal unit test helpers for the host build (one executable per tested module, run by ctest)
+
+#include <stdio.h>
+#include <string.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);    \
+            test_failures++;                                                    \
+        }                                                                       \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                                                \
+    do {                                                                                                              \
+        long long a_ = (long long)(a), b_ = (long long)(b);                                                           \
+        if (a_ != b_) {                                                                                               \
+            printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, a_, b_);             \
+            test_failures++;                                                                                          \
+        }                                                                                                             \
+    } while (0)
+
+#define CHECK_STR(a, b)                                                                                               \
+    do {                                                                                                              \
+        if (strcmp((a), (b)) != 0) {                                                                                  \
+            printf("%s:%d: CHECK_STR(%s, %s) failed: \"%s\" != \"%s\"\n", __FILE__, __LINE__, #a, #b, (a), (b));     \
+            test_failures++;                                                                                          \
+        }                                                                                                             \
+    } while (0)
+
+#define RUN(test)              \
+    do {                       \
+        printf("%s\n", #test); \
+        test();                \
+    } while (0)
+
+#define TEST_RESULT() (printf(test_failures ? "FAILED (%d)\n" : "OK\n", test_failures), test_failures != 0)
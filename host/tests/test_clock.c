@@ -0,0 +1,170 @@
+// Unit tests of device clock (clock.c): time on the cycle counter, sync, drift, local time, sleep and SYNC / SYNQ commands
+
+#include "clock.h"
+#include "fake.h"
+#include "link.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+
+#define CYCLES_PER_US (168000000 / 1000000)
+#define TIMER_CYCLES 4 // cycles per tick of the sleep timer (TIM7)
+
+static uint32_t timer_cycles; // cycles counted by the sleep timer, it runs on in sleep
+static uint32_t sleep_cycles; // length of the next sleep
+
+static void Timer(uint32_t cycles)
+{
+    timer_cycles += cycles;
+    fake_TIM7.CNT = (timer_cycles / TIMER_CYCLES) & 0xFFFF;
+}
+
+// Move the cycle counter (and the timer with it) forward, with a tick every 10 ms as on the device
+static void Wait(uint64_t us)
+{
+    for (; us > 10000; us -= 10000) {
+        fake_DWT.CYCCNT += 10000 * CYCLES_PER_US;
+        Timer(10000 * CYCLES_PER_US);
+        CLK_Tick();
+    }
+    fake_DWT.CYCCNT += (uint32_t)us * CYCLES_PER_US;
+    Timer((uint32_t)us * CYCLES_PER_US);
+    CLK_Tick();
+}
+
+// Core sleeps: cycle counter stops, timer counts on
+static void Sleep()
+{
+    Timer(sleep_cycles);
+}
+
+static void test_free_running()
+{
+    fake_DWT.CYCCNT = 12345;
+    CLK_Init();
+    CHECK_EQ(CLK_Now(), 0);
+
+    Wait(1000);
+    CHECK_EQ(CLK_Now(), 1000);
+    CHECK_EQ(CLK_Time(fake_DWT.CYCCNT - 500 * CYCLES_PER_US), 500);
+    CHECK_EQ(CLK_Until(3000), 2000);
+    CHECK_EQ(CLK_Until(0), -1000);
+    CHECK_EQ(CLK_Local(1000000), 1000000); // no drift yet
+
+    // Cycle counter wraps every 25.6 s, device time goes on (rate is rounded to 2^-32 us per cycle)
+    Wait(60000000);
+    CHECK(CLK_Now() - 60001000 <= 1);
+}
+
+static void test_sync()
+{
+    // Terminator of SYNC was received 200 us ago, time was 5000000 then
+    uint32_t before = CLK_Time(fake_DWT.CYCCNT - 200 * CYCLES_PER_US);
+    CLK_Sync(fake_DWT.CYCCNT - 200 * CYCLES_PER_US, 5000000);
+    CHECK_EQ(CLK_Now(), 5000200);
+    CHECK_EQ(CLK_Stats.syncs, 1);
+    CHECK_EQ(CLK_Stats.offset, (int32_t)(5000000 - before));
+    CHECK_EQ(CLK_Stats.drift, 0);
+
+    // Time wraps around 2^32, times are compared modulo 2^32
+    CLK_Sync(fake_DWT.CYCCNT, 0xFFFFFF00);
+    Wait(0x200);
+    CHECK_EQ(CLK_Now(), 0x100);
+    CHECK_EQ(CLK_Until(0xFFFFFFF0), -0x110);
+}
+
+static void test_drift()
+{
+    // Master's clock runs 100 ppm faster: syncs 2 s apart measure it
+    CLK_Init();
+    CLK_Sync(fake_DWT.CYCCNT, 1000000);
+    Wait(500000);
+    CLK_Sync(fake_DWT.CYCCNT, 1500050); // too close to measure drift
+    CHECK_EQ(CLK_Stats.drift, 0);
+    Wait(1500000);
+    CLK_Sync(fake_DWT.CYCCNT, 3000200);
+    CHECK(CLK_Stats.drift > 99900 && CLK_Stats.drift < 100100);
+
+    // Time between syncs follows master's rate
+    Wait(1000000);
+    CHECK_EQ(CLK_Now(), 4000300);
+    Wait(10000000);
+    CHECK(CLK_Now() >= 14001299 && CLK_Now() <= 14001301);
+
+    // Durations in device time are shorter in local time (timer ticks) by the drift
+    CHECK(CLK_Local(1000000) >= 999899 && CLK_Local(1000000) <= 999901);
+    CHECK(CLK_Local(-1000000) >= -999901 && CLK_Local(-1000000) <= -999899);
+    CHECK_EQ(CLK_Local(20), 20);
+
+    // Master's time jumped, that is not drift
+    int32_t drift = CLK_Stats.drift;
+    CLK_Sync(fake_DWT.CYCCNT, 100000000);
+    CHECK_EQ(CLK_Stats.drift, drift);
+    CHECK_EQ(CLK_Now(), 100000000);
+}
+
+static void test_sleep()
+{
+    CLK_Init();
+    fake_wfi_hook   = Sleep;
+    uint32_t offset = timer_cycles - fake_DWT.CYCCNT;
+
+    // Cycle counter is carried over the sleep
+    uint32_t before = CLK_Now();
+    sleep_cycles    = 800 * CYCLES_PER_US;
+    CLK_Sleep();
+    CHECK_EQ(CLK_Now() - before, 800);
+
+    // Sleeps that are not whole timer ticks don't add up an error, counter never goes back
+    for (int i = 0; i < 1000; ++i) {
+        uint32_t cycles = fake_DWT.CYCCNT;
+        sleep_cycles    = i % 2 ? 999 * CYCLES_PER_US + 3 : 1;
+        CLK_Sleep();
+        CHECK((int32_t)(fake_DWT.CYCCNT - cycles) >= 0);
+        Wait(7);
+    }
+    int32_t error = (int32_t)(timer_cycles - fake_DWT.CYCCNT - offset);
+    CHECK(error > -TIMER_CYCLES && error < TIMER_CYCLES);
+
+    fake_wfi_hook = NULL;
+}
+
+static void test_commands()
+{
+    CLK_Init();
+
+    // On USB sync is timestamped when parsed
+    CHECK_STR(Command("SYNC,7000000"), "SYNC,7000000");
+    CHECK_EQ(CLK_Now(), 7000000);
+
+    // On UART at the terminator of the message (UART interrupt)
+    parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+    char          text[]   = "SYNC,9000000";
+    uart_ctx.rx_end        = fake_DWT.CYCCNT;
+    Wait(300);
+    LinkReset();
+    Parse(&uart_ctx, text);
+    CHECK_STR(link_text, "SYNC,9000000");
+    CHECK_EQ(CLK_Now(), 9000300);
+
+    CHECK_EQ(CLK_Stats.syncs, 2);
+    CHECK_STR(Command("SYNQ"), "SYNQ,0,2,2000000,0");
+
+    // Without time it restarts the period (not running here)
+    CHECK_STR(Command("SYNC"), "SYNC");
+    CHECK_EQ(CLK_Stats.syncs, 2);
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+
+    RUN(test_free_running);
+    RUN(test_sync);
+    RUN(test_drift);
+    RUN(test_sleep);
+    RUN(test_commands);
+
+    return TEST_RESULT();
+}
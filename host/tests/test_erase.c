@@ -0,0 +1,120 @@
+// Sequencer output during FLASH erase: timer interrupt, and everything it calls, has to run from ITCM RAM (RAMFUNC).
+// Firmware is built with function entry instrumentation, every function entered during the erase has to be in the ITCM section.
+
+#include "fake.h"
+#include "flash.h"
+#include "latency.h"
+#include "link.h"
+#include "sequencer.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+#include "trace.h"
+
+void TIM2_IRQHandler();
+
+extern char __start_itcm_text[], __stop_itcm_text[]; // provided by the linker for the section of RAMFUNC
+
+static int   erasing;    // FLASH erase in progress
+static int   violations; // functions outside ITCM entered during erase
+static void* violation;  // last one
+
+__attribute__((no_instrument_function)) void __cyg_profile_func_enter(void* fn, void* call_site)
+{
+    (void)call_site;
+    if (erasing && ((char*)fn < __start_itcm_text || (char*)fn >= __stop_itcm_text)) {
+        violations++;
+        violation = fn;
+    }
+}
+
+__attribute__((no_instrument_function)) void __cyg_profile_func_exit(void* fn, void* call_site)
+{
+    (void)fn;
+    (void)call_site;
+}
+
+// Compare match, returns pins after the handler
+static uint32_t CompareMatch()
+{
+    TIM2->CNT = TIM2->CCR1;
+    TIM2->SR  = TIM_SR_CC1IF;
+    TIM2_IRQHandler();
+    FAKE_GPIO_Latch(GPIOE);
+    return GPIOE->ODR;
+}
+
+static void UpdateEvent()
+{
+    TIM2->CNT = 0;
+    TIM2->SR  = TIM_SR_UIF;
+    TIM2_IRQHandler();
+    FAKE_GPIO_Latch(GPIOE);
+}
+
+static uint32_t edges[32]; // pins after each compare match during erase
+static int      num_of_edges;
+
+// Two periods of output while the sector is being erased (stop was requested, stopping period is the second one)
+static void Erase()
+{
+    erasing = 1;
+
+    for (int period = 0; period < 2; ++period) {
+        for (int i = 0; i < 4; ++i)
+            edges[num_of_edges++] = CompareMatch();
+        UpdateEvent();
+    }
+
+    erasing = 0;
+}
+
+static void test_output_continues_during_erase()
+{
+    TRACE_Mask = ~0u; // every event the interrupt can record
+    fake_flash_erase_hook = Erase;
+
+    LAT_Received(LINK_USB, 0, 0);
+    Command("PRDS,1000\nCHLS,0,100,200\nCHLS,1,150,300\nSTRT");
+    SEQ_Poll();
+    CHECK(LAT_EdgePending); // first edge is measured during erase
+    StopRequest(LINK_USB);  // and stop completes during erase
+    SEQ_Poll();
+
+    CHECK_EQ(FLASH_StartErase(ADDR_FLASH_SECTOR_5, NULL), 0);
+    FLASH_Wait();
+    CHECK_EQ(fake_flash_erases, 1);
+
+    const uint32_t expected[] = {0x1, 0x3, 0x2, 0x0, 0x1, 0x3, 0x2, 0x0};
+    CHECK_EQ(num_of_edges, 8);
+    for (int i = 0; i < 8; ++i)
+        CHECK_EQ(edges[i], expected[i]);
+    CHECK_EQ(g_seq_stats.late_edges, 0);
+    CHECK(!LAT_EdgePending);
+    CHECK(!IsRunning()); // stopped during erase
+
+    if (violations)
+        printf("function %p (not RAMFUNC) entered during erase\n", violation);
+    CHECK_EQ(violations, 0);
+}
+
+static void test_check_detects_flash_code()
+{
+    // Same check catches the interrupt calling a function that is left in FLASH
+    erasing = 1;
+    Command("STOP");
+    erasing = 0;
+    CHECK(violations > 0);
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    SEQ_Init();
+
+    RUN(test_output_continues_during_erase);
+    RUN(test_check_detects_flash_code);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,83 @@
+// Unit tests of main loop events (event.c): posting, taking, waiting, who posts what
+
+#include "event.h"
+#include "fake.h"
+#include "flash.h"
+#include "kvstore.h"
+#include "link.h"
+#include "prof.h"
+#include "sequencer.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+
+static void test_post_and_take()
+{
+    EVT_Post(EVT_USB_RX);
+    EVT_Post(EVT_TICK);
+    EVT_Post(EVT_TICK); // already pending, seen once
+
+    CHECK_EQ(EVT_Take(EVT_START), 0);
+    CHECK_EQ(EVT_Take(EVT_TICK | EVT_START), EVT_TICK);
+    CHECK_EQ(EVT_Take(EVT_TICK), 0);
+    CHECK_EQ(EVT_Wait(), EVT_USB_RX); // pending, no sleep
+    CHECK_EQ(EVT_Take(~0u), 0);
+}
+
+static void test_wait_takes_all()
+{
+    PROF_Enable(1);
+    EVT_Post(EVT_BULK_RX | EVT_KV);
+    CHECK_EQ(EVT_Wait(), EVT_BULK_RX | EVT_KV);
+    CHECK_EQ(EVT_Take(~0u), 0);
+    CHECK_EQ(PROF_Stats[PROF_SLEEP].count, 0); // events were pending, main loop did not sleep
+    PROF_Enable(0);
+}
+
+static void test_start_request_posts_start()
+{
+    Command("PRDS,1000\nCHLS,0,100,200");
+    EVT_Take(~0u);
+
+    Command("STRT");
+    CHECK_EQ(EVT_Take(~0u), EVT_START);
+    CHECK(!IsRunning()); // started by main loop on the event
+    SEQ_Poll();
+    CHECK(IsRunning());
+    Command("STOP");
+}
+
+static void test_kv_write_posts_kv()
+{
+    uint8_t id = 7;
+
+    KV_Init();
+    EVT_Take(~0u);
+
+    CHECK_EQ(KV_Write(KV_ID, &id, 1), 0);
+    CHECK_EQ(EVT_Take(~0u), EVT_KV);
+
+    KV_Poll(); // starts FLASH operation, its end posts again
+    CHECK(FLASH_Busy());
+    CHECK_EQ(EVT_Take(~0u), 0);
+    FLASH_Wait();
+    CHECK_EQ(EVT_Take(~0u), EVT_KV);
+
+    CHECK_EQ(KV_Write(KV_ID, &id, 1), 0); // same value, nothing to write
+    CHECK_EQ(EVT_Take(~0u), 0);
+    KV_Flush();
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    SEQ_Init();
+
+    RUN(test_post_and_take);
+    RUN(test_wait_takes_all);
+    RUN(test_start_request_posts_start);
+    RUN(test_kv_write_posts_kv);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,88 @@
+// Unit tests of binary link layer (frame.c): CRC32, COBS encode/decode
+
+#include "frame.h"
+#include "test.h"
+
+static void test_crc32_matches_zlib()
+{
+    CHECK_EQ(FRAME_CRC32((const uint8_t*)"123456789", 9), 0xCBF43926); // standard check value
+    CHECK_EQ(FRAME_CRC32((const uint8_t*)"", 0), 0);
+}
+
+static void test_encode_has_no_zero_inside()
+{
+    uint8_t packet[] = {0x01, 0x04, 0x00, 0x00, 0x05};
+    uint8_t frame[32];
+
+    int size = FRAME_Encode(packet, sizeof(packet), frame, sizeof(frame));
+    CHECK(size > 0);
+    CHECK_EQ(frame[0], FRAME_DELIMITER);
+    CHECK_EQ(frame[size - 1], FRAME_DELIMITER);
+    for (int i = 1; i < size - 1; ++i)
+        CHECK(frame[i] != 0);
+}
+
+static void test_roundtrip(int packet_size)
+{
+    uint8_t packet[FRAME_MAX_PACKET_SIZE];
+    uint8_t frame[FRAME_ENCODED_SIZE(FRAME_MAX_PACKET_SIZE)];
+
+    for (int i = 0; i < packet_size; ++i)
+        packet[i] = i % 7 == 0 ? 0 : (uint8_t)(i * 31);
+
+    int size = FRAME_Encode(packet, packet_size, frame, sizeof(frame));
+    CHECK(size > 0 && size <= FRAME_ENCODED_SIZE(packet_size));
+
+    int decoded = FRAME_Decode(&frame[1], size - 2); // without delimiters
+    CHECK_EQ(decoded, packet_size);
+    CHECK(memcmp(&frame[1], packet, packet_size) == 0);
+}
+
+static void test_roundtrip_sizes()
+{
+    int sizes[] = {2, 3, 250, 251, 253, 254, 255, 300, 400, FRAME_MAX_PACKET_SIZE};
+    for (int i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+        test_roundtrip(sizes[i]);
+}
+
+static void test_encode_rejects_small_buffer()
+{
+    uint8_t packet[10] = {1, 2};
+    uint8_t frame[FRAME_ENCODED_SIZE(10) - 1];
+    CHECK_EQ(FRAME_Encode(packet, sizeof(packet), frame, sizeof(frame)), 0);
+    CHECK_EQ(FRAME_Encode(packet, 0, frame, sizeof(frame)), 0);
+}
+
+static void test_decode_detects_corruption()
+{
+    uint8_t packet[] = {7, 0x04};
+    uint8_t frame[32];
+    int     size = FRAME_Encode(packet, sizeof(packet), frame, sizeof(frame));
+
+    for (int i = 1; i < size - 1; ++i) {
+        uint8_t copy[32];
+        memcpy(copy, frame, size);
+        copy[i] ^= 0x10;
+        if (copy[i] == 0)
+            continue; // would be a delimiter, receiver splits the frame there
+        CHECK_EQ(FRAME_Decode(&copy[1], size - 2), -1);
+    }
+
+    uint8_t short_frame[] = {0x02, 0x01};
+    CHECK_EQ(FRAME_Decode(short_frame, sizeof(short_frame)), -1);
+    uint8_t bad_code[] = {0x09, 0x01, 0x02};
+    CHECK_EQ(FRAME_Decode(bad_code, sizeof(bad_code)), -1);
+}
+
+int main()
+{
+    FRAME_Init();
+
+    RUN(test_crc32_matches_zlib);
+    RUN(test_encode_has_no_zero_inside);
+    RUN(test_roundtrip_sizes);
+    RUN(test_encode_rejects_small_buffer);
+    RUN(test_decode_detects_corruption);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,238 @@
+// Unit tests of USB to RS-485 gateway (gateway.c): forwarding, reply routing and bus pacing
+
+#include "clock.h"
+#include "event.h"
+#include "fake.h"
+#include "gateway.h"
+#include "link.h"
+#include "slot.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+
+#define CYCLES_PER_US (168000000 / 1000000)
+
+static uint32_t now_us;
+
+// Move the clock forward
+static void Wait(uint32_t us)
+{
+    now_us += us;
+    fake_DWT.CYCCNT = now_us * CYCLES_PER_US;
+}
+
+// Bytes written to the bus since last call
+static const char* Bus()
+{
+    static char text[FAKE_UART_TX_SIZE + 1];
+    memcpy(text, fake_uart_tx, fake_uart_tx_len);
+    text[fake_uart_tx_len] = '\0';
+    fake_uart_tx_len       = 0;
+    return text;
+}
+
+// Line of a unit received after_us from now (its terminator), routed to the link by main loop
+static const char* Reply(int address, const char* text, uint32_t after_us)
+{
+    uart_rx_time rx = {.address = 0x80 | address};
+    rx.first        = (now_us + after_us) * CYCLES_PER_US - SLOT_CHARS_US(strlen(text)) * CYCLES_PER_US;
+    rx.last         = (now_us + after_us) * CYCLES_PER_US;
+
+    Wait(after_us);
+    LinkReset();
+    GATE_Received((const uint8_t*)text, strlen(text), &rx);
+    GATE_Poll();
+    return link_text;
+}
+
+static void test_forward_and_reply()
+{
+    // Nothing is answered locally, messages wait for the bus (EXTI interrupt)
+    CHECK_STR(Command("@5,PRDS,1000\n@6,PING"), "");
+    CHECK(UART_Monitor);
+    CHECK_EQ(EXTI->SWIER, EXTI_SWIER_SWIER0);
+
+    GATE_Send();
+    CHECK_STR(Bus(), "\x85PRDS,1000\n");
+    GATE_Send(); // waits for reply
+    CHECK_STR(Bus(), "");
+
+    CHECK_STR(Reply(5, "PRDS,1000", 2000), "@5,PRDS,1000");
+    GATE_Send(); // rest of reply may follow
+    CHECK_STR(Bus(), "");
+    Wait(SLOT_CHARS_US(SLOT_GUARD_CHARS));
+    GATE_Send();
+    CHECK_STR(Bus(), "\x86PING\n");
+
+    // Own transmission echoed by transceiver is not a reply
+    CHECK_STR(Reply(6, "PING", 100), "");
+    CHECK_STR(Reply(6, "PING", 1000), "@6,PING");
+    Wait(1000);
+    GATE_Send();
+    CHECK_EQ(GATE_Stats.forwarded, 2);
+    CHECK_EQ(GATE_Stats.replies, 2);
+}
+
+static void test_timeout()
+{
+    Command("@7,PING\n@8,PING");
+    GATE_Send();
+    CHECK_STR(Bus(), "\x87PING\n");
+
+    Wait(20000);
+    GATE_Send();
+    CHECK_STR(Bus(), "");
+
+    Wait(100000); // unit 7 is not there
+    GATE_Send();
+    CHECK_STR(Bus(), "\x88PING\n");
+    CHECK_EQ(GATE_Stats.timeouts, 1);
+
+    Reply(8, "PING", 1000);
+    Wait(1000);
+}
+
+static void test_batched_pipeline()
+{
+    // Tagged messages are not answered until ACKS, they go out back to back
+    Command("@5,#1,PRDS,1000\n@6,#2,PRDS,1000\n@5,ACKS\n@6,ACKS");
+    GATE_Send();
+    CHECK_STR(Bus(), "\x85#1,PRDS,1000\n\x86#2,PRDS,1000\n\x85" "ACKS\n");
+
+    CHECK_STR(Reply(5, "#1,OK,PRDS,1000", 2000), "@5,#1,OK,PRDS,1000");
+    CHECK_STR(Reply(5, "ACKS", 100), "@5,ACKS"); // second line of the same reply
+    Wait(1000);
+    GATE_Send();
+    CHECK_STR(Bus(), "\x86" "ACKS\n");
+    Reply(6, "#2,OK,PRDS,1000", 2000);
+    Wait(1000);
+}
+
+static void test_broadcast()
+{
+    // Slotted query keeps the bus until its last slot, other broadcasts don't wait
+    Command("@*,ENUM,0,4\n@*,STRT\n@3,PING\n@200,PING");
+    GATE_Send();
+    CHECK_STR(Bus(), "\xFF" "ENUM,0,4\n"); // broadcast address byte
+
+    CHECK_STR(Reply(2, "ENUM,2", SLOT_CHARS_US(10) + SLOT_CHARS_US(SLOT_GUARD_CHARS) + 3 * SLOT_Time), "@2,ENUM,2");
+    GATE_Send();
+    CHECK_STR(Bus(), "");
+
+    Wait(SLOT_Time);
+    GATE_Send();
+    CHECK_STR(Bus(), "\xFF" "STRT\n\x83PING\n"); // unit 200 doesn't exist
+    Reply(3, "PING", 1000);
+    Wait(1000);
+
+    // Bus is busy while a message is being received
+    Command("@3,PING");
+    fake_uart_receiving = 1;
+    GATE_Send();
+    CHECK_STR(Bus(), "");
+    fake_uart_receiving = 0;
+    GATE_Send();
+    CHECK_STR(Bus(), "\x83PING\n");
+    Reply(3, "PING", 1000);
+    Wait(1000);
+}
+
+static void test_flow_control()
+{
+    // Received USB data is parsed only if its messages surely fit into the queue
+    char message[100];
+    memset(message, 'x', sizeof(message));
+    message[0] = '#';
+
+    CHECK(GATE_Ready(GATE_QUEUE_SIZE));
+    Command("@9,PING"); // waits for reply, keeps the rest in the queue
+    GATE_Send();
+    Bus();
+
+    int queued = 0;
+    while (GATE_Forward(LinkWrite, 9, message, sizeof(message)) == 0)
+        queued++;
+    CHECK_EQ(queued, (GATE_QUEUE_SIZE) / (GATE_HEADER_SIZE + sizeof(message)));
+    CHECK_EQ(GATE_Stats.dropped, 1);
+    CHECK(!GATE_Ready(512));
+
+    // Queue drained when unit replies, main loop is told
+    EVT_Take(EVT_GATE);
+    Reply(9, "PING", 1000);
+    Wait(1000);
+    GATE_Send();
+    CHECK_EQ(strlen(Bus()), queued * (sizeof(message) + 2));
+    CHECK(EVT_Take(EVT_GATE));
+    CHECK(GATE_Ready(GATE_QUEUE_SIZE));
+
+    // Messages longer than a unit can receive are dropped
+    char long_message[GATE_MAX_MESSAGE + 1] = {0};
+    CHECK_EQ(GATE_Forward(LinkWrite, 9, long_message, sizeof(long_message)), -1);
+}
+
+static void test_uart_is_not_forwarded()
+{
+    // Gateway prefix is only recognized on USB links
+    parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+    char          text[]   = "@5,PING";
+    Parse(&uart_ctx, text);
+    GATE_Send();
+    CHECK_STR(Bus(), "");
+}
+
+static void test_statistics()
+{
+    CHECK_STR(Command("GATG"), "GATG,32,10,1,2");
+}
+
+static void test_time_broadcast()
+{
+    // Gateway is the bus master of device time: SYNC,<time of its terminator at receivers>
+    CLK_Init();
+    CHECK_STR(Command("SYNM,100"), "SYNM,100");
+    fake_tick += 100;
+    EXTI->SWIER = 0;
+    GATE_Poll();
+    CHECK_EQ(EXTI->SWIER, EXTI_SWIER_SWIER0);
+
+    Command("@5,PING");
+    GATE_Send();
+    CHECK_STR(Bus(), "\xFF" "SYNC,0000001471\n\x85PING\n"); // middle of the last stop bit: 16.95 characters at 115200 baud
+    Reply(5, "PING", 3000);
+
+    // Not before the interval, nor while the transmitter is busy (start of the message wouldn't be known)
+    Wait(1000);
+    GATE_Send();
+    CHECK_STR(Bus(), "");
+    fake_tick += 100;
+    fake_uart_tx_len = 1;
+    GATE_Send();
+    CHECK_EQ(fake_uart_tx_len, 1);
+    Bus();
+    GATE_Send();
+    CHECK_STR(Bus(), "\xFF" "SYNC,0000005471\n");
+
+    CHECK_STR(Command("SYNM,0"), "SYNM,0");
+    fake_tick += 100;
+    Wait(1000);
+    GATE_Send();
+    CHECK_STR(Bus(), "");
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    Wait(1000);
+
+    RUN(test_forward_and_reply);
+    RUN(test_timeout);
+    RUN(test_batched_pipeline);
+    RUN(test_broadcast);
+    RUN(test_flow_control);
+    RUN(test_uart_is_not_forwarded);
+    RUN(test_statistics);
+    RUN(test_time_broadcast);
+
+    return TEST_RESULT();
+}
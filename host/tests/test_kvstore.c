@@ -0,0 +1,255 @@
+// Unit tests of key-value store (kvstore.c): records, background writing, remounting, compaction, interrupted writes, old ID layout
+
+#include "fake.h"
+#include "kvstore.h"
+#include "test.h"
+
+static uint32_t ReadU32(kv_key key)
+{
+    uint32_t value = 0;
+    CHECK_EQ(KV_Read(key, &value, sizeof(value)), sizeof(value));
+    return value;
+}
+
+// Write value and wait until it is in FLASH
+static void Store(kv_key key, const void* data, int size)
+{
+    CHECK_EQ(KV_Write(key, data, size), 0);
+    KV_Flush();
+}
+
+static void test_empty_store()
+{
+    FAKE_FLASH_Reset();
+    KV_Init();
+
+    uint8_t id;
+    CHECK_EQ(KV_Read(KV_ID, &id, 1), -1);
+
+    kv_stats stats;
+    KV_Stats(&stats);
+    CHECK_EQ(stats.sector, 0); // formatted in the background
+    CHECK(KV_Busy());
+
+    KV_Flush();
+    CHECK_EQ(fake_flash_erases, 0); // erased FLASH is not erased again
+    KV_Stats(&stats);
+    CHECK_EQ(stats.sector, KV_SECTOR_A);
+    CHECK_EQ(stats.generation, 1);
+    CHECK_EQ(stats.used, 8);
+    CHECK(!KV_Busy());
+}
+
+static void test_write_and_remount()
+{
+    uint32_t baud = 115200;
+    uint8_t  id   = 7;
+    uint8_t  recipe[5] = {1, 2, 3, 4, 5}, out[8];
+
+    CHECK_EQ(KV_Write(KV_ID, &id, 1), 0);
+    CHECK_EQ(KV_Write(KV_BAUD, &baud, sizeof(baud)), 0);
+    CHECK_EQ(KV_Write(KV_RECIPE, recipe, sizeof(recipe)), 0);
+    id = 9;
+    CHECK_EQ(KV_Write(KV_ID, &id, 1), 0);
+
+    // Values are read back before they are in FLASH
+    kv_stats stats;
+    KV_Stats(&stats);
+    CHECK_EQ(stats.pending, 3);
+    CHECK_EQ(stats.used, 8);
+    CHECK_EQ(ReadU32(KV_BAUD), 115200);
+
+    KV_Flush();
+    KV_Stats(&stats);
+    CHECK_EQ(stats.pending, 0);
+    CHECK_EQ(stats.used, 8 + 12 + 12 + 16); // ID written once
+
+    KV_Init();
+    id = 0;
+    CHECK_EQ(KV_Read(KV_ID, &id, 1), 1);
+    CHECK_EQ(id, 9);
+    CHECK_EQ(ReadU32(KV_BAUD), 115200);
+    CHECK_EQ(KV_Read(KV_RECIPE, out, sizeof(out)), 5);
+    CHECK(memcmp(out, recipe, sizeof(recipe)) == 0);
+    CHECK_EQ(KV_Read(KV_RECIPE, out, 2), 5); // truncated, full size is returned
+    CHECK_EQ(KV_Read(KV_CALIBRATION, out, sizeof(out)), -1);
+    CHECK_EQ(fake_flash_erases, 0);
+}
+
+static void test_same_value_is_not_written()
+{
+    kv_stats before, after;
+    uint32_t baud = 115200;
+
+    KV_Stats(&before);
+    Store(KV_BAUD, &baud, sizeof(baud));
+    KV_Stats(&after);
+    CHECK_EQ(after.used, before.used);
+}
+
+static void test_background_write()
+{
+    kv_stats stats;
+    uint32_t value = 1;
+
+    // Record first, then its CRC, one FLASH operation per poll
+    CHECK_EQ(KV_Write(KV_CALIBRATION, &value, sizeof(value)), 0);
+    CHECK(!FLASH_Busy()); // nothing is written by KV_Write
+    KV_Poll();
+    CHECK(FLASH_Busy());
+    KV_Poll(); // operation not finished, nothing to do
+    FLASH_Wait();
+
+    // Value changed while it is being written is written again
+    value = 2;
+    CHECK_EQ(KV_Write(KV_CALIBRATION, &value, sizeof(value)), 0);
+    KV_Poll(); // CRC of the first value
+    FLASH_Wait();
+    KV_Poll(); // second value
+    CHECK(FLASH_Busy());
+    KV_Stats(&stats);
+    CHECK_EQ(stats.pending, 1);
+
+    KV_Flush();
+    KV_Init();
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 2);
+}
+
+static void test_writes_are_combined()
+{
+    kv_stats before, after;
+
+    KV_Stats(&before);
+    for (uint32_t i = 0; i < 1000; ++i)
+        CHECK_EQ(KV_Write(KV_CALIBRATION, &i, sizeof(i)), 0);
+    KV_Flush();
+    KV_Stats(&after);
+    CHECK_EQ(after.used, before.used + 12); // only the last value
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 999);
+}
+
+static void test_flash_error()
+{
+    kv_stats stats;
+    uint32_t value = 77;
+
+    fake_flash_fail = 1;
+    CHECK_EQ(KV_Write(KV_CALIBRATION, &value, sizeof(value)), 0);
+    KV_Flush(); // returns, writing stopped
+    KV_Stats(&stats);
+    CHECK_EQ(stats.errors, 1);
+    CHECK_EQ(stats.pending, 1);
+    CHECK(!KV_Busy());
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 77);
+
+    // Retried with the next write, into the other sector (failed record could be partly programmed)
+    uint32_t sector = stats.sector;
+    value           = 78;
+    Store(KV_CALIBRATION, &value, sizeof(value));
+    KV_Init();
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 78);
+    CHECK_EQ(ReadU32(KV_BAUD), 115200);
+    KV_Stats(&stats);
+    CHECK(stats.sector != sector);
+}
+
+static void test_compaction()
+{
+    kv_stats stats;
+    uint32_t i;
+
+    // 12 byte records, a sector holds ~10900 of them
+    for (i = 0; i < 50000; ++i)
+        Store(KV_CALIBRATION, &i, sizeof(i));
+
+    KV_Stats(&stats);
+    CHECK_EQ(stats.generation, 5);
+    CHECK_EQ(stats.sector, KV_SECTOR_A);
+    CHECK_EQ(fake_flash_erases, 3); // sector B was not erased when it was written the first time
+
+    KV_Init();
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 49999);
+    CHECK_EQ(ReadU32(KV_BAUD), 115200);
+    KV_Stats(&stats);
+    CHECK_EQ(stats.generation, 5);
+}
+
+static void test_interrupted_write()
+{
+    kv_stats stats;
+    uint32_t value = 1234;
+
+    KV_Stats(&stats);
+    uint32_t offset = stats.sector - KV_SECTOR_A + stats.used;
+    Store(KV_CALIBRATION, &value, sizeof(value));
+    fake_flash[offset + 8] = 0xFF; // CRC not written yet
+
+    KV_Init();
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 49999);
+    KV_Stats(&stats);
+    CHECK_EQ(stats.bad, 1);
+
+    // Next record is appended after the broken one
+    value = 4321;
+    Store(KV_CALIBRATION, &value, sizeof(value));
+    KV_Init();
+    CHECK_EQ(ReadU32(KV_CALIBRATION), 4321);
+}
+
+static void test_interrupted_compaction()
+{
+    kv_stats stats;
+    uint32_t value;
+
+    KV_Stats(&stats);
+    uint32_t generation = stats.generation;
+    for (value = 0; stats.generation == generation; ++value) {
+        Store(KV_CALIBRATION, &value, sizeof(value));
+        KV_Stats(&stats);
+    }
+
+    // Take back the header of the new sector, as if power failed before it was written
+    CHECK_EQ(stats.sector, KV_SECTOR_B);
+    memset(&fake_flash[KV_SECTOR_SIZE], 0xFF, 8);
+    KV_Init();
+    KV_Stats(&stats);
+    CHECK_EQ(stats.sector, KV_SECTOR_A);
+    CHECK_EQ(stats.generation, generation);
+    CHECK_EQ(ReadU32(KV_CALIBRATION), value - 2); // last value before compaction
+}
+
+static void test_old_id_is_migrated()
+{
+    FAKE_FLASH_Reset();
+    fake_flash[KV_SECTOR_B - KV_SECTOR_A] = 42; // ID written by old firmware at the start of sector 5
+    KV_Init();
+
+    uint8_t id = 0;
+    CHECK_EQ(KV_Read(KV_ID, &id, 1), 1);
+    CHECK_EQ(id, 42);
+
+    KV_Flush();
+    KV_Init();
+    CHECK_EQ(KV_Read(KV_ID, &id, 1), 1);
+    CHECK_EQ(id, 42);
+    kv_stats stats;
+    KV_Stats(&stats);
+    CHECK_EQ(stats.sector, KV_SECTOR_A);
+    CHECK_EQ(stats.used, 8 + 12);
+}
+
+int main()
+{
+    RUN(test_empty_store);
+    RUN(test_write_and_remount);
+    RUN(test_same_value_is_not_written);
+    RUN(test_background_write);
+    RUN(test_writes_are_combined);
+    RUN(test_compaction);
+    RUN(test_interrupted_write);
+    RUN(test_interrupted_compaction);
+    RUN(test_flash_error);
+    RUN(test_old_id_is_migrated);
+
+    return TEST_RESULT();
+}
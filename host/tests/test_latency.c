@@ -0,0 +1,132 @@
+// Unit tests of start command latency (latency.c): timestamps through parser and sequencer, LATG command
+
+#include "fake.h"
+#include "latency.h"
+#include "link.h"
+#include "sequencer.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+
+#define US 168 // cycles per us at fake core clock
+
+void TIM2_IRQHandler();
+
+static void CompareMatch()
+{
+    TIM2->CNT = TIM2->CCR1;
+    TIM2->SR  = TIM_SR_CC1IF;
+    TIM2_IRQHandler();
+}
+
+static void UpdateEvent()
+{
+    TIM2->CNT = 0;
+    TIM2->SR  = TIM_SR_UIF;
+    TIM2_IRQHandler();
+}
+
+// Start command received over [first, last], timer enabled at enable, first edge at edge [us]
+static void Start(uint32_t first, uint32_t last, uint32_t enable, uint32_t edge)
+{
+    LAT_Received(LINK_USB, first * US, last * US);
+    Command("STRT");
+    fake_DWT.CYCCNT = enable * US;
+    SEQ_Poll();
+    fake_DWT.CYCCNT = edge * US;
+    CompareMatch();
+}
+
+static void Stop()
+{
+    Command("STOP");
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+}
+
+static void test_nothing_measured()
+{
+    CHECK_STR(Command("LATG"), "LATG,CLOCK,168000000");
+}
+
+static void test_start_is_measured()
+{
+    Command("PRDS,1000\nCHLS,0,100,200");
+    Start(1000, 1003, 1010, 1110);
+    CHECK(IsRunning());
+
+    Command("LATG");
+    CHECK(strstr(link_text, "\nLATG,USB,RX,1,504,504,504,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0\n") != NULL);    // 3 us
+    CHECK(strstr(link_text, "\nLATG,USB,ENABLE,1,1176,1176,1176,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0\n") != NULL); // 7 us
+    CHECK(strstr(link_text, "\nLATG,USB,EDGE,1,17976,17976,17976,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0,0") != NULL); // 107 us
+    CHECK(strstr(link_text, "UART") == NULL);
+
+    // Only the first edge after start
+    fake_DWT.CYCCNT = 5000 * US;
+    CompareMatch();
+    CHECK(strstr(Command("LATG"), "\nLATG,USB,EDGE,1,") != NULL);
+}
+
+static void test_start_while_running_is_not_measured()
+{
+    Start(2000, 2000, 2001, 2002);
+    CHECK(strstr(Command("LATG"), "\nLATG,USB,ENABLE,1,") != NULL);
+
+    Stop();
+    CHECK(!IsRunning());
+    Start(3000, 3000, 3001, 3002);
+    CHECK(strstr(Command("LATG"), "\nLATG,USB,ENABLE,2,168,672,1176,") != NULL);
+    Stop();
+}
+
+static void test_stop_before_first_edge()
+{
+    LAT_Received(LINK_USB, 0, 0);
+    Command("STRT");
+    SEQ_Poll();
+    CHECK(LAT_EdgePending);
+    Stop();
+    CHECK(!LAT_EdgePending);
+}
+
+static void test_fast_start_is_measured_separately()
+{
+    parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+
+    // Same command timing as the first start above, executed in UART interrupt instead of main loop
+    LAT_Received(LINK_UART, 1000 * US, 1003 * US);
+    fake_DWT.CYCCNT = 1004 * US;
+    CHECK_EQ(ParseFast(&uart_ctx, (const uint8_t*)"STRT", 4), 1);
+    fake_DWT.CYCCNT = 1104 * US;
+    CompareMatch();
+
+    Command("LATG");
+    CHECK(strstr(link_text, "\nLATG,UART_FAST,RX,1,504,504,504,") != NULL);     // 3 us
+    CHECK(strstr(link_text, "\nLATG,UART_FAST,ENABLE,1,168,168,168,") != NULL); // 1 us
+    CHECK(strstr(link_text, "\nLATG,UART_FAST,EDGE,1,16968,") != NULL);         // 101 us
+    CHECK(strstr(link_text, "\nLATG,UART,") == NULL);
+    Stop();
+}
+
+static void test_clear()
+{
+    CHECK(strstr(Command("LATG,1"), "\nLATG,USB,") != NULL); // reported, then cleared
+    CHECK_STR(Command("LATG"), "LATG,CLOCK,168000000");
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    SEQ_Init();
+
+    RUN(test_nothing_measured);
+    RUN(test_start_is_measured);
+    RUN(test_start_while_running_is_not_measured);
+    RUN(test_stop_before_first_edge);
+    RUN(test_fast_start_is_measured_separately);
+    RUN(test_clear);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,302 @@
+// Unit tests of command parser (parse.c): ASCII commands, tagged commands, binary frames
+
+#include "event.h"
+#include "fake.h"
+#include "kvstore.h"
+#include "link.h"
+#include "sequencer.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+#include "uart.h"
+
+extern uint8_t UART_Address;
+
+void TIM2_IRQHandler();
+
+static void test_ping_and_version()
+{
+    CHECK_STR(Command("PING\n"), "PING");
+    CHECK_STR(Command("PING\nPING\n"), "PING\nPING"); // one write for the whole Parse call
+    CHECK(strncmp(Command("VERG"), "VERG,", 5) == 0);
+    CHECK_STR(Command("NOPE\n"), "");
+}
+
+// Carry out queued requests and let the timer stop at the end of period
+static void StopTimer()
+{
+    SEQ_Poll();
+    for (int i = 0; i < 2; ++i) {
+        TIM2->SR = TIM_SR_UIF;
+        TIM2_IRQHandler();
+    }
+}
+
+static void test_program_and_readback()
+{
+    uint32_t version = g_settings_version;
+
+    Command("STOP");
+    CHECK_STR(Command("PRDS,65000"), "PRDS,65000");
+    CHECK_EQ(SEQ_Staging(LINK_USB)->timer_period_us, 65000);
+    CHECK_STR(Command("CHLS,0,140,240,32460,32560"), "CHLS,0,140,240,32460,32560");
+    CHECK_STR(Command("CHLS,5,490,502"), "CHLS,5,490,502");
+    CHECK_EQ(SEQ_Staging(LINK_USB)->num_of_entries, 6);
+
+    CHECK_STR(Command("STRT"), "STRT");
+    CHECK(g_settings_version != version); // published by the start, loaded into active tables
+    SEQ_Poll();
+    CHECK_EQ(g_num_of_entries, 6);
+    // Times are sorted and shifted by one (last entry holds the first edge)
+    CHECK_EQ(g_time[0], 240);
+    CHECK_EQ(g_time[g_num_of_entries - 1], 140);
+
+    CHECK_STR(Command("CHLG,0"), "CHLG,0,140,240,32460,32560");
+    CHECK_STR(Command("CHLG,5"), "CHLG,5,490,502");
+    CHECK_STR(Command("CHLG,1"), "CHLG,1,");
+    CHECK_STR(Command("STTG"), "PERIOD,65000\nCH,0,140,240,32460,32560\nCH,5,490,502\n");
+
+    Command("STOP");
+    StopTimer();
+}
+
+static void test_invalid_arguments()
+{
+    CHECK_STR(Command("CHLG"), "");
+    CHECK_STR(Command("CHLG,16"), "");
+    CHECK_STR(Command("CHLS,16,100,200"), "");
+    CHECK_STR(Command("PRDS,0"), "PRDS,65000"); // echoes unchanged period
+}
+
+static void test_tagged_commands_are_held()
+{
+    CHECK_STR(Command("#1,PING\n#2,CHLG\n"), "");
+    CHECK_STR(Command("ACKS\n"), "#1,OK,PING\n#2,ERR");
+    CHECK_STR(Command("#3,PING\nPING\n"), "#3,OK,PING\nPING");
+}
+
+static void test_long_echo_after_held_acks()
+{
+    // Echo of STTG (about 400 bytes) doesn't fit next to 200 bytes of held acknowledgements,
+    // they are written out first and its acknowledgement prefixes it in emptied output
+    char text[1024] = "STOP\nPRDS,65000\n";
+    for (int ch = 0; ch < NUM_OF_CHANNELS; ++ch)
+        sprintf(&text[strlen(text)], "CHLS,%d,%d,%d,%d\n", ch, 10000 + 10 * ch, 10001 + 10 * ch, 10002 + 10 * ch);
+    Command(text);
+    char sttg[600];
+    strcpy(sttg, Command("STTG"));
+    CHECK(strlen(sttg) > 380);
+
+    char acks[300] = "";
+    text[0]        = '\0';
+    for (int i = 10; i < 28; ++i) {
+        sprintf(&text[strlen(text)], "#%d,PING\n", i);
+        sprintf(&acks[strlen(acks)], i > 10 ? "\n#%d,OK,PING" : "#%d,OK,PING", i);
+    }
+    CHECK(strlen(acks) > 200);
+    strcat(text, "#99,STTG\nACKS\n");
+
+    char expected[1024];
+    snprintf(expected, sizeof(expected), "%s#99,OK,%s", acks, sttg);
+    CHECK_STR(Command(text), expected);
+}
+
+static void test_set_address()
+{
+    CHECK_STR(Command("ID_S,12"), "ID_S,12");
+    CHECK_EQ(UART_Address, 12);
+    uint8_t id = 0;
+    CHECK_EQ(KV_Read(KV_ID, &id, 1), 1);
+    CHECK_EQ(id, 12);
+    CHECK_STR(Command("ID_G"), "ID_G,12");
+    CHECK_STR(Command("ID_S,127"), "ID_S,12"); // address of all units (broadcast)
+    CHECK_STR(Command("FLSG"), "FLSG,NONE,0,0,0,0,1,0,0"); // not in FLASH yet (store not even formatted)
+}
+
+static void test_reset()
+{
+    // Only requested, main loop stores pending values and resets
+    EVT_Take(EVT_RESET);
+    CHECK_STR(Command("RSET"), "RSET");
+    CHECK_EQ(fake_reset_count, 0);
+    CHECK(EVT_Take(EVT_RESET));
+    CHECK(KV_Busy());
+    KV_Flush();
+
+    // Pending ID was stored before reset
+    uint8_t id = 0;
+    KV_Init();
+    CHECK_EQ(KV_Read(KV_ID, &id, 1), 1);
+    CHECK_EQ(id, 12);
+    CHECK_STR(Command("FLSG"), "FLSG,NONE,1,1,0,0,0,1,20"); // last operation programmed CRC of the ID record
+}
+
+static void test_frames()
+{
+    uint8_t ping[] = {5, 0x04};
+    LinkReset();
+    ParseFrame(&link_ctx, ping, sizeof(ping));
+    CHECK_EQ(link_packets, 1);
+    CHECK_EQ(link_packet_len, 7);
+    CHECK(memcmp(link_packet, "\x05\x04\x00PING", 7) == 0);
+
+    // Repeated sequence number is not executed again
+    LinkReset();
+    ParseFrame(&link_ctx, ping, sizeof(ping));
+    CHECK_EQ(link_packets, 1);
+    CHECK_EQ(link_packet_len, FRAME_RESPONSE_HEADER_SIZE);
+    CHECK_EQ(link_packet[2], FRAME_STATUS_DUPLICATE);
+
+    uint8_t unknown[] = {6, 0x7F};
+    LinkReset();
+    ParseFrame(&link_ctx, unknown, sizeof(unknown));
+    CHECK_EQ(link_packet[2], FRAME_STATUS_UNKNOWN);
+
+    uint8_t bad_args[] = {7, 0x20, 1, 2}; // PRDS needs 4 bytes
+    LinkReset();
+    ParseFrame(&link_ctx, bad_args, sizeof(bad_args));
+    CHECK_EQ(link_packet[2], FRAME_STATUS_BAD_ARGS);
+
+    uint8_t prds[] = {8, 0x20, 0x10, 0x27, 0, 0}; // 10000 us
+    LinkReset();
+    ParseFrame(&link_ctx, prds, sizeof(prds));
+    CHECK_EQ(link_packet[2], FRAME_STATUS_OK);
+    CHECK_EQ(SEQ_Staging(LINK_USB)->timer_period_us, 10000);
+
+    uint8_t gap[] = {10, 0x04};
+    uint32_t gaps  = link_ctx.seq_gaps;
+    ParseFrame(&link_ctx, gap, sizeof(gap));
+    CHECK_EQ(link_ctx.seq_gaps, gaps + 1);
+}
+
+static void test_commands_of_link()
+{
+    // UART is parsed in EXTI interrupt: commands that are not interrupt safe (BNCH) or
+    // only meant for the host (gateway) are ignored there
+    parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+    char          text[]   = "BNCH\nGATG\nSYNM,100\nPING";
+    LinkReset();
+    Parse(&uart_ctx, text);
+    CHECK_STR(link_text, "PING");
+
+    uint8_t bnch[] = {1, 0x07};
+    LinkReset();
+    ParseFrame(&uart_ctx, bnch, sizeof(bnch));
+    CHECK_EQ(link_packet[2], FRAME_STATUS_UNKNOWN);
+
+    CHECK(strncmp(Command("GATG"), "GATG,", 5) == 0);
+}
+
+static void test_links_stage_settings()
+{
+    // UART command in the middle of USB settings changes only its own staging copy
+    parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+    char          text[]   = "STOP\nPRDS,3000\nCHLS,2,100,200";
+
+    Command("STOP\nPRDS,5000\nCHLS,0,140,240");
+    Parse(&uart_ctx, text);
+    CHECK_STR(Command("CHLS,1,300,400"), "CHLS,1,300,400");
+    CHECK_STR(Command("STTG"), "PERIOD,5000\nCH,0,140,240\nCH,1,300,400\n");
+    CHECK_EQ(SEQ_Staging(LINK_UART)->num_of_entries, 2);
+
+    // Changed settings are published by the parser on start, not by the fast path
+    uint32_t version = g_settings_version;
+    CHECK_EQ(ParseFast(&link_ctx, (const uint8_t*)"STRT", 4), 0);
+    CHECK_STR(Command("STRT"), "STRT");
+    CHECK(g_settings_version != version);
+    SEQ_Poll();
+    CHECK_EQ(g_timer_period_us, 5000);
+    CHECK_EQ(g_num_of_entries, 4);
+
+    // Published settings stay as they were, link goes on in its staging copy
+    CHECK_STR(Command("CHLS,3,10,20"), "CHLS,3,10,20");
+    CHECK_STR(Command("CHLG,0"), "CHLG,0,");
+    CHECK_EQ(g_num_of_entries, 4);
+    Command("STOP");
+    StopTimer();
+}
+
+// UART write of the test below: size of each batch as written to the transmit buffer
+static int uart_batches, uart_batch_max, uart_lines;
+
+static int UartBatch(const uint8_t* data, int size)
+{
+    int lines = 1;
+    for (int i = 0; i < size; ++i)
+        lines += data[i] == '\n';
+
+    uart_batches++;
+    uart_lines += lines;
+    if (size + lines + 1 > uart_batch_max)
+        uart_batch_max = size + lines + 1; // address byte of each line, terminator
+    return size;
+}
+
+static void test_uart_output_fits_transmit_buffer()
+{
+    // 100 echoes fit into output (499 bytes), with address bytes and terminator they take 600
+    parse_context uart_ctx = {.Write = UartBatch, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+    char          text[600] = "";
+    for (int i = 0; i < 100; ++i)
+        strcat(text, "PING\n");
+    char more[sizeof(text)];
+    strcpy(more, text);
+
+    fake_uart_tx_len = FAKE_UART_TX_SIZE - UART_BUFFER_SIZE; // transmit buffer has room for UART_BUFFER_SIZE bytes
+    Parse(&uart_ctx, text);
+    CHECK_EQ(uart_batches, 2);
+    CHECK_EQ(uart_lines, 100);
+    CHECK(uart_batch_max <= UART_BUFFER_SIZE);
+
+    // Less room, smaller batches
+    uart_batches = uart_lines = uart_batch_max = 0;
+    fake_uart_tx_len = FAKE_UART_TX_SIZE - 100;
+    Parse(&uart_ctx, more);
+    CHECK_EQ(uart_lines, 100);
+    CHECK(uart_batch_max <= 100);
+
+    FAKE_UART_Reset();
+}
+
+static void test_bench_keeps_settings()
+{
+    Command("STOP\nPRDS,2000\nCHLS,3,100,200");
+    StopTimer();
+    CHECK(!IsRunning());
+    CHECK(strncmp(Command("BNCH,2"), "BNCH,CLOCK,", 11) == 0);
+    CHECK(strstr(link_text, "BNCH,CHLS,62,") != NULL);
+
+    CHECK_EQ(SEQ_Staging(LINK_USB)->timer_period_us, 2000);
+    CHECK_EQ(SEQ_Staging(LINK_USB)->num_of_entries, 2);
+    Command("STRT");
+    CHECK_STR(Command("CHLG,3"), "CHLG,3,100,200");
+
+    // Stops of the kernels were not queued on this link, start is carried out
+    SEQ_Poll();
+    CHECK(IsRunning());
+    Command("STOP");
+    StopTimer();
+    CHECK(!IsRunning());
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    FRAME_Init();
+
+    RUN(test_ping_and_version);
+    RUN(test_program_and_readback);
+    RUN(test_invalid_arguments);
+    RUN(test_tagged_commands_are_held);
+    RUN(test_long_echo_after_held_acks);
+    RUN(test_set_address);
+    RUN(test_reset);
+    RUN(test_frames);
+    RUN(test_commands_of_link);
+    RUN(test_uart_output_fits_transmit_buffer);
+    RUN(test_links_stage_settings);
+    RUN(test_bench_keeps_settings);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,436 @@
+// Unit tests of sequencer (sequencer.c): timer interrupt state machine driven through the fake TIM2
+
+#include "clock.h"
+#include "fake.h"
+#include "link.h"
+#include "sequencer.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+#include "trace.h"
+
+void TIM2_IRQHandler();
+
+// Compare match: counter reaches CCR1 (plus delay of interrupt entry), returns pins after the handler
+static uint32_t CompareMatch(uint32_t delay)
+{
+    TIM2->CNT = TIM2->CCR1 + delay;
+    TIM2->SR  = TIM_SR_CC1IF;
+    TIM2_IRQHandler();
+    FAKE_GPIO_Latch(GPIOE);
+    return GPIOE->ODR;
+}
+
+static void UpdateEvent()
+{
+    TIM2->CNT = 0;
+    TIM2->SR  = TIM_SR_UIF;
+    TIM2_IRQHandler();
+    FAKE_GPIO_Latch(GPIOE);
+}
+
+static void test_init()
+{
+    SEQ_Init();
+    CHECK_EQ(fake_gpio_init_pin, GPIO_PIN_All);
+    CHECK_EQ(TIM2->PSC, 84 - 1); // 1 us tick from 84 MHz timer clock
+    CHECK_EQ(TIM2->DIER, TIM_DIER_UIE | TIM_DIER_CC1IE);
+    CHECK_EQ(GPIOE->ODR, 0);
+}
+
+static void test_init_216mhz()
+{
+    // CLOCK_216MHZ profile: APB1 at 216 / 4 MHz, timer clock 108 MHz, tick stays 1 us
+    fake_pclk1 = 54000000;
+    SEQ_Init();
+    CHECK_EQ(TIM2->PSC, 108 - 1);
+
+    fake_pclk1 = 42000000;
+    SEQ_Init();
+    CHECK_EQ(TIM2->PSC, 84 - 1);
+}
+
+static void test_start_without_settings()
+{
+    // No channel was programmed, start must not index the empty tables
+    uint32_t ccr1 = TIM2->CCR1;
+    Command("STRT");
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK_EQ(TIM2->CCR1, ccr1);
+
+    Command("STOP");
+    CHECK(!IsStopping()); // requested, carried out by main loop
+    SEQ_Poll();
+    CHECK(IsStopping());
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+    CHECK(!IsStopping());
+}
+
+static void test_one_period()
+{
+    Command("PRDS,1000\nCHLS,0,100,200\nCHLS,1,150,300\nSTRT");
+    CHECK(!IsRunning()); // started from main loop
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK_EQ(TIM2->ARR, 1000);
+    CHECK_EQ(TIM2->CCR1, 100);
+
+    uint32_t periods = g_seq_stats.periods;
+    CHECK_EQ(CompareMatch(0), 0x1);
+    CHECK_EQ(TIM2->CCR1, 150);
+    CHECK_EQ(CompareMatch(0), 0x3);
+    CHECK_EQ(CompareMatch(0), 0x2);
+    CHECK_EQ(CompareMatch(0), 0x0);
+    CHECK_EQ(TIM2->CCR1, 100); // first edge of next period
+    UpdateEvent();
+    CHECK_EQ(g_seq_stats.periods, periods + 1);
+
+    // Same edges again in the next period
+    CHECK_EQ(CompareMatch(0), 0x1);
+    CHECK_EQ(CompareMatch(0), 0x3);
+}
+
+static void test_latency_and_late_edges()
+{
+    g_seq_stats.max_latency = 0;
+    uint32_t late           = g_seq_stats.late_edges;
+
+    CHECK_EQ(CompareMatch(7), 0x2); // edge at 200
+    CHECK_EQ(g_seq_stats.max_latency, 7);
+    CHECK_EQ(g_seq_stats.late_edges, late);
+    CHECK_EQ(CompareMatch(250), 0x0); // edge at 300, next one (100) is first edge of next period, not late
+    CHECK_EQ(g_seq_stats.late_edges, late);
+    CHECK_EQ(g_seq_stats.max_latency, 250);
+    UpdateEvent();
+
+    // Edge at 100 handled at 160, edge at 150 has already passed
+    CHECK_EQ(CompareMatch(60), 0x1);
+    CHECK_EQ(g_seq_stats.late_edges, late + 1);
+    CHECK_EQ(CompareMatch(0), 0x3);
+    CHECK_EQ(CompareMatch(0), 0x2);
+    CHECK_EQ(CompareMatch(0), 0x0);
+}
+
+static void test_stop_at_end_of_period()
+{
+    UpdateEvent();
+    Command("STOP");
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK(IsStopping());
+    CHECK_EQ(CompareMatch(0), 0x1);
+
+    UpdateEvent(); // enters one pulse mode, last period runs to the end
+    CHECK(TIM2->CR1 & TIM_CR1_OPM);
+    CHECK(IsRunning());
+    CHECK_EQ(CompareMatch(0), 0x1);
+
+    UpdateEvent(); // stopped, pins back to default state
+    CHECK(!IsRunning());
+    CHECK(!IsStopping());
+    CHECK(!(TIM2->CR1 & TIM_CR1_OPM));
+    CHECK_EQ(GPIOE->ODR, 0);
+}
+
+static void test_stop_then_start()
+{
+    // Requests of a link are carried out in order: start waits in the queue until the stop completes
+    Command("STRT");
+    SEQ_Poll();
+    CHECK(IsRunning());
+
+    Command("STOP\nSTRT");
+    SEQ_Poll();
+    CHECK(IsStopping());
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK(!IsStopping());
+
+    Command("STOP");
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+}
+
+static void test_start_then_stop()
+{
+    // Stop sent right after start is not lost, even though the sequencer was not running yet when it arrived
+    Command("STRT\nSTOP");
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK(IsStopping());
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+}
+
+static void test_settings_change_while_running()
+{
+    // New settings are copied to the active ones only by the next start
+    Command("STRT");
+    SEQ_Poll();
+    Command("PRDS,2000");
+    CHECK_EQ(TIM2->ARR, 1000);
+
+    // Start while running publishes them, but running sequencer is left alone
+    uint32_t periods = g_seq_stats.periods;
+    Command("STRT");
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK_EQ(TIM2->ARR, 1000);
+    CHECK_EQ(g_timer_period_us, 1000);
+    UpdateEvent();
+    CHECK_EQ(g_seq_stats.periods, periods + 1);
+
+    Command("STOP\nSTRT");
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK_EQ(TIM2->ARR, 2000);
+
+    Command("STOP\nPRDS,1000");
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+}
+
+// Message received on UART, passed to the fast path by UART interrupt
+static parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+
+static int Fast(const char* text)
+{
+    return ParseFast(&uart_ctx, (const uint8_t*)text, strlen(text));
+}
+
+static void test_fast_start_and_stop()
+{
+    // Period was changed on USB, parser publishes it on start (not the fast path)
+    CHECK_EQ(ParseFast(&link_ctx, (const uint8_t*)"STRT", 4), 0);
+    Command("STRT\nSTOP");
+
+    // Published settings are loaded by main loop
+    CHECK_EQ(Fast("STRT"), 0);
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+
+    // Loaded settings are started and stopped right away, without main loop
+    CHECK_EQ(Fast("STRT"), 1);
+    CHECK(IsRunning());
+    CHECK_EQ(TIM2->CCR1, 100);
+    CHECK_EQ(Fast("STOP\r"), 1);
+    CHECK(IsStopping());
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+    CHECK_EQ(Fast("STOP"), 1); // nothing to stop
+
+    // Echo is written afterwards, same as by the parser
+    LinkReset();
+    ParseExecuted(&uart_ctx, (const uint8_t*)"STOP\r", 5);
+    CHECK_STR(link_text, "STOP");
+
+    // Anything else is parsed as usual
+    CHECK_EQ(Fast("STRT,1"), 0);
+    CHECK_EQ(Fast("PING"), 0);
+    CHECK_EQ(Fast("STR"), 0);
+    CHECK(!IsRunning());
+}
+
+static void test_fast_path_keeps_order()
+{
+    // Queued request of the link is not overtaken
+    CHECK_EQ(StartRequest(LINK_UART), 0);
+    CHECK_EQ(Fast("STOP"), 0);
+    CHECK_EQ(StopRequest(LINK_UART), 0);
+    SEQ_Poll();
+    CHECK(IsStopping());
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+
+    // Requests of other links don't matter
+    CHECK_EQ(StartRequest(LINK_USB), 0);
+    CHECK_EQ(Fast("STRT"), 1);
+    SEQ_Poll(); // start while running
+    CHECK_EQ(Fast("STOP"), 1);
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+}
+
+static void test_sync()
+{
+    CHECK_STR(Command("SYNC"), "SYNC"); // not running, nothing to align
+
+    Command("STRT");
+    SEQ_Poll();
+    CHECK_EQ(CompareMatch(0), 0x1);
+    CHECK_EQ(TIM2->CCR1, 150);
+
+    // Period restarts: pins to default state, first edge again
+    TIM2->EGR = 0;
+    CHECK_EQ(Fast("SYNC"), 1);
+    CHECK_EQ(TIM2->EGR, TIM_EGR_UG);
+    CHECK_EQ(TIM2->CCR1, 100);
+    FAKE_GPIO_Latch(GPIOE);
+    CHECK_EQ(GPIOE->ODR, 0);
+    UpdateEvent();
+    CHECK_EQ(CompareMatch(0), 0x1);
+    CHECK_EQ(CompareMatch(0), 0x3);
+
+    Command("STOP");
+    SEQ_Poll();
+    CHECK_STR(Command("SYNC"), "SYNC"); // stopping, period is not restarted
+    CHECK_EQ(TIM2->CCR1, 200);
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+}
+
+// Last event recorded in trace
+static trace_entry LastTrace()
+{
+    trace_entry e, last = {0};
+    uint32_t    seq = 0;
+    while (TRACE_Read(&seq, &e, 1) == 1)
+        last = e;
+    return last;
+}
+
+static void test_scheduled_start()
+{
+    CLK_Init(); // device time 0 now
+
+    // Timer counts the lead time, period and first edge wait in preload registers
+    CHECK_STR(Command("STRT@5000000"), "STRT@5000000");
+    CHECK(!IsRunning());
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK(IsArmed());
+    CHECK_EQ(LastTrace().event, TRACE_ARM);
+    CHECK_EQ(LastTrace().arg16, 5000); // lead time [ms]
+    CHECK(TIM2->CR1 & TIM_CR1_ARPE);
+    CHECK(TIM2->CCMR1 & TIM_CCMR1_OC1PE);
+    CHECK_EQ(TIM2->ARR, 1000);
+    CHECK_EQ(TIM2->CCR1, 100);
+    CHECK(strncmp(Command("STTQ"), "STTQ,0,3,", 9) == 0);
+
+    // Waiting for the start, period is not restarted, stop goes through main loop
+    TIM2->EGR = 0;
+    CHECK_EQ(Fast("SYNC"), 1);
+    CHECK_EQ(TIM2->EGR, 0);
+    CHECK_EQ(Fast("STOP"), 0);
+    LinkReset();
+
+    // End of lead time starts the first period, preload is off again, lead time is not a period
+    uint32_t periods = g_seq_stats.periods;
+    UpdateEvent();
+    CHECK(!IsArmed());
+    CHECK(!(TIM2->CR1 & TIM_CR1_ARPE));
+    CHECK(!(TIM2->CCMR1 & TIM_CCMR1_OC1PE));
+    CHECK_EQ(LastTrace().event, TRACE_START);
+    CHECK_EQ(g_seq_stats.periods, periods);
+    CHECK_EQ(CompareMatch(0), 0x1);
+    CHECK_EQ(TIM2->CCR1, 150);
+    CHECK_EQ(CompareMatch(0), 0x3);
+    CHECK_EQ(CompareMatch(0), 0x2);
+    CHECK_EQ(CompareMatch(0), 0x0);
+    UpdateEvent();
+    CHECK_EQ(g_seq_stats.periods, periods + 1);
+
+    // Start at a time while running is ignored
+    Command("STRT@9000000");
+    SEQ_Poll();
+    CHECK(!IsArmed());
+    Command("STOP");
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+}
+
+static void test_scheduled_start_cancelled_or_late()
+{
+    // Stop before the start time cancels it, timer is left ready for the next start
+    Command("STRT@5000000\nSTOP");
+    SEQ_Poll();
+    CHECK(!IsRunning());
+    CHECK(!IsArmed());
+    CHECK_EQ(LastTrace().event, TRACE_STOP);
+    CHECK_EQ(LastTrace().arg8, 1);
+    CHECK(!(TIM2->CR1 & TIM_CR1_ARPE));
+    CHECK(!(TIM2->CCMR1 & TIM_CCMR1_OC1PE));
+    CHECK_EQ(TIM2->ARR, 1000);
+    CHECK_EQ(TIM2->CCR1, 100);
+
+    // Start time has (nearly) passed: started right away, counted
+    uint32_t late = g_seq_stats.late_starts;
+    fake_DWT.CYCCNT += 6000000 * 168;
+    Command("STRT@6000010");
+    SEQ_Poll();
+    CHECK(IsRunning());
+    CHECK(!IsArmed());
+    CHECK_EQ(g_seq_stats.late_starts, late + 1);
+    Command("STOP");
+    SEQ_Poll();
+    UpdateEvent();
+    UpdateEvent();
+    CHECK(!IsRunning());
+
+    // Time must be a number
+    CHECK_STR(Command("STRT@soon"), "");
+    SEQ_Poll();
+    CHECK(!IsRunning());
+}
+
+static void test_profiler()
+{
+    Command("PROF,1");
+    fake_DWT.CYCCNT = 0;
+    UpdateEvent();
+    UpdateEvent();
+
+    CHECK(strncmp(Command("PROF"), "PROF,TIME,", 10) == 0);
+    CHECK(strstr(link_text, "\nPROF,TIM,2,0,0\n") != NULL);
+
+    Command("PROF,0");
+    UpdateEvent();
+    CHECK(strstr(Command("PROF"), "\nPROF,TIM,2,") != NULL); // not counted while disabled, kept
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+
+    RUN(test_init);
+    RUN(test_init_216mhz);
+    RUN(test_start_without_settings);
+    RUN(test_one_period);
+    RUN(test_latency_and_late_edges);
+    RUN(test_stop_at_end_of_period);
+    RUN(test_stop_then_start);
+    RUN(test_start_then_stop);
+    RUN(test_settings_change_while_running);
+    RUN(test_fast_start_and_stop);
+    RUN(test_fast_path_keeps_order);
+    RUN(test_sync);
+    RUN(test_scheduled_start);
+    RUN(test_scheduled_start_cancelled_or_late);
+    RUN(test_profiler);
+
+    return TEST_RESULT();
+}
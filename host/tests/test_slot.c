@@ -0,0 +1,153 @@
+// Unit tests of broadcast queries answered in time slots (slot.c, ENUM / STTQ / SLTS in parse.c)
+
+#include "fake.h"
+#include "link.h"
+#include "slot.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+
+void TIM5_IRQHandler();
+
+extern uint8_t UART_Address;
+
+#define CYCLES_PER_US (168000000 / 1000000)
+
+// Message received on UART, terminator at cycle counter 1000
+static parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1, .rx_end = 1000};
+
+// Parse a message sent to all units, handled after_us after its terminator
+static const char* Broadcast(const char* text, uint32_t after_us)
+{
+    char buf[256];
+    strcpy(buf, text);
+    LinkReset();
+    fake_DWT.CYCCNT    = uart_ctx.rx_end + after_us * CYCLES_PER_US;
+    uart_ctx.broadcast = 1;
+    Parse(&uart_ctx, buf);
+    uart_ctx.broadcast = 0;
+    return link_text;
+}
+
+// Slot timer expires
+static void SlotStart()
+{
+    TIM5->SR = TIM_SR_UIF;
+    TIM5_IRQHandler();
+}
+
+static void test_init()
+{
+    SLOT_Init();
+    CHECK_EQ(TIM5->PSC, 84 - 1); // 1 us tick
+    CHECK_EQ(TIM5->CR1, TIM_CR1_OPM);
+    CHECK_EQ(TIM5->DIER, TIM_DIER_UIE);
+    CHECK_EQ(SLOT_Time, SLOT_DEFAULT_US);
+    CHECK_EQ(SLOT_DEFAULT_US, 3646); // 42 characters at 115200 baud
+}
+
+static void test_enumeration()
+{
+    UART_Address = 3;
+
+    // Nothing is written while parsing, response waits for slot 3
+    CHECK_STR(Broadcast("ENUM", 50), "");
+    CHECK(TIM5->CR1 & TIM_CR1_CEN);
+    CHECK_EQ(TIM5->ARR, SLOT_CHARS_US(SLOT_GUARD_CHARS) + 3 * SLOT_DEFAULT_US - 50);
+
+    SlotStart();
+    CHECK_STR(link_text, "ENUM,3");
+    CHECK_EQ(SLOT_Stats.sent, 1);
+
+    // Range: unit 3 is in the second slot of 2..5, not in 4..7
+    Broadcast("ENUM,2,4", 0);
+    CHECK_EQ(TIM5->ARR, SLOT_CHARS_US(SLOT_GUARD_CHARS) + SLOT_DEFAULT_US);
+    SlotStart();
+    CHECK_STR(link_text, "ENUM,3");
+
+    TIM5->CR1 = TIM_CR1_OPM;
+    Broadcast("ENUM,4,4", 0);
+    CHECK(!(TIM5->CR1 & TIM_CR1_CEN));
+    Broadcast("ENUM,0,3", 0);
+    CHECK(!(TIM5->CR1 & TIM_CR1_CEN));
+    CHECK_EQ(SLOT_Stats.sent, 2);
+    CHECK_EQ(SLOT_Stats.missed, 0);
+}
+
+static void test_addressed_query()
+{
+    // Query sent to this unit (or on another link) is answered right away
+    LinkReset();
+    char buf[] = "ENUM";
+    Parse(&uart_ctx, buf);
+    CHECK_STR(link_text, "ENUM,3");
+    CHECK_STR(Command("STTQ"), "STTQ,3,0,0,0");
+    CHECK_STR(Command("ENUM,10,1"), "ENUM,3");
+}
+
+static void test_late_query()
+{
+    // Slot of unit 0 has already started
+    UART_Address = 0;
+    Broadcast("STTQ", SLOT_CHARS_US(SLOT_GUARD_CHARS));
+    CHECK_EQ(SLOT_Stats.missed, 1);
+
+    // Second query while the first response still waits
+    UART_Address = 1;
+    Broadcast("STTQ", 0);
+    Broadcast("ENUM", 0);
+    CHECK_EQ(SLOT_Stats.missed, 2);
+    SlotStart();
+    CHECK_STR(link_text, "STTQ,1,0,0,0");
+    CHECK_EQ(SLOT_Stats.sent, 3);
+}
+
+static void test_broadcast_is_not_answered()
+{
+    TIM5->CR1 = TIM_CR1_OPM;
+    CHECK_STR(Broadcast("PING\nPRDS,1500\nSTRT\nSTOP", 0), "");
+    CHECK(!(TIM5->CR1 & TIM_CR1_CEN));
+    LinkReset();
+    char prdg[] = "PRDG";
+    Parse(&uart_ctx, prdg);
+    CHECK_STR(link_text, "PRDG,1500"); // executed though
+
+    // Held acknowledgements of an addressed pipeline are not lost
+    LinkReset();
+    char buf[] = "#1,PING";
+    Parse(&uart_ctx, buf);
+    CHECK_STR(Broadcast("PING", 0), "");
+    char acks[] = "ACKS";
+    Parse(&uart_ctx, acks);
+    CHECK(strncmp(link_text, "#1,OK,PING", 10) == 0);
+}
+
+static void test_slot_time()
+{
+    CHECK_STR(Command("SLTS,1000"), "SLTS,1000");
+    CHECK_EQ(SLOT_Time, 1000);
+    CHECK_STR(Command("SLTS,0"), "SLTS,1000");
+    CHECK_STR(Command("SLTG"), "SLTG,1000,3,2");
+
+    // Set on the whole bus at once
+    Broadcast("SLTS,500", 0);
+    CHECK_EQ(SLOT_Time, 500);
+    Broadcast("ENUM", 0);
+    CHECK_EQ(TIM5->ARR, SLOT_CHARS_US(SLOT_GUARD_CHARS) + 500);
+    SlotStart();
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+
+    RUN(test_init);
+    RUN(test_enumeration);
+    RUN(test_addressed_query);
+    RUN(test_late_query);
+    RUN(test_broadcast_is_not_answered);
+    RUN(test_slot_time);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,94 @@
+// Unit tests of lock-free single producer, single consumer queue (spsc.c)
+
+#include "spsc.h"
+#include "test.h"
+
+typedef struct {
+    uint32_t seq;
+    uint8_t  data[6];
+} item;
+
+SPSC_QUEUE(queue, item, 4);
+
+static void test_push_and_pull()
+{
+    item in = {.seq = 1, .data = "abc"}, out;
+
+    CHECK_EQ(SPSC_Count(&queue), 0);
+    CHECK(SPSC_Peek(&queue) == NULL);
+    CHECK_EQ(SPSC_Pull(&queue, &out), 0);
+
+    CHECK_EQ(SPSC_Push(&queue, &in), 0);
+    in.seq = 2;
+    CHECK_EQ(SPSC_Push(&queue, &in), 0);
+    CHECK_EQ(SPSC_Count(&queue), 2);
+
+    CHECK_EQ(SPSC_Pull(&queue, &out), 1);
+    CHECK_EQ(out.seq, 1);
+    CHECK_STR((char*)out.data, "abc");
+    CHECK_EQ(((item*)SPSC_Peek(&queue))->seq, 2);
+    SPSC_Pop(&queue);
+    CHECK_EQ(SPSC_Count(&queue), 0);
+}
+
+static void test_full_queue_counts_overflow()
+{
+    item in = {0}, out;
+
+    for (in.seq = 10; in.seq < 14; ++in.seq)
+        CHECK_EQ(SPSC_Push(&queue, &in), 0);
+    CHECK(SPSC_Claim(&queue) == NULL);
+    CHECK_EQ(SPSC_Push(&queue, &in), -1); // rejected, queued items are kept
+    CHECK_EQ(queue.overflow, 1);
+    CHECK_EQ(SPSC_Count(&queue), 4);
+
+    for (uint32_t seq = 10; seq < 14; ++seq) {
+        CHECK_EQ(SPSC_Pull(&queue, &out), 1);
+        CHECK_EQ(out.seq, seq);
+    }
+    CHECK_EQ(SPSC_Pull(&queue, &out), 0);
+}
+
+static void test_wrap_around()
+{
+    // Counters run freely past the capacity and past their 32 bit range
+    item in = {0}, out;
+
+    queue.head = queue.tail = 0xFFFFFFFEu;
+    for (in.seq = 0; in.seq < 20; ++in.seq) {
+        CHECK_EQ(SPSC_Push(&queue, &in), 0);
+        CHECK_EQ(SPSC_Push(&queue, &in), 0);
+        CHECK_EQ(SPSC_Pull(&queue, &out), 1);
+        CHECK_EQ(out.seq, in.seq);
+        CHECK_EQ(SPSC_Pull(&queue, &out), 1);
+    }
+    CHECK_EQ(SPSC_Count(&queue), 0);
+}
+
+static void test_claim_fills_in_parts()
+{
+    // Claimed slot stays the same until published, consumer does not see it before
+    item* slot = SPSC_Claim(&queue);
+
+    slot->seq = 7;
+    CHECK(SPSC_Claim(&queue) == slot);
+    CHECK(SPSC_Peek(&queue) == NULL);
+    slot->data[0] = 'x';
+    SPSC_Publish(&queue);
+
+    CHECK(SPSC_Peek(&queue) == slot);
+    CHECK(SPSC_Claim(&queue) != slot);
+    CHECK_EQ(slot->seq, 7);
+    CHECK_EQ(slot->data[0], 'x');
+    SPSC_Pop(&queue);
+}
+
+int main()
+{
+    RUN(test_push_and_pull);
+    RUN(test_full_queue_counts_overflow);
+    RUN(test_wrap_around);
+    RUN(test_claim_fills_in_parts);
+
+    return TEST_RESULT();
+}
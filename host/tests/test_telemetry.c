@@ -0,0 +1,98 @@
+// Unit tests of telemetry stream (telemetry.c): records on USB right away, on RS-485 in the unit's slot of device time
+
+#include "clock.h"
+#include "fake.h"
+#include "link.h"
+#include "stm32f7xx_hal.h"
+#include "telemetry.h"
+#include "test.h"
+
+extern uint8_t UART_Address;
+
+#define CYCLES_PER_US (168000000 / 1000000)
+#define SLOT_US (TLM_UART_SLOT_MS * 1000)
+#define ROUND_US (TLM_UART_SLOTS * SLOT_US)
+
+static parse_context uart_ctx = {.Write = LinkWrite, .WriteFrame = LinkWriteFrame, .link = LINK_UART, .last_seq = -1};
+
+// Move time forward by ms (tick) and us (cycle counter, device time)
+static void Wait(uint32_t ms, uint32_t us)
+{
+    fake_tick += ms;
+    fake_DWT.CYCCNT += us * CYCLES_PER_US;
+    CLK_Tick();
+}
+
+static void test_usb_record()
+{
+    TLM_Configure(&link_ctx, 0, 10);
+    LinkReset();
+
+    Wait(9, 0);
+    TLM_Poll();
+    CHECK_EQ(link_packets, 0);
+
+    Wait(1, 0);
+    TLM_Poll();
+    CHECK_EQ(link_packets, 1);
+    CHECK_EQ(link_packet[1], TLM_RECORD_OPCODE);
+    CHECK_EQ(link_packet_len, FRAME_RESPONSE_HEADER_SIZE + sizeof(tlm_record));
+
+    TLM_Configure(&link_ctx, 0, 0);
+}
+
+static void test_uart_slot()
+{
+    // Device time 0, slot of unit 3 starts at 3 slots (slots of all units count from the same device time)
+    UART_Address = 3;
+    CLK_Init();
+    TLM_Configure(&uart_ctx, 0, 10);
+    LinkReset();
+
+    Wait(10, 1000);
+    TLM_Poll();
+    CHECK_EQ(link_packets, 0);
+    CHECK_EQ(fake_EXTI.SWIER, 0);
+
+    // Slot begins: main loop hands the record to EXTI interrupt, which writes it
+    Wait(1, 3 * SLOT_US - CLK_Now());
+    TLM_Poll();
+    CHECK_EQ(link_packets, 0);
+    CHECK_EQ(fake_EXTI.SWIER, EXTI_SWIER_SWIER0);
+    TLM_Send();
+    CHECK_EQ(link_packets, 1);
+    CHECK_EQ(link_packet[1], TLM_RECORD_OPCODE);
+    TLM_Send();
+    CHECK_EQ(link_packets, 1);
+
+    // Next record: slot passed before the interrupt got to it, it waits for the next round
+    fake_EXTI.SWIER = 0;
+    Wait(10, ROUND_US + 3 * SLOT_US - CLK_Now());
+    TLM_Poll();
+    CHECK_EQ(fake_EXTI.SWIER, EXTI_SWIER_SWIER0);
+    Wait(0, SLOT_US / 2);
+    TLM_Send();
+    CHECK_EQ(link_packets, 1);
+    TLM_Poll();
+    CHECK_EQ(link_packets, 1);
+
+    Wait(0, 2 * ROUND_US + 3 * SLOT_US - CLK_Now());
+    TLM_Poll();
+    TLM_Send();
+    CHECK_EQ(link_packets, 2);
+
+    TLM_Configure(&uart_ctx, 0, 0);
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+    CLK_Init();
+
+    RUN(test_usb_record);
+    RUN(test_uart_slot);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,136 @@
+// Unit tests of event trace (trace.c): ring buffer, reading, TRCD/TRCE commands, keeping over reset
+
+#include "fake.h"
+#include "link.h"
+#include "sequencer.h"
+#include "stm32f7xx_hal.h"
+#include "test.h"
+#include "trace.h"
+
+static void test_reset_is_recorded()
+{
+    TRACE_Init(0x14);
+
+    trace_entry e[4];
+    uint32_t    seq = 0;
+    CHECK_EQ(TRACE_Read(&seq, e, 4), 1);
+    CHECK_EQ(e[0].seq, 1);
+    CHECK_EQ(e[0].event, TRACE_RESET);
+    CHECK_EQ(e[0].arg8, 0x14);
+    CHECK_EQ(seq, 2);
+    CHECK_EQ(TRACE_Read(&seq, e, 4), 0); // nothing new
+}
+
+static void test_commands_and_mask()
+{
+    trace_entry e[8];
+    uint32_t    seq = 2;
+
+    fake_tick = 1234;
+    Command("PING\nPRDG");
+    CHECK_EQ(TRACE_Read(&seq, e, 8), 2);
+    CHECK_EQ(e[0].event, TRACE_COMMAND);
+    CHECK_EQ(e[0].arg8, LINK_USB);
+    CHECK_EQ(e[0].arg16, 0x04);
+    CHECK_EQ(e[0].tick, 1234);
+    CHECK_EQ(e[1].arg16, 0x30);
+
+    CHECK_STR(Command("TRCE,0"), "TRCE,0");
+    CHECK_EQ(TRACE_Read(&seq, e, 8), 1); // TRCE itself is recorded before it runs
+    Command("PING");
+    CHECK_EQ(TRACE_Read(&seq, e, 8), 0);
+    CHECK_STR(Command("TRCE"), "TRCE,0");
+    TRACE_Mask = TRACE_DEFAULT_MASK;
+}
+
+static void test_wrap_keeps_newest()
+{
+    for (int i = 0; i < TRACE_SIZE + 10; ++i)
+        TRACE_Write(TRACE_LATE_EDGE, 0, i);
+
+    trace_entry e[TRACE_SIZE];
+    uint32_t    seq = 1; // long gone
+    CHECK_EQ(TRACE_Read(&seq, e, TRACE_SIZE), TRACE_SIZE);
+    CHECK_EQ(e[TRACE_SIZE - 1].arg16, TRACE_SIZE + 9);
+    CHECK_EQ(e[0].arg16, 10);
+    CHECK_EQ(e[TRACE_SIZE - 1].seq - e[0].seq, TRACE_SIZE - 1);
+
+    // Partial reads continue where previous one ended
+    seq   = 0;
+    int n = TRACE_Read(&seq, e, 100);
+    CHECK_EQ(n, 100);
+    CHECK_EQ(TRACE_Read(&seq, e, TRACE_SIZE), TRACE_SIZE - 100);
+}
+
+static void test_dump_command()
+{
+    TRACE_Write(TRACE_UART_OVERRUN, 0, 0);
+
+    // ASCII: TRCD,<next>,<hex entries>, oldest first
+    Command("TRCD");
+    CHECK(strncmp(link_text, "TRCD,", 5) == 0);
+
+    // Binary: next seq, then entries
+    uint8_t request[] = {1, 0x09, 0, 0, 0, 0};
+    LinkReset();
+    ParseFrame(&link_ctx, request, sizeof(request));
+    CHECK_EQ(link_packet[2], FRAME_STATUS_OK);
+    int n = (link_packet_len - FRAME_RESPONSE_HEADER_SIZE - 4) / sizeof(trace_entry);
+    CHECK_EQ((link_packet_len - FRAME_RESPONSE_HEADER_SIZE - 4) % sizeof(trace_entry), 0);
+    CHECK(n > 0);
+
+    // Read to the end, last entry is the overrun
+    uint32_t    seq = 0;
+    trace_entry e[TRACE_SIZE];
+    n = TRACE_Read(&seq, e, TRACE_SIZE);
+    for (int i = 0; i < n; ++i) {
+        if (e[i].event == TRACE_UART_OVERRUN)
+            CHECK_EQ(i, n - 3); // followed by the two TRCD commands
+    }
+}
+
+static void test_kept_over_reset()
+{
+    uint32_t    seq = 0;
+    trace_entry e[TRACE_SIZE];
+    int         before = TRACE_Read(&seq, e, TRACE_SIZE);
+    uint32_t    last   = e[before - 1].seq;
+
+    TRACE_Init(0x04); // warm reset, buffer kept
+    seq = last;
+    CHECK_EQ(TRACE_Read(&seq, e, TRACE_SIZE), 2);
+    CHECK_EQ(e[1].event, TRACE_RESET);
+    CHECK_EQ(e[1].seq, last + 1);
+}
+
+static void test_start_stop_recorded()
+{
+    uint32_t    seq = 0;
+    trace_entry e[TRACE_SIZE];
+    TRACE_Read(&seq, e, TRACE_SIZE);
+
+    SEQ_Init();
+    Command("PRDS,1000\nCHLS,0,100,200\nSTRT");
+    SEQ_Poll();
+
+    int n = TRACE_Read(&seq, e, TRACE_SIZE);
+    CHECK(n >= 4);
+    CHECK_EQ(e[n - 1].event, TRACE_START);
+    CHECK_EQ(e[n - 1].arg16, 2);
+}
+
+int main()
+{
+    FAKE_HAL_Reset();
+    FAKE_UART_Reset();
+    FAKE_FLASH_Reset();
+
+    RUN(test_reset_is_recorded);
+    RUN(test_commands_and_mask);
+    RUN(test_wrap_keeps_newest);
+    RUN(test_dump_command);
+    RUN(test_kept_over_reset);
+    RUN(test_start_stop_recorded);
+
+    return TEST_RESULT();
+}
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""Host client for the vendor bulk interface of STREAM_IAC_CU.
+
+Sends binary frames (COBS(seq, opcode, args, CRC32) between zero delimiters,
+see frame.h) on the bulk OUT endpoint, one frame per transfer, and reads the
+response frames (seq, opcode, status, payload) from the bulk IN endpoint.
+
+Requires pyusb (libusb backend). On Windows bind WinUSB to interface 2 of the
+device (e.g. with Zadig); the CDC interfaces keep the usbser driver.
+
+Any device exposing the same interface can stand in for the board, e.g. a
+Linux USB gadget (FunctionFS on dummy_hcd) - select it with --vid/--pid.
+
+Examples:
+    bulk_client.py ping
+    bulk_client.py period 1000
+    bulk_client.py upload recipe.txt     # lines: <channel>,<time>,<time>,...
+    bulk_client.py start
+    bulk_client.py telemetry 100         # record every 100 periods (TLMS), Ctrl+C to stop
+    bulk_client.py trace                 # dump event trace (TRCD), oldest first
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+import usb.core
+import usb.util
+
+VID = 0x0483
+PID = 0x5740
+BULK_INTERFACE = 2
+BULK_OUT_EP = 0x03
+BULK_IN_EP = 0x83
+TRANSFER_SIZE = 512  # BULK_RX_BUFFER_SIZE
+
+OPCODES = {
+    "VERG": 0x01, "ID_S": 0x02, "ID_G": 0x03, "PING": 0x04, "RSET": 0x05, "ACKS": 0x06,
+    "BNCH": 0x07, "PROF": 0x08, "TRCD": 0x09, "TRCE": 0x0A, "LATG": 0x0B, "FLSG": 0x0C,
+    "ENUM": 0x0D, "STTQ": 0x0E, "GATG": 0x0F,
+    "STRT": 0x10, "STOP": 0x11, "SYNC": 0x12,
+    "PRDS": 0x20, "CHLS": 0x21, "SLTS": 0x22, "SYNM": 0x23,
+    "PRDG": 0x30, "CHLG": 0x31, "STTG": 0x32, "SLTG": 0x33, "SYNQ": 0x34,
+    "TLMS": 0x40,
+}
+TLM_RECORD_OPCODE = 0xC0
+TLM_RECORD = struct.Struct("<BBIHHHH" + "HHH" * 3)  # tlm_record in telemetry.h
+STATUS = {0: "OK", 1: "UNKNOWN", 2: "DUPLICATE", 3: "BAD_ARGS"}
+TRACE_ENTRY = struct.Struct("<IIIBBH")  # trace_entry in trace.h
+TRACE_EVENTS = ("RESET", "COMMAND", "START", "STOP", "UPDATE", "LATE_EDGE", "UART_OVERRUN", "USB_TX_STALL", "FLASH", "SYNC", "ARM")
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b == 0:
+            out.append(len(block) + 1)
+            out += block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 254:
+                out.append(255)
+                out += block
+                block = bytearray()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data) + 1:
+            raise ValueError("bad COBS block")
+        out += data[i + 1:i + code]
+        i += code
+        if code < 255 and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def frame_encode(packet):
+    return b"\0" + cobs_encode(packet + struct.pack("<I", zlib.crc32(packet))) + b"\0"
+
+
+def frame_decode(encoded):
+    packet = cobs_decode(encoded.strip(b"\0"))
+    if len(packet) < 4 or struct.unpack("<I", packet[-4:])[0] != zlib.crc32(packet[:-4]):
+        raise ValueError("bad frame CRC")
+    return packet[:-4]
+
+
+class BulkLink:
+    def __init__(self, vid, pid, timeout_ms):
+        self.dev = usb.core.find(idVendor=vid, idProduct=pid)
+        if self.dev is None:
+            raise SystemExit("device %04x:%04x not found" % (vid, pid))
+        usb.util.claim_interface(self.dev, BULK_INTERFACE)
+        self.timeout = timeout_ms
+        self.seq = 0
+
+    def request(self, opcode, args=b""):
+        self.seq = (self.seq + 1) & 0xFF
+        self.dev.write(BULK_OUT_EP, frame_encode(bytes([self.seq, opcode]) + args), self.timeout)
+        while True:
+            data = bytes(self.dev.read(BULK_IN_EP, TRANSFER_SIZE, self.timeout))
+            if not data:  # zero length packet ending a transfer of full packets
+                continue
+            packet = frame_decode(data)
+            if packet[0] == self.seq and packet[1] == opcode:
+                return packet[2], packet[3:]
+
+    def records(self):
+        while True:
+            try:
+                data = bytes(self.dev.read(BULK_IN_EP, TRANSFER_SIZE, self.timeout))
+            except usb.core.USBTimeoutError:
+                continue
+            if data:
+                packet = frame_decode(data)
+                if packet[1] == TLM_RECORD_OPCODE:
+                    yield TLM_RECORD.unpack(packet[3:3 + TLM_RECORD.size])
+
+
+def print_telemetry(link, args):
+    link.request(OPCODES["TLMS"], b"".join(struct.pack("<I", int(x)) for x in args))
+    links = ("uart", "usb", "bulk")
+    try:
+        for r in link.records():
+            stats = " ".join("%s %d/%d/%d" % (links[i], *r[7 + 3 * i:10 + 3 * i]) for i in range(3))
+            print("%s periods %d late %d latency %dus uart ovr %d err %d | %s" % (
+                "RUN " if r[1] & 1 else "IDLE", r[2], r[3], r[4], r[5], r[6], stats))
+    except KeyboardInterrupt:
+        link.request(OPCODES["TLMS"], struct.pack("<I", 0))
+
+
+def print_trace(link):
+    seq = 0
+    while True:
+        status, payload = link.request(OPCODES["TRCD"], struct.pack("<I", seq))
+        if status != 0 or len(payload) <= 4:
+            return
+        seq = struct.unpack("<I", payload[:4])[0]
+        for i in range(4, len(payload) - TRACE_ENTRY.size + 1, TRACE_ENTRY.size):
+            s, tick, cycles, event, arg8, arg16 = TRACE_ENTRY.unpack(payload[i:i + TRACE_ENTRY.size])
+            name = TRACE_EVENTS[event] if event < len(TRACE_EVENTS) else str(event)
+            print("%8d %10d ms %10d cyc %-12s %3d %5d" % (s, tick, cycles, name, arg8, arg16))
+
+
+def parse_recipe(path):
+    for line in open(path):
+        fields = [int(x) for x in line.replace(",", " ").split()]
+        if fields:
+            yield struct.pack("<B", fields[0]) + b"".join(struct.pack("<I", t) for t in fields[1:])
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--vid", type=lambda x: int(x, 16), default=VID)
+    ap.add_argument("--pid", type=lambda x: int(x, 16), default=PID)
+    ap.add_argument("--timeout", type=int, default=1000, help="transfer timeout in ms")
+    ap.add_argument("command", help="ping, version, period <us>, upload <file>, start, stop, telemetry <periods> [<ms>], trace or raw command name")
+    ap.add_argument("args", nargs="*")
+    opt = ap.parse_args()
+
+    link = BulkLink(opt.vid, opt.pid, opt.timeout)
+    cmd = opt.command.lower()
+
+    if cmd == "telemetry":
+        print_telemetry(link, opt.args or ["100"])
+        return 0
+    elif cmd == "trace":
+        print_trace(link)
+        return 0
+    elif cmd == "upload":
+        requests = [(OPCODES["CHLS"], args) for args in parse_recipe(opt.args[0])]
+    elif cmd == "period":
+        requests = [(OPCODES["PRDS"], struct.pack("<I", int(opt.args[0])))]
+    else:
+        name = {"ping": "PING", "version": "VERG", "start": "STRT", "stop": "STOP"}.get(cmd, opt.command.upper())
+        args = struct.pack("<I", int(opt.args[0])) if opt.args else b""
+        requests = [(OPCODES[name], args)]
+
+    failed = 0
+    for opcode, args in requests:
+        status, payload = link.request(opcode, args)
+        print("%s %s" % (STATUS.get(status, status), payload.decode(errors="replace")))
+        failed += status != 0
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())